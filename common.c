@@ -1,11 +1,13 @@
 #include "common.h"
+#include "crawler.h"
 #include "list.h"
 
 #include <ctype.h>
+#include <stdint.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <dirent.h>
 #include <sys/stat.h>
 
 void fatal_error(char *msg)
@@ -14,95 +16,197 @@ void fatal_error(char *msg)
     exit(1);
 }
 
-void tokenize_file(FILE *file, list_t *list)
+token_t *token_create(char *word, size_t len)
 {
-    char *word;
-    char buf[101];
-    buf[100] = 0;
+    token_t *token = malloc(sizeof(token_t));
+    if (token == NULL)
+        fatal_error("out of memory");
+    token->word = word;
+    token->hash = hash_bytes(word, len);
+    return token;
+}
+
+void token_destroy(token_t *token)
+{
+    free(token->word);
+    free(token);
+}
 
-    while (!feof(file)) {
-		/* Skip non-letters */
-		fscanf(file, "%*[^a-zA-Z0-9'_]");
-		/* Scan up to 100 letters */
-		if (fscanf(file, "%100[a-zA-Z0-9'_]", buf) == 1) {
-	    	word = strdup(buf);
-	    	if (word == NULL)
-				fatal_error("out of memory");
-	    	list_addlast(list, word);
-		}
+char *read_file(FILE *file, size_t *len)
+{
+    size_t capacity = 4096, n = 0, r;
+    char *buf = malloc(capacity);
+
+    if (buf == NULL)
+        fatal_error("out of memory");
+    while ((r = fread(buf + n, 1, capacity - n - 1, file)) > 0) {
+        n += r;
+        if (n + 1 == capacity) {
+            capacity *= 2;
+            buf = realloc(buf, capacity);
+            if (buf == NULL)
+                fatal_error("out of memory");
+        }
     }
+    if (ferror(file)) {
+        free(buf);
+        return NULL;
+    }
+    buf[n] = '\0';
+    *len = n;
+    return buf;
 }
 
-enum { OK_FILE_TYPE = (S_IFREG | S_IFDIR) };
-int _read_dir(char *root, list_t *list)
+char *join_path(char *dir, char *name)
 {
-	if (root == NULL || list == NULL) {
-		return 1;
-	}
-
-	DIR *dp = opendir(root);
-	if (dp == NULL) {
-		perror(root);
-		goto error;
-	}
-
-	struct dirent *file;
-	while((file = readdir(dp)) != NULL) {
-		if (file->d_name[0] == '.') {
-			/* skip hidden files and ".", "..", so we do up in the hierarchy */
-			continue;
-		}
-
-		int file_path_len = strlen(root)+1+strlen(file->d_name)+1; // +1+ for slash +1 for '\0'
-		char *file_path = (char *)malloc(sizeof(*file_path)*file_path_len);
-		if (file_path == NULL) {
-			perror("malloc");
-			goto error;
-		}
-
-		snprintf(file_path, file_path_len, "%s/%s", root, file->d_name);
-
-		struct stat s;
-		if (!(stat(file_path, &s) == 0 && (s.st_mode & OK_FILE_TYPE))) {
-			fprintf(stderr, "skipping irregular file '%s'\n", file_path);
-			free(file_path);
-		} else if ((s.st_mode & S_IFDIR)) {
-			_read_dir(file_path, list);
-		} else {
-			FILE *fp = fopen(file_path, "r");
-			if (fp == NULL) {
-				perror(file_path);
-				free(file_path);
-			} else {
-				list_addlast(list, file_path);
-				fclose(fp);
-			}
-		}
-	}
-
-	closedir(dp);
-	return 0;
+    size_t dirlen = strlen(dir), namelen = strlen(name);
+    char *path = malloc(dirlen + 1 + namelen + 1);
+
+    if (path == NULL)
+        fatal_error("out of memory");
+    memcpy(path, dir, dirlen);
+    path[dirlen] = '/';
+    memcpy(path + dirlen + 1, name, namelen + 1);
+    return path;
+}
+
+/*
+ * Extensions of files in binary or generated formats.
+ */
+static const char *skipped_extensions[] = {
+    ".o", ".a", ".so", ".dylib", ".dll", ".exe", ".obj", ".lib", ".class", ".jar", ".pyc", ".wasm",
+    ".png", ".jpg", ".jpeg", ".gif", ".bmp", ".ico", ".webp", ".tif", ".tiff", ".psd",
+    ".pdf", ".zip", ".gz", ".tgz", ".bz2", ".xz", ".zst", ".7z", ".rar", ".tar",
+    ".mp3", ".mp4", ".wav", ".ogg", ".flac", ".avi", ".mov", ".mkv",
+    ".woff", ".woff2", ".ttf", ".otf", ".eot",
+    ".db", ".sqlite", ".bin", ".iso", ".img",
+    ".min.js", ".min.css", ".map",
+    NULL
+};
+
+const char *skip_reason_name(enum skip_reason reason)
+{
+    static const char *names[NUM_SKIP_REASONS] = { "none", "too large", "extension", "binary", "generated" };
+    return names[reason];
+}
+
+enum skip_reason sniff_name(const char *name)
+{
+    size_t len = strlen(name), extlen;
+    int i;
+
+    for (i = 0; skipped_extensions[i] != NULL; i++) {
+        extlen = strlen(skipped_extensions[i]);
+        if (len > extlen && strcasecmp(name + len - extlen, skipped_extensions[i]) == 0)
+            return SKIP_EXTENSION;
+    }
+    return SKIP_NONE;
+}
+
+/*
+ * Returns 1 if the given string occurs in the given bytes, 0 otherwise.
+ */
+static int has_marker(const char *block, size_t len, const char *marker)
+{
+    size_t n = strlen(marker);
+    const char *p = block, *end = block + len;
+
+    while (p + n <= end && (p = memchr(p, marker[0], end - p - n + 1)) != NULL) {
+        if (memcmp(p, marker, n) == 0)
+            return 1;
+        p++;
+    }
+    return 0;
+}
+
+enum skip_reason sniff_file(const char *block, size_t len)
+{
+    size_t i, control = 0;
+
+    if (memchr(block, '\0', len) != NULL)
+        return SKIP_BINARY;
+    for (i = 0; i < len; i++) {
+        unsigned char c = block[i];
+        /* Bytes of UTF-8 characters are fine, unlike most control characters */
+        control += (c < 0x20 && c != '\t' && c != '\n' && c != '\r' && c != '\f' && c != '\v') || c == 0x7f;
+    }
+    if (control * 10 > len)
+        return SKIP_BINARY;
+    if (len == SNIFF_LEN && memchr(block, '\n', len) == NULL)
+        return SKIP_GENERATED;
+    if (has_marker(block, len, "@generated") || has_marker(block, len, "DO NOT EDIT"))
+        return SKIP_GENERATED;
+    return SKIP_NONE;
+}
 
-error:
-	if (dp != NULL) {
-		closedir(dp);
-	}
-	return 1;
+static void count_skipped(find_stats_t *stats, enum skip_reason reason, size_t size)
+{
+    if (stats != NULL) {
+        stats->skipped[reason]++;
+        stats->skippedbytes[reason] += size;
+    }
 }
 
-struct list *find_files(char *root)
+/*
+ * Sniffs the file at the given path by its size and its first bytes.
+ * Assigns its size to the given pointer.  Returns -1 if it cannot be
+ * read.
+ */
+static int sniff_path(char *path, size_t *size)
 {
-    list_t *files = list_create(compare_strings);
-	if (files == NULL) {
-		return NULL;
-	}
+    char block[SNIFF_LEN];
+    struct stat s;
+    size_t len;
+    FILE *f = fopen(path, "r");
 
-	if (_read_dir(root, files) > 0) {
-		list_destroy(files);
-		return NULL;
-	} else {
-		return files;
-	}
+    if (f == NULL || fstat(fileno(f), &s) != 0) {
+        perror(path);
+        if (f != NULL)
+            fclose(f);
+        return -1;
+    }
+    *size = s.st_size;
+    if (s.st_size > MAX_FILE_SIZE) {
+        fclose(f);
+        return SKIP_SIZE;
+    }
+    len = fread(block, 1, sizeof(block), f);
+    fclose(f);
+    return sniff_file(block, len);
+}
+
+struct list *find_files(char *root, find_stats_t *stats)
+{
+    crawler_t *crawler = crawler_create(root, DEFAULT_CRAWLER_THREADS);
+    find_stats_t crawled;
+    list_t *files;
+    char *path;
+
+    if (crawler == NULL)
+        return NULL;
+    if (stats != NULL)
+        memset(stats, 0, sizeof(*stats));
+    files = list_create(compare_strings);
+    while ((path = crawler_next(crawler)) != NULL) {
+        size_t size;
+        int reason = sniff_path(path, &size);
+
+        if (reason == SKIP_NONE) {
+            list_addlast(files, path);
+            continue;
+        }
+        if (reason > SKIP_NONE)
+            count_skipped(stats, reason, size);
+        free(path);
+    }
+    if (stats != NULL) {
+        /* Files left out by name are never opened, so their size is unknown */
+        crawler_getstats(crawler, &crawled);
+        stats->files = list_size(files);
+        stats->skipped[SKIP_EXTENSION] = crawled.skipped[SKIP_EXTENSION];
+    }
+    crawler_destroy(crawler);
+    return files;
 }
 
 int compare_strings(void *a, void *b)
@@ -110,15 +214,69 @@ int compare_strings(void *a, void *b)
     return strcmp(a, b);
 }
 
-unsigned long hash_string(void *str)
+/*
+ * Word-at-a-time hash in the style of wyhash: the input is consumed 8 or
+ * 16 bytes at a time and mixed with 64x64->128 bit multiplications, which
+ * gives well distributed low bits for power-of-two sized hash tables.
+ */
+static const uint64_t hash_secret[2] = { 0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL };
+
+static inline uint64_t hash_mix(uint64_t a, uint64_t b)
 {
-    unsigned char *p = str;
-    unsigned long hash = 5381;
-    int c;
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
 
-    while ((c = *p++) != '\0')
-        hash = ((hash << 5) + hash) + c; /* hash * 33 + c */
-    return hash;
+static inline uint64_t read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+unsigned long hash_bytes(const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint64_t seed = hash_secret[0] ^ len;
+    uint64_t a, b;
+
+    if (len <= 16) {
+        if (len >= 4) {
+            size_t mid = (len >> 3) << 2;
+            a = (read32(p) << 32) | read32(p + mid);
+            b = (read32(p + len - 4) << 32) | read32(p + len - 4 - mid);
+        }
+        else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        }
+        else {
+            a = b = 0;
+        }
+    }
+    else {
+        size_t i = len;
+        while (i > 16) {
+            seed = hash_mix(read64(p) ^ hash_secret[1], read64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = read64(p + i - 16);
+        b = read64(p + i - 8);
+    }
+    return hash_mix(hash_secret[1] ^ len, hash_mix(a ^ hash_secret[1], b ^ seed));
+}
+
+unsigned long hash_string(void *str)
+{
+    return hash_bytes(str, strlen(str));
 }
 
 int compare_pointers(void *a, void *b)
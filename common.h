@@ -22,21 +22,107 @@ typedef unsigned long (*hashfunc_t)(void *);
 void fatal_error(char *msg);
 
 /*
- * Reads the given file, and parses it into words (tokens).
- * Adds the words to the given list, in the same order that they
- * occur in the file.
- *
- * This tokenizer ignores punctuation and whitespace, so if the file
- * contains the text "Hello! This is an example...." the recognized
- * words will be "Hello", "This", "is", "an", and "example".
+ * The maximum length of a word.  Longer words are split.
  */
-void tokenize_file(FILE *file, struct list *list);
+enum { MAX_WORD_LEN = 100 };
 
 /*
- * Recursively finds the names of all files under the given root directory.
- * Returns the file names as a list of strings.
+ * The type of tokens.  A token is a word together with its hash (see
+ * hash_bytes()), which is computed once by the tokenizer and then
+ * carried along so that the index never has to hash the word again.
  */
-struct list *find_files(char *root);
+typedef struct {
+    char *word;
+    unsigned long hash;
+} token_t;
+
+/*
+ * Creates a token for the given word of the given length, and computes
+ * its hash.  The token takes ownership of the word.
+ */
+token_t *token_create(char *word, size_t len);
+
+/*
+ * Destroys the given token and its word.
+ */
+void token_destroy(token_t *token);
+
+/*
+ * Reads the rest of the given file into a buffer, which belongs to the
+ * caller, and assigns its length to the given len pointer.  The buffer
+ * is terminated by a '\0' past its length.  Returns NULL on error.
+ */
+char *read_file(FILE *file, size_t *len);
+
+/*
+ * Returns the path of the given name in the given directory, which
+ * belongs to the caller.
+ */
+char *join_path(char *dir, char *name);
+
+/*
+ * Files larger than this are not indexed.
+ */
+enum { MAX_FILE_SIZE = 8 << 20 };
+
+/*
+ * The number of bytes at the start of a file that sniff_file() looks at.
+ */
+enum { SNIFF_LEN = 4096 };
+
+/*
+ * Why find_files() left out a file, or SKIP_NONE.
+ */
+enum skip_reason {
+    SKIP_NONE,
+    SKIP_SIZE,          /* Larger than MAX_FILE_SIZE */
+    SKIP_EXTENSION,     /* e.g. ".o", ".png" or ".min.js" */
+    SKIP_BINARY,        /* Has NUL bytes or many control characters */
+    SKIP_GENERATED,     /* Minified, or marked as generated */
+    NUM_SKIP_REASONS
+};
+
+/*
+ * Counters of the files found by find_files().
+ */
+typedef struct {
+    int files;                          /* Found and kept */
+    int skipped[NUM_SKIP_REASONS];      /* Left out, by reason */
+    size_t skippedbytes[NUM_SKIP_REASONS];
+} find_stats_t;
+
+/*
+ * Returns a short name for the given reason, e.g. "binary".
+ */
+const char *skip_reason_name(enum skip_reason reason);
+
+/*
+ * Returns the reason to leave out a file with the given name, judging
+ * by its extension, or SKIP_NONE.
+ */
+enum skip_reason sniff_name(const char *name);
+
+/*
+ * Returns the reason to leave out a file that starts with the given
+ * bytes (the first SNIFF_LEN of them, or all if it is shorter), or
+ * SKIP_NONE if it looks like text.  A file is binary if it has a NUL
+ * byte or more than a tenth of control characters, and generated if
+ * it is marked "@generated" or "DO NOT EDIT", or if its first line
+ * does not end within SNIFF_LEN bytes, as in minified code.
+ */
+enum skip_reason sniff_file(const char *block, size_t len);
+
+/*
+ * Finds the names of all files under the given root directory with a
+ * crawler (see crawler.h), except for the files that are not worth
+ * indexing: those too large, with the extension of a binary format (see
+ * sniff_name()), or whose first bytes do not look like text written by
+ * hand (see sniff_file()).  Returns the file names as a list of strings,
+ * in no particular order, and assigns the counts of the files kept and
+ * left out to the given stats unless it is NULL.  Returns NULL if the
+ * root cannot be opened.
+ */
+struct list *find_files(char *root, find_stats_t *stats);
 
 /* 
  * Compares two strings using strcmp().
@@ -44,7 +130,13 @@ struct list *find_files(char *root);
 int compare_strings(void *a, void *b);
 
 /*
- * Hashes a string.
+ * Hashes the given number of bytes.  The hash is suitable for hash
+ * tables whose sizes are powers of two.
+ */
+unsigned long hash_bytes(const void *data, size_t len);
+
+/*
+ * Hashes a string.  Same as hash_bytes() on the characters of the string.
  */
 unsigned long hash_string(void *s);
 
@@ -0,0 +1,450 @@
+#include "common.h"
+#include "levenshtein.h"
+#include "map.h"
+#include "map_str.h"
+#include "set.h"
+#include "set_u32.h"
+#include "suggest.h"
+#include "termdict.h"
+
+#include <malloc.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Compares the callback based set_t and map_t with the type-specialized
+ * set_u32_t and map_str_t on the operations that the index and the query
+ * parser use the most: merging sets of document ids and looking up words.
+ * Also reports the insert latency distribution of map_str_t with and
+ * without incremental resizing, the memory use and lookup time of the
+ * frozen term dictionary compared with the hash map, fuzzy lookups in
+ * a large term dictionary compared with checking every term, and
+ * completing prefixes with the suggester compared with reading every
+ * term with the prefix.
+ */
+
+enum {
+	NELEMS = 200000,
+	NWORDS = 200000,
+	ROUNDS = 10,
+	NLATENCY = 2000000,
+	NFUZZYTERMS = 2000000,
+	NFUZZY = 200,
+	NSUGGEST = 200000,
+	MAX_SUGGEST = 10,
+};
+
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static int compare_ints(void *a, void *b)
+{
+	uintptr_t x = (uintptr_t)a, y = (uintptr_t)b;
+	return (x > y) - (x < y);
+}
+
+
+static void report(char *what, double callback, double specialized)
+{
+	printf("%-14s callback %8.2f ms  specialized %8.2f ms  speedup %5.1fx\n",
+	       what, callback * 1000, specialized * 1000, callback / specialized);
+}
+
+
+static void bench_sets(void)
+{
+	set_t *a = set_create(compare_ints), *b = set_create(compare_ints);
+	set_u32_t *ua = set_u32_create(), *ub = set_u32_create();
+	double t, tcb, tsp;
+	int i, r;
+
+	/* Every other id in a, every third id in b */
+	for (i = 1; i < NELEMS * 3; i++) {
+		if (i % 2 == 0) {
+			set_add(a, (void *)(uintptr_t)i);
+			set_u32_add(ua, i);
+		}
+		if (i % 3 == 0) {
+			set_add(b, (void *)(uintptr_t)i);
+			set_u32_add(ub, i);
+		}
+	}
+
+	set_t *(*ops[])(set_t *, set_t *) = { set_union, set_intersection, set_difference };
+	set_u32_t *(*uops[])(set_u32_t *, set_u32_t *) = { set_u32_union, set_u32_intersection, set_u32_difference };
+	char *names[] = { "union", "intersection", "difference" };
+
+	for (i = 0; i < 3; i++) {
+		t = now();
+		for (r = 0; r < ROUNDS; r++) {
+			set_destroy(ops[i](a, b));
+		}
+		tcb = now() - t;
+
+		t = now();
+		for (r = 0; r < ROUNDS; r++) {
+			set_u32_destroy(uops[i](ua, ub));
+		}
+		tsp = now() - t;
+
+		report(names[i], tcb, tsp);
+	}
+
+	set_destroy(a);
+	set_destroy(b);
+	set_u32_destroy(ua);
+	set_u32_destroy(ub);
+}
+
+
+static void bench_maps(void)
+{
+	char **words = malloc(NWORDS * sizeof(char *));
+	map_t *map = map_create(compare_strings, hash_string);
+	map_str_t *smap = map_str_create();
+	double t, tcb, tsp;
+	long found = 0;
+	int i, r;
+
+	if (words == NULL) {
+		fatal_error("out of memory");
+	}
+	for (i = 0; i < NWORDS; i++) {
+		char buf[32];
+		snprintf(buf, sizeof(buf), "identifier_%d", i * 7919);
+		words[i] = strdup(buf);
+	}
+
+	t = now();
+	for (i = 0; i < NWORDS; i++) {
+		map_put(map, words[i], words[i]);
+	}
+	tcb = now() - t;
+	t = now();
+	for (i = 0; i < NWORDS; i++) {
+		map_str_put(smap, words[i], words[i]);
+	}
+	tsp = now() - t;
+	report("put", tcb, tsp);
+
+	t = now();
+	for (r = 0; r < ROUNDS; r++) {
+		for (i = 0; i < NWORDS; i++) {
+			found += map_get(map, words[i]) != NULL;
+		}
+	}
+	tcb = now() - t;
+	t = now();
+	for (r = 0; r < ROUNDS; r++) {
+		for (i = 0; i < NWORDS; i++) {
+			found += map_str_get(smap, words[i]) != NULL;
+		}
+	}
+	tsp = now() - t;
+	report("get", tcb, tsp);
+
+	if (found != 2L * ROUNDS * NWORDS) {
+		fprintf(stderr, "map lookups failed\n");
+	}
+
+	map_destroy(map);
+	map_str_destroy(smap);
+	for (i = 0; i < NWORDS; i++) {
+		free(words[i]);
+	}
+	free(words);
+}
+
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+
+static void bench_latency(int incremental)
+{
+	char **words = malloc(NLATENCY * sizeof(char *));
+	double *latency = malloc(NLATENCY * sizeof(double));
+	map_str_t *map = map_str_create();
+	int i;
+
+	if (words == NULL || latency == NULL) {
+		fatal_error("out of memory");
+	}
+	for (i = 0; i < NLATENCY; i++) {
+		char buf[32];
+		snprintf(buf, sizeof(buf), "term_%d", i);
+		words[i] = strdup(buf);
+	}
+
+	map_str_setincremental(map, incremental);
+	for (i = 0; i < NLATENCY; i++) {
+		double t = now();
+		map_str_put(map, words[i], words[i]);
+		latency[i] = now() - t;
+	}
+
+	qsort(latency, NLATENCY, sizeof(double), compare_doubles);
+	printf("%-14s p50 %6.0f ns  p99 %6.0f ns  p999 %6.0f ns  max %10.0f ns\n",
+	       incremental ? "put (incr.)" : "put (at once)",
+	       latency[NLATENCY / 2] * 1e9, latency[NLATENCY / 100 * 99] * 1e9,
+	       latency[NLATENCY / 1000 * 999] * 1e9, latency[NLATENCY - 1] * 1e9);
+
+	map_str_destroy(map);
+	for (i = 0; i < NLATENCY; i++) {
+		free(words[i]);
+	}
+	free(words);
+	free(latency);
+}
+
+
+static int compare_words(const void *a, const void *b)
+{
+	return strcmp(*(char **)a, *(char **)b);
+}
+
+
+static void bench_termdict(void)
+{
+	char **words = malloc(NWORDS * sizeof(char *));
+	map_str_t *map = map_str_create();
+	size_t mapsize;
+	double t, tmap, tdict;
+	long found = 0;
+	int i, r;
+
+	if (words == NULL) {
+		fatal_error("out of memory");
+	}
+	for (i = 0; i < NWORDS; i++) {
+		char buf[32];
+		snprintf(buf, sizeof(buf), "identifier_%d", i * 7919);
+		words[i] = strdup(buf);
+	}
+	qsort(words, NWORDS, sizeof(char *), compare_words);
+
+	/* Entries and strings, including the allocator's bookkeeping */
+	mapsize = sizeof(map_str_t);
+	for (i = 0; i < NWORDS; i++) {
+		map_str_put(map, words[i], words[i]);
+		mapsize += sizeof(map_str_entry_t) + malloc_usable_size(words[i]) + 2 * sizeof(size_t);
+	}
+	mapsize += map->numbuckets * sizeof(map_str_entry_t *);
+
+	termdict_t *dict = termdict_create(words, NWORDS);
+	printf("%-14s map %6.1f bytes/term  termdict %6.1f bytes/term\n", "dictionary",
+	       (double)mapsize / NWORDS, (double)termdict_memsize(dict) / NWORDS);
+
+	t = now();
+	for (r = 0; r < ROUNDS; r++) {
+		for (i = 0; i < NWORDS; i++) {
+			found += map_str_get(map, words[i]) != NULL;
+		}
+	}
+	tmap = now() - t;
+	t = now();
+	for (r = 0; r < ROUNDS; r++) {
+		for (i = 0; i < NWORDS; i++) {
+			found += termdict_lookup(dict, words[i]) == i;
+		}
+	}
+	tdict = now() - t;
+	printf("%-14s map %8.2f ms  termdict %8.2f ms\n", "lookup", tmap * 1000, tdict * 1000);
+
+	if (found != 2L * ROUNDS * NWORDS) {
+		fprintf(stderr, "dictionary lookups failed\n");
+	}
+
+	termdict_destroy(dict);
+	map_str_destroy(map);
+	for (i = 0; i < NWORDS; i++) {
+		free(words[i]);
+	}
+	free(words);
+}
+
+
+/*
+ * Fills the given array with NFUZZYTERMS random lower case words of 4 to
+ * 12 letters, drawn with English letter frequencies, then sorts them and
+ * drops the duplicates.  Returns the number of distinct words.
+ */
+static int random_words(char **words)
+{
+	unsigned int seed = 1;
+	int i, j, n;
+
+	for (i = 0; i < NFUZZYTERMS; i++) {
+		char buf[16];
+		int len;
+		seed = seed * 1103515245 + 12345;
+		len = 4 + (seed >> 16) % 9;
+		for (j = 0; j < len; j++) {
+			seed = seed * 1103515245 + 12345;
+			buf[j] = "eeeeeeeeeeeettttttttaaaaaaaooooooiiiiiinnnnnnsssssshhhhhhrrrrrddddlllluucmwfgypbvkjxqz"[(seed >> 16) % 86];
+		}
+		buf[len] = '\0';
+		words[i] = strdup(buf);
+	}
+	qsort(words, NFUZZYTERMS, sizeof(char *), compare_words);
+	for (i = n = 0; i < NFUZZYTERMS; i++) {
+		if (n == 0 || strcmp(words[i], words[n - 1]) != 0) {
+			words[n++] = words[i];
+		} else {
+			free(words[i]);
+		}
+	}
+	return n;
+}
+
+
+static void bench_fuzzy(void)
+{
+	char **words = malloc(NFUZZYTERMS * sizeof(char *));
+	double t, tscan, tdict;
+	int i, j, n, edits;
+
+	if (words == NULL) {
+		fatal_error("out of memory");
+	}
+	n = random_words(words);
+	termdict_t *dict = termdict_create(words, n);
+
+	for (edits = 1; edits <= 2; edits++) {
+		long scanned = 0, found = 0;
+
+		/* Checking every term takes long, so only do it for a few */
+		t = now();
+		for (i = 0; i < NFUZZY / 20; i++) {
+			levenshtein_t *lev = levenshtein_create(words[(i * 7919L) % n], edits);
+			for (j = 0; j < n; j++) {
+				scanned += levenshtein_matches(lev, words[j]);
+			}
+			levenshtein_destroy(lev);
+		}
+		tscan = (now() - t) / (NFUZZY / 20);
+
+		t = now();
+		for (i = 0; i < NFUZZY; i++) {
+			termdict_iter_t *it = termdict_fuzzyiter(dict, words[(i * 7919L) % n], edits);
+			while (termdict_hasnext(it)) {
+				termdict_next(it, NULL);
+				found += i < NFUZZY / 20;
+			}
+			termdict_destroyiter(it);
+		}
+		tdict = (now() - t) / NFUZZY;
+
+		if (found != scanned) {
+			fprintf(stderr, "fuzzy lookups failed\n");
+		}
+		printf("%-14s scan %8.2f ms  termdict %8.3f ms  (%d terms)\n",
+		       edits == 1 ? "fuzzy, 1 edit" : "fuzzy, 2 edits", tscan * 1000, tdict * 1000, n);
+	}
+
+	termdict_destroy(dict);
+	for (i = 0; i < n; i++) {
+		free(words[i]);
+	}
+	free(words);
+}
+
+
+static void bench_suggest(void)
+{
+	char **words = malloc(NFUZZYTERMS * sizeof(char *));
+	uint32_t *weights = malloc(NFUZZYTERMS * sizeof(uint32_t));
+	unsigned int seed = 7;
+	double t, tscan, tsuggest, tbuild;
+	int i, n, len, ids[MAX_SUGGEST];
+
+	if (words == NULL || weights == NULL) {
+		fatal_error("out of memory");
+	}
+	n = random_words(words);
+	/* Skewed like document frequencies: most words are rare */
+	for (i = 0; i < n; i++) {
+		seed = seed * 1103515245 + 12345;
+		weights[i] = 1000000 / (1 + (seed >> 8) % 1000000);
+	}
+	termdict_t *dict = termdict_create(words, n);
+	t = now();
+	suggest_t *suggest = suggest_create(dict, weights, MAX_SUGGEST);
+	tbuild = now() - t;
+
+	/* Prefixes of a few letters, as typed, start the most words */
+	for (len = 1; len <= 4; len++) {
+		long scanned = 0, found = 0;
+
+		t = now();
+		for (i = 0; i < NSUGGEST / 100; i++) {
+			char prefix[8];
+			uint32_t best = 0;
+			int id;
+
+			snprintf(prefix, len + 1, "%s", words[(i * 7919L) % n]);
+			termdict_iter_t *it = termdict_prefixiter(dict, prefix);
+			while (termdict_hasnext(it)) {
+				termdict_next(it, &id);
+				best = weights[id] > best ? weights[id] : best;
+			}
+			termdict_destroyiter(it);
+			scanned += best;
+		}
+		tscan = (now() - t) / (NSUGGEST / 100);
+
+		t = now();
+		for (i = 0; i < NSUGGEST; i++) {
+			char prefix[8];
+
+			snprintf(prefix, len + 1, "%s", words[(i * 7919L) % n]);
+			if (suggest_lookup(suggest, prefix, MAX_SUGGEST, ids) > 0 && i < NSUGGEST / 100) {
+				found += weights[ids[0]];
+			}
+		}
+		tsuggest = (now() - t) / NSUGGEST;
+
+		if (found != scanned) {
+			fprintf(stderr, "suggestions failed\n");
+		}
+		printf("suggest, %d letter%s  scan %8.3f ms  suggester %8.4f ms\n",
+		       len, len == 1 ? " " : "s", tscan * 1000, tsuggest * 1000);
+	}
+	printf("suggester: %.1f s to build, %zu KB (termdict %zu KB, %d terms)\n",
+	       tbuild, suggest_memsize(suggest) >> 10, termdict_memsize(dict) >> 10, n);
+
+	suggest_destroy(suggest);
+	termdict_destroy(dict);
+	for (i = 0; i < n; i++) {
+		free(words[i]);
+	}
+	free(words);
+	free(weights);
+}
+
+
+int main(int argc, char **argv)
+{
+	bench_sets();
+	bench_maps();
+	bench_latency(0);
+	bench_latency(1);
+	bench_termdict();
+	bench_fuzzy();
+	bench_suggest();
+
+	return 0;
+}
@@ -0,0 +1,308 @@
+#include "common.h"
+#include "crawler.h"
+#include "list.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * The most directories that are kept open while they wait in the queue.
+ * Directories queued past this are opened by path when their turn
+ * comes, so that a wide tree does not run out of file descriptors.
+ */
+enum { MAX_QUEUED_FDS = 256 };
+
+/*
+ * A directory to read, with its path, and its descriptor if it was
+ * opened relative to its parent when it was found, or -1.
+ */
+typedef struct {
+    int fd;
+    char *path;
+} dir_t;
+
+struct crawler {
+    pthread_mutex_t lock;
+    pthread_cond_t work;        /* Signaled when directories are queued, or the crawl ends */
+    pthread_cond_t found;       /* Signaled when files are found, or the crawl ends */
+    list_t *dirs;               /* Directories to read */
+    int busy;                   /* Directories being read */
+    list_t *files;              /* Paths found, not yet handed out */
+    int stop;
+    int queuedfds;              /* Descriptors of queued directories, updated atomically */
+    find_stats_t stats;
+    pthread_t *threads;
+    int numthreads;
+};
+
+static int done(crawler_t *crawler)
+{
+    return crawler->busy == 0 && list_size(crawler->dirs) == 0;
+}
+
+static dir_t *dir_create(int fd, char *path)
+{
+    dir_t *dir = malloc(sizeof(dir_t));
+
+    if (dir == NULL)
+        fatal_error("out of memory");
+    dir->fd = fd;
+    dir->path = path;
+    return dir;
+}
+
+static void dir_destroy(crawler_t *crawler, dir_t *dir)
+{
+    if (dir->fd >= 0) {
+        close(dir->fd);
+        __atomic_fetch_sub(&crawler->queuedfds, 1, __ATOMIC_RELAXED);
+    }
+    free(dir->path);
+    free(dir);
+}
+
+/*
+ * Handles an entry of the given directory, of the given type (a DT_*
+ * value from the directory), and adds it to the given lists of
+ * subdirectories or files.  Returns 1 if the entry is a file left out
+ * for its extension, or 0 otherwise.
+ */
+static int add_entry(crawler_t *crawler, int dirfd, char *dirpath, char *name, int type,
+                     list_t *subdirs, list_t *files)
+{
+    if (name[0] == '.') {
+        /* skip hidden files and ".", "..", so we do up in the hierarchy */
+        return 0;
+    }
+    if (type == DT_UNKNOWN || type == DT_LNK) {
+        struct stat s;
+
+        /* Not every file system tells, and links are resolved here */
+        if (fstatat(dirfd, name, &s, 0) != 0)
+            type = DT_UNKNOWN;
+        else if (S_ISDIR(s.st_mode))
+            type = type == DT_LNK ? DT_LNK : DT_DIR;
+        else if (S_ISREG(s.st_mode))
+            type = DT_REG;
+    }
+
+    if (type == DT_DIR) {
+        int fd = -1;
+
+        if (__atomic_add_fetch(&crawler->queuedfds, 1, __ATOMIC_RELAXED) <= MAX_QUEUED_FDS)
+            fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0)
+            __atomic_fetch_sub(&crawler->queuedfds, 1, __ATOMIC_RELAXED);
+        list_addlast(subdirs, dir_create(fd, join_path(dirpath, name)));
+    }
+    else if (type == DT_REG) {
+        if (sniff_name(name) != SKIP_NONE)
+            return 1;
+        list_addlast(files, join_path(dirpath, name));
+    }
+    else if (type != DT_LNK) {
+        fprintf(stderr, "skipping irregular file '%s/%s'\n", dirpath, name);
+    }
+    return 0;
+}
+
+#ifdef SYS_getdents64
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+/*
+ * Reads the given directory, and queues what it holds.
+ */
+static void read_dir(crawler_t *crawler, dir_t *dir)
+{
+    list_t *subdirs = list_create(compare_pointers);
+    list_t *files = list_create(compare_strings);
+    int fd = dir->fd, skipped = 0;
+
+    if (fd < 0)
+        fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    else
+        __atomic_fetch_sub(&crawler->queuedfds, 1, __ATOMIC_RELAXED);
+    dir->fd = -1;
+    if (fd < 0) {
+        perror(dir->path);
+    }
+    else {
+#ifdef SYS_getdents64
+        /* Many entries per system call, with their types */
+        char buf[32768] __attribute__((aligned(8)));
+        long n, offset;
+
+        while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+            for (offset = 0; offset < n; ) {
+                struct linux_dirent64 *entry = (struct linux_dirent64 *)(buf + offset);
+                skipped += add_entry(crawler, fd, dir->path, entry->d_name, entry->d_type, subdirs, files);
+                offset += entry->d_reclen;
+            }
+        }
+        if (n < 0)
+            perror(dir->path);
+        close(fd);
+#else
+        DIR *dp = fdopendir(fd);
+        struct dirent *entry;
+
+        while ((entry = readdir(dp)) != NULL)
+            skipped += add_entry(crawler, fd, dir->path, entry->d_name, entry->d_type, subdirs, files);
+        closedir(dp);
+#endif
+    }
+
+    /* Hand out everything found at once, to take the lock once */
+    pthread_mutex_lock(&crawler->lock);
+    crawler->stats.files += list_size(files);
+    crawler->stats.skipped[SKIP_EXTENSION] += skipped;
+    if (list_size(subdirs) > 0)
+        pthread_cond_broadcast(&crawler->work);
+    while (list_size(subdirs) > 0)
+        list_addlast(crawler->dirs, list_popfirst(subdirs));
+    /* Wake as many readers as there are files for */
+    if (list_size(files) > 1)
+        pthread_cond_broadcast(&crawler->found);
+    else if (list_size(files) > 0)
+        pthread_cond_signal(&crawler->found);
+    while (list_size(files) > 0)
+        list_addlast(crawler->files, list_popfirst(files));
+    pthread_mutex_unlock(&crawler->lock);
+
+    list_destroy(subdirs);
+    list_destroy(files);
+}
+
+static void *crawl(void *arg)
+{
+    crawler_t *crawler = arg;
+
+    pthread_mutex_lock(&crawler->lock);
+    for (;;) {
+        dir_t *dir;
+
+        while (list_size(crawler->dirs) == 0 && crawler->busy > 0 && !crawler->stop)
+            pthread_cond_wait(&crawler->work, &crawler->lock);
+        if (crawler->stop || done(crawler))
+            break;
+        dir = list_popfirst(crawler->dirs);
+        crawler->busy++;
+        pthread_mutex_unlock(&crawler->lock);
+
+        read_dir(crawler, dir);
+        dir_destroy(crawler, dir);
+
+        pthread_mutex_lock(&crawler->lock);
+        crawler->busy--;
+        if (done(crawler)) {
+            /* Wake the other threads and the reader to end */
+            pthread_cond_broadcast(&crawler->work);
+            pthread_cond_broadcast(&crawler->found);
+        }
+    }
+    pthread_mutex_unlock(&crawler->lock);
+    return NULL;
+}
+
+crawler_t *crawler_create(char *root, int numthreads)
+{
+    crawler_t *crawler;
+    int i, fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    char *path;
+
+    if (fd < 0)
+        return NULL;
+    crawler = calloc(1, sizeof(crawler_t));
+    path = strdup(root);
+    if (numthreads < 1)
+        numthreads = 1;
+    if (crawler == NULL || path == NULL)
+        fatal_error("out of memory");
+    pthread_mutex_init(&crawler->lock, NULL);
+    pthread_cond_init(&crawler->work, NULL);
+    pthread_cond_init(&crawler->found, NULL);
+    crawler->dirs = list_create(compare_pointers);
+    crawler->files = list_create(compare_strings);
+    crawler->queuedfds = 1;
+    list_addlast(crawler->dirs, dir_create(fd, path));
+
+    crawler->numthreads = numthreads;
+    crawler->threads = malloc(numthreads * sizeof(pthread_t));
+    if (crawler->threads == NULL)
+        fatal_error("out of memory");
+    for (i = 0; i < numthreads; i++) {
+        if (pthread_create(&crawler->threads[i], NULL, crawl, crawler) != 0)
+            fatal_error("pthread_create() failed");
+    }
+    return crawler;
+}
+
+void crawler_destroy(crawler_t *crawler)
+{
+    int i;
+
+    pthread_mutex_lock(&crawler->lock);
+    crawler->stop = 1;
+    pthread_cond_broadcast(&crawler->work);
+    pthread_mutex_unlock(&crawler->lock);
+    for (i = 0; i < crawler->numthreads; i++)
+        pthread_join(crawler->threads[i], NULL);
+
+    while (list_size(crawler->dirs) > 0)
+        dir_destroy(crawler, list_popfirst(crawler->dirs));
+    while (list_size(crawler->files) > 0)
+        free(list_popfirst(crawler->files));
+    list_destroy(crawler->dirs);
+    list_destroy(crawler->files);
+    pthread_cond_destroy(&crawler->work);
+    pthread_cond_destroy(&crawler->found);
+    pthread_mutex_destroy(&crawler->lock);
+    free(crawler->threads);
+    free(crawler);
+}
+
+char *crawler_next(crawler_t *crawler)
+{
+    char *path = NULL;
+
+    pthread_mutex_lock(&crawler->lock);
+    while (list_size(crawler->files) == 0 && !done(crawler))
+        pthread_cond_wait(&crawler->found, &crawler->lock);
+    if (list_size(crawler->files) > 0)
+        path = list_popfirst(crawler->files);
+    pthread_mutex_unlock(&crawler->lock);
+    return path;
+}
+
+char *crawler_trynext(crawler_t *crawler)
+{
+    char *path = NULL;
+
+    pthread_mutex_lock(&crawler->lock);
+    if (list_size(crawler->files) > 0)
+        path = list_popfirst(crawler->files);
+    pthread_mutex_unlock(&crawler->lock);
+    return path;
+}
+
+void crawler_getstats(crawler_t *crawler, find_stats_t *stats)
+{
+    pthread_mutex_lock(&crawler->lock);
+    *stats = crawler->stats;
+    pthread_mutex_unlock(&crawler->lock);
+}
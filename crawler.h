@@ -0,0 +1,63 @@
+#ifndef CRAWLER_H
+#define CRAWLER_H
+
+#include "common.h"
+
+/*
+ * The type of crawlers.  A crawler finds the files under a directory
+ * with several threads, which take directories to read from a shared
+ * queue and add the subdirectories they find to it, and hands the files
+ * out as they are found, so that they can be indexed while the crawl
+ * goes on.
+ *
+ * Directories are read with getdents64() on Linux, and opened with
+ * openat() relative to their parent, and the type of each entry comes
+ * from the directory itself, so files are never stat()ed or opened.
+ * Only symbolic links are followed with fstatat(), to files but not
+ * to directories, which may lead back up the tree.  Hidden files and
+ * directories, and files with the extension of a binary format (see
+ * sniff_name()), are left out.
+ *
+ * The order of the files depends on the timing of the threads.
+ */
+struct crawler;
+typedef struct crawler crawler_t;
+
+/*
+ * The default number of threads of a crawler.  Crawling mostly waits
+ * for the disk, so this is more than the number of processors.
+ */
+enum { DEFAULT_CRAWLER_THREADS = 4 };
+
+/*
+ * Starts crawling the given root directory with the given number of
+ * threads.  Returns NULL, with errno set, if the root cannot be opened.
+ */
+crawler_t *crawler_create(char *root, int numthreads);
+
+/*
+ * Stops the given crawler if it is not done, and destroys it.
+ */
+void crawler_destroy(crawler_t *crawler);
+
+/*
+ * Returns the path of the next file found, which belongs to the caller,
+ * waiting for the threads to find one if need be.  Returns NULL once
+ * the crawl is done and every file has been returned.
+ */
+char *crawler_next(crawler_t *crawler);
+
+/*
+ * Like crawler_next(), but returns NULL rather than wait if no file has
+ * been found yet, so NULL does not mean that the crawl is done.
+ */
+char *crawler_trynext(crawler_t *crawler);
+
+/*
+ * Assigns the counts of the files found so far to the given stats,
+ * where files is the number of files handed out or waiting to be, and
+ * only SKIP_EXTENSION counts skipped files.
+ */
+void crawler_getstats(crawler_t *crawler, find_stats_t *stats);
+
+#endif
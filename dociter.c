@@ -0,0 +1,226 @@
+#include "common.h"
+#include "dociter.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+enum kind { ITER_SET, ITER_AND, ITER_OR, ITER_ANDNOT };
+
+struct dociter {
+    enum kind kind;
+    uint32_t doc;               /* Current document */
+    int started;                /* Has doc been set? */
+    long cost;
+    set_u32_t *set;             /* ITER_SET only */
+    int pos;
+    int owned;
+    dociter_t **children;       /* AND, OR and ANDNOT (a and b) */
+    int numchildren;
+};
+
+static dociter_t *newiter(enum kind kind, dociter_t **children, int numchildren)
+{
+    dociter_t *iter = calloc(1, sizeof(dociter_t));
+
+    if (iter == NULL)
+        fatal_error("out of memory");
+    iter->kind = kind;
+    iter->doc = DOCITER_END;
+    if (numchildren > 0) {
+        iter->children = malloc(numchildren * sizeof(dociter_t *));
+        if (iter->children == NULL)
+            fatal_error("out of memory");
+        memcpy(iter->children, children, numchildren * sizeof(dociter_t *));
+    }
+    iter->numchildren = numchildren;
+    return iter;
+}
+
+dociter_t *dociter_set(set_u32_t *set, int owned)
+{
+    dociter_t *iter = newiter(ITER_SET, NULL, 0);
+
+    iter->set = set;
+    iter->owned = owned;
+    iter->pos = -1;
+    iter->cost = set->size;
+    return iter;
+}
+
+static int compare_cost(const void *a, const void *b)
+{
+    long x = (*(dociter_t **)a)->cost, y = (*(dociter_t **)b)->cost;
+    return (x > y) - (x < y);
+}
+
+dociter_t *dociter_and(dociter_t **children, int numchildren)
+{
+    dociter_t *iter = newiter(ITER_AND, children, numchildren);
+    int i;
+
+    /* The rarest child leads, and the others only seek */
+    qsort(iter->children, numchildren, sizeof(dociter_t *), compare_cost);
+    iter->cost = numchildren > 0 ? iter->children[0]->cost : 0;
+    for (i = 1; i < numchildren; i++) {
+        if (iter->children[i]->cost < iter->cost)
+            iter->cost = iter->children[i]->cost;
+    }
+    return iter;
+}
+
+dociter_t *dociter_or(dociter_t **children, int numchildren)
+{
+    dociter_t *iter = newiter(ITER_OR, children, numchildren);
+    int i;
+
+    for (i = 0; i < numchildren; i++)
+        iter->cost += children[i]->cost;
+    return iter;
+}
+
+dociter_t *dociter_andnot(dociter_t *a, dociter_t *b)
+{
+    dociter_t *children[2] = { a, b };
+    dociter_t *iter = newiter(ITER_ANDNOT, children, 2);
+
+    iter->cost = a->cost;
+    return iter;
+}
+
+void dociter_destroy(dociter_t *iter)
+{
+    int i;
+
+    for (i = 0; i < iter->numchildren; i++)
+        dociter_destroy(iter->children[i]);
+    free(iter->children);
+    if (iter->owned)
+        set_u32_destroy(iter->set);
+    free(iter);
+}
+
+long dociter_cost(dociter_t *iter)
+{
+    return iter->cost;
+}
+
+/*
+ * Returns the first document from the given candidate of the leading
+ * child on that every child has.
+ */
+static uint32_t leapfrog(dociter_t *iter, uint32_t doc)
+{
+    int i = 1;
+
+    while (doc != DOCITER_END && i < iter->numchildren) {
+        uint32_t other = dociter_advance(iter->children[i], doc);
+        if (other == doc) {
+            i++;
+        }
+        else {
+            /* Start over from the first document the child has */
+            doc = dociter_advance(iter->children[0], other);
+            i = 1;
+        }
+    }
+    return doc;
+}
+
+/*
+ * Returns the smallest current document of the children.
+ */
+static uint32_t smallest(dociter_t *iter)
+{
+    uint32_t doc = DOCITER_END;
+    int i;
+
+    for (i = 0; i < iter->numchildren; i++) {
+        if (iter->children[i]->doc < doc)
+            doc = iter->children[i]->doc;
+    }
+    return doc;
+}
+
+/*
+ * Returns the first document from the given candidate of a that b
+ * does not have.
+ */
+static uint32_t exclude(dociter_t *iter, uint32_t doc)
+{
+    while (doc != DOCITER_END && dociter_advance(iter->children[1], doc) == doc)
+        doc = dociter_next(iter->children[0]);
+    return doc;
+}
+
+uint32_t dociter_next(dociter_t *iter)
+{
+    int i;
+
+    switch (iter->kind) {
+    case ITER_SET:
+        if (iter->pos < iter->set->size)
+            iter->pos++;
+        iter->doc = iter->pos < iter->set->size ? iter->set->elems[iter->pos] : DOCITER_END;
+        break;
+    case ITER_AND:
+        if (iter->numchildren == 0)
+            iter->doc = DOCITER_END;
+        else
+            iter->doc = leapfrog(iter, dociter_next(iter->children[0]));
+        break;
+    case ITER_OR:
+        for (i = 0; i < iter->numchildren; i++) {
+            dociter_t *child = iter->children[i];
+            if (!iter->started || child->doc == iter->doc)
+                dociter_next(child);
+        }
+        iter->doc = smallest(iter);
+        break;
+    case ITER_ANDNOT:
+        iter->doc = exclude(iter, dociter_next(iter->children[0]));
+        break;
+    }
+    iter->started = 1;
+    return iter->doc;
+}
+
+uint32_t dociter_advance(dociter_t *iter, uint32_t target)
+{
+    int i;
+
+    if (iter->started && iter->doc >= target)
+        return iter->doc;
+
+    switch (iter->kind) {
+    case ITER_SET:
+        iter->pos = set_u32_seek(iter->set, iter->pos < 0 ? 0 : iter->pos, target);
+        iter->doc = iter->pos < iter->set->size ? iter->set->elems[iter->pos] : DOCITER_END;
+        break;
+    case ITER_AND:
+        if (iter->numchildren == 0)
+            iter->doc = DOCITER_END;
+        else
+            iter->doc = leapfrog(iter, dociter_advance(iter->children[0], target));
+        break;
+    case ITER_OR:
+        for (i = 0; i < iter->numchildren; i++)
+            dociter_advance(iter->children[i], target);
+        iter->doc = smallest(iter);
+        break;
+    case ITER_ANDNOT:
+        iter->doc = exclude(iter, dociter_advance(iter->children[0], target));
+        break;
+    }
+    iter->started = 1;
+    return iter->doc;
+}
+
+set_u32_t *dociter_drain(dociter_t *iter)
+{
+    set_u32_t *result = set_u32_create();
+    uint32_t doc;
+
+    while ((doc = dociter_next(iter)) != DOCITER_END)
+        set_u32_add(result, doc);
+    return result;
+}
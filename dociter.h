@@ -0,0 +1,89 @@
+#ifndef DOCITER_H
+#define DOCITER_H
+
+#include "set_u32.h"
+
+#include <stdint.h>
+
+/*
+ * The type of document iterators.  A document iterator produces the
+ * ids of the documents that match some query, one at a time and in
+ * increasing order, without computing the rest.  Iterators over sets
+ * of documents are the leaves of a tree, and the inner iterators
+ * combine them:
+ *
+ *   AND     leapfrogs between its children, starting with the one with
+ *           the fewest documents, so long lists are skipped over by
+ *           galloping rather than read
+ *   OR      keeps every child on its next document and yields the
+ *           smallest
+ *   ANDNOT  yields the documents of its first child that its second
+ *           child skips past
+ *
+ * so the work done is proportional to the number of documents pulled
+ * from the tree rather than to the number of documents that match.
+ */
+struct dociter;
+typedef struct dociter dociter_t;
+
+/*
+ * Returned by dociter_next() and dociter_advance() at the end.
+ */
+#define DOCITER_END UINT32_MAX
+
+/*
+ * Creates an iterator over the given set.  If owned is set, the
+ * iterator destroys the set when it is destroyed.
+ */
+dociter_t *dociter_set(set_u32_t *set, int owned);
+
+/*
+ * Creates an iterator over the documents that all the given iterators
+ * produce.  The new iterator owns the given ones, but not the array.
+ */
+dociter_t *dociter_and(dociter_t **children, int numchildren);
+
+/*
+ * Creates an iterator over the documents that any of the given
+ * iterators produce.  The new iterator owns the given ones, but not
+ * the array.
+ */
+dociter_t *dociter_or(dociter_t **children, int numchildren);
+
+/*
+ * Creates an iterator over the documents that a produces and b does
+ * not.  The new iterator owns a and b.
+ */
+dociter_t *dociter_andnot(dociter_t *a, dociter_t *b);
+
+/*
+ * Destroys the given iterator and its children.
+ */
+void dociter_destroy(dociter_t *iter);
+
+/*
+ * Returns an upper bound on the number of documents the given
+ * iterator produces.
+ */
+long dociter_cost(dociter_t *iter);
+
+/*
+ * Moves the given iterator to its next document and returns it, or
+ * returns DOCITER_END if there are no more.
+ */
+uint32_t dociter_next(dociter_t *iter);
+
+/*
+ * Moves the given iterator to its first document that is not smaller
+ * than target and returns it, or returns DOCITER_END if there is none.
+ * Does not move the iterator if its current document is already not
+ * smaller than target.
+ */
+uint32_t dociter_advance(dociter_t *iter, uint32_t target);
+
+/*
+ * Returns the set of the remaining documents of the given iterator.
+ */
+set_u32_t *dociter_drain(dociter_t *iter);
+
+#endif
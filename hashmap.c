@@ -2,10 +2,17 @@
 
 #include <stdlib.h>
 
+/*
+ * The number of old buckets that are moved to the new table per
+ * operation while an incremental resize is in progress.
+ */
+#define MIGRATE_STEP 4
+
 struct mapentry
 {
     void *key;
     void *value;
+    unsigned long hash;     /* Cached, so growing never rehashes */
     struct mapentry *next;
 };
 
@@ -17,10 +24,14 @@ struct map
     hashfunc_t hashfunc;
     int size;
     mapentry_t **buckets;
-    int numbuckets;
+    int numbuckets;         /* Always a power of two */
+    int incremental;        /* Resize a few buckets at a time? */
+    mapentry_t **oldbuckets;    /* Table being migrated, or NULL */
+    int oldnumbuckets;
+    int migrated;           /* Old buckets below this one are empty */
 };
 
-static mapentry_t *newentry(void *key, void *value, mapentry_t *next)
+static mapentry_t *newentry(void *key, void *value, unsigned long hash, mapentry_t *next)
 {
     mapentry_t *e = malloc(sizeof(mapentry_t));
     if (e == NULL) {
@@ -29,6 +40,7 @@ static mapentry_t *newentry(void *key, void *value, mapentry_t *next)
 	}
     e->key = key;
     e->value = value;
+    e->hash = hash;
     e->next = next;
     return e;
 }
@@ -50,6 +62,10 @@ map_t *map_create(cmpfunc_t cmpfunc, hashfunc_t hashfunc)
         fatal_error("out of memory");
 		return NULL;
 	}
+    map->incremental = 0;
+    map->oldbuckets = NULL;
+    map->oldnumbuckets = 0;
+    map->migrated = 0;
     return map;
 }
 
@@ -71,45 +87,115 @@ static void freebuckets(int numbuckets, mapentry_t **buckets)
 
 void map_destroy(map_t *map)
 {
+    if (map->oldbuckets != NULL) {
+        freebuckets(map->oldnumbuckets, map->oldbuckets);
+    }
     freebuckets(map->numbuckets, map->buckets);
     free(map);
 }
 
+/*
+ * Moves the entries of the given old bucket to the new table.
+ */
+static void migratebucket(map_t *map, int b)
+{
+    mapentry_t *e = map->oldbuckets[b];
+
+    while (e != NULL) {
+        mapentry_t *next = e->next;
+        int nb = e->hash & (map->numbuckets - 1);
+        e->next = map->buckets[nb];
+        map->buckets[nb] = e;
+        e = next;
+    }
+    map->oldbuckets[b] = NULL;
+}
+
+/*
+ * Migrates up to the given number of old buckets, and frees the old
+ * table once it is empty.
+ */
+static void migrate(map_t *map, int nbuckets)
+{
+    while (nbuckets-- > 0 && map->migrated < map->oldnumbuckets) {
+        migratebucket(map, map->migrated++);
+    }
+    if (map->migrated == map->oldnumbuckets) {
+        free(map->oldbuckets);
+        map->oldbuckets = NULL;
+        map->oldnumbuckets = 0;
+        map->migrated = 0;
+    }
+}
+
 static void growmap(map_t *map)
 {
-    int b;
-    int oldnumbuckets = map->numbuckets;
-    mapentry_t **oldbuckets = map->buckets;
+    /* A previous resize must be complete before the next one starts */
+    if (map->oldbuckets != NULL) {
+        migrate(map, map->oldnumbuckets);
+    }
 
-    map->size = 0;
-    map->numbuckets = oldnumbuckets * 2;
+    map->oldnumbuckets = map->numbuckets;
+    map->oldbuckets = map->buckets;
+    map->migrated = 0;
+
+    map->numbuckets = map->oldnumbuckets * 2;
     map->buckets = calloc(map->numbuckets, sizeof(mapentry_t *));
     if (map->buckets == NULL) {
         fatal_error("out of memory");
 		return;
 	}
 
-    for (b = 0; b < oldnumbuckets; b++) {
-        mapentry_t *e = oldbuckets[b];
-        while (e != NULL) {
-            map_put(map, e->key, e->value);
-            e = e->next;
+    if (!map->incremental) {
+        /* Relink all the existing entries right away */
+        migrate(map, map->oldnumbuckets);
+    }
+}
+
+void map_setincremental(map_t *map, int incremental)
+{
+    map->incremental = incremental;
+    if (!incremental && map->oldbuckets != NULL) {
+        migrate(map, map->oldnumbuckets);
+    }
+}
+
+/*
+ * Returns the entry with the given key, looking in the old table too
+ * if the key's old bucket has not been migrated yet.
+ */
+static mapentry_t *findentry(map_t *map, void *key, unsigned long hash)
+{
+    mapentry_t *e = map->buckets[hash & (map->numbuckets - 1)];
+
+    while (e != NULL && (e->hash != hash || map->cmpfunc(key, e->key) != 0)) {
+        e = e->next;
+    }
+    if (e == NULL && map->oldbuckets != NULL) {
+        int b = hash & (map->oldnumbuckets - 1);
+        if (b >= map->migrated) {
+            e = map->oldbuckets[b];
+            while (e != NULL && (e->hash != hash || map->cmpfunc(key, e->key) != 0)) {
+                e = e->next;
+            }
         }
     }
-    freebuckets(oldnumbuckets, oldbuckets);
+    return e;
 }
 
 void map_put(map_t *map, void *key, void *value)
 {
     unsigned long hash = map->hashfunc(key);
-    int b = hash % map->numbuckets;
-    mapentry_t *e = map->buckets[b];
+    mapentry_t *e;
 
-    while (e != NULL && map->cmpfunc(key, e->key) != 0) {
-        e = e->next;
+    if (map->oldbuckets != NULL) {
+        migrate(map, MIGRATE_STEP);
     }
+
+    e = findentry(map, key, hash);
     if (e == NULL) {
-        map->buckets[b] = newentry(key, value, map->buckets[b]);
+        int b = hash & (map->numbuckets - 1);
+        map->buckets[b] = newentry(key, value, hash, map->buckets[b]);
         map->size++;
         if (map->size >= map->numbuckets)
             growmap(map);
@@ -121,14 +207,7 @@ void map_put(map_t *map, void *key, void *value)
 
 int map_haskey(map_t *map, void *key)
 {
-    unsigned long hash = map->hashfunc(key);
-    int b = hash % map->numbuckets;
-    mapentry_t *e = map->buckets[b];
-
-    while (e != NULL && map->cmpfunc(key, e->key) != 0) {
-        e = e->next;
-    }
-    if (e == NULL) {
+    if (findentry(map, key, map->hashfunc(key)) == NULL) {
         return 0;
     }
     else {
@@ -138,13 +217,8 @@ int map_haskey(map_t *map, void *key)
 
 void *map_get(map_t *map, void *key)
 {
-    unsigned long hash = map->hashfunc(key);
-    int b = hash % map->numbuckets;
-    mapentry_t *e = map->buckets[b];
+    mapentry_t *e = findentry(map, key, map->hashfunc(key));
 
-    while (e != NULL && map->cmpfunc(key, e->key) != 0) {
-        e = e->next;
-    }
     if (e == NULL) {
 		return NULL;
     }
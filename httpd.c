@@ -152,11 +152,37 @@ char *js_escape(char *s)
     }
 }
 
+/*
+ * Parses the given &-terminated list of url encoded key=value pairs
+ * into the given map.  Modifies the string.
+ */
+static void parseargs(char *buf, map_t *args)
+{
+    char *p = strchr(buf, '&');
+
+    while (p != NULL) {
+        char *key, *value;
+        *p++ = 0;
+        if (splitstring(buf, '=', &key, &value)) {
+            key = urldecode(key);
+            value = urldecode(value);
+            map_put(args, key, value);
+        }
+        buf = p;
+        p = strchr(p, '&');
+    }
+}
+
 void http_ok(FILE *f, char *content_type)
 {
     fprintf(f, "HTTP/1.0 200 OK\r\nContent-Type: %s\r\n\r\n", content_type);
 }
 
+void http_badrequest(FILE *f, char *content_type)
+{
+    fprintf(f, "HTTP/1.0 400 Bad Request\r\nContent-Type: %s\r\n\r\n", content_type);
+}
+
 void http_notfound(FILE *f, char *path)
 {
     fprintf(f, "HTTP/1.0 404 Not Found\r\nContent-Type: text/html\r\n\r\n");
@@ -170,6 +196,7 @@ static int handle_request(int s, http_handler_t handler)
 	char *method = newstring(300);
 	char *path = newstring(300);
 	char *line = newstring(300);
+	char *query;
 	map_t *header = map_create(compare_strings, hash_string);
     map_t *args = map_create(compare_strings, hash_string);
 	int t, status = 1;
@@ -191,6 +218,15 @@ static int handle_request(int s, http_handler_t handler)
 		status = 1;
 		goto out;
 	}
+	/* Split off the query string, e.g. /api/count?q=word */
+	query = strchr(path, '?');
+	if (query != NULL) {
+		char *buf = newstring(strlen(query));
+		*query++ = 0;
+		strcpy(buf, query);
+		strcat(buf, "&");
+		parseargs(buf, args);
+	}
 	/* Read the remainder of the request line */
 	fgets(line, 300, inf);
 	/* Read and parse the header fields */
@@ -212,7 +248,7 @@ static int handle_request(int s, http_handler_t handler)
 	/* If this is a POST request, read and parse the posted data */
 	if (strcmp(method, "POST") == 0) {
 		int length;
-		char *buf, *p;
+		char *buf;
 
 		if (!map_haskey(header, "Content-Length")) {
 			fprintf(stderr, "No Content-Length in POST request\n");
@@ -222,18 +258,7 @@ static int handle_request(int s, http_handler_t handler)
 		buf = newstring(length+1);
 		fread(buf, 1, length, inf);
         buf[length] = '&';
-        p = strchr(buf, '&');
-        while (p != NULL) {
-            char *key, *value;
-            *p++ = 0;
-            if (splitstring(buf, '=', &key, &value)) {
-                key = urldecode(key);
-                value = urldecode(value);
-                map_put(args, key, value);
-            }
-            buf = p;
-            p = strchr(p, '&');
-        }
+        parseargs(buf, args);
 	}
 
 	/* Create a FILE for writing the response */
@@ -12,7 +12,9 @@ typedef int (*http_handler_t)(char *path, map_t *header, map_t *args, FILE *f);
 
 /*
  * Starts a HTTP server on the given port, passing incoming
- * GET and POST requests to the given request handler.
+ * GET and POST requests to the given request handler.  The arguments
+ * of both the query string (for GET) and the posted form (for POST)
+ * are passed in args, and the query string is removed from the path.
  * 
  * Returns a status code similar to that of a main() function.
  */
@@ -24,6 +26,12 @@ int http_server(unsigned short port, http_handler_t handler);
  */
 void http_ok(FILE *f, char *content_type);
 
+/*
+ * Sends a HTTP Bad Request header on the given connection (file),
+ * setting the Content-Type field to the given value.
+ */
+void http_badrequest(FILE *f, char *content_type);
+
 /*
  * Sends a HTTP Not Found header on the given connection (file),
  * indicating that the given path was not found.
@@ -1,29 +1,113 @@
 #include "common.h"
+#include "dociter.h"
 #include "index.h"
+#include "levenshtein.h"
 #include "list.h"
-#include "map.h"
+#include "map_str.h"
+#include "postings.h"
+#include "qcache.h"
 #include "query_parser.h"
-#include "set.h"
+#include "rank.h"
+#include "set_u32.h"
+#include "suggest.h"
+#include "termdict.h"
+#include "tokenizer.h"
+#include "trigram.h"
 
+#include <limits.h>
+#include <regex.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 
+/*
+ * While documents are being added, the dictionary is a hash map from
+ * words to postings.  index_freeze() replaces it with a sorted, front
+ * coded termdict_t and an array of postings indexed by term id, plus
+ * a dictionary of the reversed words for suffix wildcards.
+ *
+ * Removed documents are only marked in the deleted bitmap, which
+ * queries apply as a filter, and stay in the postings until the next
+ * compaction (see index_compact()).  The statistics used for scoring
+ * still count them until then, so the score bounds stay valid.  The
+ * bitmap, numdeleted and generation are updated atomically, and the
+ * paths of removed documents are kept until the compaction, so that
+ * documents may be removed from a frozen index while other threads
+ * query it.
+ */
 struct index {
-	map_t *words;
+	map_str_t *words;	/* word -> postings_t, or NULL */
+	termdict_t *dict;	/* frozen dictionary, or NULL */
+	postings_t **postings;	/* term id -> postings_t */
+	termdict_t *rdict;	/* frozen dictionary of reversed words */
+	uint32_t *rids;		/* reversed term id -> term id */
+	suggest_t *suggest;	/* completions of prefixes of frozen words */
+	int maxexpansions;	/* max words matched by a wildcard */
+	int positional;		/* store word positions? */
+	int casefold;		/* fold the words of queries to lower case? */
+	int pruning;		/* skip what the score bounds rule out when ranking? */
+	tokenizer_t *tokenizer;	/* splits the phrases of queries */
+	char **paths;		/* document id -> path */
+	uint32_t *doclens;	/* document id -> number of words */
+	uint64_t totallen;	/* sum of doclens */
+	uint64_t generation;	/* bumped by every change */
+	qcache_t *cache;	/* recent query results, or NULL */
+	qcache_t *subcache;	/* results of parts of queries, or NULL */
+	trigram_t *trigrams;	/* trigrams of the documents' text, or NULL */
+	map_str_t *docids;	/* path -> document id + 1 */
+	uint64_t *deleted;	/* bitmap of removed documents still in the postings */
+	int numdeleted;		/* bits set in deleted */
+	int numpurged;		/* removed documents compacted away */
+	int numpaths;
+	int maxpaths;
 };
 
 
+/*
+ * index_freeze() compacts the index once at least one in this many of
+ * the documents in the postings are removed ones.
+ */
+#define COMPACT_RATIO 4
+
+
+/*
+ * Returns 1 if removed documents are still in the postings, or 0
+ * otherwise.
+ */
+static inline int has_deleted(index_t *idx) {
+	return __atomic_load_n(&idx->numdeleted, __ATOMIC_RELAXED) > 0;
+}
+
+
+/*
+ * Returns 1 if the given document was removed but is still in the
+ * postings, or 0 otherwise.
+ */
+static inline int is_deleted(index_t *idx, uint32_t doc) {
+	return (__atomic_load_n(&idx->deleted[doc / 64], __ATOMIC_RELAXED) >> (doc % 64)) & 1;
+}
+
+
 index_t *index_create() {
 	index_t *idx = (index_t *)calloc(1,sizeof(*idx));
 	if (idx == NULL) {
 		goto error;
 	}
 
-	idx->words = map_create(compare_strings, hash_string);
+	idx->words = map_str_create();
 	if (idx->words == NULL) {
 		goto error;
 	}
+	/* Avoid long pauses when the dictionary grows during updates */
+	map_str_setincremental(idx->words, 1);
+	idx->docids = map_str_create();
+	if (idx->docids == NULL) {
+		goto error;
+	}
+	idx->maxexpansions = DEFAULT_MAX_EXPANSIONS;
+	idx->pruning = 1;
+	idx->tokenizer = tokenizer_copy(tokenizer_default());
 
 	return idx;
 error:
@@ -32,13 +116,741 @@ error:
 }
 
 
+index_t *index_createlike(index_t *other) {
+	index_t *idx = index_create();
+	if (idx == NULL) {
+		return NULL;
+	}
+	idx->positional = other->positional;
+	idx->casefold = other->casefold;
+	idx->maxexpansions = other->maxexpansions;
+	idx->pruning = other->pruning;
+	index_settokenizer(idx, other->tokenizer);
+	if (other->trigrams != NULL) {
+		idx->trigrams = trigram_create();
+	}
+	return idx;
+}
+
+
 void index_destroy(index_t *idx) {
 	if (idx != NULL) {
-		free(idx);
+		if (idx->dict != NULL) {
+			int i;
+			for (i = 0; i < termdict_size(idx->dict); i++) {
+				postings_destroy(idx->postings[i]);
+			}
+			free(idx->postings);
+			termdict_destroy(idx->dict);
+			termdict_destroy(idx->rdict);
+			free(idx->rids);
+			suggest_destroy(idx->suggest);
+		}
 		if (idx->words != NULL) {
-			map_destroy(idx->words);
+			map_str_iter_t *it = map_str_createiter(idx->words);
+			while (map_str_hasnext(it)) {
+				map_str_entry_t *e = map_str_next(it);
+				free(e->key);
+				postings_destroy(e->value);
+			}
+			map_str_destroyiter(it);
+			map_str_destroy(idx->words);
+		}
+		if (idx->cache != NULL) {
+			qcache_destroy(idx->cache);
+		}
+		if (idx->subcache != NULL) {
+			qcache_destroy(idx->subcache);
+		}
+		if (idx->trigrams != NULL) {
+			trigram_destroy(idx->trigrams);
+		}
+		if (idx->docids != NULL) {
+			map_str_destroy(idx->docids);
+		}
+		int i;
+		for (i = 0; i < idx->numpaths; i++) {
+			free(idx->paths[i]);
+		}
+		free(idx->paths);
+		free(idx->doclens);
+		free(idx->deleted);
+		tokenizer_destroy(idx->tokenizer);
+		free(idx);
+	}
+}
+
+
+static int compare_entries(const void *a, const void *b) {
+	return strcmp((*(map_str_entry_t **)a)->key, (*(map_str_entry_t **)b)->key);
+}
+
+
+static char *reverse_string(char *s) {
+	int i, len = strlen(s);
+	char *r = malloc(len + 1);
+	if (r == NULL) {
+		fatal_error("out of memory");
+	}
+	for (i = 0; i < len; i++) {
+		r[i] = s[len - 1 - i];
+	}
+	r[len] = '\0';
+	return r;
+}
+
+
+struct reversed {
+	char *word;
+	uint32_t id;
+};
+
+static int compare_reversed(const void *a, const void *b) {
+	return strcmp(((struct reversed *)a)->word, ((struct reversed *)b)->word);
+}
+
+
+/*
+ * Builds the dictionary of reversed words from the given sorted words.
+ */
+static void build_reversed(index_t *idx, char **terms, int numterms) {
+	struct reversed *rev = malloc((numterms + 1) * sizeof(*rev));
+	char **rterms = malloc((numterms + 1) * sizeof(*rterms));
+	idx->rids = malloc((numterms + 1) * sizeof(*idx->rids));
+	if (rev == NULL || rterms == NULL || idx->rids == NULL) {
+		fatal_error("out of memory");
+	}
+
+	int i;
+	for (i = 0; i < numterms; i++) {
+		rev[i].word = reverse_string(terms[i]);
+		rev[i].id = i;
+	}
+	qsort(rev, numterms, sizeof(*rev), compare_reversed);
+	for (i = 0; i < numterms; i++) {
+		rterms[i] = rev[i].word;
+		idx->rids[i] = rev[i].id;
+	}
+	idx->rdict = termdict_create(rterms, numterms);
+
+	for (i = 0; i < numterms; i++) {
+		free(rev[i].word);
+	}
+	free(rterms);
+	free(rev);
+}
+
+
+/*
+ * Assigns the collection statistics used for scoring.
+ */
+static void get_stats(index_t *idx, rank_stats_t *stats) {
+	int numdocs = idx->numpaths - idx->numpurged;
+	stats->numdocs = numdocs;
+	stats->doclens = idx->doclens;
+	stats->deleted = (has_deleted(idx) ? idx->deleted : NULL);
+	stats->dfs = NULL;
+	stats->avgdoclen = (numdocs > 0 && idx->totallen > 0 ? (double)idx->totallen / numdocs : 1.0);
+}
+
+
+void index_freeze(index_t *idx) {
+	if (idx == NULL) {
+		return;
+	}
+	if (idx->numdeleted > 0 && idx->numdeleted * COMPACT_RATIO >= idx->numpaths - idx->numpurged) {
+		index_compact(idx);
+	}
+	if (idx->dict != NULL) {
+		return;
+	}
+
+	int i, numterms = map_str_size(idx->words);
+	map_str_entry_t **entries = malloc((numterms + 1) * sizeof(*entries));
+	char **terms = malloc((numterms + 1) * sizeof(*terms));
+	idx->postings = malloc((numterms + 1) * sizeof(*idx->postings));
+	if (entries == NULL || terms == NULL || idx->postings == NULL) {
+		fatal_error("out of memory");
+	}
+
+	map_str_iter_t *it = map_str_createiter(idx->words);
+	for (i = 0; map_str_hasnext(it); i++) {
+		entries[i] = map_str_next(it);
+	}
+	map_str_destroyiter(it);
+
+	qsort(entries, numterms, sizeof(*entries), compare_entries);
+	for (i = 0; i < numterms; i++) {
+		terms[i] = entries[i]->key;
+		idx->postings[i] = entries[i]->value;
+	}
+	idx->dict = termdict_create(terms, numterms);
+	build_reversed(idx, terms, numterms);
+
+	/* Words are suggested by the number of documents that contain them */
+	uint32_t *dfs = malloc((numterms + 1) * sizeof(*dfs));
+	if (dfs == NULL) {
+		fatal_error("out of memory");
+	}
+	for (i = 0; i < numterms; i++) {
+		dfs[i] = idx->postings[i]->docs->size;
+	}
+	idx->suggest = suggest_create(idx->dict, dfs, MAX_SUGGESTIONS);
+	free(dfs);
+
+	/* The bounds for pruning ranked queries stay valid until the next document */
+	rank_stats_t stats;
+	get_stats(idx, &stats);
+	for (i = 0; i < numterms; i++) {
+		rank_setbounds(idx->postings[i], &stats);
+	}
+
+	for (i = 0; i < numterms; i++) {
+		free(terms[i]);
+	}
+	free(terms);
+	free(entries);
+	map_str_destroy(idx->words);
+	idx->words = NULL;
+	if (idx->trigrams != NULL) {
+		trigram_compact(idx->trigrams);
+	}
+}
+
+
+/*
+ * Turns a frozen dictionary back into a hash map, so that more
+ * documents can be added.
+ */
+static void thaw(index_t *idx) {
+	idx->words = map_str_create();
+	map_str_setincremental(idx->words, 1);
+
+	termdict_iter_t *it = termdict_rangeiter(idx->dict, NULL, NULL);
+	while (termdict_hasnext(it)) {
+		int id;
+		char *word = strdup(termdict_next(it, &id));
+		if (word == NULL) {
+			fatal_error("out of memory");
+		}
+		map_str_put(idx->words, word, idx->postings[id]);
+	}
+	termdict_destroyiter(it);
+
+	suggest_destroy(idx->suggest);
+	idx->suggest = NULL;
+	termdict_destroy(idx->dict);
+	idx->dict = NULL;
+	free(idx->postings);
+	idx->postings = NULL;
+	termdict_destroy(idx->rdict);
+	idx->rdict = NULL;
+	free(idx->rids);
+	idx->rids = NULL;
+}
+
+
+/*
+ * Returns the given word of a query as the documents' words are
+ * tokenized, which is the word itself or a folded copy of it in the
+ * given buffer, which must have room for the word.
+ */
+static char *query_word(index_t *idx, char *word, char *buf) {
+	if (!idx->casefold) {
+		return word;
+	}
+	size_t len = strlen(word);
+	memcpy(buf, word, len + 1);
+	fold_case(buf, len);
+	return buf;
+}
+
+
+/*
+ * Returns the posting list of the given word, or NULL.
+ */
+static postings_t *lookup_postings(index_t *idx, char *word) {
+	char buf[strlen(word) + 1];
+	word = query_word(idx, word, buf);
+	if (idx->dict != NULL) {
+		int id = termdict_lookup(idx->dict, word);
+		return id < 0 ? NULL : idx->postings[id];
+	}
+	return map_str_get(idx->words, word);
+}
+
+
+set_u32_t *index_lookup(index_t *idx, char *word) {
+	postings_t *postings = lookup_postings(idx, word);
+	return postings == NULL ? NULL : postings->docs;
+}
+
+
+set_u32_t *index_lookupphrase(index_t *idx, char **words, int numwords, char **errmsg) {
+	if (numwords == 0) {
+		*errmsg = strdup("Empty phrase");
+		return NULL;
+	}
+	if (!idx->positional && numwords > 1) {
+		*errmsg = strdup("Phrase queries need an index with word positions");
+		return NULL;
+	}
+
+	postings_t **postings = malloc(numwords * sizeof(*postings));
+	if (postings == NULL) {
+		fatal_error("out of memory");
+	}
+
+	int i;
+	set_u32_t *result = NULL;
+	for (i = 0; i < numwords; i++) {
+		postings[i] = lookup_postings(idx, words[i]);
+		if (postings[i] == NULL) {
+			/* Some word does not occur anywhere */
+			result = set_u32_create();
+			break;
+		}
+	}
+	if (result == NULL) {
+		result = (numwords == 1 ? set_u32_copy(postings[0]->docs) : postings_phrase(postings, numwords));
+	}
+
+	free(postings);
+	return result;
+}
+
+
+void index_setmaxexpansions(index_t *idx, int maxexpansions) {
+	idx->maxexpansions = maxexpansions;
+}
+
+
+void index_setpositional(index_t *idx, int positional) {
+	if (idx->numpaths > 0) {
+		fatal_error("index_setpositional() on a non-empty index");
+	}
+	idx->positional = positional;
+}
+
+
+void index_setcasefold(index_t *idx, int casefold) {
+	idx->casefold = casefold;
+}
+
+
+void index_settokenizer(index_t *idx, tokenizer_t *tokenizer) {
+	tokenizer_destroy(idx->tokenizer);
+	idx->tokenizer = tokenizer_copy(tokenizer);
+}
+
+
+void index_setpruning(index_t *idx, int pruning) {
+	idx->pruning = pruning;
+}
+
+
+void index_settrigrams(index_t *idx, int trigrams) {
+	if (idx->numpaths > 0) {
+		fatal_error("index_settrigrams() on a non-empty index");
+	}
+	if (trigrams && idx->trigrams == NULL) {
+		idx->trigrams = trigram_create();
+	} else if (!trigrams && idx->trigrams != NULL) {
+		trigram_destroy(idx->trigrams);
+		idx->trigrams = NULL;
+	}
+}
+
+
+void index_addtrigrams(index_t *idx, char *text, size_t len) {
+	if (idx->trigrams == NULL || idx->numpaths == 0) {
+		fatal_error("index_addtrigrams() without trigrams or documents");
+	}
+	trigram_add(idx->trigrams, idx->numpaths - 1, text, len);
+	idx->generation++;
+}
+
+
+/*
+ * Returns 1 if the given text contains the given string, 0 otherwise.
+ */
+static int contains(char *text, size_t len, char *s, size_t slen) {
+	char *p = text, *end = text + len;
+
+	if (slen == 0) {
+		return 1;
+	}
+	while ((size_t)(end - p) >= slen && (p = memchr(p, s[0], end - p - slen + 1)) != NULL) {
+		if (memcmp(p, s, slen) == 0) {
+			return 1;
+		}
+		p++;
+	}
+	return 0;
+}
+
+
+list_t *index_grep(index_t *idx, char *pattern, int regex, char **errmsg) {
+	set_u32_t *candidates;
+	regex_t re;
+	int i;
+
+	if (idx->trigrams == NULL) {
+		*errmsg = strdup("Substring and regex queries need an index with trigrams");
+		return NULL;
+	}
+	if (regex) {
+		int status = regcomp(&re, pattern, REG_EXTENDED | REG_NOSUB | REG_NEWLINE);
+		if (status != 0) {
+			char buf[256];
+			regerror(status, &re, buf, sizeof(buf));
+			*errmsg = strdup(buf);
+			return NULL;
+		}
+		candidates = trigram_regex(idx->trigrams, pattern, idx->numpaths);
+	} else {
+		candidates = trigram_substring(idx->trigrams, pattern, strlen(pattern), idx->numpaths);
+	}
+
+	/* The trigrams may occur apart, so read the candidates to be sure */
+	list_t *list = list_create(compare_strings);
+	for (i = 0; i < candidates->size; i++) {
+		uint32_t doc = candidates->elems[i];
+		char *path = idx->paths[doc];
+		FILE *f;
+		size_t len;
+		char *text;
+
+		/* Removed documents keep their trigrams */
+		if (path == NULL || (has_deleted(idx) && is_deleted(idx, doc)) || (f = fopen(path, "r")) == NULL) {
+			continue;
+		}
+		text = read_file(f, &len);
+		fclose(f);
+		if (text == NULL) {
+			continue;
+		}
+		if (regex ? regexec(&re, text, 0, NULL, 0) == 0 : contains(text, len, pattern, strlen(pattern))) {
+			list_addlast(list, path);
+		}
+		free(text);
+	}
+
+	if (regex) {
+		regfree(&re);
+	}
+	set_u32_destroy(candidates);
+	return list;
+}
+
+
+set_u32_t *index_lookupnear(index_t *idx, char *a, char *b, int distance, char **errmsg) {
+	if (!idx->positional) {
+		*errmsg = strdup("NEAR queries need an index with word positions");
+		return NULL;
+	}
+
+	postings_t *pa = lookup_postings(idx, a);
+	postings_t *pb = lookup_postings(idx, b);
+	if (pa == NULL || pb == NULL) {
+		return set_u32_create();
+	}
+	return postings_near(pa, pb, distance);
+}
+
+
+/*
+ * Adds a set to a growing array of sets.  Returns 0 if the array
+ * already holds the given maximum number of sets, or 1 otherwise.
+ */
+static int add_match(set_u32_t ***matches, int *nummatches, int max, set_u32_t *docs) {
+	if (*nummatches >= max) {
+		return 0;
+	}
+	if ((*nummatches & (*nummatches - 1)) == 0) {
+		/* Grow at powers of two */
+		*matches = realloc(*matches, (*nummatches == 0 ? 1 : 2 * *nummatches) * sizeof(**matches));
+		if (*matches == NULL) {
+			fatal_error("out of memory");
+		}
+	}
+	(*matches)[(*nummatches)++] = docs;
+	return 1;
+}
+
+
+/*
+ * Assigns the postings of every word that starts (or, if suffix is set,
+ * ends) with the given affix to the given array.  Returns the number of
+ * words, or -1 if there are more than the index's maxexpansions.
+ */
+static int expand(index_t *idx, char *affix, int suffix, set_u32_t ***matches) {
+	int nummatches = 0, ok = 1, id;
+
+	*matches = NULL;
+	if (idx->dict != NULL) {
+		/* The matching words are a contiguous range of the sorted dictionary */
+		char *rev = suffix ? reverse_string(affix) : NULL;
+		termdict_iter_t *it = termdict_prefixiter(suffix ? idx->rdict : idx->dict, suffix ? rev : affix);
+		while (ok && termdict_hasnext(it)) {
+			termdict_next(it, &id);
+			ok = add_match(matches, &nummatches, idx->maxexpansions,
+						   idx->postings[suffix ? idx->rids[id] : id]->docs);
+		}
+		termdict_destroyiter(it);
+		free(rev);
+	} else {
+		/* Not frozen yet, so scan the hash map */
+		int len = strlen(affix);
+		map_str_iter_t *it = map_str_createiter(idx->words);
+		while (ok && map_str_hasnext(it)) {
+			map_str_entry_t *e = map_str_next(it);
+			int wordlen = strlen(e->key);
+			if (wordlen >= len && strncmp(e->key + (suffix ? wordlen - len : 0), affix, len) == 0) {
+				ok = add_match(matches, &nummatches, idx->maxexpansions,
+							   ((postings_t *)e->value)->docs);
+			}
+		}
+		map_str_destroyiter(it);
+	}
+
+	return ok ? nummatches : -1;
+}
+
+
+int index_expandwildcard(index_t *idx, char *pattern, set_u32_t ***sets, char **errmsg) {
+	int len = strlen(pattern);
+	char *star = strchr(pattern, '*');
+
+	*sets = NULL;
+	if (star == NULL || strchr(star + 1, '*') != NULL || len < 2 ||
+		(star != pattern && star != pattern + len - 1)) {
+		*errmsg = strdup("Wildcards must be of the form word* or *word");
+		return -1;
+	}
+
+	int suffix = (star == pattern);
+	char *affix = strndup(pattern + suffix, len - 1);
+	if (affix == NULL) {
+		fatal_error("out of memory");
+	}
+	if (idx->casefold) {
+		fold_case(affix, len - 1);
+	}
+
+	int nummatches = expand(idx, affix, suffix, sets);
+	free(affix);
+	if (nummatches < 0) {
+		*errmsg = strdup("Wildcard matches too many words");
+		free(*sets);
+		*sets = NULL;
+	}
+	return nummatches;
+}
+
+
+set_u32_t *index_lookupwildcard(index_t *idx, char *pattern, char **errmsg) {
+	set_u32_t **matches;
+	int nummatches = index_expandwildcard(idx, pattern, &matches, errmsg);
+	if (nummatches < 0) {
+		return NULL;
+	}
+
+	set_u32_t *result = postings_union(matches, nummatches, idx->numpaths);
+	free(matches);
+	return result;
+}
+
+
+int index_expandfuzzy(index_t *idx, char *word, int maxedits, set_u32_t ***sets, char **errmsg) {
+	int nummatches = 0, ok = 1, id;
+	char buf[strlen(word) + 1];
+	word = query_word(idx, word, buf);
+
+	*sets = NULL;
+	if (maxedits < 1 || maxedits > MAX_FUZZY_EDITS || *word == '\0') {
+		*errmsg = strdup("Fuzzy words must be of the form word~1 or word~2");
+		return -1;
+	}
+
+	if (idx->dict != NULL) {
+		/* Only the parts of the dictionary near the matches are read */
+		termdict_iter_t *it = termdict_fuzzyiter(idx->dict, word, maxedits);
+		while (ok && termdict_hasnext(it)) {
+			termdict_next(it, &id);
+			ok = add_match(sets, &nummatches, idx->maxexpansions, idx->postings[id]->docs);
+		}
+		termdict_destroyiter(it);
+	} else {
+		/* Not frozen yet, so scan the hash map */
+		levenshtein_t *lev = levenshtein_create(word, maxedits);
+		map_str_iter_t *it = map_str_createiter(idx->words);
+		while (ok && map_str_hasnext(it)) {
+			map_str_entry_t *e = map_str_next(it);
+			if (levenshtein_matches(lev, e->key)) {
+				ok = add_match(sets, &nummatches, idx->maxexpansions, ((postings_t *)e->value)->docs);
+			}
 		}
+		map_str_destroyiter(it);
+		levenshtein_destroy(lev);
 	}
+
+	if (!ok) {
+		*errmsg = strdup("Fuzzy word matches too many words");
+		free(*sets);
+		*sets = NULL;
+		return -1;
+	}
+	return nummatches;
+}
+
+
+set_u32_t *index_lookupfuzzy(index_t *idx, char *word, int maxedits, char **errmsg) {
+	set_u32_t **matches;
+	int nummatches = index_expandfuzzy(idx, word, maxedits, &matches, errmsg);
+	if (nummatches < 0) {
+		return NULL;
+	}
+
+	set_u32_t *result = postings_union(matches, nummatches, idx->numpaths);
+	free(matches);
+	return result;
+}
+
+
+static int compare_suggestions(const void *a, const void *b) {
+	map_str_entry_t *x = *(map_str_entry_t **)a, *y = *(map_str_entry_t **)b;
+	int dfx = ((postings_t *)x->value)->docs->size, dfy = ((postings_t *)y->value)->docs->size;
+	if (dfx != dfy) {
+		return dfx > dfy ? -1 : 1;
+	}
+	return strcmp(x->key, y->key);
+}
+
+
+list_t *index_suggest(index_t *idx, char *prefix, int n) {
+	list_t *words = list_create(compare_strings);
+	char buf[strlen(prefix) + 1];
+	int i;
+
+	prefix = query_word(idx, prefix, buf);
+
+	if (n > MAX_SUGGESTIONS) {
+		n = MAX_SUGGESTIONS;
+	}
+	if (idx->dict != NULL) {
+		int ids[MAX_SUGGESTIONS];
+		int numids = suggest_lookup(idx->suggest, prefix, n, ids);
+		for (i = 0; i < numids; i++) {
+			list_addlast(words, termdict_term(idx->dict, ids[i]));
+		}
+	} else if (n > 0) {
+		/* Not frozen yet, so scan the hash map */
+		int numentries = 0, prefixlen = strlen(prefix);
+		map_str_entry_t **entries = malloc((map_str_size(idx->words) + 1) * sizeof(*entries));
+		if (entries == NULL) {
+			fatal_error("out of memory");
+		}
+		map_str_iter_t *it = map_str_createiter(idx->words);
+		while (map_str_hasnext(it)) {
+			map_str_entry_t *e = map_str_next(it);
+			if (strncmp(e->key, prefix, prefixlen) == 0) {
+				entries[numentries++] = e;
+			}
+		}
+		map_str_destroyiter(it);
+		qsort(entries, numentries, sizeof(*entries), compare_suggestions);
+		for (i = 0; i < numentries && i < n; i++) {
+			char *word = strdup(entries[i]->key);
+			if (word == NULL) {
+				fatal_error("out of memory");
+			}
+			list_addlast(words, word);
+		}
+		free(entries);
+	}
+	return words;
+}
+
+
+int index_numdocs(index_t *idx) {
+	return idx->numpaths;
+}
+
+
+uint64_t index_generation(index_t *idx) {
+	return __atomic_load_n(&idx->generation, __ATOMIC_ACQUIRE);
+}
+
+
+void index_setcachesize(index_t *idx, size_t bytes) {
+	if (bytes == 0) {
+		if (idx->cache != NULL) {
+			qcache_destroy(idx->cache);
+			idx->cache = NULL;
+		}
+	} else if (idx->cache == NULL) {
+		idx->cache = qcache_create(bytes);
+	} else {
+		qcache_setbudget(idx->cache, bytes);
+	}
+}
+
+
+int index_cachestats(index_t *idx, qcache_stats_t *stats) {
+	if (idx->cache == NULL) {
+		return 0;
+	}
+	qcache_getstats(idx->cache, stats);
+	return 1;
+}
+
+
+void index_setsubcachesize(index_t *idx, size_t bytes) {
+	if (bytes == 0) {
+		if (idx->subcache != NULL) {
+			qcache_destroy(idx->subcache);
+			idx->subcache = NULL;
+		}
+	} else if (idx->subcache == NULL) {
+		idx->subcache = qcache_createcostaware(bytes);
+	} else {
+		qcache_setbudget(idx->subcache, bytes);
+	}
+}
+
+
+int index_subcachestats(index_t *idx, qcache_stats_t *stats) {
+	if (idx->subcache == NULL) {
+		return 0;
+	}
+	qcache_getstats(idx->subcache, stats);
+	return 1;
+}
+
+
+qcache_t *index_subcache(index_t *idx) {
+	return idx->subcache;
+}
+
+
+/*
+ * Assigns the next document id to the given path.
+ */
+static uint32_t add_document(index_t *idx, char *path) {
+	if (idx->numpaths == idx->maxpaths) {
+		idx->maxpaths = (idx->maxpaths == 0 ? 64 : idx->maxpaths * 2);
+		idx->paths = realloc(idx->paths, idx->maxpaths * sizeof(*idx->paths));
+		idx->doclens = realloc(idx->doclens, idx->maxpaths * sizeof(*idx->doclens));
+		idx->deleted = realloc(idx->deleted, idx->maxpaths / 64 * sizeof(*idx->deleted));
+		if (idx->paths == NULL || idx->doclens == NULL || idx->deleted == NULL) {
+			fatal_error("out of memory");
+		}
+		memset(idx->deleted + idx->numpaths / 64, 0, (idx->maxpaths - idx->numpaths) / 64 * sizeof(*idx->deleted));
+	}
+	idx->paths[idx->numpaths] = path;
+	map_str_put(idx->docids, path, (void *)(uintptr_t)(idx->numpaths + 1));
+	return idx->numpaths++;
 }
 
 
@@ -47,49 +859,390 @@ void index_addpath(index_t *idx, char *path, list_t *words) {
 		return;
 	}
 
-	while(list_size(words) > 0) {
-		char *word = list_popfirst(words);
+	if (idx->dict != NULL) {
+		thaw(idx);
+	}
 
-		set_t *files_with_word = map_get(idx->words, word);
-		if (files_with_word == NULL) {
-			files_with_word = set_create(compare_strings);
-			if (files_with_word == NULL) {
-				perror("index_addpath (malloc):");
-				return;
-			}
-			map_put(idx->words, word, files_with_word);
+	uint32_t doc = add_document(idx, path);
+	idx->generation++;
+	uint32_t position;
+
+	for (position = 0; list_size(words) > 0; position++) {
+		token_t *token = list_popfirst(words);
+
+		/* The tokenizer already hashed the word */
+		postings_t *postings = map_str_gethashed(idx->words, token->word, token->hash);
+		if (postings == NULL) {
+			postings = postings_create(idx->positional);
+			map_str_puthashed(idx->words, token->word, token->hash, postings);
+			free(token);
 		} else {
-			free(word);
+			token_destroy(token);
 		}
 
-		set_add(files_with_word, path);
+		/* Document ids only grow, so this appends to the postings */
+		postings_add(postings, doc, position);
 	}
+	idx->doclens[doc] = position;
+	idx->totallen += position;
 	return;
 }
 
 
-static list_t *list_from_set(set_t *set) {
-	if (set == NULL) {
+/*
+ * Leaves the removed documents out of the given set of documents.
+ */
+static void drop_deleted(index_t *idx, set_u32_t *docs) {
+	if (docs == NULL || !has_deleted(idx)) {
+		return;
+	}
+	int i, n = 0;
+	for (i = 0; i < docs->size; i++) {
+		if (!is_deleted(idx, docs->elems[i])) {
+			docs->elems[n++] = docs->elems[i];
+		}
+	}
+	docs->size = n;
+}
+
+
+/*
+ * Marks the given document as removed.  Only the bitmap changes, and
+ * the postings and the path are left to index_compact().
+ */
+static void remove_document(index_t *idx, uint32_t doc) {
+	char *path = idx->paths[doc];
+
+	/* The path may have been added again since, as another document */
+	if ((uintptr_t)map_str_get(idx->docids, path) == doc + 1) {
+		map_str_remove(idx->docids, path);
+	}
+	__atomic_fetch_or(&idx->deleted[doc / 64], (uint64_t)1 << (doc % 64), __ATOMIC_RELAXED);
+	__atomic_add_fetch(&idx->numdeleted, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&idx->generation, 1, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Returns 1 if the given path, or a directory above it, is in the given
+ * map of paths, or 0 otherwise.  The directories are looked up in a
+ * copy, since queries may be reading the path meanwhile.
+ */
+static int matches_path(map_str_t *paths, char *path) {
+	size_t i = strlen(path);
+	char buf[i + 1];
+
+	if (map_str_haskey(paths, path)) {
+		return 1;
+	}
+	memcpy(buf, path, i + 1);
+	while (i-- > 1) {
+		if (buf[i] == '/') {
+			buf[i] = '\0';
+			if (map_str_haskey(paths, buf)) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+
+int index_removepaths(index_t *idx, char **paths, int numpaths) {
+	map_str_t *dirs = NULL;
+	int i, numremoved = 0;
+
+	for (i = 0; i < numpaths; i++) {
+		uintptr_t id = (uintptr_t)map_str_get(idx->docids, paths[i]);
+		if (id != 0) {
+			remove_document(idx, id - 1);
+			numremoved++;
+		} else {
+			if (dirs == NULL) {
+				dirs = map_str_create();
+			}
+			map_str_put(dirs, paths[i], NULL);
+		}
+	}
+
+	/* The rest may be directories, which takes one pass over the paths */
+	if (dirs != NULL) {
+		for (i = 0; i < idx->numpaths; i++) {
+			if (idx->paths[i] != NULL && !is_deleted(idx, i) && matches_path(dirs, idx->paths[i])) {
+				remove_document(idx, i);
+				numremoved++;
+			}
+		}
+		map_str_destroy(dirs);
+	}
+	return numremoved;
+}
+
+
+int index_removepath(index_t *idx, char *path) {
+	return index_removepaths(idx, &path, 1);
+}
+
+
+int index_updatepath(index_t *idx, char *path, list_t *words) {
+	uintptr_t id = (uintptr_t)map_str_get(idx->docids, path);
+	if (id != 0) {
+		remove_document(idx, id - 1);
+	}
+	index_addpath(idx, path, words);
+	return id != 0;
+}
+
+
+void index_compact(index_t *idx) {
+	if (idx->numdeleted == 0) {
+		return;
+	}
+
+	set_u32_t *removed = set_u32_create();
+	int w;
+	for (w = 0; w < (idx->numpaths + 63) / 64; w++) {
+		uint64_t word = idx->deleted[w];
+		while (word != 0) {
+			uint32_t doc = w * 64 + __builtin_ctzll(word);
+			set_u32_add(removed, doc);
+			free(idx->paths[doc]);
+			idx->paths[doc] = NULL;
+			idx->totallen -= idx->doclens[doc];
+			idx->doclens[doc] = 0;
+			word &= word - 1;
+		}
+		idx->deleted[w] = 0;
+	}
+
+	if (idx->dict != NULL) {
+		thaw(idx);
+	}
+
+	/* One pass over every posting list for every document removed since the last time */
+	list_t *empty = list_create(compare_strings);
+	map_str_iter_t *it = map_str_createiter(idx->words);
+	while (map_str_hasnext(it)) {
+		map_str_entry_t *e = map_str_next(it);
+		postings_t *postings = e->value;
+		if (postings_remove(postings, removed) > 0 && postings->docs->size == 0) {
+			list_addlast(empty, e->key);
+		}
+	}
+	map_str_destroyiter(it);
+	while (list_size(empty) > 0) {
+		char *word = list_popfirst(empty);
+		postings_destroy(map_str_remove(idx->words, word));
+		free(word);
+	}
+	list_destroy(empty);
+	set_u32_destroy(removed);
+
+	idx->numpurged += idx->numdeleted;
+	idx->numdeleted = 0;
+	idx->generation++;
+}
+
+
+int index_haspath(index_t *idx, char *path) {
+	return map_str_haskey(idx->docids, path);
+}
+
+
+int index_size(index_t *idx) {
+	return idx->numpaths - idx->numpurged - __atomic_load_n(&idx->numdeleted, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Appends the postings of the given word in a source of index_merge()
+ * to those of the word in the given index, under the new ids.
+ */
+static void merge_postings(index_t *idx, char *word, postings_t *src, uint32_t *docmap) {
+	postings_t *postings = map_str_get(idx->words, word);
+	if (postings == NULL) {
+		postings = postings_create(idx->positional);
+		if (postings_append(postings, src, docmap) == 0) {
+			/* Only in removed documents */
+			postings_destroy(postings);
+			return;
+		}
+		word = strdup(word);
+		if (word == NULL) {
+			fatal_error("out of memory");
+		}
+		map_str_put(idx->words, word, postings);
+		return;
+	}
+	postings_append(postings, src, docmap);
+}
+
+
+/*
+ * Returns the budget of the given cache, or 0 if it is NULL.
+ */
+static size_t cache_budget(qcache_t *cache) {
+	qcache_stats_t stats;
+	if (cache == NULL) {
+		return 0;
+	}
+	qcache_getstats(cache, &stats);
+	return stats.budget;
+}
+
+
+index_t *index_merge(index_t **sources, int numsources) {
+	index_t *idx = index_createlike(sources[0]);
+	uint32_t *docmap = NULL;
+	size_t cachesize = 0, subcachesize = 0;
+	int i, j;
+
+	if (idx == NULL) {
+		fatal_error("out of memory");
+	}
+	for (i = 0; i < numsources; i++) {
+		index_t *src = sources[i];
+
+		/* The documents that are left keep their order, and get the next ids */
+		docmap = realloc(docmap, (src->numpaths + 1) * sizeof(*docmap));
+		if (docmap == NULL) {
+			fatal_error("out of memory");
+		}
+		for (j = 0; j < src->numpaths; j++) {
+			docmap[j] = UINT32_MAX;
+			if (src->paths[j] != NULL && !is_deleted(src, j)) {
+				char *path = strdup(src->paths[j]);
+				if (path == NULL) {
+					fatal_error("out of memory");
+				}
+				docmap[j] = add_document(idx, path);
+				idx->doclens[docmap[j]] = src->doclens[j];
+				idx->totallen += src->doclens[j];
+			}
+		}
+
+		if (src->dict != NULL) {
+			termdict_iter_t *it = termdict_rangeiter(src->dict, NULL, NULL);
+			while (termdict_hasnext(it)) {
+				int id;
+				char *word = termdict_next(it, &id);
+				merge_postings(idx, word, src->postings[id], docmap);
+			}
+			termdict_destroyiter(it);
+		} else {
+			map_str_iter_t *it = map_str_createiter(src->words);
+			while (map_str_hasnext(it)) {
+				map_str_entry_t *e = map_str_next(it);
+				merge_postings(idx, e->key, e->value, docmap);
+			}
+			map_str_destroyiter(it);
+		}
+		if (idx->trigrams != NULL && src->trigrams != NULL) {
+			trigram_merge(idx->trigrams, src->trigrams, docmap);
+		}
+		cachesize += cache_budget(src->cache);
+		subcachesize += cache_budget(src->subcache);
+	}
+	free(docmap);
+
+	index_freeze(idx);
+	index_setcachesize(idx, cachesize);
+	index_setsubcachesize(idx, subcachesize);
+	return idx;
+}
+
+
+/*
+ * Counts the matches of the given plan like _count(), but leaves out
+ * the removed documents, which takes pulling the matches one at a time
+ * until the index is compacted.
+ */
+static int count_matches(index_t *idx, query_plan_t *plan, int limit, char **errmsg) {
+	if (!has_deleted(idx)) {
+		return _count(idx, plan, limit, errmsg);
+	}
+
+	dociter_t *iter = _iterate(idx, plan, errmsg);
+	if (iter == NULL) {
+		return -1;
+	}
+	int count = 0;
+	uint32_t doc;
+	while (count < limit && (doc = dociter_next(iter)) != DOCITER_END) {
+		if (!is_deleted(idx, doc)) {
+			count++;
+		}
+	}
+	dociter_destroy(iter);
+	return count;
+}
+
+
+static list_t *list_from_docs(index_t *idx, set_u32_t *docs) {
+	if (docs == NULL) {
 		return NULL;
 	}
 
 	list_t *list = list_create(compare_strings);
 	if (list == NULL) {
-		perror("list_from_set (could not create list):");
+		perror("list_from_docs (could not create list):");
 		return NULL;
 	}
 
-	set_iter_t *si = set_createiter(set);
-	if (si == NULL) {
-		perror("list_from_set (could not create set iterator):");
-		return NULL;
+	int i;
+	for (i = 0; i < docs->size; i++) {
+		list_addlast(list, idx->paths[docs->elems[i]]);
 	}
 
-	while (set_hasnext(si)) {
-		list_addlast(list, set_next(si));
+	return list;
+}
+
+
+/*
+ * Evaluates the given plan like _evaluate(), but through the index's
+ * query cache, if it has one.
+ */
+static set_u32_t *evaluate_cached(index_t *idx, query_plan_t *plan, char **errmsg) {
+	set_u32_t *result;
+	if (idx->cache == NULL) {
+		result = _evaluate(idx, plan, errmsg);
+		drop_deleted(idx, result);
+		return result;
 	}
 
-	return list;
+	uint64_t generation = index_generation(idx);
+	result = qcache_get(idx->cache, plan->key, generation);
+	if (result == NULL) {
+		result = _evaluate(idx, plan, errmsg);
+		drop_deleted(idx, result);
+		if (result != NULL) {
+			qcache_put(idx->cache, plan->key, generation, result);
+		}
+	}
+	return result;
+}
+
+
+query_plan_t *index_compile(index_t *idx, char *query, char **errmsg) {
+	return _compile(query, idx->tokenizer, errmsg);
+}
+
+
+void index_freeplan(query_plan_t *plan) {
+	_freeplan(plan);
+}
+
+
+list_t *index_runquery(index_t *idx, query_plan_t *plan, char **errmsg) {
+	set_u32_t *result = evaluate_cached(idx, plan, errmsg);
+	if (result == NULL) {
+		return NULL;
+	}
+
+	list_t *result_as_list = list_from_docs(idx, result);
+	set_u32_destroy(result);
+
+	return result_as_list;
 }
 
 
@@ -98,13 +1251,299 @@ list_t *index_query(index_t *idx, char *query, char **errmsg) {
 		return NULL;
 	}
 
-	set_t *result = _query(idx->words, &query, errmsg, 0);
-	if (result == NULL) {
+	query_plan_t *plan = index_compile(idx, query, errmsg);
+	if (plan == NULL) {
 		return NULL;
 	}
+	list_t *result = index_runquery(idx, plan, errmsg);
+	index_freeplan(plan);
+	return result;
+}
 
-	list_t *result_as_list = list_from_set(result);
-	set_destroy(result);
 
-	return result_as_list;
+list_t *index_query_page(index_t *idx, char *query, int offset, int limit, char **errmsg) {
+	query_plan_t *plan = index_compile(idx, query, errmsg);
+	if (plan == NULL) {
+		return NULL;
+	}
+	dociter_t *iter = _iterate(idx, plan, errmsg);
+	index_freeplan(plan);
+	if (iter == NULL) {
+		return NULL;
+	}
+
+	list_t *page = list_create(compare_strings);
+	uint32_t doc;
+	int i = 0;
+	while (i - offset < limit && (doc = dociter_next(iter)) != DOCITER_END) {
+		if (has_deleted(idx) && is_deleted(idx, doc)) {
+			continue;
+		}
+		if (i++ >= offset) {
+			list_addlast(page, idx->paths[doc]);
+		}
+	}
+	dociter_destroy(iter);
+	return page;
+}
+
+
+int index_runcount(index_t *idx, query_plan_t *plan, int limit, char **errmsg) {
+	return count_matches(idx, plan, limit, errmsg);
+}
+
+
+int index_count(index_t *idx, char *query, int limit, char **errmsg) {
+	query_plan_t *plan = index_compile(idx, query, errmsg);
+	if (plan == NULL) {
+		return -1;
+	}
+	int count = index_runcount(idx, plan, limit, errmsg);
+	index_freeplan(plan);
+	return count;
+}
+
+
+int index_exists(index_t *idx, char *query, char **errmsg) {
+	return index_count(idx, query, 1, errmsg);
+}
+
+
+/*
+ * Evaluates the given queries together, and assigns their sets of
+ * documents (or NULL and an error message) to the given arrays.
+ */
+static void evaluate_batch(index_t *idx, char **queries, int numqueries, set_u32_t **sets, char **errmsgs) {
+	query_plan_t **plans = malloc((numqueries + 1) * sizeof(*plans));
+	if (plans == NULL) {
+		fatal_error("out of memory");
+	}
+
+	int i;
+	for (i = 0; i < numqueries; i++) {
+		plans[i] = index_compile(idx, queries[i], &errmsgs[i]);
+	}
+	_evaluatebatch(idx, plans, numqueries, sets, errmsgs);
+	for (i = 0; i < numqueries; i++) {
+		drop_deleted(idx, sets[i]);
+		index_freeplan(plans[i]);
+	}
+	free(plans);
+}
+
+
+void index_query_batch(index_t *idx, char **queries, int numqueries, list_t **results, char **errmsgs) {
+	set_u32_t **sets = malloc((numqueries + 1) * sizeof(*sets));
+	if (sets == NULL) {
+		fatal_error("out of memory");
+	}
+
+	evaluate_batch(idx, queries, numqueries, sets, errmsgs);
+	int i;
+	for (i = 0; i < numqueries; i++) {
+		results[i] = list_from_docs(idx, sets[i]);
+		if (sets[i] != NULL) {
+			set_u32_destroy(sets[i]);
+		}
+	}
+	free(sets);
+}
+
+
+void index_count_batch(index_t *idx, char **queries, int numqueries, int *counts, char **errmsgs) {
+	set_u32_t **sets = malloc((numqueries + 1) * sizeof(*sets));
+	if (sets == NULL) {
+		fatal_error("out of memory");
+	}
+
+	evaluate_batch(idx, queries, numqueries, sets, errmsgs);
+	int i;
+	for (i = 0; i < numqueries; i++) {
+		counts[i] = -1;
+		if (sets[i] != NULL) {
+			counts[i] = sets[i]->size;
+			set_u32_destroy(sets[i]);
+		}
+	}
+	free(sets);
+}
+
+
+/*
+ * Assigns the distinct posting lists of the given words to the given
+ * array, and returns their number.  Also assigns an array of the
+ * numbers of documents that contain them to dfs, taken from the given
+ * array of such numbers for each of the words.
+ */
+static int lookup_words(index_t *idx, list_t *words, uint32_t *worddfs, postings_t ***postings, uint32_t **dfs) {
+	*postings = malloc((list_size(words) + 1) * sizeof(**postings));
+	*dfs = malloc((list_size(words) + 1) * sizeof(**dfs));
+	if (*postings == NULL || *dfs == NULL) {
+		fatal_error("out of memory");
+	}
+
+	int i, j, numwords = 0;
+	list_iter_t *it = list_createiter(words);
+	for (j = 0; list_hasnext(it); j++) {
+		postings_t *p = lookup_postings(idx, list_next(it));
+		i = 0;
+		while (i < numwords && (*postings)[i] != p) {
+			i++;
+		}
+		if (p != NULL && i == numwords) {
+			(*dfs)[numwords] = worddfs[j];
+			(*postings)[numwords++] = p;
+		}
+	}
+	list_destroyiter(it);
+	return numwords;
+}
+
+
+list_t *index_query_ranked(index_t *idx, char *query, int k, int *nummatches, char **errmsg) {
+	if (idx == NULL) {
+		return NULL;
+	}
+
+	query_plan_t *plan = index_compile(idx, query, errmsg);
+	if (plan == NULL) {
+		return NULL;
+	}
+	list_t *ranked = index_runranked(idx, plan, k, nummatches, errmsg);
+	index_freeplan(plan);
+	return ranked;
+}
+
+
+/*
+ * Scores the documents of the given index that match the given plan as
+ * if the index held the given number of documents, where the scored
+ * words of the plan occur in the given numbers of documents, and
+ * assigns the k best to hits like rank_topk().  Returns the number of
+ * hits, or -1 on error.  Adds the number of matches to nummatches
+ * unless it is NULL.
+ */
+static int rank_index(index_t *idx, query_plan_t *plan, uint32_t numdocs, uint32_t *worddfs,
+					  rank_hit_t *hits, int k, int *nummatches, char **errmsg) {
+	rank_stats_t stats;
+	get_stats(idx, &stats);
+	stats.numdocs = numdocs;
+
+	postings_t **postings;
+	int numwords = lookup_words(idx, plan->scoredwords, worddfs, &postings, &stats.dfs), numhits = -1;
+
+	if (idx->dict != NULL && idx->pruning && plan->disjunction) {
+		/* The score bounds are up to date, so skip what cannot make the top k */
+		numhits = rank_topk_or(postings, numwords, &stats, hits, k);
+		if (nummatches != NULL) {
+			*nummatches += count_matches(idx, plan, INT_MAX, errmsg);
+		}
+	} else if (idx->dict != NULL && idx->pruning) {
+		/* Pull the matches through the iterators, and skip by the score bounds too */
+		dociter_t *iter = _iterate(idx, plan, errmsg);
+		if (iter != NULL) {
+			numhits = rank_topk_iter(postings, numwords, iter, &stats, hits, k);
+			dociter_destroy(iter);
+			if (nummatches != NULL) {
+				*nummatches += count_matches(idx, plan, INT_MAX, errmsg);
+			}
+		}
+	} else {
+		set_u32_t *result = evaluate_cached(idx, plan, errmsg);
+		if (result != NULL) {
+			numhits = rank_topk(postings, numwords, result, &stats, hits, k);
+			if (nummatches != NULL) {
+				*nummatches += result->size;
+			}
+			set_u32_destroy(result);
+		}
+	}
+	free(postings);
+	free(stats.dfs);
+	return numhits;
+}
+
+
+list_t *index_runranked(index_t *idx, query_plan_t *plan, int k, int *nummatches, char **errmsg) {
+	return index_runranked_many(&idx, 1, plan, k, nummatches, errmsg);
+}
+
+
+/*
+ * A hit of index_runranked_many(), with the index it is in.
+ */
+typedef struct {
+	rank_hit_t hit;
+	int index;
+} source_hit_t;
+
+
+static int compare_hits(const void *a, const void *b) {
+	const source_hit_t *x = a, *y = b;
+	if (x->hit.score != y->hit.score) {
+		return x->hit.score < y->hit.score ? 1 : -1;
+	}
+	if (x->index != y->index) {
+		return x->index - y->index;
+	}
+	return (x->hit.doc > y->hit.doc) - (x->hit.doc < y->hit.doc);
+}
+
+
+list_t *index_runranked_many(index_t **indexes, int numindexes, query_plan_t *plan, int k, int *nummatches, char **errmsg) {
+	int i, j, numhits, total = 0, matches = 0;
+	uint32_t numdocs = 0;
+	uint32_t *worddfs = calloc(list_size(plan->scoredwords) + 1, sizeof(*worddfs));
+	rank_hit_t *hits = malloc((k > 0 ? k : 1) * sizeof(*hits));
+	source_hit_t *all = malloc(((size_t)numindexes * (k > 0 ? k : 1)) * sizeof(*all));
+	if (worddfs == NULL || hits == NULL || all == NULL) {
+		fatal_error("out of memory");
+	}
+
+	/* Every index scores its documents against the documents of them all */
+	for (i = 0; i < numindexes; i++) {
+		numdocs += indexes[i]->numpaths - indexes[i]->numpurged;
+		list_iter_t *it = list_createiter(plan->scoredwords);
+		for (j = 0; list_hasnext(it); j++) {
+			postings_t *p = lookup_postings(indexes[i], list_next(it));
+			if (p != NULL) {
+				worddfs[j] += p->docs->size;
+			}
+		}
+		list_destroyiter(it);
+	}
+
+	list_t *ranked = NULL;
+	for (i = 0; i < numindexes; i++) {
+		numhits = rank_index(indexes[i], plan, numdocs, worddfs, hits, k, nummatches != NULL ? &matches : NULL, errmsg);
+		if (numhits < 0) {
+			goto out;
+		}
+		for (j = 0; j < numhits; j++) {
+			all[total].hit = hits[j];
+			all[total++].index = i;
+		}
+	}
+	if (numindexes > 1) {
+		qsort(all, total, sizeof(*all), compare_hits);
+	}
+
+	ranked = list_create(compare_pointers);
+	for (i = 0; i < total && i < k; i++) {
+		index_hit_t *hit = malloc(sizeof(*hit));
+		if (hit == NULL) {
+			fatal_error("out of memory");
+		}
+		hit->path = indexes[all[i].index]->paths[all[i].hit.doc];
+		hit->score = all[i].hit.score;
+		list_addlast(ranked, hit);
+	}
+	if (nummatches != NULL) {
+		*nummatches = matches;
+	}
+out:
+	free(worddfs);
+	free(hits);
+	free(all);
+	return ranked;
 }
@@ -2,15 +2,49 @@
 #define INDEX_H
 
 #include "list.h"
+#include "qcache.h"
+#include "set_u32.h"
+#include "tokenizer.h"
+
+#include <stddef.h>
+#include <stdint.h>
 
 struct index;
 typedef struct index index_t;
 
+/*
+ * The type of compiled queries (see index_compile()).
+ */
+struct query_plan;
+typedef struct query_plan query_plan_t;
+
+/*
+ * The default maximum number of words that a wildcard may match.
+ */
+enum { DEFAULT_MAX_EXPANSIONS = 100000 };
+
+/*
+ * The maximum number of edits of a fuzzy word (see index_lookupfuzzy()).
+ */
+enum { MAX_FUZZY_EDITS = 2 };
+
+/*
+ * The maximum number of words that index_suggest() returns.
+ */
+enum { MAX_SUGGESTIONS = 10 };
+
 /*
  * Creates a new, empty index.
  */
 index_t *index_create();
 
+/*
+ * Creates a new, empty index with the same settings as the given one
+ * (positions, case folding, the maximum expansions and trigrams), but
+ * no caches.
+ */
+index_t *index_createlike(index_t *other);
+
 /*
  * Destroys the given index.  Subsequently accessing the index will
  * lead to undefined behavior.
@@ -19,10 +53,320 @@ void index_destroy(index_t *index);
 
 /*
  * Adds the given path to the given index, and index the given
- * list of words under that path.
+ * list of words (token_t's, see tokenizer_text()) under that path.
+ * The index takes ownership of the path and the tokens, and empties
+ * the list.
+ *
+ * Adding to a frozen index converts the whole dictionary back, and the
+ * next index_freeze() rebuilds the dictionary, the suggestions and the
+ * score bounds of every posting list, so a document added to a frozen
+ * index costs as much as the whole index.  Add the documents of a live
+ * tree to a segmented index instead (see segindex.h).
  */
 void index_addpath(index_t *index, char *path, list_t *words);
 
+/*
+ * Removes the document with the given path from the given index, or
+ * the documents under it if it is a directory, and returns the number
+ * of documents removed.  A removed document is only marked in a bitmap
+ * of deleted documents, which queries apply as a filter, so this takes
+ * constant time for a document (a directory takes a pass over the
+ * paths).  Its postings stay until the index is compacted (see
+ * index_compact()), and until then, the sets returned by
+ * index_lookup() and the other lookups may still hold it, and it still
+ * counts for scoring and suggestions.
+ *
+ * The ids of removed documents are not reused.
+ */
+int index_removepath(index_t *index, char *path);
+
+/*
+ * A frozen index that is not compacted may be queried by many threads
+ * while one more thread removes documents from it: the bitmap, the
+ * number of removed documents and the generation are updated
+ * atomically, and the paths of removed documents are kept until the
+ * index is compacted.  Anything else that changes an index needs the
+ * queries to stop.
+ */
+
+/*
+ * Removes the documents with the given paths, or under them, like
+ * index_removepath(), but directories take one pass over the paths for
+ * the whole batch.  Returns the number of documents removed.
+ */
+int index_removepaths(index_t *index, char **paths, int numpaths);
+
+/*
+ * Replaces the document with the given path, if any, with the given
+ * list of words, like index_removepath() followed by index_addpath().
+ * The index takes ownership of the path and the tokens.  Returns 1 if a
+ * document was replaced, or 0 if the path is new.
+ *
+ * Removing the old version takes constant time, and adding the new one
+ * costs about as much as its words, as long as the dictionary is not
+ * frozen.  On a frozen index, like index_addpath(), this converts the
+ * whole dictionary back, and the next index_freeze() rebuilds it, so a
+ * batch of updates between freezes costs as much as the size of the
+ * dictionary.  To update a large index a few documents at a time, use
+ * a segmented index (see segindex.h), which adds them to a small index
+ * of their own.
+ */
+int index_updatepath(index_t *index, char *path, list_t *words);
+
+/*
+ * Takes the removed documents out of every posting list of the given
+ * index, in one pass for all of them, and drops the words left in no
+ * document.  index_freeze() does this on its own once the removed
+ * documents are a quarter of those in the postings, so the cost of the
+ * pass is spread over many removals.  Like index_addpath(), this
+ * converts a frozen dictionary back, so freeze it again afterwards.
+ */
+void index_compact(index_t *index);
+
+/*
+ * Freezes the dictionary of the given index into a sorted, compact
+ * form (see termdict.h), which uses much less memory than the hash map
+ * used while documents are being added.  Call this once all documents
+ * have been added; adding more afterwards converts the dictionary back.
+ * Compacts the index first if enough documents were removed (see
+ * index_compact()).
+ */
+void index_freeze(index_t *index);
+
+/*
+ * Returns a new, frozen index with the documents of the given indexes
+ * that were not removed, in order, under new ids, with the settings of
+ * the first.  Removed documents are left out, so this compacts them
+ * too.  The new index gets caches as large as those of the given
+ * indexes put together.  The given indexes are left as they are.
+ */
+index_t *index_merge(index_t **indexes, int numindexes);
+
+/*
+ * Returns 1 if the given index holds a document with the given path
+ * that was not removed, or 0 otherwise.
+ */
+int index_haspath(index_t *index, char *path);
+
+/*
+ * Returns the number of documents in the given index that were not
+ * removed.
+ */
+int index_size(index_t *index);
+
+/*
+ * Returns the set of ids of the documents that contain the given word,
+ * or NULL if there are none.  The set belongs to the index.
+ */
+set_u32_t *index_lookup(index_t *index, char *word);
+
+/*
+ * Returns the set of ids of the documents that contain a word matching
+ * the given wildcard pattern, which is either a prefix followed by '*'
+ * (e.g. "handle_*") or '*' followed by a suffix (e.g. "*Exception").
+ * The matching words are enumerated in sorted order and their sets of
+ * documents are merged.  The returned set belongs to the caller.
+ *
+ * If the pattern is malformed, or matches more words than the maximum
+ * set with index_setmaxexpansions(), an error message is assigned to
+ * the given errmsg pointer and the return value will be NULL.
+ */
+set_u32_t *index_lookupwildcard(index_t *index, char *pattern, char **errmsg);
+
+/*
+ * Assigns an array of the sets of documents of every word matching the
+ * given wildcard pattern (see index_lookupwildcard()) to the given sets
+ * pointer, and returns the number of sets.  The sets belong to the
+ * index, and the array to the caller.
+ *
+ * If the pattern is malformed or matches too many words, an error
+ * message is assigned to the given errmsg pointer and the return value
+ * will be -1.
+ */
+int index_expandwildcard(index_t *index, char *pattern, set_u32_t ***sets, char **errmsg);
+
+/*
+ * Returns the set of ids of the documents that contain a word within
+ * the given number of edits (see levenshtein.h) of the given word, e.g.
+ * "receive" for "recieve" and 1 edit.  On a frozen index, the matching
+ * words are found by running a Levenshtein automaton over the sorted
+ * dictionary, which skips every range of words that cannot match (see
+ * termdict_fuzzyiter()).  The returned set belongs to the caller.
+ *
+ * If the number of edits is not between 1 and MAX_FUZZY_EDITS, or the
+ * word matches more words than the maximum set with
+ * index_setmaxexpansions(), an error message is assigned to the given
+ * errmsg pointer and the return value will be NULL.
+ */
+set_u32_t *index_lookupfuzzy(index_t *index, char *word, int maxedits, char **errmsg);
+
+/*
+ * Assigns an array of the sets of documents of every word within the
+ * given number of edits of the given word (see index_lookupfuzzy()) to
+ * the given sets pointer, and returns the number of sets, like
+ * index_expandwildcard().
+ *
+ * If there is an error, an error message is assigned to the given
+ * errmsg pointer and the return value will be -1.
+ */
+int index_expandfuzzy(index_t *index, char *word, int maxedits, set_u32_t ***sets, char **errmsg);
+
+/*
+ * Returns the list of the at most n words (n is capped at
+ * MAX_SUGGESTIONS) that start with the given prefix and occur in the
+ * most documents, most first, and words in as many documents in sorted
+ * order.  This is for completing words as they are typed.  On a frozen
+ * index, the best words for every prefix that starts many words are
+ * kept in a trie (see suggest.h), so the time this takes does not grow
+ * with the number of words that start with the prefix.  The words
+ * belong to the caller along with the list.
+ */
+list_t *index_suggest(index_t *index, char *prefix, int n);
+
+/*
+ * Returns the number of document ids in the given index, which are all
+ * smaller than this, including those of removed documents.
+ */
+int index_numdocs(index_t *index);
+
+/*
+ * Returns the generation of the given index, which changes whenever
+ * documents are added or removed, so results computed at one
+ * generation are valid for as long as the generation stays the same.
+ */
+uint64_t index_generation(index_t *index);
+
+/*
+ * Keeps the results of up to the given number of bytes worth of recent
+ * queries (see qcache.h), so that repeating a query with index_query(),
+ * or with index_query_ranked() where it needs every match, only parses
+ * it again.  Queries are looked up by their parsed
+ * form, so spacing and redundant parentheses do not matter.  The cache
+ * is emptied whenever documents are added.  A size of 0, the default,
+ * turns the cache off.
+ */
+void index_setcachesize(index_t *index, size_t bytes);
+
+/*
+ * Assigns the counters of the given index's query cache to the given
+ * stats.  Returns 0 if the cache is off, or 1 otherwise.
+ */
+int index_cachestats(index_t *index, qcache_stats_t *stats);
+
+/*
+ * Keeps the documents of up to the given number of bytes worth of parts
+ * of queries, such as "(error OR fatal OR panic)" in "(error OR fatal OR
+ * panic) AND disk", so that other queries with the same part reuse them
+ * instead of computing them again.  The cache is cost-aware (see
+ * qcache.h): it keeps the parts that took the longest to compute times
+ * the number of times they were used.  A part is matched in full for the
+ * cache once it has been seen twice, unless it would be matched in full
+ * anyway (e.g. wildcards).  A size of 0, the default, turns the cache off.
+ */
+void index_setsubcachesize(index_t *index, size_t bytes);
+
+/*
+ * Assigns the counters of the given index's cache of parts of queries
+ * to the given stats.  Returns 0 if the cache is off, or 1 otherwise.
+ */
+int index_subcachestats(index_t *index, qcache_stats_t *stats);
+
+/*
+ * Returns the given index's cache of parts of queries, or NULL if it is
+ * off.  This is meant for the query evaluator.
+ */
+qcache_t *index_subcache(index_t *index);
+
+/*
+ * Sets the maximum number of words that a wildcard may match.
+ */
+void index_setmaxexpansions(index_t *index, int maxexpansions);
+
+/*
+ * Selects whether the given index stores the position of every word
+ * in every document, which phrase queries need.  This must be set
+ * before any paths are added.
+ */
+void index_setpositional(index_t *index, int positional);
+
+/*
+ * Selects whether the words of queries are folded to lower case (see
+ * fold_case()) before they are looked up, which should match whether
+ * the words of the documents were (see TOKENIZER_CASEFOLD), so that
+ * e.g. "Error" finds "error" and "ERROR".  The words of documents are
+ * added as they are, so this does not fold them.
+ */
+void index_setcasefold(index_t *index, int casefold);
+
+/*
+ * Selects how the phrases of queries are split into words, which should
+ * be how the text of the documents was (see tokenizer_text()), so that
+ * e.g. "built-in" is one word of a phrase if it is one word of the
+ * documents.  The index keeps a copy of the given tokenizer.  Phrases
+ * are split with tokenizer_default() unless this is called.
+ */
+void index_settokenizer(index_t *index, tokenizer_t *tokenizer);
+
+/*
+ * Selects whether ranked queries on the given index, once it is frozen,
+ * skip the documents that the score bounds rule out (the default), or
+ * score every match.  Both give the same hits; this is for measuring
+ * what the bounds save.
+ */
+void index_setpruning(index_t *index, int pruning);
+
+/*
+ * Selects whether the given index keeps a trigram index (see trigram.h)
+ * of the text of the documents, which index_grep() needs.  This must be
+ * set before any paths are added.
+ */
+void index_settrigrams(index_t *index, int trigrams);
+
+/*
+ * Adds the trigrams of the given text, which is usually the contents of
+ * the file, to the document last added with index_addpath().  Documents
+ * whose text is never added are never found by index_grep().
+ */
+void index_addtrigrams(index_t *index, char *text, size_t len);
+
+/*
+ * Returns the list of paths of the documents whose text contains the
+ * given string, or, if regex is set, a match of the given POSIX
+ * extended regular expression (where '.' and '[^...]' do not match a
+ * newline, and '^' and '$' also match at newlines).  Unlike queries,
+ * which match whole words, these match anywhere, e.g. "->next" or
+ * "alloc(" or "hash_[a-z]+\(".  Only the documents that contain the
+ * trigrams the pattern needs are read from disk to check for a match.
+ * The paths belong to the index and the list to the caller.
+ *
+ * If there is an error (e.g. the index does not keep trigrams, or the
+ * regular expression is malformed), an error message is assigned to
+ * the given errmsg pointer and the return value will be NULL.
+ */
+list_t *index_grep(index_t *index, char *pattern, int regex, char **errmsg);
+
+/*
+ * Returns the set of ids of the documents where the given words occur
+ * next to each other, in the given order.  The returned set belongs
+ * to the caller.
+ *
+ * If there is an error (e.g. the index does not store positions), an
+ * error message is assigned to the given errmsg pointer and the return
+ * value will be NULL.
+ */
+set_u32_t *index_lookupphrase(index_t *index, char **words, int numwords, char **errmsg);
+
+/*
+ * Returns the set of ids of the documents where the two given words
+ * occur at most the given distance apart, in either order.  Adjacent
+ * words are 1 apart.  The returned set belongs to the caller.
+ *
+ * If there is an error (e.g. the index does not store positions), an
+ * error message is assigned to the given errmsg pointer and the return
+ * value will be NULL.
+ */
+set_u32_t *index_lookupnear(index_t *index, char *a, char *b, int distance, char **errmsg);
+
 /*
  * Performs the given query on the given index.  If the query
  * succeeds, the return value will be a list of paths.  If there
@@ -32,6 +376,134 @@ void index_addpath(index_t *index, char *path, list_t *words);
  */
 list_t *index_query(index_t *index, char *query, char **errmsg);
 
+/*
+ * Compiles the given query into a plan, so that running it does not
+ * parse it again.  A plan depends on the given index only through how
+ * its phrases are split (see index_settokenizer()), and does not change
+ * when it is run, so it may be run any number of times, on that index
+ * and any index like it (see index_createlike()), from several threads
+ * at once.
+ *
+ * If there is an error (e.g. a syntax error in the query), an error
+ * message is assigned to the given errmsg pointer and the return value
+ * will be NULL.
+ */
+query_plan_t *index_compile(index_t *index, char *query, char **errmsg);
+
+/*
+ * Destroys the given plan.
+ */
+void index_freeplan(query_plan_t *plan);
+
+/*
+ * Runs the given plan like index_query().
+ */
+list_t *index_runquery(index_t *index, query_plan_t *plan, char **errmsg);
+
+/*
+ * Runs the given plan like index_count().
+ */
+int index_runcount(index_t *index, query_plan_t *plan, int limit, char **errmsg);
+
+/*
+ * Performs the given query like index_query(), but returns only the
+ * matches from the given offset on, at most limit of them, in the same
+ * order.  The documents are pulled one at a time through a tree of
+ * iterators (see dociter.h), so the work is proportional to offset plus
+ * limit rather than to the number of matches, except for wildcards,
+ * phrases and NEAR, which are matched in full.
+ *
+ * If there is an error, an error message is assigned to the given
+ * errmsg pointer and the return value will be NULL.
+ */
+list_t *index_query_page(index_t *index, char *query, int offset, int limit, char **errmsg);
+
+/*
+ * Returns the number of documents that match the given query, like
+ * list_size(index_query()), but without building the list of paths or
+ * the set of documents at the top of the query.  Counting stops at the
+ * given limit, which is returned if there are at least that many
+ * matches.  Parts of the query that cannot change the count (e.g. the
+ * right side of an AND whose left side matches nothing) may be skipped,
+ * and errors in them go unreported.
+ *
+ * If there is an error, an error message is assigned to the given
+ * errmsg pointer and the return value will be -1.
+ */
+int index_count(index_t *index, char *query, int limit, char **errmsg);
+
+/*
+ * Returns 1 if any document matches the given query, or 0 otherwise.
+ * This is index_count() with a limit of 1, so it stops at the first
+ * match wherever it can.
+ *
+ * If there is an error, an error message is assigned to the given
+ * errmsg pointer and the return value will be -1.
+ */
+int index_exists(index_t *index, char *query, char **errmsg);
+
+/*
+ * Performs the given number of queries like index_query(), and assigns
+ * their results to the given array of lists.  The queries are evaluated
+ * together: parts that several of them share (see _compile() in
+ * query_parser.h) are computed only once, and every word's documents
+ * are read once.  If a query fails, its list is NULL and its error
+ * message is assigned to the same position of the given errmsgs array.
+ */
+void index_query_batch(index_t *index, char **queries, int numqueries, list_t **results, char **errmsgs);
+
+/*
+ * Counts the matches of the given number of queries like index_count()
+ * without a limit, but evaluates them together like
+ * index_query_batch().  If a query fails, its count is -1 and its error
+ * message is assigned to the same position of the given errmsgs array.
+ */
+void index_count_batch(index_t *index, char **queries, int numqueries, int *counts, char **errmsgs);
+
+/*
+ * A document found by index_query_ranked().
+ */
+typedef struct {
+	char *path;	/* Belongs to the index */
+	double score;
+} index_hit_t;
+
+/*
+ * Performs the given query on the given index like index_query(), but
+ * scores the matching documents with BM25 over the words of the query
+ * (except those after ANDNOT, and wildcards, which do not affect the
+ * score) and returns only the k best.  The return value is a list of
+ * index_hit_t's in decreasing order of score, which belong to the
+ * caller along with the list.  The number of matching documents is
+ * assigned to the nummatches pointer unless it is NULL.
+ *
+ * On a frozen index, queries skip the documents that cannot make the
+ * top k by the score bounds of the words: queries that are just words
+ * separated by OR with rank_topk_or(), and the others by pulling the
+ * matches through iterators with rank_topk_iter(), so the set of
+ * matches is never built.  Counting the matches, if the number is
+ * requested, takes a pass over all of them.
+ *
+ * If there is an error, an error message is assigned to the given
+ * errmsg pointer and the return value will be NULL.
+ */
+list_t *index_query_ranked(index_t *index, char *query, int k, int *nummatches, char **errmsg);
+
+/*
+ * Runs the given plan like index_query_ranked().
+ */
+list_t *index_runranked(index_t *index, query_plan_t *plan, int k, int *nummatches, char **errmsg);
+
+/*
+ * Runs the given plan like index_runranked(), but over the documents of
+ * all the given indexes at once, as if they were one, and returns the k
+ * best of them.  Every index scores its documents with the number of
+ * documents and the document frequencies of all of them, and with its
+ * own average document length.  Hits with the same score are in the
+ * order of the indexes.
+ */
+list_t *index_runranked_many(index_t **indexes, int numindexes, query_plan_t *plan, int k, int *nummatches, char **errmsg);
+
 #endif
 
 
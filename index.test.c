@@ -1,12 +1,22 @@
 #include "common.h"
+#include "crawler.h"
 #include "index.h"
 #include "list.h"
+#include "query_parser.h"
+#include "reader.h"
+#include "segindex.h"
+#include "tokenizer.h"
+#include "trigram.h"
 #include "unittest.h"
+#include "watcher.h"
 
 #include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 
 struct query {
@@ -28,7 +38,7 @@ list_t *list_from_array(char **array, int count)
 
 	int i;
 	for (i = 0; i < count; i++) {
-		list_addlast(list, strdup(array[i]));
+		list_addlast(list, token_create(strdup(array[i]), strlen(array[i])));
 	}
 
 	UNITTEST(list_size(list) == count);
@@ -37,6 +47,51 @@ list_t *list_from_array(char **array, int count)
 }
 
 
+list_t *list_from_sentence(char *sentence)
+{
+	char *words[100], *copy = strdup(sentence);
+	int count = 0;
+
+	char *word = strtok(copy, " ");
+	while (word != NULL && count < 100) {
+		words[count++] = word;
+		word = strtok(NULL, " ");
+	}
+
+	list_t *list = list_from_array(words, count);
+	free(copy);
+	return list;
+}
+
+
+/*
+ * Checks that paging through the matches of a query gives the same
+ * paths in the same order as the full result.
+ */
+void check_pages(index_t *idx, char *query, list_t *res)
+{
+	char *errmsg;
+	int offset, pagesize = 2;
+	list_iter_t *it = list_createiter(res);
+
+	for (offset = 0; offset <= list_size(res); offset += pagesize) {
+		list_t *page = index_query_page(idx, query, offset, pagesize, &errmsg);
+		if (!UNITTEST(page != NULL)) {
+			break;
+		}
+		UNITTEST(list_size(page) == (list_size(res) - offset < pagesize ? list_size(res) - offset : pagesize));
+		while (list_size(page) > 0) {
+			char *path = list_popfirst(page);
+			if (UNITTEST(list_hasnext(it))) {
+				UNITTEST(strcmp(path, list_next(it)) == 0);
+			}
+		}
+		list_destroy(page);
+	}
+	list_destroyiter(it);
+}
+
+
 void check_query(index_t *idx, struct query *q)
 {
 	char *errmsg, *query = q->q, **ans=q->ans;
@@ -46,9 +101,18 @@ void check_query(index_t *idx, struct query *q)
 		if (ans[0] != NULL) {
 			fprintf(stderr, "query: \"%s\" should have been %s, but failed with error \"%s\"\n", query, (*ans[0] == '\0' ? "empty" : "non empty"), errmsg);
 		}
+		UNITTEST(index_count(idx, query, INT_MAX, &errmsg) == -1);
+		UNITTEST(index_query_page(idx, query, 0, 10, &errmsg) == NULL);
 		return;
 	}
 
+	/* Counting agrees with the full result */
+	int count = list_size(res);
+	UNITTEST(index_count(idx, query, INT_MAX, &errmsg) == count);
+	UNITTEST(index_count(idx, query, 2, &errmsg) == (count < 2 ? count : 2));
+	UNITTEST(index_exists(idx, query, &errmsg) == (count > 0));
+	check_pages(idx, query, res);
+
 	if (ans[0] == NULL) {
 		if (res != NULL) {
 			fprintf(stderr, "query: \"%s\" should have failed, but is %s\n", query, (list_size(res) > 0 ? "non empty" : "empty"));
@@ -79,6 +143,44 @@ void check_query(index_t *idx, struct query *q)
 }
 
 
+/*
+ * Checks that evaluating the given queries in one batch gives the same
+ * results and counts as evaluating them one at a time.
+ */
+void check_batch(index_t *idx, struct query *queries)
+{
+	char *texts[200], *errmsgs[200], *errmsg;
+	list_t *results[200];
+	int counts[200], n, i;
+
+	for (n = 0; queries[n].q != NULL; n++) {
+		texts[n] = queries[n].q;
+	}
+	/* The same queries twice, so that every part is shared */
+	for (i = 0; i < n; i++) {
+		texts[n + i] = queries[i].q;
+	}
+	index_query_batch(idx, texts, 2 * n, results, errmsgs);
+	index_count_batch(idx, texts, 2 * n, counts, errmsgs);
+
+	for (i = 0; i < 2 * n; i++) {
+		list_t *res = index_query(idx, texts[i], &errmsg);
+		if (res == NULL) {
+			UNITTEST(results[i] == NULL && counts[i] == -1);
+			continue;
+		}
+		UNITTEST(counts[i] == list_size(res));
+		if (UNITTEST(results[i] != NULL && list_size(results[i]) == list_size(res))) {
+			while (list_size(res) > 0) {
+				UNITTEST(strcmp(list_popfirst(res), list_popfirst(results[i])) == 0);
+			}
+			list_destroy(results[i]);
+		}
+		list_destroy(res);
+	}
+}
+
+
 void index_test(void)
 {
 	enum {
@@ -163,11 +265,1538 @@ void index_test(void)
 		check_query(idx, &queries[i]);
 	}
 
+	check_batch(idx, queries);
+
+	/* Any number of operators, nested as deep as they go, without overflowing the stack */
+	enum { NUMOPS = 100000 };
+	char *big = malloc(10 * NUMOPS + 10), *errmsg;
+	char *p = big;
+	for (i = 0; i < NUMOPS; i++) {
+		p += sprintf(p, i % 2 ? "(a AND " : "1 OR ");
+	}
+	p += sprintf(p, "z");
+	for (i = 1; i < NUMOPS; i += 2) {
+		*p++ = ')';
+	}
+	*p = '\0';
+	struct query deep = { big, { "alpha", "dec", "alnum", "hex", "" } };
+	check_query(idx, &deep);
+	char *batch[] = { big, big, "a" };
+	list_t *batched[3];
+	char *batcherrs[3];
+	index_query_batch(idx, batch, 3, batched, batcherrs);
+	for (i = 0; i < 3; i++) {
+		UNITTEST(batched[i] != NULL && list_size(batched[i]) == (i < 2 ? 4 : 3));
+		list_destroy(batched[i]);
+	}
+	int nummatches;
+	list_t *ranked = index_query_ranked(idx, big, 2, &nummatches, &errmsg);
+	UNITTEST(ranked != NULL && list_size(ranked) == 2 && nummatches == 4);
+	while (ranked != NULL && list_size(ranked) > 0) {
+		free(list_popfirst(ranked));
+	}
+	list_destroy(ranked);
+	free(big);
+
+	/* The same queries against the frozen dictionary */
+	index_freeze(idx);
+	for (i = 0; queries[i].q != NULL; i++) {
+		check_query(idx, &queries[i]);
+	}
+	check_batch(idx, queries);
+
+	/* Adding after freezing */
+	char *extra[] = { "extra", "a" };
+	index_addpath(idx, strdup("extra"), list_from_array(extra, 2));
+	struct query extra_query = {"extra OR z", {"extra", "alpha", "alnum", ""}};
+	check_query(idx, &extra_query);
+	struct query extra_query2 = {"a ANDNOT 0", {"alpha", "extra", ""}};
+	check_query(idx, &extra_query2);
+
+	/* Wildcards, both before and after freezing */
+	char *server[] = { "handle_request", "handle_reply", "IOException" };
+	char *client[] = { "handler", "RuntimeException", "handle_reply" };
+	index_addpath(idx, strdup("server"), list_from_array(server, 3));
+	index_addpath(idx, strdup("client"), list_from_array(client, 3));
+
+	struct query wildcard_queries[] = {
+		{"handle_*", {"server", "client", ""}}, {"handle*", {"server", "client", ""}}, {"handle_req*", {"server", ""}},
+		{"*Exception", {"server", "client", ""}}, {"*IOException", {"server", ""}}, {"*tion ANDNOT handler", {"server", ""}},
+		{"ex*", {"extra", ""}}, {"nothing*", {""}}, {"*nothing", {""}}, {"(handle_r* AND *Exception) OR z", {"server", "client", "alpha", "alnum", ""}},
+		{"*", {NULL}}, {"a**", {NULL}}, {"*a*", {NULL}}, {"ha*le", {NULL}}, {"a OR *", {NULL}},
+		{NULL, {NULL}}
+	};
+	for (i = 0; wildcard_queries[i].q != NULL; i++) {
+		check_query(idx, &wildcard_queries[i]);
+	}
+	index_freeze(idx);
+	for (i = 0; wildcard_queries[i].q != NULL; i++) {
+		check_query(idx, &wildcard_queries[i]);
+	}
+	check_batch(idx, wildcard_queries);
+
+	/* Fuzzy words, both before and after freezing */
+	char *mail[] = { "receive", "recipe", "deceive" };
+	index_addpath(idx, strdup("mail"), list_from_array(mail, 3));
+	struct query fuzzy_queries[] = {
+		{"recieve~1", {"mail", ""}}, {"handlr~1", {"client", ""}}, {"handlr~2", {"client", ""}},
+		{"IOExceptoin~1 OR z", {"server", "alpha", "alnum", ""}}, {"recipe~2 ANDNOT deceive", {""}},
+		{"extar~1 AND a", {"extra", ""}}, {"b~1 ANDNOT 0", {"alpha", "extra", ""}}, {"zzzzzz~2", {""}},
+		{"recieve~0", {NULL}}, {"recieve~3", {NULL}}, {"~1", {NULL}}, {"rec*~1", {NULL}}, {"a~1 NEAR/2 b", {NULL}},
+		{NULL, {NULL}}
+	};
+	for (i = 0; fuzzy_queries[i].q != NULL; i++) {
+		check_query(idx, &fuzzy_queries[i]);
+	}
+	index_freeze(idx);
+	for (i = 0; fuzzy_queries[i].q != NULL; i++) {
+		check_query(idx, &fuzzy_queries[i]);
+	}
+	check_batch(idx, fuzzy_queries);
+
+	/* Again through the caches, until parts of the queries come from them */
+	qcache_stats_t stats;
+	int round;
+	index_setcachesize(idx, 1 << 20);
+	index_setsubcachesize(idx, 1 << 20);
+	for (round = 0; round < 3; round++) {
+		for (i = 0; wildcard_queries[i].q != NULL; i++) {
+			check_query(idx, &wildcard_queries[i]);
+		}
+		for (i = 0; fuzzy_queries[i].q != NULL; i++) {
+			check_query(idx, &fuzzy_queries[i]);
+		}
+		check_query(idx, &extra_query);
+		check_query(idx, &extra_query2);
+	}
+	UNITTEST(index_subcachestats(idx, &stats) == 1 && stats.hits > 0);
+	index_setcachesize(idx, 0);
+	index_setsubcachesize(idx, 0);
+
+	/* Expansion limit */
+	index_setmaxexpansions(idx, 2);
+	UNITTEST(index_query(idx, strdup("handle*"), &errmsg) == NULL);
+	index_setmaxexpansions(idx, 3);
+	UNITTEST(index_query(idx, strdup("handle*"), &errmsg) != NULL);
+
+	/* Many dense and many sparse posting lists */
+	index_setmaxexpansions(idx, DEFAULT_MAX_EXPANSIONS);
+	for (i = 0; i < 100; i++) {
+		char name[32], word[32], *words[2] = { name, word };
+		snprintf(name, sizeof(name), "doc_%d", i);
+		snprintf(word, sizeof(word), "term_%d", i % 20);
+		index_addpath(idx, strdup(name), list_from_array(words, 2));
+	}
+	index_freeze(idx);
+	list_t *res = index_query(idx, strdup("doc_*"), &errmsg);
+	UNITTEST(res != NULL && list_size(res) == 100);
+	res = index_query(idx, strdup("term_1*"), &errmsg);
+	UNITTEST(res != NULL && list_size(res) == 55);
+
+	index_destroy(idx);
+}
+
+void phrase_test(void)
+{
+	index_t *idx = index_create();
+	index_setpositional(idx, 1);
+
+	index_addpath(idx, strdup("oom"), list_from_sentence("we ran out of memory today"));
+	index_addpath(idx, strdup("oom2"), list_from_sentence("out of time and memory"));
+	index_addpath(idx, strdup("rev"), list_from_sentence("memory out of"));
+	index_addpath(idx, strdup("rep"), list_from_sentence("to be or not to be"));
+
+	/* Positions that need multi-byte encodings */
+	char *long_doc[303], filler[200][8];
+	int i;
+	for (i = 0; i < 200; i++) {
+		snprintf(filler[i], sizeof(filler[i]), "f%d", i);
+		long_doc[i] = filler[i];
+	}
+	long_doc[200] = "out";
+	long_doc[201] = "of";
+	long_doc[202] = "memory";
+	index_addpath(idx, strdup("long"), list_from_array(long_doc, 203));
+
+	struct query queries[] = {
+		{"\"out of memory\"", {"oom", "long", ""}}, {"\"of memory\"", {"oom", "long", ""}}, {"\"out of\"", {"oom", "oom2", "rev", "long", ""}},
+		{"\"f198 f199 out\"", {"long", ""}}, {"\"f0 f1\"", {"long", ""}}, {"\"f1 f0\"", {""}},
+		{"\"memory out\"", {"rev", ""}}, {"\"out of memory\" OR \"memory out\"", {"oom", "rev", "long", ""}},
+		{"\"ran\"", {"oom", ""}}, {"\"out of memory\" AND today", {"oom", ""}}, {"out AND memory ANDNOT \"out of memory\"", {"oom2", "rev", ""}},
+		{"\"to be\"", {"rep", ""}}, {"\"not to be\"", {"rep", ""}}, {"\"be or not\"", {"rep", ""}}, {"\"be to\"", {""}}, {"\"to be to\"", {""}},
+		{"\"out-of memory!\"", {"oom", "long", ""}}, {"(\"time and\")", {"oom2", ""}}, {"\"out of nothing\"", {""}},
+		{"out NEAR/1 memory", {"rev", ""}}, {"out NEAR/2 memory", {"oom", "rev", "long", ""}}, {"memory NEAR/4 out", {"oom", "oom2", "rev", "long", ""}},
+		{"to NEAR/4 to", {"rep", ""}}, {"to NEAR/3 to", {""}}, {"be NEAR/1 or AND (not NEAR/1 to)", {"rep", ""}}, {"out NEAR/9 nothing", {""}}, {"NEAR", {""}},
+		{"out NEAR/ memory", {NULL}}, {"out NEAR/2", {NULL}}, {"NEAR/2 out", {NULL}}, {"out* NEAR/2 memory", {NULL}}, {"\"out\" NEAR/2 memory", {NULL}},
+		{"out NEAR/8388609 memory", {NULL}}, {"out NEAR/99999999999999999999 memory", {NULL}}, {"out NEAR/8388608 memory", {"oom", "oom2", "rev", "long", ""}},
+		{"\"out of", {NULL}}, {"\"\"", {NULL}}, {"\" ! \"", {NULL}}, {"out \"of\"", {NULL}}, {"\"out\" of", {NULL}},
+		{NULL, {NULL}}
+	};
+
+	for (i = 0; queries[i].q != NULL; i++) {
+		check_query(idx, &queries[i]);
+	}
+	index_freeze(idx);
+	for (i = 0; queries[i].q != NULL; i++) {
+		check_query(idx, &queries[i]);
+	}
+	index_destroy(idx);
+
+	/* Without positions, only single word phrases work */
+	idx = index_create();
+	index_addpath(idx, strdup("oom"), list_from_sentence("we ran out of memory today"));
+	struct query single = {"\"memory\"", {"oom", ""}};
+	struct query multiple = {"\"out of memory\"", {NULL}};
+	struct query near = {"out NEAR/2 memory", {NULL}};
+	check_query(idx, &single);
+	check_query(idx, &multiple);
+	check_query(idx, &near);
+	index_destroy(idx);
+}
+
+/*
+ * Checks that the ranked query returns the given paths, in order.
+ */
+void check_ranked(index_t *idx, char *query, int k, int nummatches, char **ans)
+{
+	char *errmsg;
+	int n = -1, i = 0;
+
+	list_t *res = index_query_ranked(idx, query, k, &n, &errmsg);
+	if (!UNITTEST(res != NULL)) {
+		return;
+	}
+	UNITTEST(n == nummatches);
+
+	double last = 1e300;
+	while (list_size(res) > 0) {
+		index_hit_t *hit = list_popfirst(res);
+		if (UNITTEST(*ans[i] != '\0')) {
+			if (strcmp(hit->path, ans[i]) != 0) {
+				fprintf(stderr, "ranked query: \"%s\" hit %d is \"%s\", should have been \"%s\"\n", query, i, hit->path, ans[i]);
+			}
+			i++;
+		}
+		UNITTEST(hit->score <= last);
+		last = hit->score;
+		free(hit);
+	}
+	UNITTEST(*ans[i] == '\0');
+	list_destroy(res);
+}
+
+void ranked_test(void)
+{
+	index_t *idx = index_create();
+	index_setpositional(idx, 1);
+
+	index_addpath(idx, strdup("once"), list_from_sentence("apple banana"));
+	index_addpath(idx, strdup("thrice"), list_from_sentence("apple apple apple banana"));
+	index_addpath(idx, strdup("both"), list_from_sentence("banana cherry"));
+	index_addpath(idx, strdup("rare"), list_from_sentence("cherry"));
+	index_addpath(idx, strdup("long"), list_from_sentence("apple and a lot of other words that make this document long"));
+
+	/* More occurrences win, longer documents lose */
+	check_ranked(idx, "apple", 10, 3, (char *[]){"thrice", "once", "long", ""});
+	check_ranked(idx, "apple", 1, 3, (char *[]){"thrice", ""});
+	/* Matching more words wins */
+	check_ranked(idx, "banana OR cherry", 1, 4, (char *[]){"both", ""});
+	/* Excluded words do not score */
+	check_ranked(idx, "banana ANDNOT apple", 5, 1, (char *[]){"both", ""});
+	check_ranked(idx, "nothing", 5, 0, (char *[]){""});
+	check_ranked(idx, "apple", 0, 3, (char *[]){""});
+
+	char *errmsg;
+	UNITTEST(index_query_ranked(idx, "apple AND", 5, NULL, &errmsg) == NULL);
+
+	index_freeze(idx);
+	check_ranked(idx, "apple", 10, 3, (char *[]){"thrice", "once", "long", ""});
+	check_ranked(idx, "\"apple banana\" OR cherry", 3, 4, (char *[]){"both", "thrice", "once", ""});
+
+	index_destroy(idx);
+}
+
+/*
+ * Checks that the given query ranks the same on the given frozen index,
+ * which skips by the score bounds, as on the given index with the same
+ * documents that is not frozen, which scores every match.
+ */
+void check_pruned(index_t *idx, index_t *exhaustive, char *query, int k)
+{
+	char *errmsg;
+	int n1 = -1, n2 = -2;
+
+	list_t *pruned = index_query_ranked(idx, query, k, &n1, &errmsg);
+	list_t *full = index_query_ranked(exhaustive, query, k, &n2, &errmsg);
+	if (!UNITTEST(pruned != NULL && full != NULL)) {
+		return;
+	}
+	UNITTEST(n1 == n2);
+	UNITTEST(list_size(pruned) == list_size(full));
+	while (list_size(pruned) > 0 && list_size(full) > 0) {
+		index_hit_t *a = list_popfirst(pruned), *b = list_popfirst(full);
+		if (strcmp(a->path, b->path) != 0 || a->score != b->score) {
+			fprintf(stderr, "ranked query: \"%s\" pruned hit %s (%f), exhaustive %s (%f)\n", query, a->path, a->score, b->path, b->score);
+		}
+		free(a);
+		free(b);
+	}
+	list_destroy(pruned);
+	list_destroy(full);
+}
+
+void pruned_test(void)
+{
+	index_t *idx = index_create(), *exhaustive = index_create();
+	unsigned int seed = 12345;
+	int i, j;
+
+	/* Word w_i occurs with probability about 1/(i+1), so some are common */
+	for (i = 0; i < 2000; i++) {
+		char name[32], *words[40], buf[40][16];
+		int count = 0;
+		for (j = 0; j < 40; j++) {
+			seed = seed * 1103515245 + 12345;
+			int w = (seed >> 16) % 1000;
+			snprintf(buf[count], sizeof(buf[count]), "w_%d", 1000 / (w + 1));
+			words[count] = buf[count];
+			count++;
+		}
+		snprintf(name, sizeof(name), "doc_%d", i);
+		index_addpath(idx, strdup(name), list_from_array(words, count));
+		index_addpath(exhaustive, strdup(name), list_from_array(words, count));
+	}
+	index_freeze(idx);
+
+	check_pruned(idx, exhaustive, "w_1", 10);
+	check_pruned(idx, exhaustive, "w_1 OR w_2", 10);
+	check_pruned(idx, exhaustive, "w_1 OR w_2 OR w_3 OR w_50", 10);
+	check_pruned(idx, exhaustive, "w_1 OR w_1000 OR w_7", 1);
+	check_pruned(idx, exhaustive, "w_2 OR w_9 OR w_100 OR w_500 OR nothing", 100);
+	check_pruned(idx, exhaustive, "w_1 OR w_2 OR w_3", 5000);
+	/* Words in most documents, whose bounds cannot prune, so they are scored exhaustively */
+	check_pruned(idx, exhaustive, "w_1 OR w_2 OR w_3 OR w_4 OR w_5 OR w_6", 10);
+	check_pruned(idx, exhaustive, "w_1 OR w_2 OR w_3 OR w_4 OR w_5 OR w_6 OR w_1000", 1);
+	check_pruned(idx, exhaustive, "w_1 AND w_2", 10);
+	check_pruned(idx, exhaustive, "w_1 AND (w_3 OR w_50) AND w_7", 10);
+	check_pruned(idx, exhaustive, "w_2 ANDNOT w_3", 1);
+	check_pruned(idx, exhaustive, "(w_1 OR w_2) ANDNOT (w_5 OR w_9)", 20);
+	check_pruned(idx, exhaustive, "w_1 AND w_10* AND nothing", 10);
+	check_pruned(idx, exhaustive, "w_1 AND w_2", 5000);
+
+	/* Removed documents are left out, even before they are compacted */
+	index_removepath(idx, "doc_7");
+	index_removepath(exhaustive, "doc_7");
+	check_pruned(idx, exhaustive, "w_1 AND w_2", 10);
+	check_pruned(idx, exhaustive, "w_1 ANDNOT w_4", 10);
+
+	/* Including the best hit of a query that is scored exhaustively */
+	char *common = "w_1 OR w_2 OR w_3 OR w_4 OR w_5 OR w_6", *errmsg;
+	list_t *best = index_query_ranked(idx, common, 1, NULL, &errmsg);
+	if (UNITTEST(best != NULL && list_size(best) == 1)) {
+		index_hit_t *hit = list_popfirst(best);
+		index_removepath(idx, hit->path);
+		index_removepath(exhaustive, hit->path);
+		free(hit);
+		check_pruned(idx, exhaustive, common, 10);
+	}
+	list_destroy(best);
+
+	index_destroy(idx);
+	index_destroy(exhaustive);
+}
+
+void cache_test(void)
+{
+	index_t *idx = index_create();
+	qcache_stats_t stats;
+	char *errmsg;
+	list_t *res;
+
+	UNITTEST(index_cachestats(idx, &stats) == 0);
+	index_setcachesize(idx, 1 << 20);
+
+	index_addpath(idx, strdup("ab"), list_from_sentence("a b"));
+	index_addpath(idx, strdup("bc"), list_from_sentence("b c"));
+
+	/* The second query is the same once parsed */
+	res = index_query(idx, "a OR c", &errmsg);
+	UNITTEST(res != NULL && list_size(res) == 2);
+	list_destroy(res);
+	res = index_query(idx, "(a)   OR c", &errmsg);
+	UNITTEST(res != NULL && list_size(res) == 2);
+	list_destroy(res);
+	UNITTEST(index_cachestats(idx, &stats) == 1);
+	UNITTEST(stats.hits == 1 && stats.misses == 1 && stats.entries == 1);
+
+	/* Adding a document invalidates the cached results */
+	uint64_t generation = index_generation(idx);
+	index_addpath(idx, strdup("cd"), list_from_sentence("c d"));
+	UNITTEST(index_generation(idx) != generation);
+	res = index_query(idx, "a OR c", &errmsg);
+	UNITTEST(res != NULL && list_size(res) == 3);
+	list_destroy(res);
+	index_cachestats(idx, &stats);
+	UNITTEST(stats.hits == 1 && stats.invalidations == 1 && stats.entries == 1);
+
+	/* Errors are not cached */
+	UNITTEST(index_query(idx, "a AND", &errmsg) == NULL);
+	free(errmsg);
+	UNITTEST(index_query(idx, "a*b*", &errmsg) == NULL);
+	free(errmsg);
+	index_cachestats(idx, &stats);
+	UNITTEST(stats.entries == 1);
+
+	/* A small budget evicts the least recently used results, "b" here */
+	index_setcachesize(idx, stats.bytes * 2);
+	res = index_query(idx, "b", &errmsg);
+	list_destroy(res);
+	res = index_query(idx, "a OR c", &errmsg);
+	list_destroy(res);
+	res = index_query(idx, "c", &errmsg);
+	list_destroy(res);
+	index_cachestats(idx, &stats);
+	UNITTEST(stats.evictions == 1 && stats.entries == 2 && stats.bytes <= stats.budget);
+	res = index_query(idx, "a OR c", &errmsg);
+	UNITTEST(res != NULL && list_size(res) == 3);
+	list_destroy(res);
+	index_cachestats(idx, &stats);
+	UNITTEST(stats.hits == 3);
+
+	index_setcachesize(idx, 0);
+	UNITTEST(index_cachestats(idx, &stats) == 0);
+	index_destroy(idx);
+}
+
+
+void costaware_test(void)
+{
+	set_u32_t *docs = set_u32_create(), *res;
+	qcache_stats_t stats;
+	int i;
+
+	for (i = 0; i < 100; i++) {
+		set_u32_add(docs, i);
+	}
+
+	/* Room for two entries */
+	qcache_t *cache = qcache_createcostaware(1200);
+	qcache_putcost(cache, "slow", 1, docs, 10);
+	qcache_putcost(cache, "slower", 1, docs, 20);
+	qcache_getstats(cache, &stats);
+	UNITTEST(stats.entries == 2);
+
+	/* Not worth evicting either of them */
+	UNITTEST(qcache_get(cache, "fast", 1) == NULL);
+	qcache_putcost(cache, "fast", 1, docs, 1);
+	qcache_getstats(cache, &stats);
+	UNITTEST(stats.rejections == 1 && stats.entries == 2);
+
+	/* Until it has missed often enough, and then it evicts the cheapest */
+	for (i = 0; i < 10; i++) {
+		UNITTEST(qcache_get(cache, "fast", 1) == NULL);
+	}
+	UNITTEST(qcache_frequency(cache, "fast", 1) == 11);
+	qcache_putcost(cache, "fast", 1, docs, 1);
+	qcache_getstats(cache, &stats);
+	UNITTEST(stats.evictions == 1 && stats.entries == 2);
+	UNITTEST(qcache_get(cache, "slow", 1) == NULL);
+	res = qcache_get(cache, "slower", 1);
+	UNITTEST(res != NULL && res->size == 100);
+	set_u32_destroy(res);
+
+	/* A new generation forgets everything */
+	UNITTEST(qcache_get(cache, "fast", 2) == NULL);
+	UNITTEST(qcache_frequency(cache, "fast", 2) == 1);
+	qcache_getstats(cache, &stats);
+	UNITTEST(stats.invalidations == 2 && stats.entries == 0);
+	qcache_destroy(cache);
+
+	/* An entry that was costly once is evicted if it is not asked for again */
+	cache = qcache_createcostaware(1200);
+	qcache_putcost(cache, "once", 1, docs, 100);
+	qcache_putcost(cache, "q0", 1, docs, 50);
+	for (i = 1; i < 5; i++) {
+		char query[8];
+
+		sprintf(query, "q%d", i);
+		qcache_putcost(cache, query, 1, docs, 60);
+	}
+	qcache_getstats(cache, &stats);
+	UNITTEST(stats.entries == 2 && stats.rejections == 0);
+	UNITTEST(qcache_get(cache, "once", 1) == NULL);
+	res = qcache_get(cache, "q4", 1);
+	UNITTEST(res != NULL);
+	set_u32_destroy(res);
+
+	qcache_destroy(cache);
+	set_u32_destroy(docs);
+}
+
+
+struct runner {
+	index_t *idx;
+	query_plan_t *plan;
+	int count;
+	int ok;
+};
+
+
+static void *run_plan(void *arg)
+{
+	struct runner *r = arg;
+	char *errmsg;
+	int i;
+
+	r->ok = 1;
+	for (i = 0; i < 200; i++) {
+		list_t *res = index_runquery(r->idx, r->plan, &errmsg);
+		r->ok &= (res != NULL && list_size(res) == r->count);
+		r->ok &= (index_runcount(r->idx, r->plan, INT_MAX, &errmsg) == r->count);
+		list_destroy(res);
+	}
+	return NULL;
+}
+
+
+void plan_test(void)
+{
+	index_t *a = index_create(), *b = index_create();
+	char *errmsg;
+	list_t *res;
+	int i;
+
+	index_addpath(a, strdup("one"), list_from_sentence("ORACLE AND android"));
+	index_addpath(b, strdup("two"), list_from_sentence("ORACLE ORDER"));
+	index_addpath(b, strdup("three"), list_from_sentence("ORDER"));
+
+	/* Operators are whole words only */
+	query_plan_t *plan = index_compile(a, "ORACLE OR ORDER", &errmsg);
+	if (!UNITTEST(plan != NULL)) {
+		return;
+	}
+
+	/* One plan, several indexes */
+	res = index_runquery(a, plan, &errmsg);
+	UNITTEST(res != NULL && list_size(res) == 1);
+	list_destroy(res);
+	res = index_runquery(b, plan, &errmsg);
+	UNITTEST(res != NULL && list_size(res) == 2);
+	list_destroy(res);
+	UNITTEST(index_runcount(b, plan, 1, &errmsg) == 1);
+	res = index_runranked(b, plan, 1, &i, &errmsg);
+	UNITTEST(res != NULL && list_size(res) == 1 && i == 2);
+	while (res != NULL && list_size(res) > 0) {
+		free(list_popfirst(res));
+	}
+	list_destroy(res);
+
+	/* Several threads, through the caches */
+	struct runner runners[4];
+	pthread_t threads[4];
+	index_setcachesize(b, 1 << 20);
+	for (i = 0; i < 4; i++) {
+		runners[i].idx = b;
+		runners[i].plan = plan;
+		runners[i].count = 2;
+		pthread_create(&threads[i], NULL, run_plan, &runners[i]);
+	}
+	for (i = 0; i < 4; i++) {
+		pthread_join(threads[i], NULL);
+		UNITTEST(runners[i].ok);
+	}
+	index_freeplan(plan);
+
+	/* Deep nesting does not recurse in the parser */
+	enum { DEPTH = 100000 };
+	char *deep = malloc(2 * DEPTH + 6);
+	memset(deep, '(', DEPTH);
+	strcpy(deep + DEPTH, "ORDER");
+	memset(deep + DEPTH + 5, ')', DEPTH);
+	deep[2 * DEPTH + 5] = '\0';
+	UNITTEST(index_count(b, deep, INT_MAX, &errmsg) == 2);
+	free(deep);
+
+	UNITTEST(index_compile(a, "ORACLE OR", &errmsg) == NULL);
+	free(errmsg);
+	UNITTEST(index_compile(a, "\"ORACLE", &errmsg) == NULL);
+	free(errmsg);
+
+	index_destroy(a);
+	index_destroy(b);
+}
+
+
+/*
+ * Checks that index_grep() finds exactly the given paths, in order.
+ */
+void check_grep(index_t *idx, char *pattern, int regex, char **ans)
+{
+	char *errmsg;
+	list_t *res = index_grep(idx, pattern, regex, &errmsg);
+	int i;
+
+	UNITTEST(res != NULL);
+	for (i = 0; ans[i] != NULL; i++) {
+		char *path = list_size(res) > 0 ? list_popfirst(res) : "";
+		if (!UNITTEST(strstr(path, ans[i]) != NULL)) {
+			fprintf(stderr, "grep: \"%s\" gives \"%s\" instead of \"%s\"\n", pattern, path, ans[i]);
+		}
+	}
+	UNITTEST(list_size(res) == 0);
+	list_destroy(res);
+}
+
+
+/*
+ * Returns the number of candidates the given trigrams give for the
+ * given regular expression, out of 4 documents.
+ */
+int count_candidates(trigram_t *trigrams, char *regex)
+{
+	set_u32_t *docs = trigram_regex(trigrams, regex, 4);
+	int n = docs->size;
+	set_u32_destroy(docs);
+	return n;
+}
+
+
+void grep_test(void)
+{
+	char *texts[] = {
+		"p = p->next;\nreturn hash_string(s);\n",
+		"while (node->prev)\n\tnode = node->prev;\n",
+		"hash_bytes(data, len) and nextval\n",
+		"ab",
+	};
+	char dir[] = "/tmp/grep_testXXXXXX";
+	char paths[4][64];
+	index_t *idx = index_create();
+	trigram_t *trigrams = trigram_create();
+	char *errmsg;
+	int i;
+
+	UNITTEST(mkdtemp(dir) != NULL);
+	index_settrigrams(idx, 1);
+	for (i = 0; i < 4; i++) {
+		snprintf(paths[i], sizeof(paths[i]), "%s/f%d", dir, i);
+		FILE *f = fopen(paths[i], "w");
+		fputs(texts[i], f);
+		fclose(f);
+		index_addpath(idx, strdup(paths[i]), list_from_sentence(texts[i]));
+		index_addtrigrams(idx, texts[i], strlen(texts[i]));
+		trigram_add(trigrams, i, texts[i], strlen(texts[i]));
+	}
+	index_freeze(idx);
+
+	check_grep(idx, "->next", 0, (char *[]) { "f0", NULL });
+	check_grep(idx, "->", 0, (char *[]) { "f0", "f1", NULL });
+	check_grep(idx, "next", 0, (char *[]) { "f0", "f2", NULL });
+	check_grep(idx, "hash_", 0, (char *[]) { "f0", "f2", NULL });
+	check_grep(idx, "xt;\nre", 0, (char *[]) { "f0", NULL });
+	check_grep(idx, "zzz", 0, (char *[]) { NULL });
+	check_grep(idx, "", 0, (char *[]) { "f0", "f1", "f2", "f3", NULL });
+
+	check_grep(idx, "hash_[a-z]+\\(", 1, (char *[]) { "f0", "f2", NULL });
+	check_grep(idx, "^while", 1, (char *[]) { "f1", NULL });
+	check_grep(idx, "^node", 1, (char *[]) { NULL });
+	check_grep(idx, "prev|next", 1, (char *[]) { "f0", "f1", "f2", NULL });
+	check_grep(idx, "node->(prev|next)", 1, (char *[]) { "f1", NULL });
+	check_grep(idx, "(foo)?->ne+xt", 1, (char *[]) { "f0", NULL });
+	check_grep(idx, "p.*next", 1, (char *[]) { "f0", NULL });
+	check_grep(idx, "a", 1, (char *[]) { "f0", "f2", "f3", NULL });
+
+	/* Only the documents with every trigram a match needs are read */
+	UNITTEST(count_candidates(trigrams, "node->(prev|next)") == 1);
+	UNITTEST(count_candidates(trigrams, "hash_[a-z]+\\(") == 2);
+	UNITTEST(count_candidates(trigrams, "(qqq)*->n") == 1);
+	UNITTEST(count_candidates(trigrams, "ha(sh_|xx_)") == 2);
+	UNITTEST(count_candidates(trigrams, "ha(sh_|x_)") == 4);
+	UNITTEST(count_candidates(trigrams, "nex?t") == 4);
+	UNITTEST(count_candidates(trigrams, "nexx*t") == 2);
+	UNITTEST(count_candidates(trigrams, "p|->next") == 4);
+	UNITTEST(count_candidates(trigrams, "while|->next") == 2);
+	UNITTEST(count_candidates(trigrams, "[->]next") == 2);
+	UNITTEST(count_candidates(trigrams, "\\->next") == 1);
+	UNITTEST(count_candidates(trigrams, "zzz|yyy") == 0);
+
+	UNITTEST(index_grep(idx, "x(", 1, &errmsg) == NULL);
+	free(errmsg);
+
+	for (i = 0; i < 4; i++) {
+		unlink(paths[i]);
+	}
+	rmdir(dir);
+	trigram_destroy(trigrams);
+	index_destroy(idx);
+
+	/* An index without trigrams cannot do it */
+	idx = index_create();
+	index_addpath(idx, strdup("a"), list_from_sentence("a"));
+	UNITTEST(index_grep(idx, "a", 0, &errmsg) == NULL);
+	free(errmsg);
+	index_destroy(idx);
+}
+
+
+void check_suggest(index_t *idx, char *prefix, int n, char **ans)
+{
+	list_t *res = index_suggest(idx, prefix, n);
+	int i = 0;
+
+	while (list_size(res) > 0) {
+		char *word = list_popfirst(res);
+		UNITTEST(*ans[i] != '\0' && strcmp(word, ans[i]) == 0);
+		if (*ans[i] != '\0') {
+			i++;
+		}
+		free(word);
+	}
+	UNITTEST(*ans[i] == '\0');
+	list_destroy(res);
+}
+
+void suggest_test(void)
+{
+	index_t *idx = index_create();
+	char path[16], sentence[128];
+	int i, round;
+
+	/* w0 is in every document, w1 in all but one, and so on */
+	for (i = 0; i < 15; i++) {
+		int len = 0, j;
+		for (j = 0; j <= i; j++) {
+			len += sprintf(sentence + len, "w%d ", j);
+		}
+		sprintf(sentence + len, "%s", i == 0 ? "apple apricot" : "apricot");
+		snprintf(path, sizeof(path), "doc%d", i);
+		index_addpath(idx, strdup(path), list_from_sentence(sentence));
+	}
+
+	/* Both the hash map and the frozen dictionary */
+	for (round = 0; round < 2; round++) {
+		check_suggest(idx, "w", 3, (char *[]){"w0", "w1", "w2", ""});
+		check_suggest(idx, "w1", 4, (char *[]){"w1", "w10", "w11", "w12", ""});
+		check_suggest(idx, "a", 10, (char *[]){"apricot", "apple", ""});
+		check_suggest(idx, "", 3, (char *[]){"apricot", "w0", "w1", ""});
+		check_suggest(idx, "w14", 10, (char *[]){"w14", ""});
+		check_suggest(idx, "x", 10, (char *[]){""});
+		check_suggest(idx, "w", 0, (char *[]){""});
+		check_suggest(idx, "w", 100, (char *[]){"w0", "w1", "w2", "w3", "w4", "w5", "w6", "w7", "w8", "w9", ""});
+		index_freeze(idx);
+	}
+
+	index_destroy(idx);
+}
+
+
+/*
+ * Checks that the given tokenizer splits the given text into the given
+ * words, the last of which is "".
+ */
+void check_tokens(tokenizer_t *tokenizer, char *text, char **ans)
+{
+	list_t *tokens = list_create(compare_pointers);
+	int i = 0;
+
+	tokenizer_text(tokenizer, text, strlen(text), tokens);
+	while (list_size(tokens) > 0) {
+		token_t *token = list_popfirst(tokens);
+		UNITTEST(*ans[i] != '\0' && strcmp(token->word, ans[i]) == 0);
+		UNITTEST(token->hash == hash_string(token->word));
+		if (*ans[i] != '\0') {
+			i++;
+		}
+		token_destroy(token);
+	}
+	UNITTEST(*ans[i] == '\0');
+	list_destroy(tokens);
+}
+
+void tokenize_test(void)
+{
+	tokenizer_t *tokenizer = tokenizer_default();
+
+	check_tokens(tokenizer, "Hello! This is an example....", (char *[]){"Hello", "This", "is", "an", "example", ""});
+	check_tokens(tokenizer, "it's snake_case, not kebab-case", (char *[]){"it's", "snake_case", "not", "kebab", "case", ""});
+	/* Letters of any script, but not punctuation or symbols */
+	check_tokens(tokenizer, "naïve café «Größe» ΑΒΓ Привет 日本語、テスト 😀x ½€",
+				 (char *[]){"naïve", "café", "Größe", "ΑΒΓ", "Привет", "日本語", "テスト", "x", ""});
+	/* Malformed UTF-8 separates words */
+	check_tokens(tokenizer, "ab\xff\xfe" "cd \xc3(e\xe6\x97 f\xc0\xafg \xc3", (char *[]){"ab", "cd", "e", "f", "g", ""});
+
+	tokenizer = tokenizer_create(TOKENIZER_CASEFOLD, "_-");
+	check_tokens(tokenizer, "Hello WÖRLD ΆΛΦΑ Привет ĀŁŸ ß kebab-case it's",
+				 (char *[]){"hello", "wörld", "άλφα", "привет", "āłÿ", "ß", "kebab-case", "it", "s", ""});
+	tokenizer_destroy(tokenizer);
+	tokenizer = tokenizer_create(TOKENIZER_ASCII, NULL);
+	check_tokens(tokenizer, "naïve 日本 x", (char *[]){"na", "ve", "x", ""});
+	tokenizer_destroy(tokenizer);
+
+	char s[] = "ÀÉÎ ΣΩ ЖЁ Ա ABC";
+	fold_case(s, strlen(s));
+	UNITTEST(strcmp(s, "àéî σω жё ա abc") == 0);
+
+	/* Overlong words are split between characters */
+	char text[1000], *copy = text;
+	int i, total = 0;
+	for (i = 0; i < 150; i++) {
+		copy += sprintf(copy, i == 0 ? "a" : "é");
+	}
+	list_t *tokens = list_create(compare_pointers);
+	tokenizer_text(tokenizer_default(), text, strlen(text), tokens);
+	UNITTEST(list_size(tokens) == 3);
+	while (list_size(tokens) > 0) {
+		token_t *token = list_popfirst(tokens);
+		int len = strlen(token->word);
+		UNITTEST(len <= MAX_WORD_LEN && (token->word[len - 1] & 0xc0) == 0x80);
+		total += len;
+		token_destroy(token);
+	}
+	UNITTEST(total == 1 + 149 * 2);
+	list_destroy(tokens);
+
+	/* Random ASCII, which takes the fast path in blocks, split as one byte at a time */
+	for (i = 0; i < (int)sizeof(text) - 1; i++) {
+		text[i] = "ab_'. \n("[random_int() % (i % 200 < 100 ? 8 : 3)];
+	}
+	text[sizeof(text) - 1] = '\0';
+	tokens = list_create(compare_pointers);
+	tokenizer_text(tokenizer_default(), text, strlen(text), tokens);
+	int start = 0, end = 0;
+	while (start < (int)sizeof(text) - 1) {
+		while (text[start] != '\0' && strchr("ab_'", text[start]) == NULL) {
+			start++;
+		}
+		for (end = start; text[end] != '\0' && strchr("ab_'", text[end]) != NULL && end - start < MAX_WORD_LEN; end++)
+			;
+		if (end > start) {
+			token_t *token = list_popfirst(tokens);
+			UNITTEST(token != NULL && strlen(token->word) == end - start &&
+					 strncmp(token->word, text + start, end - start) == 0);
+			token_destroy(token);
+		}
+		start = end;
+	}
+	UNITTEST(list_size(tokens) == 0);
+	list_destroy(tokens);
+}
+
+void casefold_test(void)
+{
+	tokenizer_t *tokenizer = tokenizer_create(TOKENIZER_CASEFOLD, NULL);
+	index_t *idx = index_create();
+	char *texts[] = { "Error: disk FULL", "no error here", "ÉCOLE Straße", NULL };
+	char *paths[] = { "upper", "lower", "latin" };
+	int i;
+
+	index_setpositional(idx, 1);
+	index_setcasefold(idx, 1);
+	for (i = 0; texts[i] != NULL; i++) {
+		list_t *words = list_create(compare_strings);
+		tokenizer_text(tokenizer, texts[i], strlen(texts[i]), words);
+		index_addpath(idx, strdup(paths[i]), words);
+		list_destroy(words);
+	}
+	tokenizer_destroy(tokenizer);
+
+	struct query queries[] = {
+		{"error", {"upper", "lower", ""}}, {"ERROR", {"upper", "lower", ""}}, {"Err*", {"upper", "lower", ""}},
+		{"\"Disk Full\"", {"upper", ""}}, {"école AND STRASSE~2", {"latin", ""}}, {"Erorr~1", {"upper", "lower", ""}},
+		{NULL, {NULL}}
+	};
+	for (i = 0; queries[i].q != NULL; i++) {
+		check_query(idx, &queries[i]);
+	}
+	index_freeze(idx);
+	for (i = 0; queries[i].q != NULL; i++) {
+		check_query(idx, &queries[i]);
+	}
+	check_suggest(idx, "ÉC", 10, (char *[]){"école", ""});
+
+	index_destroy(idx);
+}
+
+
+void wordchars_test(void)
+{
+	tokenizer_t *tokenizer = tokenizer_create(0, "_'-");
+	index_t *idx = index_create();
+	char *texts[] = { "a built-in thing", "built in thing", NULL };
+	char *paths[] = { "hyphen", "spaces" };
+	int i;
+
+	index_setpositional(idx, 1);
+	index_settokenizer(idx, tokenizer);
+	for (i = 0; texts[i] != NULL; i++) {
+		list_t *words = list_create(compare_strings);
+		tokenizer_text(tokenizer, texts[i], strlen(texts[i]), words);
+		index_addpath(idx, strdup(paths[i]), words);
+		list_destroy(words);
+	}
+	tokenizer_destroy(tokenizer);
+
+	/* Phrases are split like the documents were */
+	struct query queries[] = {
+		{"\"built-in thing\"", {"hyphen", ""}}, {"\"built in thing\"", {"spaces", ""}},
+		{"\"a built-in\"", {"hyphen", ""}}, {"\"in thing\"", {"spaces", ""}},
+		{NULL, {NULL}}
+	};
+	for (i = 0; queries[i].q != NULL; i++) {
+		check_query(idx, &queries[i]);
+	}
+	index_freeze(idx);
+	for (i = 0; queries[i].q != NULL; i++) {
+		check_query(idx, &queries[i]);
+	}
+
+	/* Indexes like it split phrases the same way */
+	index_t *like = index_createlike(idx);
+	index_addpath(like, strdup("like"), list_from_sentence("built-in thing"));
+	struct query liked = {"\"built-in thing\"", {"like", ""}};
+	check_query(like, &liked);
+
+	index_destroy(like);
+	index_destroy(idx);
+}
+
+
+void find_files_test(void)
+{
+	char dir[] = "/tmp/find_testXXXXXX", sub[64], path[96], block[SNIFF_LEN];
+	char *names[] = { "main.c", "sub/README", "main.o", "logo.PNG", "app.min.js", "data", "parser.c", "bundle.js", "huge.txt" };
+	find_stats_t stats;
+	int i;
+
+	UNITTEST(mkdtemp(dir) != NULL);
+	snprintf(sub, sizeof(sub), "%s/sub", dir);
+	mkdir(sub, 0700);
+	for (i = 0; i < 9; i++) {
+		snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+		FILE *f = fopen(path, "w");
+		if (i == 5) {
+			fwrite("\x7f" "ELF\0\1\2", 1, 8, f);
+		} else if (i == 6) {
+			fputs("/* Code generated by yacc. DO NOT EDIT. */\nint x;\n", f);
+		} else if (i == 7) {
+			memset(block, 'x', sizeof(block));
+			fwrite(block, 1, sizeof(block), f);
+		} else {
+			fputs("int main(void) { return 0; }\n", f);
+		}
+		if (i == 8) {
+			ftruncate(fileno(f), MAX_FILE_SIZE + 1);
+		}
+		fclose(f);
+	}
+
+	list_t *files = find_files(dir, &stats);
+	UNITTEST(list_size(files) == 2 && stats.files == 2);
+	UNITTEST(stats.skipped[SKIP_EXTENSION] == 3);
+	UNITTEST(stats.skipped[SKIP_BINARY] == 1 && stats.skippedbytes[SKIP_BINARY] == 8);
+	UNITTEST(stats.skipped[SKIP_GENERATED] == 2);
+	UNITTEST(stats.skipped[SKIP_SIZE] == 1);
+	while (list_size(files) > 0) {
+		char *file = list_popfirst(files);
+		UNITTEST(strstr(file, "main.c") != NULL || strstr(file, "README") != NULL);
+		free(file);
+	}
+	list_destroy(files);
+
+	/* Text in any script is text, but control characters are not */
+	char *utf8 = "Größe: 日本語\ttab\r\n";
+	UNITTEST(sniff_file(utf8, strlen(utf8)) == SKIP_NONE);
+	UNITTEST(sniff_file("a\x01\x02\x03\x04b", 6) == SKIP_BINARY);
+	UNITTEST(sniff_file("// @generated\n", 14) == SKIP_GENERATED);
+	UNITTEST(sniff_file("", 0) == SKIP_NONE);
+	UNITTEST(sniff_name("x.tar.gz") == SKIP_EXTENSION && sniff_name("gz") == SKIP_NONE && sniff_name("main.js") == SKIP_NONE);
+
+	for (i = 0; i < 9; i++) {
+		snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+		unlink(path);
+	}
+	rmdir(sub);
+	rmdir(dir);
+}
+
+
+void crawler_test(void)
+{
+	char dir[] = "/tmp/crawler_testXXXXXX", path[128], target[128];
+	char *dirs[] = { "a", "a/b", "a/b/c", "d", ".hidden" };
+	enum { NUMDIRS = 5, FILES_PER_DIR = 50 };
+	int found[NUMDIRS - 1][FILES_PER_DIR] = {{0}};
+	int i, j, numfound = 0, others = 0;
+	find_stats_t stats;
+	crawler_t *crawler;
+	char *file;
+
+	UNITTEST(mkdtemp(dir) != NULL);
+	for (i = 0; i < NUMDIRS; i++) {
+		snprintf(path, sizeof(path), "%s/%s", dir, dirs[i]);
+		mkdir(path, 0700);
+		for (j = 0; j < FILES_PER_DIR; j++) {
+			snprintf(path, sizeof(path), "%s/%s/%d.txt", dir, dirs[i], j);
+			FILE *f = fopen(path, "w");
+			fclose(f);
+		}
+	}
+	/* A hidden file, a skipped one, a link to a file, and a loop */
+	snprintf(path, sizeof(path), "%s/.profile", dir);
+	fclose(fopen(path, "w"));
+	snprintf(path, sizeof(path), "%s/a/b/c/x.o", dir);
+	fclose(fopen(path, "w"));
+	snprintf(target, sizeof(target), "%s/d/0.txt", dir);
+	snprintf(path, sizeof(path), "%s/a/link.txt", dir);
+	UNITTEST(symlink(target, path) == 0);
+	snprintf(path, sizeof(path), "%s/a/b/c/up", dir);
+	UNITTEST(symlink(dir, path) == 0);
+
+	crawler = crawler_create(dir, 3);
+	UNITTEST(crawler != NULL);
+	while ((file = crawler_next(crawler)) != NULL) {
+		char *name = file + strlen(dir) + 1;
+		for (i = 0; i < NUMDIRS - 1; i++) {
+			size_t len = strlen(dirs[i]);
+			if (strncmp(name, dirs[i], len) == 0 && name[len] == '/' &&
+				sscanf(name + len + 1, "%d.txt", &j) == 1 && strchr(name + len + 1, '/') == NULL) {
+				found[i][j]++;
+				break;
+			}
+		}
+		if (i == NUMDIRS - 1) {
+			UNITTEST(strcmp(name, "a/link.txt") == 0);
+			others++;
+		}
+		numfound++;
+		free(file);
+	}
+	UNITTEST(crawler_next(crawler) == NULL);
+	for (i = 0; i < NUMDIRS - 1; i++) {
+		for (j = 0; j < FILES_PER_DIR; j++) {
+			UNITTEST(found[i][j] == 1);
+		}
+	}
+	UNITTEST(others == 1 && numfound == (NUMDIRS - 1) * FILES_PER_DIR + 1);
+	crawler_getstats(crawler, &stats);
+	UNITTEST(stats.files == numfound && stats.skipped[SKIP_EXTENSION] == 1);
+	crawler_destroy(crawler);
+
+	/* Stopping before the crawl is done */
+	crawler = crawler_create(dir, 2);
+	free(crawler_next(crawler));
+	crawler_destroy(crawler);
+	UNITTEST(crawler_create("/nonexistent/crawler_test", 1) == NULL);
+
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/a/link.txt", dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/a/b/c/x.o", dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/.profile", dir);
+	unlink(path);
+	for (i = NUMDIRS - 1; i >= 0; i--) {
+		for (j = 0; j < FILES_PER_DIR; j++) {
+			snprintf(path, sizeof(path), "%s/%s/%d.txt", dir, dirs[i], j);
+			unlink(path);
+		}
+		snprintf(path, sizeof(path), "%s/%s", dir, dirs[i]);
+		rmdir(path);
+	}
+	rmdir(dir);
+}
+
+
+/*
+ * Reads the files of the given directory with the given reader flags,
+ * and checks the text, or the reason to skip each one and its size.
+ */
+static void check_reader(char *dir, int flags, char **names, char **texts, size_t *sizes, enum skip_reason *reasons, int numfiles)
+{
+	int seen[16] = {0}, i;
+	enum skip_reason reason;
+	crawler_t *crawler = crawler_create(dir, 2);
+	reader_t *reader = reader_create(crawler, 4, flags);
+	char *path, *text;
+	size_t len;
+
+	UNITTEST(flags == READER_PREAD ? strcmp(reader_method(reader), "pread") == 0 : 1);
+	while ((path = reader_next(reader, &text, &len, &reason)) != NULL) {
+		for (i = 0; i < numfiles && strcmp(strrchr(path, '/') + 1, names[i]) != 0; i++) {
+		}
+		UNITTEST(i < numfiles);
+		seen[i]++;
+		UNITTEST(reason == reasons[i]);
+		if (reasons[i] == SKIP_NONE) {
+			UNITTEST(text != NULL && len == strlen(texts[i]) && strcmp(text, texts[i]) == 0);
+		} else {
+			UNITTEST(text == NULL && len == sizes[i]);
+		}
+		free(text);
+		free(path);
+	}
+	for (i = 0; i < numfiles; i++) {
+		UNITTEST(seen[i] == 1);
+	}
+	reader_destroy(reader);
+	crawler_destroy(crawler);
+
+	/* Stopping with files in flight */
+	crawler = crawler_create(dir, 2);
+	reader = reader_create(crawler, 4, flags);
+	path = reader_next(reader, &text, &len, &reason);
+	free(path);
+	free(text);
+	reader_destroy(reader);
+	crawler_destroy(crawler);
+}
+
+void reader_test(void)
+{
+	char dir[] = "/tmp/reader_testXXXXXX", path[64];
+	char *names[] = { "a.c", "empty", "big.c", "bin", "huge", "b.c", "c.c", "d.c", "e.c", "f.c", "bigbin" };
+	char *texts[] = { "int a;\n", "", NULL, "\x7f" "ELF\0", "", "b", "c\n", "d\n", "e\n", "f\n", NULL };
+	enum skip_reason reasons[] = { SKIP_NONE, SKIP_NONE, SKIP_NONE, SKIP_BINARY, SKIP_SIZE,
+								   SKIP_NONE, SKIP_NONE, SKIP_NONE, SKIP_NONE, SKIP_NONE, SKIP_BINARY };
+	enum { NUMFILES = 11, BIGLEN = 3 << 20 };
+	size_t sizes[NUMFILES];
+	char *big = malloc(BIGLEN + 1), *bigbin = malloc(BIGLEN);
+	int i;
+
+	/* Larger than a single read may return */
+	for (i = 0; i < BIGLEN; i++) {
+		big[i] = i % 64 == 63 ? '\n' : 'a' + i % 26;
+	}
+	big[BIGLEN] = '\0';
+	texts[2] = big;
+	/* Binary from its first block on, so only that block is read */
+	memcpy(bigbin, big, BIGLEN);
+	bigbin[100] = '\0';
+	texts[10] = bigbin;
+
+	UNITTEST(mkdtemp(dir) != NULL);
+	for (i = 0; i < NUMFILES; i++) {
+		snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+		FILE *f = fopen(path, "w");
+		sizes[i] = i == 3 ? 5 : i == 10 ? BIGLEN : strlen(texts[i]);
+		fwrite(texts[i], 1, sizes[i], f);
+		if (i == 4) {
+			ftruncate(fileno(f), MAX_FILE_SIZE + 1);
+			sizes[i] = MAX_FILE_SIZE + 1;
+		}
+		fclose(f);
+	}
+
+	check_reader(dir, 0, names, texts, sizes, reasons, NUMFILES);
+	check_reader(dir, READER_PREAD, names, texts, sizes, reasons, NUMFILES);
+
+	for (i = 0; i < NUMFILES; i++) {
+		snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+		unlink(path);
+	}
+	rmdir(dir);
+	free(big);
+	free(bigbin);
+}
+
+
+void remove_test(void)
+{
+	index_t *idx = index_create();
+	index_setpositional(idx, 1);
+
+	index_addpath(idx, strdup("dir/a"), list_from_sentence("out of memory"));
+	index_addpath(idx, strdup("dir/sub/b"), list_from_sentence("memory out of"));
+	index_addpath(idx, strdup("c"), list_from_sentence("we ran out of memory today"));
+	index_addpath(idx, strdup("dir2/d"), list_from_sentence("out of time"));
+	index_addpath(idx, strdup("e"), list_from_sentence("the time of memory out of memory"));
+	index_freeze(idx);
+
+	/* Removed documents stay in the postings, but queries leave them out */
+	UNITTEST(index_removepaths(idx, (char *[]){"dir/a", "nothing"}, 2) == 1);
+	index_freeze(idx);
+	UNITTEST(set_u32_contains(index_lookup(idx, "memory"), 0));
+	struct query after[] = {
+		{"\"out of memory\"", {"c", "e", ""}}, {"memory", {"dir/sub/b", "c", "e", ""}}, {"\"memory out of\"", {"dir/sub/b", "e", ""}},
+		{"out NEAR/1 time", {""}}, {"time", {"dir2/d", "e", ""}},
+		{NULL, {NULL}}
+	};
+	int i;
+	for (i = 0; after[i].q != NULL; i++) {
+		check_query(idx, &after[i]);
+	}
+	check_batch(idx, after);
+	check_ranked(idx, "out OR memory", 10, 4, (char *[]){"dir/sub/b", "e", "c", "dir2/d", ""});
+
+	/* Directories remove what is under them, but not their namesakes */
+	UNITTEST(index_removepaths(idx, (char *[]){"dir"}, 1) == 1);
+	UNITTEST(index_removepaths(idx, (char *[]){"dir", "dir/a"}, 2) == 0);
+	UNITTEST(index_removepaths(idx, (char *[]){"dir2/d"}, 1) == 1);
+	struct query removed[] = {
+		{"memory", {"c", "e", ""}}, {"time", {"e", ""}}, {"\"out of time\"", {""}}, {"today OR time", {"c", "e", ""}},
+		{NULL, {NULL}}
+	};
+	for (i = 0; removed[i].q != NULL; i++) {
+		check_query(idx, &removed[i]);
+	}
+	check_ranked(idx, "memory", 10, 2, (char *[]){"e", "c", ""});
+
+	/* A path comes back with a new id */
+	index_addpath(idx, strdup("dir/a"), list_from_sentence("out of time"));
+	index_freeze(idx);
+	UNITTEST(index_numdocs(idx) == 6);
+	struct query added[] = {
+		{"\"out of time\"", {"dir/a", ""}}, {"memory", {"c", "e", ""}},
+		{NULL, {NULL}}
+	};
+	for (i = 0; added[i].q != NULL; i++) {
+		check_query(idx, &added[i]);
+	}
+	check_ranked(idx, "time OR today", 10, 3, (char *[]){"c", "dir/a", "e", ""});
+
+	/* Words left in no document are gone once compacted */
+	UNITTEST(index_removepath(idx, "c") == 1);
+	index_freeze(idx);
+	check_suggest(idx, "to", 10, (char *[]){""});
+	UNITTEST(index_lookup(idx, "ran") == NULL);
+
+	/* Updates replace a document, and compaction moves the positions of the rest */
+	UNITTEST(index_updatepath(idx, strdup("e"), list_from_sentence("memory of time")) == 1);
+	UNITTEST(index_updatepath(idx, strdup("f"), list_from_sentence("out of memory")) == 0);
+	struct query updated[] = {
+		{"\"out of memory\"", {"f", ""}}, {"\"memory of time\"", {"e", ""}}, {"\"time of memory\"", {""}},
+		{"memory", {"e", "f", ""}}, {"time", {"dir/a", "e", ""}},
+		{NULL, {NULL}}
+	};
+	for (i = 0; updated[i].q != NULL; i++) {
+		check_query(idx, &updated[i]);
+	}
+	index_compact(idx);
+	UNITTEST(!set_u32_contains(index_lookup(idx, "memory"), 4));
+	index_freeze(idx);
+	for (i = 0; updated[i].q != NULL; i++) {
+		check_query(idx, &updated[i]);
+	}
+	check_ranked(idx, "time OR memory", 10, 3, (char *[]){"e", "dir/a", "f", ""});
+
+	index_destroy(idx);
+}
+
+
+/*
+ * Returns 1 if the given list of paths holds the given name in the
+ * given directory, or 0 otherwise.
+ */
+static int has_path(list_t *paths, char *dir, char *name)
+{
+	char path[128];
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	return list_contains(paths, path);
+}
+
+static void empty_paths(list_t *paths)
+{
+	while (list_size(paths) > 0) {
+		free(list_popfirst(paths));
+	}
+}
+
+void watcher_test(void)
+{
+	char dir[] = "/tmp/watcher_testXXXXXX", path[128], moved[64];
+	list_t *changed = list_create(compare_strings), *removed = list_create(compare_strings);
+	watcher_t *watcher;
+	FILE *f;
+
+	UNITTEST(mkdtemp(dir) != NULL);
+	snprintf(path, sizeof(path), "%s/old", dir);
+	mkdir(path, 0700);
+	watcher = watcher_create(dir, 50);
+	if (!UNITTEST(watcher != NULL)) {
+		return;
+	}
+	UNITTEST(watcher_wait(watcher, 0, changed, removed) == 0);
+
+	/* Files written, also in new directories, but not hidden or binary ones */
+	char *names[] = { "a.txt", ".hidden", "x.o", "old/b.txt", "new", "new/c.txt", "new/deeper", "new/deeper/d.txt" };
+	int i;
+	for (i = 0; i < 8; i++) {
+		snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+		if (strchr(names[i], '.') == NULL) {
+			mkdir(path, 0700);
+		} else {
+			f = fopen(path, "w");
+			fputs("text\n", f);
+			fclose(f);
+		}
+	}
+	UNITTEST(watcher_wait(watcher, 2000, changed, removed) == 4);
+	UNITTEST(list_size(changed) == 4 && list_size(removed) == 0);
+	UNITTEST(has_path(changed, dir, "a.txt") && has_path(changed, dir, "old/b.txt"));
+	UNITTEST(has_path(changed, dir, "new/c.txt") && has_path(changed, dir, "new/deeper/d.txt"));
+	empty_paths(changed);
+
+	/* Saved twice, then deleted, is deleted */
+	snprintf(path, sizeof(path), "%s/a.txt", dir);
+	fclose(fopen(path, "w"));
+	unlink(path);
+	/* Directories moved away are removed, and are no longer watched */
+	snprintf(path, sizeof(path), "%s/new", dir);
+	snprintf(moved, sizeof(moved), "%s.moved", dir);
+	rename(path, moved);
+	UNITTEST(watcher_wait(watcher, 2000, changed, removed) == 2);
+	UNITTEST(has_path(removed, dir, "a.txt") && has_path(removed, dir, "new"));
+	UNITTEST(list_size(changed) == 0);
+	empty_paths(removed);
+	snprintf(path, sizeof(path), "%s/deeper/d.txt", moved);
+	f = fopen(path, "w");
+	fclose(f);
+	UNITTEST(watcher_wait(watcher, 200, changed, removed) == 0);
+
+	watcher_destroy(watcher);
+	list_destroy(changed);
+	list_destroy(removed);
+
+	for (i = 7; i >= 0; i--) {
+		snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+		unlink(path);
+		rmdir(path);
+	}
+	for (i = 7; i >= 5; i--) {
+		snprintf(path, sizeof(path), "%s%s", moved, names[i] + 3);
+		unlink(path);
+		rmdir(path);
+	}
+	rmdir(moved);
+	snprintf(path, sizeof(path), "%s/old", dir);
+	rmdir(path);
+	rmdir(dir);
+}
+
+/*
+ * Checks that the given query finds the given paths in the given
+ * segmented index, in any order, or fails if there are none.
+ */
+static void check_segquery(segindex_t *si, char *query, char **ans)
+{
+	char *errmsg;
+	list_t *res = segindex_query(si, query, &errmsg);
+	int n;
+
+	if (ans[0] == NULL) {
+		UNITTEST(res == NULL && segindex_count(si, query, INT_MAX, &errmsg) == -1);
+		return;
+	}
+	if (!UNITTEST(res != NULL)) {
+		return;
+	}
+	for (n = 0; *ans[n] != '\0'; n++) {
+		if (!list_contains(res, ans[n])) {
+			fprintf(stderr, "segmented query: \"%s\" missing \"%s\"\n", query, ans[n]);
+		}
+	}
+	UNITTEST(list_size(res) == n);
+	UNITTEST(segindex_count(si, query, INT_MAX, &errmsg) == n);
+	UNITTEST(segindex_exists(si, query, &errmsg) == (n > 0));
+	empty_paths(res);
+	list_destroy(res);
+}
+
+struct seg_reader {
+	segindex_t *si;
+	int stop;
+	int ok;
+};
+
+/*
+ * Returns 1 if the given path is one of the documents added while the
+ * segments are read, or 0 if it is not, e.g. truncated.
+ */
+static int is_added_path(char *path)
+{
+	char *end;
+	long n;
+
+	if (strncmp(path, "dir/f", 5) != 0) {
+		return 0;
+	}
+	n = strtol(path + 5, &end, 10);
+	return end != path + 5 && *end == '\0' && n >= 0 && n < 60;
+}
+
+static void *read_segments(void *arg)
+{
+	struct seg_reader *r = arg;
+	char *errmsg;
+
+	r->ok = 1;
+	while (!__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE)) {
+		/* Documents come and go meanwhile, but every snapshot is whole */
+		list_t *res = segindex_query(r->si, "common", &errmsg);
+		if (res == NULL || list_size(res) > 60) {
+			r->ok = 0;
+			break;
+		}
+		while (list_size(res) > 0) {
+			char *path = list_popfirst(res);
+			r->ok &= is_added_path(path) && !list_contains(res, path);
+			free(path);
+		}
+		list_destroy(res);
+		res = segindex_query_ranked(r->si, "common OR rare", 5, NULL, &errmsg);
+		if (res == NULL) {
+			r->ok = 0;
+			break;
+		}
+		while (list_size(res) > 0) {
+			index_hit_t *hit = list_popfirst(res);
+			r->ok &= is_added_path(hit->path);
+			free(hit->path);
+			free(hit);
+		}
+		list_destroy(res);
+	}
+	return NULL;
+}
+
+void segindex_test(void)
+{
+	index_t *base = index_create();
+	qcache_stats_t stats;
+	char *errmsg, path[32], word[32];
+	int i;
+
+	index_setpositional(base, 1);
+	index_addpath(base, strdup("a"), list_from_sentence("out of memory mesh"));
+	index_addpath(base, strdup("b"), list_from_sentence("memory out of"));
+	index_addpath(base, strdup("c"), list_from_sentence("out of time"));
+	index_freeze(base);
+	index_setcachesize(base, 1 << 20);
+	segindex_t *si = segindex_create(base);
+	segindex_setflushwords(si, INT_MAX);
+
+	/* New and changed documents are found once flushed */
+	UNITTEST(segindex_updatepath(si, strdup("d"), list_from_sentence("time and mesh")) == 0);
+	UNITTEST(segindex_updatepath(si, strdup("a"), list_from_sentence("mesh of time")) == 1);
+	check_segquery(si, "time", (char *[]){"c", ""});
+	check_segquery(si, "\"out of memory\"", (char *[]){"a", ""});
+	segindex_flush(si);
+	UNITTEST(segindex_numsegments(si) == 2 && segindex_numdocs(si) == 4);
+	check_segquery(si, "time", (char *[]){"a", "c", "d", ""});
+	check_segquery(si, "\"out of memory\"", (char *[]){""});
+	check_segquery(si, "\"mesh of time\" OR memory", (char *[]){"a", "b", ""});
+	check_segquery(si, "(", (char *[]){NULL});
+
+	/* Removed documents are left out at once */
+	UNITTEST(segindex_removepaths(si, (char *[]){"b", "nothing"}, 2) == 1);
+	check_segquery(si, "memory", (char *[]){""});
+
+	/* Batches agree with one query at a time */
+	char *batch[] = {"time", "out OR mesh", "(", "mesh AND time"};
+	list_t *results[4];
+	char *errmsgs[4];
+	int counts[4], answers[] = {3, 3, -1, 2};
+	segindex_query_batch(si, batch, 4, results, errmsgs);
+	segindex_count_batch(si, batch, 4, counts, errmsgs);
+	for (i = 0; i < 4; i++) {
+		UNITTEST(counts[i] == answers[i]);
+		if (answers[i] < 0) {
+			UNITTEST(results[i] == NULL);
+		} else if (UNITTEST(results[i] != NULL && list_size(results[i]) == answers[i])) {
+			empty_paths(results[i]);
+			list_destroy(results[i]);
+		}
+	}
+
+	/* Suggestions count the documents of every segment */
+	list_t *words = segindex_suggest(si, "me", 2);
+	if (UNITTEST(list_size(words) == 2)) {
+		UNITTEST(strcmp(list_popfirst(words), "mesh") == 0);
+		UNITTEST(strcmp(list_popfirst(words), "memory") == 0);
+	}
+	list_destroy(words);
+	UNITTEST(segindex_cachestats(si, &stats) == 1 && stats.budget == 1 << 20);
+
+	/* Many small segments are merged while they are queried */
+	struct seg_reader r = { si, 0, 0 };
+	pthread_t thread;
+	pthread_create(&thread, NULL, read_segments, &r);
+	for (i = 0; i < 60; i++) {
+		snprintf(path, sizeof(path), "dir/f%d", i);
+		snprintf(word, sizeof(word), "common w%d", i);
+		segindex_updatepath(si, strdup(path), list_from_sentence(word));
+		segindex_flush(si);
+		UNITTEST(segindex_numsegments(si) <= MAX_SEGMENTS);
+		if (i % 3 == 2) {
+			/* Likely while a merge is running, and with a pass over the paths */
+			snprintf(path, sizeof(path), "dir/f%d", i - 1);
+			UNITTEST(segindex_removepaths(si, (char *[]){path, "gone/dir"}, 2) == 1);
+		}
+	}
+	__atomic_store_n(&r.stop, 1, __ATOMIC_RELEASE);
+	pthread_join(thread, NULL);
+	UNITTEST(r.ok);
+	segindex_waitmerges(si);
+	UNITTEST(segindex_numsegments(si) < 2 * MERGE_FACTOR);
+	UNITTEST(segindex_count(si, "common", INT_MAX, &errmsg) == 40);
+	UNITTEST(segindex_count(si, "w1 OR w4 OR w58", INT_MAX, &errmsg) == 0);
+	check_segquery(si, "w3 OR w57", (char *[]){"dir/f3", "dir/f57", ""});
+	check_segquery(si, "time", (char *[]){"a", "c", "d", ""});
+	UNITTEST(segindex_numdocs(si) == 43);
+
+	/* Merged segments score like one index with the same documents */
+	index_t *one = index_create();
+	index_addpath(one, strdup("x"), list_from_sentence("common rare rare"));
+	index_addpath(one, strdup("y"), list_from_sentence("common"));
+	index_addpath(one, strdup("z"), list_from_sentence("rare and more words"));
+	index_freeze(one);
+	segindex_t *merged = segindex_create(index_createlike(one));
+	segindex_setflushwords(merged, 1);
+	segindex_updatepath(merged, strdup("x"), list_from_sentence("common rare rare"));
+	segindex_updatepath(merged, strdup("y"), list_from_sentence("common"));
+	segindex_updatepath(merged, strdup("z"), list_from_sentence("rare and more words"));
+	segindex_flush(merged);
+	segindex_waitmerges(merged);
+	UNITTEST(segindex_numsegments(merged) == 1);
+	int n = -1, m = -1;
+	list_t *hits = segindex_query_ranked(merged, "common OR rare", 3, &n, &errmsg);
+	list_t *want = index_query_ranked(one, "common OR rare", 3, &m, &errmsg);
+	UNITTEST(n == 3 && m == 3);
+	while (UNITTEST(list_size(hits) == list_size(want)) && list_size(hits) > 0) {
+		index_hit_t *a = list_popfirst(hits), *b = list_popfirst(want);
+		UNITTEST(strcmp(a->path, b->path) == 0 && a->score == b->score);
+		free(a->path);
+		free(a);
+		free(b);
+	}
+	list_destroy(hits);
+	list_destroy(want);
+
+	index_destroy(one);
+	segindex_destroy(merged);
+	segindex_destroy(si);
 }
 
 int main(int argc, char **argv)
 {
 	index_test();
+	phrase_test();
+	ranked_test();
+	pruned_test();
+	cache_test();
+	costaware_test();
+	plan_test();
+	grep_test();
+	suggest_test();
+	tokenize_test();
+	casefold_test();
+	wordchars_test();
+	find_files_test();
+	crawler_test();
+	reader_test();
+	remove_test();
+	watcher_test();
+	segindex_test();
 
 	return 0;
 }
@@ -1,6 +1,14 @@
+#include "crawler.h"
 #include "index.h"
+#include "segindex.h"
 #include "httpd.h"
+#include "reader.h"
+#include "tokenizer.h"
+#include "watcher.h"
 
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,25 +18,51 @@
 enum {
 	TIME_ISO_LEN = 20,
 	DEFAULT_HTTP_PORT = 8080,
+	MAX_RESULTS = 100,	/* best ranked results shown per query */
+	DEFAULT_CACHE_MB = 64,	/* memory for each of the query caches */
 };
 
 static char *root;
-static index_t *the_index;
+static segindex_t *the_index;
 
-static void send_results(FILE *f, char *query, list_t *results)
+/*
+ * What the thread that applies changes in watch mode needs.
+ */
+typedef struct {
+    watcher_t *watcher;
+    tokenizer_t *tokenizer;
+    int trigrams;
+} watch_t;
+
+/*
+ * A changed file, read and tokenized, to be added to the index.
+ */
+typedef struct {
+    char *path;
+    char *text;
+    size_t len;
+    list_t *words;
+} update_t;
+
+static void send_results(FILE *f, char *query, list_t *results, int nummatches)
 {
     list_iter_t *it;
     int i = 1;
 
-    fprintf(f, "<hr/><h3>Your query for \"%s\" returned %d result(s)</h3>\n",
-            html_escape(query), list_size(results));
+    fprintf(f, "<hr/><h3>Your query for \"%s\" returned %d result(s)",
+            html_escape(query), nummatches);
+    if (nummatches > list_size(results)) {
+        fprintf(f, ", showing the best %d", list_size(results));
+    }
+    fprintf(f, "</h3>\n");
     it = list_createiter(results);
     while (list_hasnext(it)) {
-        char *path = list_next(it);
-        char *htmlpath = html_escape(path);
-        fprintf(f, "<p><b>%d.</b> <a href=\"/%s\">%s</a></p>\n",
-                i++, htmlpath, htmlpath);
+        index_hit_t *hit = list_next(it);
+        char *htmlpath = html_escape(hit->path);
+        fprintf(f, "<p><b>%d.</b> <a href=\"/%s\">%s</a> (%.2f)</p>\n",
+                i++, htmlpath, htmlpath, hit->score);
     }
+    list_destroyiter(it);
 }
 
 static void handle_query(FILE *f, char *query)
@@ -52,7 +86,8 @@ static void handle_query(FILE *f, char *query)
     fprintf(f, "</form>\n");
     if (strcmp(query, "") != 0) {
         char *errmsg;
-        list_t *results = index_query(the_index, query, &errmsg);
+        int nummatches;
+        list_t *results = segindex_query_ranked(the_index, query, MAX_RESULTS, &nummatches, &errmsg);
         if (results == NULL) {
             fprintf(f, "<hr/><h3>Error</h3>\n");
             fprintf(f, "<p>Your query for \"%s\" caused an error: <b>%s</b></p>\n",
@@ -61,8 +96,13 @@ static void handle_query(FILE *f, char *query)
 			printf(" -1 \"%s\"", errmsg);
         }
         else {
-			printf(" %d", list_size(results));
-            send_results(f, query, results);
+			printf(" %d", nummatches);
+            send_results(f, query, results, nummatches);
+            while (list_size(results) > 0) {
+                index_hit_t *hit = list_popfirst(results);
+                free(hit->path);
+                free(hit);
+            }
             list_destroy(results);
         }
     }
@@ -71,6 +111,223 @@ static void handle_query(FILE *f, char *query)
 	printf("\n");
 }
 
+/*
+ * Writes the given string as a JSON string literal.
+ */
+static void send_json_string(FILE *f, char *s)
+{
+    fputc('"', f);
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') {
+            fprintf(f, "\\%c", *s);
+        }
+        else if ((unsigned char)*s < 0x20) {
+            fprintf(f, "\\u%04x", *s);
+        }
+        else {
+            fputc(*s, f);
+        }
+    }
+    fputc('"', f);
+}
+
+/*
+ * Answers /api/count and /api/exists with {"count": n} or
+ * {"exists": true|false}, without building the list of results.
+ */
+static void handle_count(FILE *f, char *query, int exists)
+{
+    char *errmsg;
+    int count;
+
+    if (exists) {
+        count = segindex_exists(the_index, query, &errmsg);
+    }
+    else {
+        count = segindex_count(the_index, query, INT_MAX, &errmsg);
+    }
+
+    if (count < 0) {
+        http_badrequest(f, "application/json");
+        fprintf(f, "{\"error\": ");
+        send_json_string(f, errmsg);
+        fprintf(f, "}\n");
+        free(errmsg);
+    }
+    else {
+        http_ok(f, "application/json");
+        if (exists) {
+            fprintf(f, "{\"exists\": %s}\n", count > 0 ? "true" : "false");
+        }
+        else {
+            fprintf(f, "{\"count\": %d}\n", count);
+        }
+    }
+}
+
+/*
+ * Answers /api/batch, where q holds one query per line, with
+ * {"results": [...]} holding {"count": n} for each query, or
+ * {"count": n, "paths": [...]} if mode is "list", or {"error": ...}.
+ * The queries are evaluated together (see segindex_query_batch()).
+ */
+static void handle_batch(FILE *f, char *queries, char *mode)
+{
+    int list = strcmp(mode, "list") == 0;
+    int i, n = 1;
+    char *p;
+
+    for (p = queries; *p != '\0'; p++) {
+        n += *p == '\n';
+    }
+    char **batch = malloc(n * sizeof(char *));
+    char **errmsgs = malloc(n * sizeof(char *));
+    int *counts = malloc(n * sizeof(int));
+    list_t **results = malloc(n * sizeof(list_t *));
+    if (batch == NULL || errmsgs == NULL || counts == NULL || results == NULL) {
+        fatal_error("out of memory");
+    }
+    /* Split the lines in place, dropping any \r of \r\n */
+    for (i = 0, p = queries; i < n; i++) {
+        size_t len = strcspn(p, "\n");
+        batch[i] = p;
+        p += len;
+        if (*p == '\n') {
+            *p++ = '\0';
+        }
+        if (len > 0 && batch[i][len - 1] == '\r') {
+            batch[i][len - 1] = '\0';
+        }
+    }
+
+    if (list) {
+        segindex_query_batch(the_index, batch, n, results, errmsgs);
+    }
+    else {
+        segindex_count_batch(the_index, batch, n, counts, errmsgs);
+    }
+
+    http_ok(f, "application/json");
+    fprintf(f, "{\"results\": [");
+    for (i = 0; i < n; i++) {
+        fprintf(f, "%s\n  ", i > 0 ? "," : "");
+        if (list ? results[i] == NULL : counts[i] < 0) {
+            fprintf(f, "{\"error\": ");
+            send_json_string(f, errmsgs[i]);
+            fprintf(f, "}");
+            free(errmsgs[i]);
+        }
+        else if (list) {
+            fprintf(f, "{\"count\": %d, \"paths\": [", list_size(results[i]));
+            while (list_size(results[i]) > 0) {
+                char *path = list_popfirst(results[i]);
+                send_json_string(f, path);
+                fprintf(f, "%s", list_size(results[i]) > 0 ? ", " : "");
+                free(path);
+            }
+            fprintf(f, "]}");
+            list_destroy(results[i]);
+        }
+        else {
+            fprintf(f, "{\"count\": %d}", counts[i]);
+        }
+    }
+    fprintf(f, "\n]}\n");
+
+    free(batch);
+    free(errmsgs);
+    free(counts);
+    free(results);
+}
+
+/*
+ * Answers /api/grep, which finds the documents that contain the string
+ * q anywhere, or a match of q as a regular expression if re is "1"
+ * (see index_grep()), with {"count": n, "paths": [...]}.
+ */
+static void handle_grep(FILE *f, char *pattern, int regex)
+{
+    char *errmsg;
+    list_t *results = segindex_grep(the_index, pattern, regex, &errmsg);
+
+    if (results == NULL) {
+        http_badrequest(f, "application/json");
+        fprintf(f, "{\"error\": ");
+        send_json_string(f, errmsg);
+        fprintf(f, "}\n");
+        free(errmsg);
+        return;
+    }
+    http_ok(f, "application/json");
+    fprintf(f, "{\"count\": %d, \"paths\": [", list_size(results));
+    while (list_size(results) > 0) {
+        char *path = list_popfirst(results);
+        send_json_string(f, path);
+        fprintf(f, "%s", list_size(results) > 0 ? ", " : "");
+        free(path);
+    }
+    fprintf(f, "]}\n");
+    list_destroy(results);
+}
+
+/*
+ * Answers /api/suggest, which completes the prefix p to the at most n
+ * words (10 by default) in the most documents (see segindex_suggest()),
+ * with {"suggestions": [...]}.
+ */
+static void handle_suggest(FILE *f, char *prefix, int n)
+{
+    list_t *words = segindex_suggest(the_index, prefix, n);
+
+    http_ok(f, "application/json");
+    fprintf(f, "{\"suggestions\": [");
+    while (list_size(words) > 0) {
+        char *word = list_popfirst(words);
+        send_json_string(f, word);
+        fprintf(f, "%s", list_size(words) > 0 ? ", " : "");
+        free(word);
+    }
+    fprintf(f, "]}\n");
+    list_destroy(words);
+}
+
+/*
+ * Writes the counters of a cache as a JSON object, or null if the
+ * cache is off.
+ */
+static void send_cache_stats(FILE *f, qcache_stats_t *stats, int on)
+{
+    if (!on) {
+        fprintf(f, "null");
+        return;
+    }
+    fprintf(f, "{\"hits\": %ld, \"misses\": %ld, \"hit_rate\": %.3f, "
+            "\"evictions\": %ld, \"invalidations\": %ld, \"rejections\": %ld, "
+            "\"entries\": %d, \"bytes\": %zu, \"budget\": %zu}",
+            stats->hits, stats->misses,
+            stats->hits + stats->misses > 0 ? (double)stats->hits / (stats->hits + stats->misses) : 0.0,
+            stats->evictions, stats->invalidations, stats->rejections,
+            stats->entries, stats->bytes, stats->budget);
+}
+
+/*
+ * Answers /api/stats with the counters of the query caches.
+ */
+static void handle_stats(FILE *f)
+{
+    qcache_stats_t stats;
+    int on;
+
+    http_ok(f, "application/json");
+    fprintf(f, "{\"cache\": ");
+    on = segindex_cachestats(the_index, &stats);
+    send_cache_stats(f, &stats, on);
+    fprintf(f, ", \"subcache\": ");
+    on = segindex_subcachestats(the_index, &stats);
+    send_cache_stats(f, &stats, on);
+    fprintf(f, "}\n");
+}
+
 static void handle_page(FILE *f, char *path, char *query)
 {
     FILE *pagef = fopen(path, "r");
@@ -100,26 +357,161 @@ static int http_handler(char *path, map_t *header, map_t *args, FILE *f)
     if (strcmp(path, "/") == 0) {
         handle_query(f, query);
     }
+    else if (strcmp(path, "/api/count") == 0 || strcmp(path, "/api/exists") == 0) {
+        handle_count(f, map_haskey(args, "q") ? map_get(args, "q") : "",
+                     strcmp(path, "/api/exists") == 0);
+    }
+    else if (strcmp(path, "/api/batch") == 0) {
+        handle_batch(f, map_haskey(args, "q") ? map_get(args, "q") : "",
+                     map_haskey(args, "mode") ? map_get(args, "mode") : "count");
+    }
+    else if (strcmp(path, "/api/grep") == 0) {
+        handle_grep(f, map_haskey(args, "q") ? map_get(args, "q") : "",
+                    map_haskey(args, "re") && strcmp(map_get(args, "re"), "1") == 0);
+    }
+    else if (strcmp(path, "/api/suggest") == 0) {
+        handle_suggest(f, map_haskey(args, "p") ? map_get(args, "p") : "",
+                       map_haskey(args, "n") ? atoi(map_get(args, "n")) : MAX_SUGGESTIONS);
+    }
+    else if (strcmp(path, "/api/stats") == 0) {
+        handle_stats(f);
+    }
     else if(path[0] == '/') {
         handle_page(f, path+1, query);
     }
 	return 0;
 }
 
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Applies the changes to the files under the root to the index, a batch
+ * at a time, and flushes every batch into a new segment (see
+ * segindex.h), so queries never wait for it.
+ */
+static void *watch(void *arg)
+{
+    watch_t *w = arg;
+    list_t *changed = list_create(compare_strings);
+    list_t *removed = list_create(compare_strings);
+    list_t *updates = list_create(compare_pointers);
+    enum skip_reason reason;
+    int n, numpaths, numremoved, numadded, numupdated;
+    double start;
+
+    while ((n = watcher_wait(w->watcher, -1, changed, removed)) >= 0) {
+        char **paths = malloc((n + 1) * sizeof(char *));
+        if (paths == NULL) {
+            fatal_error("out of memory");
+        }
+        start = now();
+
+        /* Changed files that cannot be read any more are removed */
+        for (numpaths = 0; list_size(changed) > 0; ) {
+            update_t *update = malloc(sizeof(update_t));
+            if (update == NULL) {
+                fatal_error("out of memory");
+            }
+            update->path = list_popfirst(changed);
+            update->text = reader_readfile(update->path, &update->len, &reason);
+            if (update->text == NULL) {
+                if (reason == SKIP_NONE && errno != ENOENT) {
+                    perror(update->path);
+                }
+                paths[numpaths++] = update->path;
+                free(update);
+                continue;
+            }
+            update->words = list_create(compare_strings);
+            tokenizer_text(w->tokenizer, update->text, update->len, update->words);
+            list_addlast(updates, update);
+        }
+        while (list_size(removed) > 0) {
+            paths[numpaths++] = list_popfirst(removed);
+        }
+
+        numremoved = segindex_removepaths(the_index, paths, numpaths);
+        numadded = numupdated = 0;
+        while (list_size(updates) > 0) {
+            update_t *update = list_popfirst(updates);
+            if (segindex_updatepath(the_index, update->path, update->words)) {
+                numupdated++;
+            }
+            else {
+                numadded++;
+            }
+            if (w->trigrams) {
+                segindex_addtrigrams(the_index, update->text, update->len);
+            }
+            list_destroy(update->words);
+            free(update->text);
+            free(update);
+        }
+        segindex_flush(the_index);
+
+        printf("Updated the index in %.1f ms: %d files added, %d changed, %d removed, %d segments\n",
+               (now() - start) * 1000, numadded, numupdated, numremoved, segindex_numsegments(the_index));
+        fflush(stdout);
+        while (numpaths > 0) {
+            free(paths[--numpaths]);
+        }
+        free(paths);
+    }
+    perror("watcher_wait");
+    list_destroy(changed);
+    list_destroy(removed);
+    list_destroy(updates);
+    return NULL;
+}
+
 void usage_and_die(char *program)
 {
-	fprintf(stderr, "usage: %s [-p port] <root-dir>\n", program);
+	fprintf(stderr, "usage: %s [-p port] [-c cache-mb] [-s subcache-mb] [-N] [-t] [-i] [-a] [-w chars] [-j threads] [-P] [-W] <root-dir>\n", program);
+	fprintf(stderr, "  -c  megabytes of query results to cache (default %d, 0 disables)\n", DEFAULT_CACHE_MB);
+	fprintf(stderr, "  -s  megabytes of results of parts of queries to cache (default %d, 0 disables)\n", DEFAULT_CACHE_MB);
+	fprintf(stderr, "  -N  do not index word positions (disables phrase queries)\n");
+	fprintf(stderr, "  -t  index the trigrams of every file (enables /api/grep)\n");
+	fprintf(stderr, "  -i  fold words to lower case, in files and queries\n");
+	fprintf(stderr, "  -a  only ASCII letters and digits are part of words\n");
+	fprintf(stderr, "  -w  punctuation that is part of words (default \"%s\")\n", DEFAULT_WORD_CHARS);
+	fprintf(stderr, "  -j  threads that look for files (default %d)\n", DEFAULT_CRAWLER_THREADS);
+	fprintf(stderr, "  -P  read files with a pool of threads rather than io_uring\n");
+	fprintf(stderr, "  -W  watch the files, and update the index as they change\n");
 	exit(1);
 }
 
 int main(int argc, char **argv)
 {
     int status = 0;
-    list_t *files, *words;
-    list_iter_t *it;
-    FILE *f;
+    list_t *words;
+    crawler_t *crawler;
+    reader_t *reader;
+    watch_t w = { NULL, NULL, 0 };
+    pthread_t watch_thread;
+    tokenizer_t *tokenizer;
+    find_stats_t stats;
+    enum skip_reason reason;
+    int i, files = 0;
+    int skipped[NUM_SKIP_REASONS] = {0};
+    size_t len, skippedbytes[NUM_SKIP_REASONS] = {0};
+    char *path, *text;
+    index_t *base;
 
 	int port = DEFAULT_HTTP_PORT;
+	int positional = 1;
+	int trigrams = 0;
+	int tokenizerflags = 0;
+	char *wordchars = NULL;
+	int cache_mb = DEFAULT_CACHE_MB;
+	int subcache_mb = DEFAULT_CACHE_MB;
+	int threads = DEFAULT_CRAWLER_THREADS;
+	int readerflags = 0;
+	int watching = 0;
 
 	char *program = argv[0];
 	while (--argc > 0 && **(++argv) == '-') {
@@ -132,6 +524,56 @@ int main(int argc, char **argv)
 					usage_and_die(program);
 				}
 				break;
+			case 'c':
+				if (--argc > 0) {
+					cache_mb = atoi(*(++argv));
+				} else {
+					fprintf(stderr, "option \"-%c\" missing argument\n", (*argv)[1]);
+					usage_and_die(program);
+				}
+				break;
+			case 's':
+				if (--argc > 0) {
+					subcache_mb = atoi(*(++argv));
+				} else {
+					fprintf(stderr, "option \"-%c\" missing argument\n", (*argv)[1]);
+					usage_and_die(program);
+				}
+				break;
+			case 'N':
+				positional = 0;
+				break;
+			case 't':
+				trigrams = 1;
+				break;
+			case 'i':
+				tokenizerflags |= TOKENIZER_CASEFOLD;
+				break;
+			case 'a':
+				tokenizerflags |= TOKENIZER_ASCII;
+				break;
+			case 'w':
+				if (--argc > 0) {
+					wordchars = *(++argv);
+				} else {
+					fprintf(stderr, "option \"-%c\" missing argument\n", (*argv)[1]);
+					usage_and_die(program);
+				}
+				break;
+			case 'W':
+				watching = 1;
+				break;
+			case 'P':
+				readerflags |= READER_PREAD;
+				break;
+			case 'j':
+				if (--argc > 0) {
+					threads = atoi(*(++argv));
+				} else {
+					fprintf(stderr, "option \"-%c\" missing argument\n", (*argv)[1]);
+					usage_and_die(program);
+				}
+				break;
 			default:
 				fprintf(stderr, "invalid option \"%s\", relevant option character '%c'\n", *argv, (*argv)[1]);
 				usage_and_die(program);
@@ -143,29 +585,83 @@ int main(int argc, char **argv)
 		usage_and_die(program);
     }
     root = *argv;
-    files = find_files(root);
-    the_index = index_create();
+    if (watching) {
+        /* Before the crawl, so that no change is missed */
+        w.watcher = watcher_create(root, DEFAULT_WATCH_DELAY);
+        if (w.watcher == NULL) {
+            perror(root);
+            fatal_error("watcher_create() failed");
+        }
+    }
+    crawler = crawler_create(root, threads);
+    if (crawler == NULL) {
+        perror(root);
+        fatal_error("crawler_create() failed");
+    }
+    base = index_create();
+    index_setpositional(base, positional);
+    index_settrigrams(base, trigrams);
+    index_setcasefold(base, tokenizerflags & TOKENIZER_CASEFOLD);
+    tokenizer = tokenizer_create(tokenizerflags, wordchars);
+    index_settokenizer(base, tokenizer);
+    reader = reader_create(crawler, DEFAULT_READER_DEPTH, readerflags);
+    printf("Reading files with %s\n", reader_method(reader));
 
-    it = list_createiter(files);
-    while (list_hasnext(it)) {
-        char *path = list_next(it);
-        printf("Indexing %s\n", path);
-        f = fopen(path, "r");
-        if (f == NULL) {
-            perror("fopen");
-            fatal_error("fopen() failed");
+    /* Index files as they are read, while more are found and read */
+    while ((path = reader_next(reader, &text, &len, &reason)) != NULL) {
+        if (text == NULL) {
+            if (reason == SKIP_NONE) {
+                perror(path);
+            } else {
+                skipped[reason]++;
+                skippedbytes[reason] += len;
+            }
+            free(path);
+            continue;
         }
+        printf("Indexing %s\n", path);
         words = list_create(compare_strings);
-        tokenize_file(f, words);
-        index_addpath(the_index, path, words);
+        tokenizer_text(tokenizer, text, len, words);
+        index_addpath(base, path, words);
         list_destroy(words);
+        if (trigrams) {
+            index_addtrigrams(base, text, len);
+        }
+        free(text);
+        files++;
+    }
+    reader_destroy(reader);
+    crawler_getstats(crawler, &stats);
+    crawler_destroy(crawler);
+    skipped[SKIP_EXTENSION] = stats.skipped[SKIP_EXTENSION];
+
+    printf("Indexed %d files\n", files);
+    for (i = SKIP_NONE + 1; i < NUM_SKIP_REASONS; i++) {
+        if (skippedbytes[i] > 0) {
+            printf("Skipped %d files (%zu KB): %s\n", skipped[i], skippedbytes[i] >> 10, skip_reason_name(i));
+        } else if (skipped[i] > 0) {
+            printf("Skipped %d files: %s\n", skipped[i], skip_reason_name(i));
+        }
+    }
+    index_freeze(base);
+    index_setcachesize(base, (size_t)cache_mb << 20);
+    index_setsubcachesize(base, (size_t)subcache_mb << 20);
+    the_index = segindex_create(base);
+
+    if (watching) {
+        w.tokenizer = tokenizer;
+        w.trigrams = trigrams;
+        if (pthread_create(&watch_thread, NULL, watch, &w) != 0) {
+            fatal_error("pthread_create() failed");
+        }
+        printf("Watching %s for changes\n", root);
+    } else {
+        tokenizer_destroy(tokenizer);
     }
-    list_destroyiter(it);
-    list_destroy(files);
 
     printf("Serving queries on port %d\n", port);
 	status = http_server(port, http_handler);
-    index_destroy(the_index);
+    segindex_destroy(the_index);
 
     return status;
 }
@@ -0,0 +1,182 @@
+#include "common.h"
+#include "levenshtein.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Distances are capped at maxedits + 1, as anything larger makes no
+ * difference, so they fit in a byte.
+ */
+struct levenshtein {
+    unsigned char *word;
+    int len;
+    int maxedits;
+    int maxdepth;               /* Longest prefix that may be alive */
+    unsigned char *rows;        /* The state after each prefix */
+    int *chars;                 /* The character at each depth, or -1 */
+    unsigned char *alivenext;   /* Is the prefix one longer alive? */
+    unsigned char alphabet[256];/* The distinct characters of the word, sorted */
+    int alphabetsize;
+    int other;                  /* Some character that is not in the word */
+    unsigned char inword[256];  /* Is the character in the word? */
+    unsigned char *live;        /* Of each character after each prefix */
+};
+
+/*
+ * The entries of live, where the characters of the alphabet come first
+ * and all other characters, which behave the same, last.  The entries
+ * of a prefix are filled in as levenshtein_nextchar() needs them, and
+ * reset whenever the state after the prefix changes.
+ */
+enum { UNKNOWN, DEAD, ALIVE };
+
+levenshtein_t *levenshtein_create(char *word, int maxedits)
+{
+    levenshtein_t *lev = malloc(sizeof(levenshtein_t));
+    int i, c;
+
+    if (lev == NULL)
+        fatal_error("out of memory");
+    lev->len = strlen(word);
+    lev->word = (unsigned char *)strdup(word);
+    lev->maxedits = maxedits;
+    /* Longer prefixes need more than maxedits insertions */
+    lev->maxdepth = lev->len + maxedits;
+    lev->rows = malloc((lev->maxdepth + 2) * (lev->len + 1));
+    lev->chars = malloc((lev->maxdepth + 1) * sizeof(int));
+    lev->alivenext = malloc(lev->maxdepth + 1);
+    if (lev->word == NULL || lev->rows == NULL || lev->chars == NULL || lev->alivenext == NULL)
+        fatal_error("out of memory");
+    lev->chars[0] = -1;
+    memset(lev->inword, 0, sizeof(lev->inword));
+
+    for (i = 0; i <= lev->len; i++)
+        lev->rows[i] = i <= maxedits ? i : maxedits + 1;
+    for (i = 0; i < lev->len; i++)
+        lev->inword[lev->word[i]] = 1;
+    lev->alphabetsize = 0;
+    lev->other = -1;
+    for (c = 0; c < 256; c++) {
+        if (lev->inword[c]) {
+            lev->alphabet[lev->alphabetsize++] = c;
+        }
+        else if (lev->other < 0 && c > 0) {
+            lev->other = c;
+        }
+    }
+    lev->live = calloc((lev->maxdepth + 1) * (lev->alphabetsize + 1), 1);
+    if (lev->live == NULL)
+        fatal_error("out of memory");
+    return lev;
+}
+
+void levenshtein_destroy(levenshtein_t *lev)
+{
+    free(lev->word);
+    free(lev->rows);
+    free(lev->chars);
+    free(lev->alivenext);
+    free(lev->live);
+    free(lev);
+}
+
+static inline unsigned char min(unsigned char a, unsigned char b)
+{
+    return a < b ? a : b;
+}
+
+int levenshtein_step(levenshtein_t *lev, int depth, int c)
+{
+    int m = lev->len, n = lev->maxedits, cap = n + 1, live, j, lo, hi;
+    unsigned char *prev, *row;
+
+    if (depth >= lev->maxdepth)
+        return 0;
+    if (lev->chars[depth] == c)
+        return lev->alivenext[depth];
+    prev = lev->rows + depth * (m + 1);
+    row = prev + m + 1;
+    lev->chars[depth] = c;
+    /* Everything known about the longer prefixes is out of date */
+    lev->chars[depth + 1] = -1;
+    memset(lev->live + (depth + 1) * (lev->alphabetsize + 1), UNKNOWN, lev->alphabetsize + 1);
+
+    /* Only prefixes of the word within maxedits in length may be in reach */
+    lo = depth + 1 - n > 1 ? depth + 1 - n : 1;
+    hi = depth + 1 + n < m ? depth + 1 + n : m;
+    row[0] = min(prev[0] + 1, cap);
+    if (lo > 1)
+        row[lo - 1] = cap;
+    if (hi < m)
+        row[hi + 1] = cap;
+    live = row[0] < cap;
+    for (j = lo; j <= hi; j++) {
+        unsigned char d = min(prev[j - 1] + (lev->word[j - 1] != c), min(prev[j], row[j - 1]) + 1);
+        if (depth > 0 && j > 1 && lev->word[j - 2] == c && lev->word[j - 1] == lev->chars[depth - 1]) {
+            /* Swapped with the previous character */
+            d = min(d, prev[j - 2 - (m + 1)] + 1);
+        }
+        row[j] = min(d, cap);
+        live |= row[j] < cap;
+    }
+    lev->alivenext[depth] = live;
+    return live;
+}
+
+int levenshtein_accepts(levenshtein_t *lev, int depth)
+{
+    /* The distances past the band of the prefix are not kept up to date */
+    return depth <= lev->maxdepth && lev->len - depth <= lev->maxedits &&
+           lev->rows[depth * (lev->len + 1) + lev->len] <= lev->maxedits;
+}
+
+/*
+ * Returns 1 if the given character, which is the one at the given
+ * index of the alphabet or, past its end, some character that is not
+ * in the word, keeps the prefix of the given length alive.  Asks
+ * levenshtein_step() only the first time after the prefix changes.
+ */
+static int alive(levenshtein_t *lev, int depth, int i)
+{
+    unsigned char *live = lev->live + depth * (lev->alphabetsize + 1);
+
+    if (live[i] == UNKNOWN) {
+        int c = i < lev->alphabetsize ? lev->alphabet[i] : lev->other;
+        live[i] = c >= 0 && levenshtein_step(lev, depth, c) ? ALIVE : DEAD;
+    }
+    return live[i] == ALIVE;
+}
+
+int levenshtein_nextchar(levenshtein_t *lev, int depth, int c)
+{
+    int i, next = 256;
+
+    /* The smallest character after c that is not in the word, if alive */
+    for (i = c + 1; i < 256 && lev->inword[i]; i++)
+        ;
+    if (i < 256 && alive(lev, depth, lev->alphabetsize))
+        next = i;
+    /* Unless a character of the word comes first */
+    for (i = 0; i < lev->alphabetsize && lev->alphabet[i] < next; i++) {
+        if (lev->alphabet[i] > c && alive(lev, depth, i)) {
+            next = lev->alphabet[i];
+            break;
+        }
+    }
+    if (next == 256)
+        return -1;
+    levenshtein_step(lev, depth, next);
+    return next;
+}
+
+int levenshtein_matches(levenshtein_t *lev, char *s)
+{
+    int depth;
+
+    for (depth = 0; s[depth] != '\0'; depth++) {
+        if (!levenshtein_step(lev, depth, (unsigned char)s[depth]))
+            return 0;
+    }
+    return levenshtein_accepts(lev, depth);
+}
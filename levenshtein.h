@@ -0,0 +1,65 @@
+#ifndef LEVENSHTEIN_H
+#define LEVENSHTEIN_H
+
+/*
+ * The type of Levenshtein automata.  A Levenshtein automaton accepts
+ * the strings within a given number of edits of a given word, where an
+ * edit inserts, deletes or substitutes a character, or swaps two
+ * adjacent characters.
+ *
+ * The automaton is run over a string one character at a time, and
+ * keeps the state reached after each prefix of the string, which is
+ * the row of the edit distances between the prefix and every prefix
+ * of the word.  The state after a prefix only depends on the prefix,
+ * so moving on to a string that shares a prefix with the last one only
+ * computes the states past the shared prefix.  Once no extension of a
+ * prefix can be accepted, the prefix is dead, and the automaton tells
+ * the smallest character to put in place of the last one for which
+ * that is not so.  This is what makes it possible to walk a sorted
+ * dictionary while skipping every range of words that cannot match
+ * (see termdict_fuzzyiter()).
+ */
+struct levenshtein;
+typedef struct levenshtein levenshtein_t;
+
+/*
+ * Creates an automaton for the strings within the given number of
+ * edits of the given word.  The automaton keeps a copy of the word.
+ */
+levenshtein_t *levenshtein_create(char *word, int maxedits);
+
+/*
+ * Destroys the given automaton.
+ */
+void levenshtein_destroy(levenshtein_t *lev);
+
+/*
+ * Computes the state after the prefix of the given length followed by
+ * the given character, from the states of the prefix, which must have
+ * been computed already.  The state after the empty prefix always is.
+ * Returns 1 if the extended prefix is alive, or 0 if it is dead.
+ */
+int levenshtein_step(levenshtein_t *lev, int depth, int c);
+
+/*
+ * Returns 1 if the prefix of the given length, whose states must have
+ * been computed, is within the number of edits of the word, or 0
+ * otherwise.
+ */
+int levenshtein_accepts(levenshtein_t *lev, int depth);
+
+/*
+ * Returns the smallest character greater than the given one that keeps
+ * the prefix of the given length alive when it follows it, or -1 if
+ * there is none.  The state after the prefix followed by the returned
+ * character is computed as by levenshtein_step().
+ */
+int levenshtein_nextchar(levenshtein_t *lev, int depth, int c);
+
+/*
+ * Returns 1 if the given string is within the number of edits of the
+ * word, or 0 otherwise.
+ */
+int levenshtein_matches(levenshtein_t *lev, char *s);
+
+#endif
@@ -15,6 +15,15 @@ typedef struct map map_t;
  */
 map_t *map_create(cmpfunc_t cmpfunc, hashfunc_t hashfunc);
 
+/*
+ * Selects how the given map grows.  By default, all entries are moved
+ * to the bigger table at once, so the insert that triggers the resize
+ * takes time proportional to the size of the map.  In incremental mode,
+ * the old table is kept around and a few of its buckets are moved on
+ * each subsequent insert, which bounds the worst-case insert latency.
+ */
+void map_setincremental(map_t *map, int incremental);
+
 /*
  * Destroys the given map.  Subsequently accessing the map will lead
  * to undefined behavior.
@@ -0,0 +1,18 @@
+#ifndef MAP_STR_H
+#define MAP_STR_H
+
+#include "common.h"
+
+#include <string.h>
+
+/*
+ * Maps from strings to untyped values.  The map does not copy or free
+ * the key strings.  See tmap.h for the generated functions.
+ */
+#define TMAP_NAME map_str
+#define TMAP_KEY char *
+#define TMAP_HASH(k) hash_string(k)
+#define TMAP_EQ(a, b) (strcmp((a), (b)) == 0)
+#include "tmap.h"
+
+#endif
@@ -0,0 +1,478 @@
+#include "common.h"
+#include "postings.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Use a bitmap when there are at least this many sets, and they hold
+ * at least one id per 64 documents in total.
+ */
+#define BITMAP_MIN_SETS 8
+
+/*
+ * A position in one of the sets being merged.
+ */
+typedef struct {
+    uint32_t *elems;
+    int pos;
+    int size;
+} cursor_t;
+
+static void siftdown(cursor_t *heap, int n, int i)
+{
+    cursor_t tmp = heap[i];
+
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= n)
+            break;
+        if (child + 1 < n && heap[child + 1].elems[heap[child + 1].pos] < heap[child].elems[heap[child].pos])
+            child++;
+        if (tmp.elems[tmp.pos] <= heap[child].elems[heap[child].pos])
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = tmp;
+}
+
+/*
+ * Merges the sets with a heap of cursors.  The ids are appended to the
+ * given result set, or only counted if it is NULL, until there are
+ * limit of them.  Returns the number of distinct ids.
+ */
+static int heapunion(set_u32_t **sets, int numsets, set_u32_t *result, int limit)
+{
+    cursor_t *heap = malloc(numsets * sizeof(cursor_t));
+    uint32_t last = 0;
+    int i, n = 0, count = 0;
+
+    if (heap == NULL)
+        fatal_error("out of memory");
+    for (i = 0; i < numsets; i++) {
+        if (sets[i]->size > 0) {
+            heap[n].elems = sets[i]->elems;
+            heap[n].pos = 0;
+            heap[n].size = sets[i]->size;
+            n++;
+        }
+    }
+    for (i = n / 2 - 1; i >= 0; i--)
+        siftdown(heap, n, i);
+
+    while (n > 0 && count < limit) {
+        uint32_t doc = heap[0].elems[heap[0].pos];
+        if (count == 0 || last != doc) {
+            if (result != NULL)
+                result->elems[result->size++] = doc;
+            last = doc;
+            count++;
+        }
+        if (++heap[0].pos == heap[0].size)
+            heap[0] = heap[--n];
+        if (n > 0)
+            siftdown(heap, n, 0);
+    }
+    free(heap);
+    return count;
+}
+
+/*
+ * Merges the sets through a bitmap of numdocs bits.  The ids are
+ * appended to the given result set, or only counted with popcount if
+ * it is NULL.  Returns the number of distinct ids.
+ */
+static int bitmapunion(set_u32_t **sets, int numsets, uint32_t numdocs, set_u32_t *result)
+{
+    int numwords = (numdocs + 63) / 64;
+    uint64_t *bits = calloc(numwords, sizeof(uint64_t));
+    int i, j, w, count = 0;
+
+    if (bits == NULL)
+        fatal_error("out of memory");
+    for (i = 0; i < numsets; i++) {
+        for (j = 0; j < sets[i]->size; j++) {
+            uint32_t doc = sets[i]->elems[j];
+            bits[doc / 64] |= (uint64_t)1 << (doc % 64);
+        }
+    }
+
+    for (w = 0; w < numwords; w++) {
+        uint64_t word = bits[w];
+        if (result == NULL) {
+            count += __builtin_popcountll(word);
+            continue;
+        }
+        while (word != 0) {
+            result->elems[result->size++] = w * 64 + __builtin_ctzll(word);
+            word &= word - 1;
+        }
+    }
+    free(bits);
+    return result == NULL ? count : result->size;
+}
+
+postings_t *postings_create(int positional)
+{
+    postings_t *postings = calloc(1, sizeof(postings_t));
+
+    if (postings == NULL)
+        fatal_error("out of memory");
+    postings->docs = set_u32_create();
+    if (positional) {
+        postings->poscap = 16;
+        postings->positions = malloc(postings->poscap);
+        if (postings->positions == NULL)
+            fatal_error("out of memory");
+    }
+    return postings;
+}
+
+void postings_destroy(postings_t *postings)
+{
+    set_u32_destroy(postings->docs);
+    free(postings->freqs);
+    free(postings->posoffsets);
+    free(postings->blockmax);
+    free(postings->positions);
+    free(postings);
+}
+
+int postings_positional(postings_t *postings)
+{
+    return postings->positions != NULL;
+}
+
+/*
+ * Appends the given document, which must be larger than the last one,
+ * with no occurrences yet.
+ */
+static void add_doc(postings_t *postings, uint32_t doc)
+{
+    set_u32_t *docs = postings->docs;
+    int capacity = docs->capacity;
+
+    set_u32_add(docs, doc);
+    if (docs->capacity != capacity) {
+        postings->freqs = realloc(postings->freqs, docs->capacity * sizeof(uint32_t));
+        if (postings->freqs == NULL)
+            fatal_error("out of memory");
+        if (postings->positions != NULL) {
+            postings->posoffsets = realloc(postings->posoffsets, docs->capacity * sizeof(uint32_t));
+            if (postings->posoffsets == NULL)
+                fatal_error("out of memory");
+        }
+    }
+    postings->freqs[docs->size - 1] = 0;
+    if (postings->positions != NULL)
+        postings->posoffsets[docs->size - 1] = postings->poslen;
+}
+
+/*
+ * Makes room for the given number of bytes of positions.
+ */
+static void reserve_positions(postings_t *postings, size_t len)
+{
+    if (postings->poslen + len > postings->poscap) {
+        while (postings->poslen + len > postings->poscap)
+            postings->poscap *= 2;
+        postings->positions = realloc(postings->positions, postings->poscap);
+        if (postings->positions == NULL)
+            fatal_error("out of memory");
+    }
+}
+
+void postings_add(postings_t *postings, uint32_t doc, uint32_t position)
+{
+    set_u32_t *docs = postings->docs;
+    uint32_t delta;
+
+    if (docs->size == 0 || docs->elems[docs->size - 1] != doc) {
+        /* First occurrence in this document */
+        add_doc(postings, doc);
+        delta = position;
+    }
+    else {
+        delta = position - postings->lastpos;
+    }
+    postings->freqs[docs->size - 1]++;
+    if (postings->positions == NULL)
+        return;
+    postings->lastpos = position;
+
+    /* Append the delta as a varint of at most 5 bytes */
+    reserve_positions(postings, 5);
+    while (delta >= 0x80) {
+        postings->positions[postings->poslen++] = (delta & 0x7f) | 0x80;
+        delta >>= 7;
+    }
+    postings->positions[postings->poslen++] = delta;
+}
+
+int postings_remove(postings_t *postings, set_u32_t *docs)
+{
+    set_u32_t *own = postings->docs;
+    size_t poslen = 0, start, end;
+    int i, j = 0, n = 0, removed;
+
+    for (i = 0; i < own->size; i++) {
+        j = set_u32_seek(docs, j, own->elems[i]);
+        if (j < docs->size && docs->elems[j] == own->elems[i])
+            continue;
+        if (postings->positions != NULL) {
+            /* Each document's deltas start from 0, so they move as they are */
+            start = postings->posoffsets[i];
+            end = i + 1 < own->size ? postings->posoffsets[i + 1] : postings->poslen;
+            memmove(postings->positions + poslen, postings->positions + start, end - start);
+            postings->posoffsets[n] = poslen;
+            poslen += end - start;
+        }
+        own->elems[n] = own->elems[i];
+        postings->freqs[n] = postings->freqs[i];
+        n++;
+    }
+
+    removed = own->size - n;
+    if (removed > 0) {
+        own->size = n;
+        if (postings->positions != NULL)
+            postings->poslen = poslen;
+        free(postings->blockmax);
+        postings->blockmax = NULL;
+        postings->maxscore = 0;
+    }
+    return removed;
+}
+
+int postings_append(postings_t *postings, postings_t *src, uint32_t *docmap)
+{
+    set_u32_t *docs = src->docs;
+    size_t start, end;
+    int i, n = 0;
+
+    for (i = 0; i < docs->size; i++) {
+        uint32_t doc = docmap[docs->elems[i]];
+        if (doc == UINT32_MAX)
+            continue;
+        add_doc(postings, doc);
+        postings->freqs[postings->docs->size - 1] = src->freqs[i];
+        if (postings->positions != NULL) {
+            /* Each document's deltas start from 0, so they are copied as they are */
+            start = src->posoffsets[i];
+            end = i + 1 < docs->size ? src->posoffsets[i + 1] : src->poslen;
+            reserve_positions(postings, end - start);
+            memcpy(postings->positions + postings->poslen, src->positions + start, end - start);
+            postings->poslen += end - start;
+        }
+        n++;
+    }
+    return n;
+}
+
+void postings_positer(postings_t *postings, int i, positer_t *iter)
+{
+    iter->next = postings->positions + postings->posoffsets[i];
+    if (i + 1 < postings->docs->size)
+        iter->end = postings->positions + postings->posoffsets[i + 1];
+    else
+        iter->end = postings->positions + postings->poslen;
+    iter->position = 0;
+}
+
+/*
+ * Returns 1 if the words occur next to each other in the document at
+ * the given positions of their posting lists.
+ */
+static int phrasematch(postings_t **words, int *pos, int numwords,
+                       positer_t *iters, uint32_t *current)
+{
+    uint32_t first, next;
+    int k;
+
+    for (k = 0; k < numwords; k++) {
+        postings_positer(words[k], pos[k], &iters[k]);
+        if (k > 0 && !positer_next(&iters[k], &current[k]))
+            return 0;
+    }
+    /* Every iterator only ever moves forward */
+    while (positer_next(&iters[0], &first)) {
+        for (k = 1; k < numwords; k++) {
+            while (current[k] < first + k) {
+                if (!positer_next(&iters[k], &next))
+                    return 0;
+                current[k] = next;
+            }
+            if (current[k] != first + k)
+                break;
+        }
+        if (k == numwords)
+            return 1;
+    }
+    return 0;
+}
+
+set_u32_t *postings_phrase(postings_t **words, int numwords)
+{
+    set_u32_t *result = set_u32_create();
+    int *pos = calloc(numwords, sizeof(int));
+    positer_t *iters = malloc(numwords * sizeof(positer_t));
+    uint32_t *current = malloc(numwords * sizeof(uint32_t));
+    int k, matched;
+    uint32_t doc;
+
+    if (pos == NULL || iters == NULL || current == NULL)
+        fatal_error("out of memory");
+    if (numwords == 0 || words[0]->docs->size == 0)
+        goto out;
+
+    /* Leapfrog over the document ids until all words agree on one */
+    doc = words[0]->docs->elems[0];
+    for (;;) {
+        matched = 1;
+        for (k = 0; k < numwords; k++) {
+            set_u32_t *docs = words[k]->docs;
+            pos[k] = set_u32_seek(docs, pos[k], doc);
+            if (pos[k] == docs->size)
+                goto out;
+            if (docs->elems[pos[k]] != doc) {
+                doc = docs->elems[pos[k]];
+                matched = 0;
+                break;
+            }
+        }
+        if (!matched)
+            continue;
+
+        if (phrasematch(words, pos, numwords, iters, current))
+            set_u32_add(result, doc);
+        if (++pos[0] == words[0]->docs->size)
+            goto out;
+        doc = words[0]->docs->elems[pos[0]];
+    }
+
+out:
+    free(pos);
+    free(iters);
+    free(current);
+    return result;
+}
+
+/*
+ * Returns 1 if the two words occur at most the given distance apart in
+ * the document at the given positions of their posting lists.
+ */
+static int nearmatch(postings_t *a, int ia, postings_t *b, int ib, uint32_t distance)
+{
+    positer_t ita, itb;
+    uint32_t pa, pb;
+
+    postings_positer(a, ia, &ita);
+    if (a == b) {
+        /* Two different occurrences of the same word */
+        if (!positer_next(&ita, &pa))
+            return 0;
+        while (positer_next(&ita, &pb)) {
+            if (pb - pa <= distance)
+                return 1;
+            pa = pb;
+        }
+        return 0;
+    }
+
+    postings_positer(b, ib, &itb);
+    if (!positer_next(&ita, &pa) || !positer_next(&itb, &pb))
+        return 0;
+
+    /* The closest pair is found by always advancing the smaller position */
+    for (;;) {
+        if (pa <= pb) {
+            if (pb - pa <= distance)
+                return 1;
+            if (!positer_next(&ita, &pa))
+                return 0;
+        }
+        else {
+            if (pa - pb <= distance)
+                return 1;
+            if (!positer_next(&itb, &pb))
+                return 0;
+        }
+    }
+}
+
+set_u32_t *postings_near(postings_t *a, postings_t *b, uint32_t distance)
+{
+    set_u32_t *result = set_u32_create();
+    int ia = 0, ib = 0;
+
+    while (ia < a->docs->size && ib < b->docs->size) {
+        uint32_t da = a->docs->elems[ia], db = b->docs->elems[ib];
+        if (da < db) {
+            ia = set_u32_seek(a->docs, ia, db);
+        }
+        else if (da > db) {
+            ib = set_u32_seek(b->docs, ib, da);
+        }
+        else {
+            if (nearmatch(a, ia, b, ib, distance))
+                set_u32_add(result, da);
+            ia++;
+            ib++;
+        }
+    }
+    return result;
+}
+
+set_u32_t *postings_union(set_u32_t **sets, int numsets, uint32_t numdocs)
+{
+    set_u32_t *result;
+    long total = 0;
+    int i;
+
+    if (numsets == 0)
+        return set_u32_create();
+    if (numsets == 1)
+        return set_u32_copy(sets[0]);
+    if (numsets == 2)
+        return set_u32_union(sets[0], sets[1]);
+
+    for (i = 0; i < numsets; i++)
+        total += sets[i]->size;
+    result = set_u32_create();
+    set_u32_reserve(result, total < numdocs ? total : numdocs);
+    if (numsets >= BITMAP_MIN_SETS && total >= numdocs / 64)
+        bitmapunion(sets, numsets, numdocs, result);
+    else
+        heapunion(sets, numsets, result, INT_MAX);
+    return result;
+}
+
+int postings_unionsize(set_u32_t **sets, int numsets, uint32_t numdocs, int limit)
+{
+    long total = 0;
+    int i, count;
+
+    for (i = 0; i < numsets; i++) {
+        /* The union is at least as large as any of the sets */
+        if (sets[i]->size >= limit)
+            return limit;
+        total += sets[i]->size;
+    }
+    if (numsets == 0)
+        return 0;
+    if (numsets == 1)
+        return sets[0]->size;
+    if (numsets == 2) {
+        count = total - set_u32_intersectionsize(sets[0], sets[1], INT_MAX);
+        return count < limit ? count : limit;
+    }
+
+    if (numsets >= BITMAP_MIN_SETS && total >= numdocs / 64) {
+        count = bitmapunion(sets, numsets, numdocs, NULL);
+        return count < limit ? count : limit;
+    }
+    return heapunion(sets, numsets, NULL, limit);
+}
@@ -0,0 +1,152 @@
+#ifndef POSTINGS_H
+#define POSTINGS_H
+
+#include "set_u32.h"
+
+#include <stddef.h>
+
+/*
+ * The number of consecutive documents of a posting list that share a
+ * score bound (see rank_setbounds()).
+ */
+#define POSTINGS_BLOCK 64
+
+/*
+ * The type of posting lists.  A posting list holds the ids of the
+ * documents that contain a word, the number of times the word occurs
+ * in each of them and, optionally, the positions of the word within
+ * each document.
+ *
+ * The positions of each document are stored as differences between
+ * consecutive positions, encoded as variable length integers with 7
+ * bits per byte, so the positions of one document can be decoded
+ * without touching those of any other.
+ */
+typedef struct {
+    set_u32_t *docs;            /* Ids of the documents, in increasing order */
+    uint32_t *freqs;            /* Occurrences of the word in each document */
+    uint32_t *posoffsets;       /* Offset in positions of each document's positions */
+    unsigned char *positions;   /* Delta encoded positions, or NULL */
+    size_t poslen;
+    size_t poscap;
+    uint32_t lastpos;           /* Last position added to the last document */
+    float *blockmax;            /* Score bound of each block of documents, or NULL */
+    float maxscore;             /* Largest of the block bounds */
+} postings_t;
+
+/*
+ * Creates a new, empty posting list, which stores positions if the
+ * given flag is set.
+ */
+postings_t *postings_create(int positional);
+
+/*
+ * Destroys the given posting list.
+ */
+void postings_destroy(postings_t *postings);
+
+/*
+ * Returns 1 if the given posting list stores positions, 0 otherwise.
+ */
+int postings_positional(postings_t *postings);
+
+/*
+ * Records an occurrence of the word at the given position in the given
+ * document.  Documents must be added in increasing order of id, and
+ * the positions within a document in increasing order.
+ */
+void postings_add(postings_t *postings, uint32_t doc, uint32_t position);
+
+/*
+ * Removes the documents with the ids in the given set from the given
+ * posting list, along with their positions, in one pass over the list.
+ * Returns the number of documents removed.  The score bounds are
+ * dropped, since the blocks shift (see rank_setbounds()).
+ */
+int postings_remove(postings_t *postings, set_u32_t *docs);
+
+/*
+ * Appends the documents of the given src posting list to the given
+ * posting list under new ids, along with their occurrences and
+ * positions, which are copied without decoding them.  docmap maps the
+ * ids of src to the new ids, or to UINT32_MAX for documents to leave
+ * out.  The new ids must increase, and be larger than those already in
+ * the list, and both lists must store positions, or neither.  Returns
+ * the number of documents appended.
+ */
+int postings_append(postings_t *postings, postings_t *src, uint32_t *docmap);
+
+/*
+ * The type of position iterators, which decode the positions of one
+ * document in a posting list.
+ */
+typedef struct {
+    const unsigned char *next;
+    const unsigned char *end;
+    uint32_t position;
+} positer_t;
+
+/*
+ * Initializes the given iterator to decode the positions of the i'th
+ * document (not document id) of the given positional posting list.
+ */
+void postings_positer(postings_t *postings, int i, positer_t *iter);
+
+/*
+ * Assigns the next position to the given pointer and returns 1, or
+ * returns 0 if there are no more positions.
+ */
+static inline int positer_next(positer_t *iter, uint32_t *position)
+{
+    uint32_t delta = 0;
+    int shift = 0;
+    unsigned char b;
+
+    if (iter->next >= iter->end)
+        return 0;
+    do {
+        b = *iter->next++;
+        delta |= (uint32_t)(b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    iter->position += delta;
+    *position = iter->position;
+    return 1;
+}
+
+/*
+ * Returns the ids of the documents where the given words occur next to
+ * each other, in the given order.  The posting lists must be
+ * positional.  Documents that contain all the words are found first,
+ * and only their positions are decoded.
+ */
+set_u32_t *postings_phrase(postings_t **words, int numwords);
+
+/*
+ * Returns the ids of the documents where the two words occur at most
+ * the given distance apart, in either order.  The posting lists must
+ * be positional.  For each document that contains both words, the two
+ * position lists are merged until the first close enough pair.
+ */
+set_u32_t *postings_near(postings_t *a, postings_t *b, uint32_t distance);
+
+/*
+ * Returns the union of the given number of sets of document ids, where
+ * all ids are smaller than numdocs.  The sets are not modified.
+ *
+ * Few or sparse sets are merged with a heap of cursors, in time
+ * proportional to the total size of the sets times the logarithm of
+ * their number.  Many dense sets are merged through a bitmap of
+ * numdocs bits, in time proportional to the total size plus numdocs/64.
+ */
+set_u32_t *postings_union(set_u32_t **sets, int numsets, uint32_t numdocs);
+
+/*
+ * Returns the size of the union of the given sets like
+ * postings_union(), but without building it: the bitmap is counted
+ * with popcount, and the heap merge only counts distinct ids.  Stops
+ * early and returns limit once the union has at least limit ids.
+ */
+int postings_unionsize(set_u32_t **sets, int numsets, uint32_t numdocs, int limit);
+
+#endif
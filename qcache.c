@@ -0,0 +1,425 @@
+#include "common.h"
+#include "map_str.h"
+#include "qcache.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The entries are kept both in a hash map, for lookups, and in a doubly
+ * linked list in order of use, with the most recently used first, so
+ * the entry to evict from an LRU cache is always the last one.
+ *
+ * A cost-aware cache also keeps its entries in a binary min-heap ordered
+ * by priority, which is the entry's worth plus the cache's clock when it
+ * was last used.  Evicting an entry moves the clock up to its priority,
+ * so what entries have left of their worth (their priority minus the
+ * clock) shrinks as others are evicted, and an entry that is not asked
+ * for again is eventually evicted however much it once cost (this is
+ * the GreedyDual policy).  Finding victims thus takes a logarithmic
+ * time rather than a pass over every entry.
+ */
+typedef struct entry entry_t;
+
+struct entry {
+    char *query;
+    set_u32_t *docs;
+    size_t bytes;
+    double cost;            /* Of computing the documents */
+    long uses;
+    double priority;        /* Worth plus the clock when last used */
+    int heappos;            /* In the heap (cost-aware only) */
+    entry_t *prev;
+    entry_t *next;
+};
+
+struct qcache {
+    pthread_mutex_t lock;
+    map_str_t *map;         /* query -> entry_t */
+    entry_t *first;         /* Most recently used */
+    entry_t *last;          /* Least recently used */
+    uint64_t generation;    /* Of every entry */
+    int costaware;
+    entry_t **heap;         /* Ordered by priority (cost-aware only) */
+    int heapsize;
+    int heapcap;
+    double clock;           /* Priority of the last entry evicted */
+    map_str_t *missed;      /* query -> number of misses (cost-aware only) */
+    qcache_stats_t stats;
+};
+
+/*
+ * The number of missed queries a cost-aware cache remembers.  When
+ * there are more, it forgets them all and starts over.
+ */
+#define MAX_MISSED 4096
+
+qcache_t *qcache_create(size_t budget)
+{
+    qcache_t *cache = calloc(1, sizeof(qcache_t));
+
+    if (cache == NULL)
+        fatal_error("out of memory");
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->map = map_str_create();
+    cache->stats.budget = budget;
+    return cache;
+}
+
+qcache_t *qcache_createcostaware(size_t budget)
+{
+    qcache_t *cache = qcache_create(budget);
+
+    cache->costaware = 1;
+    cache->missed = map_str_create();
+    return cache;
+}
+
+static double worth(entry_t *e)
+{
+    return e->cost * e->uses;
+}
+
+static void forget_missed(qcache_t *cache)
+{
+    map_str_iter_t *it = map_str_createiter(cache->missed);
+
+    while (map_str_hasnext(it))
+        free(map_str_next(it)->key);
+    map_str_destroyiter(it);
+    map_str_destroy(cache->missed);
+    cache->missed = map_str_create();
+}
+
+static int missed(qcache_t *cache, char *query)
+{
+    return (int)(intptr_t)map_str_get(cache->missed, query);
+}
+
+static void add_missed(qcache_t *cache, char *query)
+{
+    char *key;
+    int n = missed(cache, query);
+
+    if (n > 0) {
+        map_str_put(cache->missed, query, (void *)(intptr_t)(n + 1));
+        return;
+    }
+    if (map_str_size(cache->missed) >= MAX_MISSED)
+        forget_missed(cache);
+    key = strdup(query);
+    if (key == NULL)
+        fatal_error("out of memory");
+    map_str_put(cache->missed, key, (void *)(intptr_t)1);
+}
+
+static void unlink_entry(qcache_t *cache, entry_t *e)
+{
+    if (e->prev != NULL)
+        e->prev->next = e->next;
+    else
+        cache->first = e->next;
+    if (e->next != NULL)
+        e->next->prev = e->prev;
+    else
+        cache->last = e->prev;
+}
+
+static void link_first(qcache_t *cache, entry_t *e)
+{
+    e->prev = NULL;
+    e->next = cache->first;
+    if (cache->first != NULL)
+        cache->first->prev = e;
+    else
+        cache->last = e;
+    cache->first = e;
+}
+
+static void heap_set(qcache_t *cache, int pos, entry_t *e)
+{
+    cache->heap[pos] = e;
+    e->heappos = pos;
+}
+
+static void sift_up(qcache_t *cache, int pos)
+{
+    entry_t *e = cache->heap[pos];
+
+    while (pos > 0 && cache->heap[(pos - 1) / 2]->priority > e->priority) {
+        heap_set(cache, pos, cache->heap[(pos - 1) / 2]);
+        pos = (pos - 1) / 2;
+    }
+    heap_set(cache, pos, e);
+}
+
+static void sift_down(qcache_t *cache, int pos)
+{
+    entry_t *e = cache->heap[pos];
+    int child;
+
+    while ((child = 2 * pos + 1) < cache->heapsize) {
+        if (child + 1 < cache->heapsize &&
+            cache->heap[child + 1]->priority < cache->heap[child]->priority)
+            child++;
+        if (cache->heap[child]->priority >= e->priority)
+            break;
+        heap_set(cache, pos, cache->heap[child]);
+        pos = child;
+    }
+    heap_set(cache, pos, e);
+}
+
+static void heap_push(qcache_t *cache, entry_t *e)
+{
+    if (cache->heapsize == cache->heapcap) {
+        cache->heapcap = cache->heapcap > 0 ? 2 * cache->heapcap : 16;
+        cache->heap = realloc(cache->heap, cache->heapcap * sizeof(entry_t *));
+        if (cache->heap == NULL)
+            fatal_error("out of memory");
+    }
+    heap_set(cache, cache->heapsize++, e);
+    sift_up(cache, e->heappos);
+}
+
+/*
+ * Removes the given entry from the heap.  The slot just past the heap
+ * is left holding the entry, which worth_admitting() relies on.
+ */
+static void heap_remove(qcache_t *cache, entry_t *e)
+{
+    int pos = e->heappos;
+    entry_t *last = cache->heap[--cache->heapsize];
+
+    if (last != e) {
+        heap_set(cache, pos, last);
+        sift_down(cache, pos);
+        sift_up(cache, last->heappos);
+        cache->heap[cache->heapsize] = e;
+    }
+}
+
+static void drop(qcache_t *cache, entry_t *e)
+{
+    unlink_entry(cache, e);
+    if (cache->costaware)
+        heap_remove(cache, e);
+    map_str_remove(cache->map, e->query);
+    cache->stats.entries--;
+    cache->stats.bytes -= e->bytes;
+    free(e->query);
+    set_u32_destroy(e->docs);
+    free(e);
+}
+
+/*
+ * Returns the entry to evict next, which is the least recently used one
+ * or, in a cost-aware cache, the one with the lowest priority.  Returns
+ * NULL if there is none.
+ */
+static entry_t *next_victim(qcache_t *cache)
+{
+    if (!cache->costaware)
+        return cache->last;
+    return cache->heapsize > 0 ? cache->heap[0] : NULL;
+}
+
+/*
+ * Evicts entries until the given number of bytes more fit in the budget.
+ */
+static void make_room(qcache_t *cache, size_t bytes)
+{
+    entry_t *e;
+
+    while (cache->stats.bytes + bytes > cache->stats.budget && (e = next_victim(cache)) != NULL) {
+        if (cache->costaware)
+            cache->clock = e->priority;
+        drop(cache, e);
+        cache->stats.evictions++;
+    }
+}
+
+/*
+ * Returns 1 if what the entries that would be evicted to make room for
+ * the given number of bytes have left of their worth is less than the
+ * given worth together, or 0 otherwise.  The victims are taken off the
+ * heap in order, into the slots just past it, and put back afterwards,
+ * so this only visits the entries that would be evicted.
+ */
+static int worth_admitting(qcache_t *cache, size_t bytes, double value)
+{
+    int end = cache->heapsize;
+    size_t freed = 0;
+    double lost = 0;
+    entry_t *e;
+    int admit = 1;
+
+    while (cache->stats.bytes - freed + bytes > cache->stats.budget && (e = next_victim(cache)) != NULL) {
+        heap_remove(cache, e);
+        freed += e->bytes;
+        lost += e->priority - cache->clock;
+        if (lost >= value) {
+            admit = 0;
+            break;
+        }
+    }
+    while (cache->heapsize < end)
+        heap_push(cache, cache->heap[cache->heapsize]);
+    return admit;
+}
+
+/*
+ * Drops every entry if the given generation is newer than theirs.
+ * Returns 0 if the generation is older, so the caller's results are
+ * already out of date, or 1 otherwise.
+ */
+static int check_generation(qcache_t *cache, uint64_t generation)
+{
+    if (generation < cache->generation)
+        return 0;
+    if (generation > cache->generation) {
+        cache->stats.invalidations += cache->stats.entries;
+        while (cache->last != NULL)
+            drop(cache, cache->last);
+        if (cache->costaware)
+            forget_missed(cache);
+        cache->clock = 0;
+        cache->generation = generation;
+    }
+    return 1;
+}
+
+void qcache_destroy(qcache_t *cache)
+{
+    while (cache->last != NULL)
+        drop(cache, cache->last);
+    map_str_destroy(cache->map);
+    if (cache->costaware) {
+        forget_missed(cache);
+        map_str_destroy(cache->missed);
+        free(cache->heap);
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+void qcache_setbudget(qcache_t *cache, size_t budget)
+{
+    pthread_mutex_lock(&cache->lock);
+    cache->stats.budget = budget;
+    make_room(cache, 0);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+set_u32_t *qcache_get(qcache_t *cache, char *query, uint64_t generation)
+{
+    set_u32_t *docs = NULL;
+    entry_t *e = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    if (check_generation(cache, generation))
+        e = map_str_get(cache->map, query);
+    if (e != NULL) {
+        unlink_entry(cache, e);
+        link_first(cache, e);
+        docs = set_u32_copy(e->docs);
+        e->uses++;
+        if (cache->costaware) {
+            /* Worth it again, as of now */
+            e->priority = cache->clock + worth(e);
+            sift_down(cache, e->heappos);
+        }
+        cache->stats.hits++;
+    }
+    else {
+        if (cache->costaware && generation == cache->generation)
+            add_missed(cache, query);
+        cache->stats.misses++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return docs;
+}
+
+void qcache_put(qcache_t *cache, char *query, uint64_t generation, set_u32_t *docs)
+{
+    qcache_putcost(cache, query, generation, docs, 0);
+}
+
+void qcache_putcost(qcache_t *cache, char *query, uint64_t generation, set_u32_t *docs, double cost)
+{
+    /* The entry, the query, the documents and the map's entry */
+    size_t bytes = sizeof(entry_t) + strlen(query) + 1 + sizeof(set_u32_t) +
+                   docs->size * sizeof(uint32_t) + sizeof(map_str_entry_t);
+    long uses = 1;
+    entry_t *e;
+
+    pthread_mutex_lock(&cache->lock);
+    if (!check_generation(cache, generation) || bytes > cache->stats.budget) {
+        pthread_mutex_unlock(&cache->lock);
+        return;
+    }
+    e = map_str_get(cache->map, query);
+    if (e != NULL) {
+        /* Another thread got here first */
+        pthread_mutex_unlock(&cache->lock);
+        return;
+    }
+    if (cache->costaware) {
+        /* Count the misses that led here as uses */
+        uses = missed(cache, query);
+        uses = uses > 0 ? uses : 1;
+        if (!worth_admitting(cache, bytes, cost * uses)) {
+            cache->stats.rejections++;
+            pthread_mutex_unlock(&cache->lock);
+            return;
+        }
+    }
+    make_room(cache, bytes);
+
+    e = malloc(sizeof(entry_t));
+    if (e == NULL)
+        fatal_error("out of memory");
+    e->query = strdup(query);
+    if (e->query == NULL)
+        fatal_error("out of memory");
+    /* Exactly as large as needed, unlike set_u32_copy() */
+    e->docs = set_u32_create();
+    if (docs->size > 0) {
+        e->docs->elems = malloc(docs->size * sizeof(uint32_t));
+        if (e->docs->elems == NULL)
+            fatal_error("out of memory");
+        memcpy(e->docs->elems, docs->elems, docs->size * sizeof(uint32_t));
+    }
+    e->docs->size = e->docs->capacity = docs->size;
+    e->bytes = bytes;
+    e->cost = cost;
+    e->uses = uses;
+    e->priority = cache->clock + worth(e);
+
+    map_str_put(cache->map, e->query, e);
+    link_first(cache, e);
+    if (cache->costaware)
+        heap_push(cache, e);
+    cache->stats.entries++;
+    cache->stats.bytes += bytes;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+int qcache_frequency(qcache_t *cache, char *query, uint64_t generation)
+{
+    int n = 0;
+
+    pthread_mutex_lock(&cache->lock);
+    if (cache->costaware && generation == cache->generation)
+        n = missed(cache, query);
+    pthread_mutex_unlock(&cache->lock);
+    return n;
+}
+
+void qcache_getstats(qcache_t *cache, qcache_stats_t *stats)
+{
+    pthread_mutex_lock(&cache->lock);
+    *stats = cache->stats;
+    pthread_mutex_unlock(&cache->lock);
+}
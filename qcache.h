@@ -0,0 +1,102 @@
+#ifndef QCACHE_H
+#define QCACHE_H
+
+#include "set_u32.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The type of query result caches.  A query result cache maps the text
+ * of queries to the sets of documents that match them, and holds at
+ * most a given number of bytes of entries, evicting the least recently
+ * used entries to make room for new ones.
+ *
+ * Every entry is tagged with the generation of the index it was
+ * computed from (see index_generation()).  As soon as the cache sees a
+ * newer generation, all of its entries are dropped, so a cache never
+ * returns results from before the index changed.
+ *
+ * A cost-aware cache instead keeps the entries that save the most work:
+ * each entry is worth the time it took to compute times the number of
+ * times it was asked for, and a new entry only gets in if it is worth
+ * more than the entries it would evict.  What an entry has left of its
+ * worth shrinks as other entries are evicted, until it is asked for
+ * again, so one that was costly once does not stay forever.  The cache
+ * remembers how often recent queries missed, so a query that keeps
+ * coming back is admitted even if it is cheap.
+ *
+ * All functions may be called from several threads at once.
+ */
+struct qcache;
+typedef struct qcache qcache_t;
+
+/*
+ * Counters of what a cache has done since it was created.
+ */
+typedef struct {
+    long hits;
+    long misses;
+    long evictions;         /* Entries dropped to stay within the budget */
+    long invalidations;     /* Entries dropped because the index changed */
+    long rejections;        /* Entries not worth admitting (cost-aware only) */
+    int entries;
+    size_t bytes;           /* Memory used by the entries */
+    size_t budget;
+} qcache_stats_t;
+
+/*
+ * Creates a cache that holds at most the given number of bytes of entries.
+ */
+qcache_t *qcache_create(size_t budget);
+
+/*
+ * Creates a cost-aware cache that holds at most the given number of
+ * bytes of entries.
+ */
+qcache_t *qcache_createcostaware(size_t budget);
+
+/*
+ * Destroys the given cache and its entries.
+ */
+void qcache_destroy(qcache_t *cache);
+
+/*
+ * Changes the number of bytes of entries the given cache may hold,
+ * evicting entries if it holds more.
+ */
+void qcache_setbudget(qcache_t *cache, size_t budget);
+
+/*
+ * Returns a copy of the set of documents cached for the given query and
+ * generation, which belongs to the caller, or NULL if there is none.
+ */
+set_u32_t *qcache_get(qcache_t *cache, char *query, uint64_t generation);
+
+/*
+ * Caches a copy of the given set of documents for the given query and
+ * generation, unless the entry would take more than the whole budget.
+ */
+void qcache_put(qcache_t *cache, char *query, uint64_t generation, set_u32_t *docs);
+
+/*
+ * Caches a copy of the given set of documents like qcache_put(), where
+ * computing the set took the given cost (e.g. in seconds).  A
+ * cost-aware cache only admits the entry if it is worth more than the
+ * entries it must evict to make room.
+ */
+void qcache_putcost(qcache_t *cache, char *query, uint64_t generation, set_u32_t *docs, double cost);
+
+/*
+ * Returns the number of times the given query recently missed in the
+ * given cache at the given generation.  Only cost-aware caches keep
+ * track of this; others return 0.
+ */
+int qcache_frequency(qcache_t *cache, char *query, uint64_t generation);
+
+/*
+ * Assigns the counters of the given cache to the given stats.
+ */
+void qcache_getstats(qcache_t *cache, qcache_stats_t *stats);
+
+#endif
@@ -0,0 +1,371 @@
+#include "common.h"
+#include "index.h"
+#include "list.h"
+
+#include <limits.h>
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Measures ranked top-k queries on a synthetic corpus whose word
+ * frequencies follow Zipf's law, comparing dynamic pruning of plain
+ * OR queries with exhaustive scoring of the same queries.  Also
+ * compares counting the matches of a query with listing them,
+ * queries that share an expensive part with and without caching it,
+ * evaluating such queries one at a time and in one batch, the
+ * time it takes to compile queries of different shapes, and substring
+ * and regex search through the trigram index compared with reading
+ * every file.
+ */
+
+enum {
+	NDOCS = 100000,
+	MAXDOCLEN = 200,
+	NVOCAB = 50000,
+	TOPK = 10,
+	ROUNDS = 5,
+	NSHARED = 50,
+	NCOMPILE = 2000,
+	NTERMS = 1000,
+	NFILES = 5000,
+	FILELEN = 2000,
+};
+
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void free_hits(list_t *hits)
+{
+	while (list_size(hits) > 0) {
+		free(list_popfirst(hits));
+	}
+	list_destroy(hits);
+}
+
+
+static index_t *build_index(void)
+{
+	index_t *idx = index_create();
+	double *cdf = malloc(NVOCAB * sizeof(double));
+	unsigned int seed = 1;
+	double sum = 0;
+	int i, j;
+
+	if (cdf == NULL) {
+		fatal_error("out of memory");
+	}
+	for (i = 0; i < NVOCAB; i++) {
+		sum += 1.0 / (i + 1);
+		cdf[i] = sum;
+	}
+
+	index_setpositional(idx, 0);
+	for (i = 0; i < NDOCS; i++) {
+		list_t *words = list_create(compare_strings);
+		char name[32];
+		int len;
+
+		/* Documents of varying length */
+		seed = seed * 1103515245 + 12345;
+		len = 10 + (seed >> 16) % MAXDOCLEN;
+		for (j = 0; j < len; j++) {
+			char buf[32];
+			double r;
+			int lo = 0, hi = NVOCAB - 1;
+
+			seed = seed * 1103515245 + 12345;
+			r = (seed >> 8) / (double)(1 << 24) * sum;
+			while (lo < hi) {
+				int mid = (lo + hi) / 2;
+				if (cdf[mid] < r) {
+					lo = mid + 1;
+				} else {
+					hi = mid;
+				}
+			}
+			snprintf(buf, sizeof(buf), "w%d", lo);
+			list_addlast(words, token_create(strdup(buf), strlen(buf)));
+		}
+		snprintf(name, sizeof(name), "doc_%d", i);
+		index_addpath(idx, strdup(name), words);
+		list_destroy(words);
+	}
+	index_freeze(idx);
+
+	free(cdf);
+	return idx;
+}
+
+
+/*
+ * Returns the number of files that contain the given string, or a
+ * match of it as a regular expression, read one after another.
+ */
+static int scan_files(char **paths, int numpaths, char *pattern, int regex)
+{
+	regex_t re;
+	int i, n = 0;
+
+	if (regex) {
+		regcomp(&re, pattern, REG_EXTENDED | REG_NOSUB | REG_NEWLINE);
+	}
+	for (i = 0; i < numpaths; i++) {
+		FILE *f = fopen(paths[i], "r");
+		size_t len;
+		char *text = read_file(f, &len);
+		fclose(f);
+		n += regex ? regexec(&re, text, 0, NULL, 0) == 0 : strstr(text, pattern) != NULL;
+		free(text);
+	}
+	if (regex) {
+		regfree(&re);
+	}
+	return n;
+}
+
+
+static void bench_grep(void)
+{
+	char dir[] = "/tmp/query_benchXXXXXX";
+	char **paths = malloc(NFILES * sizeof(char *));
+	char *text = malloc(FILELEN + 64);
+	index_t *idx = index_create();
+	unsigned int seed = 1;
+	char *errmsg;
+	int i, r;
+
+	if (paths == NULL || text == NULL || mkdtemp(dir) == NULL) {
+		fatal_error("out of memory");
+	}
+	index_setpositional(idx, 0);
+	index_settrigrams(idx, 1);
+	for (i = 0; i < NFILES; i++) {
+		size_t len = 0;
+		FILE *f;
+
+		/* Lines of code-like text, e.g. "w12->w345(w6);" */
+		while (len < FILELEN) {
+			int a, b, c;
+			seed = seed * 1103515245 + 12345;
+			a = (seed >> 8) % NVOCAB;
+			seed = seed * 1103515245 + 12345;
+			b = (seed >> 8) % NVOCAB;
+			seed = seed * 1103515245 + 12345;
+			c = (seed >> 8) % 100;
+			len += sprintf(text + len, "w%d->w%d(w%d);\n", a, b, c);
+		}
+		paths[i] = malloc(sizeof(dir) + 16);
+		if (paths[i] == NULL) {
+			fatal_error("out of memory");
+		}
+		sprintf(paths[i], "%s/f%d", dir, i);
+		f = fopen(paths[i], "w");
+		fwrite(text, 1, len, f);
+		fclose(f);
+		list_t *words = list_create(compare_strings);
+		index_addpath(idx, strdup(paths[i]), words);
+		list_destroy(words);
+		index_addtrigrams(idx, text, len);
+	}
+	index_freeze(idx);
+
+	char *patterns[] = { "w123->", "->w4567(", "w4999[0-9]->w1", "(w12345|w23456)\\(", NULL };
+	for (i = 0; patterns[i] != NULL; i++) {
+		int regex = i >= 2, n = 0;
+		double t, tscan, tgrep;
+
+		t = now();
+		for (r = 0; r < ROUNDS; r++) {
+			n = scan_files(paths, NFILES, patterns[i], regex);
+		}
+		tscan = (now() - t) / ROUNDS;
+
+		t = now();
+		for (r = 0; r < ROUNDS; r++) {
+			list_t *res = index_grep(idx, patterns[i], regex, &errmsg);
+			if (list_size(res) != n) {
+				fprintf(stderr, "grep of \"%s\" differs\n", patterns[i]);
+			}
+			list_destroy(res);
+		}
+		tgrep = (now() - t) / ROUNDS;
+
+		printf("%-34s scan       %8.3f ms  grep   %8.3f ms  speedup %5.1fx\n",
+		       patterns[i], tscan * 1000, tgrep * 1000, tscan / tgrep);
+	}
+
+	for (i = 0; i < NFILES; i++) {
+		unlink(paths[i]);
+		free(paths[i]);
+	}
+	rmdir(dir);
+	free(paths);
+	free(text);
+	index_destroy(idx);
+}
+
+
+int main(int argc, char **argv)
+{
+	char *queries[] = {
+		"w3 OR w40",
+		"w1 OR w7 OR w300",
+		"w10 OR w20 OR w30 OR w40",
+		"w2 OR w50 OR w500 OR w5000",
+		"w0 OR w1 OR w2 OR w3 OR w4 OR w5",
+		"w0 OR w1",
+		"w0 OR w30000",
+		NULL
+	};
+	index_t *idx = build_index();
+	char *errmsg;
+	int i, r;
+
+	for (i = 0; queries[i] != NULL; i++) {
+		double t, tfull, tpruned;
+
+		index_setpruning(idx, 0);
+		t = now();
+		for (r = 0; r < ROUNDS; r++) {
+			free_hits(index_query_ranked(idx, queries[i], TOPK, NULL, &errmsg));
+		}
+		tfull = (now() - t) / ROUNDS;
+		index_setpruning(idx, 1);
+
+		t = now();
+		for (r = 0; r < ROUNDS; r++) {
+			free_hits(index_query_ranked(idx, queries[i], TOPK, NULL, &errmsg));
+		}
+		tpruned = (now() - t) / ROUNDS;
+
+		printf("%-34s exhaustive %8.3f ms  pruned %8.3f ms  speedup %5.1fx\n",
+		       queries[i], tfull * 1000, tpruned * 1000, tfull / tpruned);
+	}
+
+	char *counted[] = {
+		"w0 OR w1 OR w2 OR w3 OR w4 OR w5",
+		"w3 AND w40",
+		"w1 ANDNOT w2",
+		"w1*",
+		NULL
+	};
+	for (i = 0; counted[i] != NULL; i++) {
+		double t, tlist, tcount;
+		int n = 0;
+
+		t = now();
+		for (r = 0; r < ROUNDS; r++) {
+			list_t *paths = index_query(idx, counted[i], &errmsg);
+			n = list_size(paths);
+			list_destroy(paths);
+		}
+		tlist = (now() - t) / ROUNDS;
+
+		t = now();
+		for (r = 0; r < ROUNDS; r++) {
+			if (index_count(idx, counted[i], INT_MAX, &errmsg) != n) {
+				fprintf(stderr, "count of \"%s\" differs\n", counted[i]);
+			}
+		}
+		tcount = (now() - t) / ROUNDS;
+
+		printf("%-34s list       %8.3f ms  count  %8.3f ms  speedup %5.1fx\n",
+		       counted[i], tlist * 1000, tcount * 1000, tlist / tcount);
+	}
+
+	char *shared[] = { "(w1* OR w20 OR w30) AND w%d", "(w2* AND w3*) OR w%d", NULL };
+	for (i = 0; shared[i] != NULL; i++) {
+		double t, times[2];
+		int cached;
+
+		for (cached = 0; cached <= 1; cached++) {
+			index_setsubcachesize(idx, cached ? 64 << 20 : 0);
+			t = now();
+			for (r = 0; r < NSHARED; r++) {
+				char query[256];
+				snprintf(query, sizeof(query), shared[i], 100 + r);
+				list_destroy(index_query(idx, query, &errmsg));
+			}
+			times[cached] = (now() - t) / NSHARED;
+		}
+		index_setsubcachesize(idx, 0);
+
+		printf("%-34s plain      %8.3f ms  cached %8.3f ms  speedup %5.1fx\n",
+		       shared[i], times[0] * 1000, times[1] * 1000, times[0] / times[1]);
+	}
+
+	for (i = 0; shared[i] != NULL; i++) {
+		char *batch[NSHARED], *errmsgs[NSHARED];
+		list_t *results[NSHARED];
+		double t, tsingle, tbatch;
+
+		for (r = 0; r < NSHARED; r++) {
+			char query[256];
+			snprintf(query, sizeof(query), shared[i], 100 + r);
+			batch[r] = strdup(query);
+		}
+
+		t = now();
+		for (r = 0; r < NSHARED; r++) {
+			list_destroy(index_query(idx, batch[r], &errmsg));
+		}
+		tsingle = now() - t;
+
+		t = now();
+		index_query_batch(idx, batch, NSHARED, results, errmsgs);
+		for (r = 0; r < NSHARED; r++) {
+			list_destroy(results[r]);
+		}
+		tbatch = now() - t;
+
+		printf("%-34s single     %8.3f ms  batch  %8.3f ms  speedup %5.1fx\n",
+		       shared[i], tsingle * 1000, tbatch * 1000, tsingle / tbatch);
+		for (r = 0; r < NSHARED; r++) {
+			free(batch[r]);
+		}
+	}
+
+	/* Long flat queries and deeply nested ones, of about the same length */
+	char *flat = malloc(NTERMS * 16), *nested = malloc(NTERMS * 16);
+	if (flat == NULL || nested == NULL) {
+		fatal_error("out of memory");
+	}
+	strcpy(flat, "w0");
+	nested[0] = '\0';
+	for (i = 1; i < NTERMS; i++) {
+		sprintf(flat + strlen(flat), " OR w%d", i);
+		strcat(nested, "(w0 OR ");
+	}
+	strcat(nested, "w1");
+	for (i = 1; i < NTERMS; i++) {
+		strcat(nested, ")");
+	}
+	char *compiled[] = { "w40000 AND w40001", flat, nested, NULL };
+	char *names[] = { "w40000 AND w40001", "flat, 1000 words", "nested 1000 deep", NULL };
+	for (i = 0; compiled[i] != NULL; i++) {
+		double t = now();
+		for (r = 0; r < NCOMPILE; r++) {
+			index_freeplan(index_compile(idx, compiled[i], &errmsg));
+		}
+		t = (now() - t) / NCOMPILE;
+		printf("%-34s compile    %8.3f us  per byte %6.1f ns\n",
+		       names[i], t * 1e6, t * 1e9 / strlen(compiled[i]));
+	}
+	free(flat);
+	free(nested);
+
+	index_destroy(idx);
+
+	bench_grep();
+	return 0;
+}
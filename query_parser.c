@@ -1,235 +1,1597 @@
 #include "common.h"
+#include "dociter.h"
 #include "list.h"
-#include "map.h"
+#include "index.h"
+#include "map_str.h"
+#include "postings.h"
+#include "qcache.h"
 #include "query_parser.h"
-#include "set.h"
+#include "set_u32.h"
+#include "tokenizer.h"
 
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-//#define DEBUG
-#ifdef DEBUG
-  #define TOKEN_DEBUG 
-#endif
-
-enum token                  { ANDNOT ,  AND ,  OR ,  PARENTHESIS_LEFT,   PARENTHESIS_RIGHT,   WORD,   EOQ };
-static char *token_text[] = {"ANDNOT", "AND", "OR", "PARENTHESIS_LEFT", "PARENTHESIS_RIGHT", "WORD", "EOQ"};
-
-static enum token get_token(char **q)
-{
-#ifdef TOKEN_DEBUG
-	printf("\"%s\" =", *q);
-#endif
-	while (isspace(**q)) {
-		(*q)++;
-	}
-#ifdef TOKEN_DEBUG
-	printf(" \"%s\" =>", *q);
-#endif
-
-	enum token t;
-	switch(**q) {
-		case '\0':
-			t = EOQ;
-			break;
-		case '(':
-			t = PARENTHESIS_LEFT;
-			break;
-		case ')':
-			t = PARENTHESIS_RIGHT;
-			break;
-		case 'A':
-			if (strncmp(token_text[AND], *q, 3) == 0) {
-				char *post_AND = (*q)+3;
-				if (strncmp(token_text[ANDNOT]+3, post_AND, 3) == 0) {
-					t = ANDNOT;
-				} else {
-					t = AND;
+enum token { ANDNOT, AND, OR, NEAR, PARENTHESIS_LEFT, PARENTHESIS_RIGHT, QUOTE, WORD, EOQ };
+
+/*
+ * A token of a query, with its text.  Words and phrases point into the
+ * query itself.
+ */
+struct lexeme {
+	enum token type;
+	char *text;	// the word, or the phrase between the quotes
+	int len;
+	int distance;	// NEAR only
+};
+
+
+/*
+ * Returns 1 if the given character ends an operator, so that e.g.
+ * "ORACLE" is a word rather than OR followed by "ACLE".
+ */
+static int is_boundary(char c) {
+	return c == '\0' || isspace((unsigned char)c) || c == '(' || c == ')' || c == '"';
+}
+
+
+static int is_keyword(char *q, char *keyword) {
+	int len = strlen(keyword);
+	return strncmp(q, keyword, len) == 0 && is_boundary(q[len]);
+}
+
+
+/*
+ * Splits a query into tokens in a single pass, ending with EOQ.
+ *
+ * returns: the number of tokens, or -1 on error along with errmsg
+ */
+static int _lex(char *q, struct lexeme **tokens, char **errmsg) {
+	// every token takes at least one character
+	*tokens = malloc((strlen(q) + 1) * sizeof(**tokens));
+	if (*tokens == NULL) {
+		fatal_error("out of memory");
+	}
+
+	int n = 0;
+	for (;;) {
+		while (isspace((unsigned char)*q)) {
+			q++;
+		}
+
+		struct lexeme *t = &(*tokens)[n++];
+		t->text = q;
+		t->len = 1;
+		switch (*q) {
+			case '\0':
+				t->type = EOQ;
+				return n;
+			case '(':
+				t->type = PARENTHESIS_LEFT;
+				break;
+			case ')':
+				t->type = PARENTHESIS_RIGHT;
+				break;
+			case '"':
+			{
+				char *end = strchr(q + 1, '"');
+				if (end == NULL) {
+					*errmsg = strdup("Missing closing quote");
+					return -1;
 				}
-			} else {
-				t = WORD;
+				t->type = QUOTE;
+				t->text = q + 1;
+				t->len = end - (q + 1);
+				q = end;
+				break;
 			}
+			default:
+				if (is_keyword(q, "ANDNOT")) {
+					t->type = ANDNOT;
+					t->len = 6;
+				} else if (is_keyword(q, "AND")) {
+					t->type = AND;
+					t->len = 3;
+				} else if (is_keyword(q, "OR")) {
+					t->type = OR;
+					t->len = 2;
+				} else if (strncmp(q, "NEAR/", 5) == 0) {
+					char *digits = q + 5;
+					if (!isdigit((unsigned char)*digits)) {
+						*errmsg = strdup("Expecting a distance after NEAR/");
+						return -1;
+					}
+					// no document has more words than MAX_FILE_SIZE
+					errno = 0;
+					long distance = strtol(digits, &digits, 10);
+					if (errno == ERANGE || distance > MAX_FILE_SIZE) {
+						*errmsg = strdup("Distance after NEAR/ is too large");
+						return -1;
+					}
+					t->type = NEAR;
+					t->distance = distance;
+					t->len = digits - q;
+				} else {
+					t->type = WORD;
+					t->len = strcspn(q, " \t\n\v\f\r)\"");
+				}
+				q += t->len - 1;
+				break;
+		}
+		q++;
+	}
+}
+
+
+/*
+ * A query being compiled: its steps so far, in postfix order, and the
+ * words of its leaves.
+ */
+struct builder {
+	struct query_step *steps;
+	char *absorbed;		// steps that became part of the chain of the operator over them
+	int numsteps;
+	char **words;
+	int numwords;
+	int maxwords;
+};
+
+
+static int _isleaf(enum query_op op) {
+	return op != QUERY_OR && op != QUERY_AND && op != QUERY_ANDNOT;
+}
+
+
+static int _addstep(struct builder *b, enum query_op op, int numargs, int words) {
+	struct query_step *step = &b->steps[b->numsteps];
+	step->op = op;
+	step->numargs = numargs;
+	step->words = words;
+	step->distance = 0;
+	step->start = 0;
+	b->absorbed[b->numsteps] = 0;
+	return b->numsteps++;
+}
+
+
+static void _addword(struct builder *b, char *word) {
+	if (word == NULL) {
+		fatal_error("out of memory");
+	}
+	if (b->numwords == b->maxwords) {
+		b->maxwords = (b->maxwords == 0 ? 16 : 2 * b->maxwords);
+		b->words = realloc(b->words, b->maxwords * sizeof(*b->words));
+		if (b->words == NULL) {
+			fatal_error("out of memory");
+		}
+	}
+	b->words[b->numwords++] = word;
+}
+
+
+/*
+ * Adds a leaf that looks up the given word, or the two words of NEAR.
+ *
+ * returns: the step of the leaf
+ */
+static int _addleaf(struct builder *b, enum query_op op, struct lexeme *a, struct lexeme *c) {
+	int words = b->numwords;
+	_addword(b, strndup(a->text, a->len));
+	if (c != NULL) {
+		_addword(b, strndup(c->text, c->len));
+	}
+	return _addstep(b, op, b->numwords - words, words);
+}
+
+
+static int _phrase(struct builder *b, char *phrase, int len, tokenizer_t *tokenizer) {
+	// split the phrase into words the same way the documents were split
+	list_t *tokens = list_create(compare_pointers);
+	tokenizer_text(tokenizer, phrase, len, tokens);
+	int words = b->numwords;
+
+	while (list_size(tokens) > 0) {
+		token_t *token = list_popfirst(tokens);
+		_addword(b, token->word);
+		free(token);
+	}
+	list_destroy(tokens);
+
+	return _addstep(b, QUERY_PHRASE, b->numwords - words, words);
+}
+
+
+/*
+ * Parses the operand at the given token, adds its leaf, and advances
+ * past it.
+ *
+ * returns: the step of the leaf, or -1 on error along with errmsg
+ */
+static int _operandstep(struct builder *b, struct lexeme **t, tokenizer_t *tokenizer, char **errmsg) {
+	// term ::= '"' <word>... '"'
+	//       | <word> "NEAR/" <distance> <word>
+	//       | <word> "~" <edits>
+	//       | <word>
+
+	struct lexeme *word = *t;
+	int step;
+
+	if (word->type == QUOTE) {
+		*t += 1;
+		return _phrase(b, word->text, word->len, tokenizer);
+	}
+
+	char *tilde = memchr(word->text, '~', word->len);
+	if (tilde != NULL) {
+		// <word>"~"<edits>
+		struct lexeme fuzzy = *word;
+		fuzzy.len = tilde - word->text;
+		if (fuzzy.len == 0 || word->len - fuzzy.len != 2 || tilde[1] < '1' || tilde[1] > '0' + MAX_FUZZY_EDITS ||
+			memchr(word->text, '*', word->len) != NULL) {
+			*errmsg = strdup("Fuzzy words must be of the form word~1 or word~2");
+			return -1;
+		}
+		if (word[1].type == NEAR) {
+			*errmsg = strdup("NEAR does not support fuzzy words");
+			return -1;
+		}
+		*t += 1;
+		step = _addleaf(b, QUERY_FUZZY, &fuzzy, NULL);
+		b->steps[step].distance = tilde[1] - '0';
+		return step;
+	}
+
+	if (word[1].type != NEAR) {
+		*t += 1;
+		return _addleaf(b, memchr(word->text, '*', word->len) != NULL ? QUERY_WILDCARD : QUERY_WORD, word, NULL);
+	}
+
+	struct lexeme *right = &word[2];
+	if (right->type != WORD) {
+		*errmsg = strdup("Expecting word after NEAR/distance");
+		return -1;
+	}
+	if (memchr(word->text, '*', word->len) != NULL || memchr(right->text, '*', right->len) != NULL) {
+		*errmsg = strdup("NEAR does not support wildcards");
+		return -1;
+	}
+	if (memchr(right->text, '~', right->len) != NULL) {
+		*errmsg = strdup("NEAR does not support fuzzy words");
+		return -1;
+	}
+	step = _addleaf(b, QUERY_NEAR, word, right);
+	b->steps[step].distance = word[1].distance;
+	*t += 3;
+	return step;
+}
+
+
+/*
+ * How tightly each operator binds: OR before AND before ANDNOT.
+ */
+static int precedence(enum token op) {
+	switch (op) {
+		case OR:
+			return 3;
+		case AND:
+			return 2;
+		case ANDNOT:
+			return 1;
+		default:
+			return 0;	// parenthesis
+	}
+}
+
+
+/*
+ * Returns the number of operands that the given step gives an operator
+ * over it: all of its own if it is a chain of the same OR or AND, which
+ * then becomes part of the operator's chain, or else 1.
+ */
+static int _absorb(struct builder *b, enum query_op op, int step) {
+	if (op != QUERY_ANDNOT && b->steps[step].op == op) {
+		b->absorbed[step] = 1;
+		return b->steps[step].numargs;
+	}
+	return 1;
+}
+
+
+static int _reduce(struct builder *b, enum token op, int left, int right) {
+	enum query_op qop = (op == OR ? QUERY_OR : op == AND ? QUERY_AND : QUERY_ANDNOT);
+	int numargs = _absorb(b, qop, left) + _absorb(b, qop, right);
+	return _addstep(b, qop, numargs, 0);
+}
+
+
+/*
+ * Parses a query into the given builder.
+ *
+ * returns: 1, or 0 on error along with errmsg
+ */
+static int _parse(char *q, tokenizer_t *tokenizer, struct builder *b, char **errmsg) {
+	// query   ::= andterm | andterm "ANDNOT" query
+	// andterm ::= orterm | orterm "AND" andterm
+	// orterm  ::= term | term "OR" orterm
+	// term    ::= "(" query ")" | ...
+	//
+	// parsed without recursion, with a stack of operands and a stack of
+	// operators, so deep nesting costs no more than long queries; the
+	// steps come out in postfix order
+
+	struct lexeme *tokens;
+	int numtokens = _lex(q, &tokens, errmsg);
+	if (numtokens < 0) {
+		free(tokens);
+		return 0;
+	}
+
+	// every token adds at most one step
+	b->steps = malloc(numtokens * sizeof(*b->steps));
+	b->absorbed = malloc(numtokens);
+	int *operands = malloc(numtokens * sizeof(*operands));
+	enum token *ops = malloc(numtokens * sizeof(*ops));
+	if (b->steps == NULL || b->absorbed == NULL || operands == NULL || ops == NULL) {
+		fatal_error("out of memory");
+	}
+	int numoperands = 0, numops = 0, error = 0;
+	struct lexeme *t = tokens;
+
+	while (!error) {
+		// expecting an operand, or a parenthesis that starts one
+		while (t->type == PARENTHESIS_LEFT) {
+			ops[numops++] = PARENTHESIS_LEFT;
+			t++;
+		}
+		if (t->type != WORD && t->type != QUOTE) {
+			*errmsg = strdup("Expecting word, phrase or \"(\" query \")\"");
+			error = 1;
 			break;
-		case 'O':
-			if (strncmp(token_text[OR], *q, 2) == 0) {
-				t = OR;
-			} else {
-				t = WORD;
+		}
+		int step = _operandstep(b, &t, tokenizer, errmsg);
+		if (step < 0) {
+			error = 1;
+			break;
+		}
+		operands[numoperands++] = step;
+
+		// expecting an operator, or parentheses that end operands
+		while (t->type == PARENTHESIS_RIGHT) {
+			while (numops > 0 && ops[numops - 1] != PARENTHESIS_LEFT) {
+				numoperands--;
+				operands[numoperands - 1] = _reduce(b, ops[--numops], operands[numoperands - 1], operands[numoperands]);
 			}
+			if (numops == 0) {
+				*errmsg = strdup("Missing left parenthesis");
+				error = 1;
+				break;
+			}
+			numops--;
+			t++;
+		}
+		if (error) {
 			break;
-		default:
-			t = WORD;
+		}
+		if (t->type == EOQ) {
+			break;
+		}
+		if (t->type != OR && t->type != AND && t->type != ANDNOT) {
+			*errmsg = strdup("Expecting \"OR\", \"AND\" or \"ANDNOT\" between terms");
+			error = 1;
 			break;
+		}
+		// all operators group to the right, so only reduce tighter ones
+		while (numops > 0 && precedence(ops[numops - 1]) > precedence(t->type)) {
+			numoperands--;
+			operands[numoperands - 1] = _reduce(b, ops[--numops], operands[numoperands - 1], operands[numoperands]);
+		}
+		ops[numops++] = t->type;
+		t++;
 	}
 
-#ifdef TOKEN_DEBUG
-	printf(" %s\n", token_text[t]); fflush(stdout);
-#endif
+	if (!error) {
+		while (numops > 0 && ops[numops - 1] != PARENTHESIS_LEFT) {
+			numoperands--;
+			operands[numoperands - 1] = _reduce(b, ops[--numops], operands[numoperands - 1], operands[numoperands]);
+		}
+		if (numops > 0) {
+			*errmsg = strdup("Missing right parenthesis");
+			error = 1;
+		}
+	}
 
-	return t;
+	free(operands);
+	free(ops);
+	free(tokens);
+	return !error;
 }
 
 
-static set_t *_term(map_t *map, char **q, char **errmsg, int level) {
-	// _term ::= "(" _query ")"
-	//       | <word>
+static void _freebuilder(struct builder *b) {
+	int i;
+	for (i = 0; i < b->numwords; i++) {
+		free(b->words[i]);
+	}
+	free(b->words);
+	free(b->steps);
+	free(b->absorbed);
+}
 
-	set_t *result = NULL;
 
-	enum token t = get_token(q);
-	switch (t) {
-		case PARENTHESIS_LEFT:
-		{
-			*q += 1; // skip left parenthesis
-			result = _query(map, q, errmsg, level+1);
-			if (get_token(q) == PARENTHESIS_RIGHT) {
-				*q += 1; // skip right parenthesis
-			} else {
-				*errmsg = strdup("Missing right parenthesis");
-				result = NULL;
+/*
+ * Turns parsed steps into a plan: drops the steps that became part of a
+ * longer chain, finds the first step of every part of the query, and
+ * packs the words into one block.  Frees the builder.
+ */
+static query_plan_t *_lower(struct builder *b) {
+	query_plan_t *plan = malloc(sizeof(*plan));
+	if (plan == NULL) {
+		fatal_error("out of memory");
+	}
+
+	int i, j, n = 0;
+	for (i = 0; i < b->numsteps; i++) {
+		if (b->absorbed[i]) {
+			continue;
+		}
+		struct query_step *step = &b->steps[n];
+		*step = b->steps[i];
+		// the operands are the parts just before, last one first
+		step->start = n;
+		if (!_isleaf(step->op)) {
+			for (j = 0; j < step->numargs; j++) {
+				step->start = b->steps[step->start - 1].start;
 			}
-			break;
 		}
-		case WORD:
-		{
-			char *post_word = *q;
-			while (!isspace(*post_word) && *post_word != '\0' && *post_word != ')') {
-				post_word++;
-			}
-			char tmp = *post_word;
-			*post_word = '\0';
-			result = map_get(map, *q);
-#ifdef DEBUG
-			printf("\"%s\" => %i matches\n", *q, (result == NULL ? -1 : set_size(result))); fflush(stdout);
-#endif
-			*post_word = tmp;
-
-			*q += post_word - *q; // skip the word
-
-			if (result == NULL) {
-				result = set_create(compare_strings); // query with no result is empty, not NULL
-			} else {
-				result = set_copy(result); // do not delete original data destroying result
+		n++;
+	}
+	plan->steps = realloc(b->steps, n * sizeof(*plan->steps));
+	plan->numsteps = n;
+
+	size_t size = b->numwords * sizeof(*plan->words);
+	for (i = 0; i < b->numwords; i++) {
+		size += strlen(b->words[i]) + 1;
+	}
+	plan->words = malloc(size + 1);
+	if (plan->steps == NULL || plan->words == NULL) {
+		fatal_error("out of memory");
+	}
+	char *text = (char *)(plan->words + b->numwords);
+	for (i = 0; i < b->numwords; i++) {
+		plan->words[i] = strcpy(text, b->words[i]);
+		text += strlen(text) + 1;
+		free(b->words[i]);
+	}
+	free(b->words);
+	free(b->absorbed);
+	return plan;
+}
+
+
+/*
+ * Assigns the operands of the given operator step to the given array,
+ * in the order of the query.
+ */
+static void _operands(query_plan_t *plan, int s, int *operands) {
+	int i, end = s - 1;
+	for (i = plan->steps[s].numargs - 1; i >= 0; i--) {
+		operands[i] = end;
+		end = plan->steps[end].start - 1;
+	}
+}
+
+
+static int *_newoperands(query_plan_t *plan, int s) {
+	int *operands = malloc(plan->steps[s].numargs * sizeof(*operands));
+	if (operands == NULL) {
+		fatal_error("out of memory");
+	}
+	_operands(plan, s, operands);
+	return operands;
+}
+
+
+/*
+ * Returns 1 if the part of a query that ends at the given step is plain
+ * words separated by OR, or 0 otherwise.
+ */
+static int _isdisjunction(query_plan_t *plan, int s) {
+	struct query_step *step = &plan->steps[s];
+	if (step->op != QUERY_OR) {
+		return step->op == QUERY_WORD;
+	}
+	int i;
+	for (i = step->start; i < s; i++) {
+		if (plan->steps[i].op != QUERY_WORD) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+/*
+ * Returns every word that a matching document may contain, i.e. not
+ * wildcards or fuzzy words, nor words after ANDNOT, in query order.
+ * The words belong to the plan.
+ */
+static list_t *_scoredwords(query_plan_t *plan) {
+	list_t *words = list_create(compare_strings);
+	int *excluded = calloc(plan->numsteps + 1, sizeof(*excluded));
+	if (excluded == NULL) {
+		fatal_error("out of memory");
+	}
+
+	// the part just before an ANDNOT is its right operand
+	int i, j, depth = 0;
+	for (i = 0; i < plan->numsteps; i++) {
+		if (plan->steps[i].op == QUERY_ANDNOT) {
+			excluded[plan->steps[i - 1].start]++;
+			excluded[i]--;
+		}
+	}
+	for (i = 0; i < plan->numsteps; i++) {
+		struct query_step *step = &plan->steps[i];
+		depth += excluded[i];
+		if (depth == 0 && (step->op == QUERY_WORD || step->op == QUERY_PHRASE || step->op == QUERY_NEAR)) {
+			for (j = 0; j < step->numargs; j++) {
+				list_addlast(words, plan->words[step->words + j]);
 			}
+		}
+	}
+	free(excluded);
+	return words;
+}
+
+
+static set_u32_t empty_set = { NULL, 0, 0 };
+
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * Parts of queries with more steps than this are not cached on their
+ * own, so that deep nesting does not format ever longer keys.
+ */
+#define MAX_SUBKEY_STEPS 1024
+
+
+static char *_format(query_plan_t *plan, int s);
+
+
+/*
+ * Returns the key of a part of a query in the index's subexpression
+ * cache, or NULL if there is no such cache, the part is a single word,
+ * whose documents are at hand anyway, or the part is too long.
+ */
+static char *_subkey(index_t *idx, query_plan_t *plan, int s) {
+	if (index_subcache(idx) == NULL || plan->steps[s].op == QUERY_WORD ||
+		s - plan->steps[s].start >= MAX_SUBKEY_STEPS) {
+		return NULL;
+	}
+	return _format(plan, s);
+}
+
+
+static set_u32_t *_evaluatepart(index_t *idx, query_plan_t *plan, int s, char **errmsg);
+
+
+/*
+ * Evaluates a part of a query like _evaluatepart(), and offers the
+ * result to the subexpression cache under the given key (unless it is
+ * NULL), along with the time it took.
+ */
+static set_u32_t *_subevaluate(index_t *idx, query_plan_t *plan, int s, char *key, char **errmsg) {
+	double start = now();
+	set_u32_t *result = _evaluatepart(idx, plan, s, errmsg);
+	if (result != NULL && key != NULL) {
+		qcache_putcost(index_subcache(idx), key, index_generation(idx), result, now() - start);
+	}
+	return result;
+}
+
+
+/*
+ * Returns the set of documents of a part of a query like
+ * _evaluatepart(), except that the set of a single word is the index's
+ * own.  Assigns whether the caller must destroy the set to owned.
+ */
+static set_u32_t *_operand(index_t *idx, query_plan_t *plan, int s, int *owned, char **errmsg) {
+	struct query_step *step = &plan->steps[s];
+	if (step->op == QUERY_WORD) {
+		set_u32_t *docs = index_lookup(idx, plan->words[step->words]);
+		*owned = 0;
+		return docs != NULL ? docs : &empty_set;
+	}
+	*owned = 1;
+
+	char *key = _subkey(idx, plan, s);
+	set_u32_t *result = NULL;
+	if (key != NULL) {
+		result = qcache_get(index_subcache(idx), key, index_generation(idx));
+	}
+	if (result == NULL) {
+		result = _subevaluate(idx, plan, s, key, errmsg);
+	}
+	free(key);
+	return result;
+}
+
+
+static void _release(set_u32_t *set, int owned) {
+	if (owned) {
+		set_u32_destroy(set);
+	}
+}
+
+
+/*
+ * The operands of a chain of ORs, which are merged all at once.
+ */
+struct operands {
+	set_u32_t **sets;
+	int *owned;
+	int num;
+};
+
+
+/*
+ * Evaluates the operands of a chain of ORs until one of them has at
+ * least limit documents.  Returns -1 on error, 1 if it stopped early
+ * and 0 otherwise.
+ */
+static int _oroperands(index_t *idx, query_plan_t *plan, int s, struct operands *ops, int limit, char **errmsg) {
+	int *operands = _newoperands(plan, s), i, status = 0;
+
+	for (i = 0; i < plan->steps[s].numargs && status == 0; i++) {
+		set_u32_t *set = _operand(idx, plan, operands[i], &ops->owned[ops->num], errmsg);
+		if (set == NULL) {
+			status = -1;
 			break;
 		}
+		ops->sets[ops->num++] = set;
+		status = (set->size >= limit);
+	}
+	free(operands);
+	return status;
+}
+
+
+static void _initoperands(struct operands *ops, query_plan_t *plan, int s) {
+	int width = plan->steps[s].numargs;
+	ops->sets = malloc(width * sizeof(*ops->sets));
+	ops->owned = malloc(width * sizeof(*ops->owned));
+	if (ops->sets == NULL || ops->owned == NULL) {
+		fatal_error("out of memory");
+	}
+	ops->num = 0;
+}
+
+
+static void _freeoperands(struct operands *ops) {
+	int i;
+	for (i = 0; i < ops->num; i++) {
+		_release(ops->sets[i], ops->owned[i]);
+	}
+	free(ops->sets);
+	free(ops->owned);
+}
+
+
+/*
+ * Chains of ORs of at least this many words are merged up front (see
+ * postings_union()), which beats keeping a cursor in every list.
+ */
+#define MERGE_MIN_WORDS 8
+
+
+/*
+ * Returns 1 if _iterate() matches the given part of a query in full up
+ * front, or 0 if it pulls the documents lazily.
+ */
+static int _materialized(query_plan_t *plan, int s) {
+	switch (plan->steps[s].op) {
+		case QUERY_WILDCARD:
+		case QUERY_FUZZY:
+		case QUERY_PHRASE:
+		case QUERY_NEAR:
+			return 1;
+		case QUERY_OR:
+			return plan->steps[s].numargs >= MERGE_MIN_WORDS && _isdisjunction(plan, s);
 		default:
-			*errmsg = strdup("Expecting word or \"(\" query \")\"");
-			break;
+			return 0;
 	}
+}
 
-	return result;
+
+static int compare_sizes(const void *a, const void *b) {
+	return (*(set_u32_t **)a)->size - (*(set_u32_t **)b)->size;
 }
 
 
-static set_t *_orterm(map_t *map, char **q, char **errmsg, int level) {
-	// _orterm ::= _term
-	//         | _term "OR" _orterm
+/*
+ * Returns the documents of the given operator over the given sets of
+ * its operands.
+ */
+static set_u32_t *_combine(index_t *idx, enum query_op op, set_u32_t **sets, int num) {
+	set_u32_t **sorted, *docs, *set;
+	int i;
+
+	switch (op) {
+		case QUERY_OR:
+			return postings_union(sets, num, index_numdocs(idx));
+		case QUERY_AND:
+			// smallest first, so the intermediate results stay small
+			sorted = malloc(num * sizeof(*sorted));
+			if (sorted == NULL) {
+				fatal_error("out of memory");
+			}
+			memcpy(sorted, sets, num * sizeof(*sorted));
+			qsort(sorted, num, sizeof(*sorted), compare_sizes);
+			docs = set_u32_copy(sorted[0]);
+			for (i = 1; i < num && docs->size > 0; i++) {
+				set = set_u32_intersection(docs, sorted[i]);
+				set_u32_destroy(docs);
+				docs = set;
+			}
+			free(sorted);
+			return docs;
+		default:
+			return set_u32_difference(sets[0], sets[1]);
+	}
+}
 
-	set_t *result, *left = _term(map, q, errmsg, level);
 
-	switch (get_token(q)) {
-		case OR:
-		{
-			*q += 2; // skip keyword
-			set_t *right = _orterm(map, q, errmsg, level);
-			if (right == NULL || left == NULL) {
-				result = NULL;
-			} else {
-				result = set_union(left, right);
-				set_destroy(left);
-				set_destroy(right);
+/*
+ * Evaluates the part of a query that ends at the given step from its
+ * first step on, with a stack of the sets of the parts so far, so that
+ * how deep it nests does not matter.  Unlike _evaluatepart(), this
+ * builds the set of every part.
+ */
+static set_u32_t *_evaluatesets(index_t *idx, query_plan_t *plan, int s, char **errmsg) {
+	int first = plan->steps[s].start, num = 0, i, j;
+	set_u32_t **sets = malloc((s - first + 1) * sizeof(*sets)), *result = NULL;
+	int *owned = malloc((s - first + 1) * sizeof(*owned));
+	if (sets == NULL || owned == NULL) {
+		fatal_error("out of memory");
+	}
+
+	for (i = first; i <= s; i++) {
+		struct query_step *step = &plan->steps[i];
+		if (_isleaf(step->op)) {
+			sets[num] = _operand(idx, plan, i, &owned[num], errmsg);
+			if (sets[num] == NULL) {
+				break;
 			}
-			break;
+			num++;
+			continue;
 		}
-		case EOQ:
-		case PARENTHESIS_RIGHT:
-		case ANDNOT:
-		case AND:
-			result = left;
+		num -= step->numargs;
+		set_u32_t *set = _combine(idx, step->op, &sets[num], step->numargs);
+		for (j = num; j < num + step->numargs; j++) {
+			_release(sets[j], owned[j]);
+		}
+		sets[num] = set;
+		owned[num++] = 1;
+	}
+
+	if (i > s) {
+		result = (owned[0] ? sets[0] : set_u32_copy(sets[0]));
+		num = 0;
+	}
+	while (num > 0) {
+		num--;
+		_release(sets[num], owned[num]);
+	}
+	free(sets);
+	free(owned);
+	return result;
+}
+
+
+/*
+ * Parts of queries nested deeper than this under the part being
+ * iterated are matched in full up front, since pulling documents
+ * through iterators recurses once per level.
+ */
+#define MAX_ITERATOR_DEPTH 256
+
+
+/*
+ * An operator whose iterator is being built, once those of its operands
+ * are.
+ */
+struct frame {
+	int step;
+	int *operands;
+	dociter_t **iters;	// of the operands so far
+	int num;
+	char *key;		// drain the documents into the subexpression cache under this key, or NULL
+	double start;
+};
+
+
+/*
+ * Starts the iterator of a part of a query at the given depth under the
+ * part being iterated, checking the subexpression cache first unless it
+ * is that part.  A part that is matched up front, or is in the cache,
+ * is done at once: assigns its iterator (or NULL on error along with
+ * errmsg) to iter, and returns 0.  Otherwise sets up the given frame,
+ * whose operands come next, and returns 1.  A part that would be pulled
+ * lazily is only matched in full, and offered to the cache, once the
+ * cache has missed it before.
+ */
+static int _enter(index_t *idx, query_plan_t *plan, int s, int depth, struct frame *frame, dociter_t **iter, char **errmsg) {
+	struct query_step *step = &plan->steps[s];
+	set_u32_t *set;
+	int owned;
+
+	if (step->op == QUERY_WORD) {
+		set = _operand(idx, plan, s, &owned, errmsg);
+		*iter = dociter_set(set, owned);
+		return 0;
+	}
+
+	if (depth >= MAX_ITERATOR_DEPTH) {
+		set = _evaluatesets(idx, plan, s, errmsg);
+		*iter = (set != NULL ? dociter_set(set, 1) : NULL);
+		return 0;
+	}
+
+	char *key = (depth == 0 ? NULL : _subkey(idx, plan, s));
+	int evaluate = _materialized(plan, s);
+	if (key != NULL) {
+		qcache_t *cache = index_subcache(idx);
+		set = qcache_get(cache, key, index_generation(idx));
+		if (set != NULL) {
+			free(key);
+			*iter = dociter_set(set, 1);
+			return 0;
+		}
+		evaluate = (evaluate || qcache_frequency(cache, key, index_generation(idx)) >= 2);
+		if (!evaluate) {
+			free(key);
+			key = NULL;
+		}
+	}
+
+	if (evaluate && (_isleaf(step->op) || _isdisjunction(plan, s))) {
+		set = _subevaluate(idx, plan, s, key, errmsg);
+		free(key);
+		*iter = (set != NULL ? dociter_set(set, 1) : NULL);
+		return 0;
+	}
+
+	frame->step = s;
+	frame->operands = _newoperands(plan, s);
+	frame->iters = malloc(step->numargs * sizeof(*frame->iters));
+	if (frame->iters == NULL) {
+		fatal_error("out of memory");
+	}
+	frame->num = 0;
+	frame->key = key;
+	frame->start = now();
+	return 1;
+}
+
+
+static void _freeframe(struct frame *frame) {
+	free(frame->operands);
+	free(frame->iters);
+	free(frame->key);
+}
+
+
+/*
+ * Combines the iterators of the operands of the given frame, and frees
+ * the frame.
+ */
+static dociter_t *_leave(index_t *idx, query_plan_t *plan, struct frame *frame) {
+	dociter_t *iter;
+
+	switch (plan->steps[frame->step].op) {
+		case QUERY_OR:
+			iter = dociter_or(frame->iters, frame->num);
+			break;
+		case QUERY_AND:
+			iter = dociter_and(frame->iters, frame->num);
 			break;
 		default:
-			*errmsg = strdup("Expecting term or term \"OR\" orterm");
-			result = NULL;
+			iter = dociter_andnot(frame->iters[0], frame->iters[1]);
+			break;
 	}
+	if (frame->key != NULL) {
+		set_u32_t *set = dociter_drain(iter);
+		dociter_destroy(iter);
+		qcache_putcost(index_subcache(idx), frame->key, index_generation(idx), set, now() - frame->start);
+		iter = dociter_set(set, 1);
+	}
+	_freeframe(frame);
+	return iter;
+}
 
-	return result;
+
+/*
+ * Builds the iterator of the part of a query that ends at the given
+ * step like _iterate(), with a stack of the operators on the way down
+ * to the operand being built.
+ */
+static dociter_t *_iteratepart(index_t *idx, query_plan_t *plan, int s, char **errmsg) {
+	struct frame *frames = malloc((s - plan->steps[s].start + 1) * sizeof(*frames));
+	if (frames == NULL) {
+		fatal_error("out of memory");
+	}
+	dociter_t *iter;
+	int i, numframes = _enter(idx, plan, s, 0, &frames[0], &iter, errmsg);
+
+	while (numframes > 0) {
+		struct frame *top = &frames[numframes - 1];
+		if (top->num < plan->steps[top->step].numargs) {
+			if (_enter(idx, plan, top->operands[top->num], numframes, &frames[numframes], &iter, errmsg)) {
+				numframes++;
+			} else if (iter != NULL) {
+				top->iters[top->num++] = iter;
+			} else {
+				break;
+			}
+			continue;
+		}
+		iter = _leave(idx, plan, top);
+		if (--numframes > 0) {
+			top = &frames[numframes - 1];
+			top->iters[top->num++] = iter;
+		}
+	}
+
+	// on error, destroy what was built so far
+	while (numframes > 0) {
+		struct frame *top = &frames[--numframes];
+		for (i = 0; i < top->num; i++) {
+			dociter_destroy(top->iters[i]);
+		}
+		_freeframe(top);
+	}
+	free(frames);
+	return iter;
 }
 
 
-static set_t *_andterm(map_t *map, char **q, char **errmsg, int level) {
-	// _andterm ::= _orterm
-	//          | _orterm "AND" _andterm
+dociter_t *_iterate(index_t *idx, query_plan_t *plan, char **errmsg) {
+	return _iteratepart(idx, plan, plan->numsteps - 1, errmsg);
+}
 
-	set_t *result, *left = _orterm(map, q, errmsg, level);
 
-	switch (get_token(q)) {
-		case AND:
+static set_u32_t *_evaluatepart(index_t *idx, query_plan_t *plan, int s, char **errmsg) {
+	struct query_step *step = &plan->steps[s];
+	char **words = &plan->words[step->words];
+	set_u32_t *result = NULL, *set;
+	int owned;
+
+	switch (step->op) {
+		case QUERY_WORD:
+			set = _operand(idx, plan, s, &owned, errmsg);
+			result = set_u32_copy(set); // do not delete original data destroying result
+			break;
+		case QUERY_WILDCARD:
+			result = index_lookupwildcard(idx, words[0], errmsg);
+			break;
+		case QUERY_FUZZY:
+			result = index_lookupfuzzy(idx, words[0], step->distance, errmsg);
+			break;
+		case QUERY_PHRASE:
+			result = index_lookupphrase(idx, words, step->numargs, errmsg);
+			break;
+		case QUERY_NEAR:
+			result = index_lookupnear(idx, words[0], words[1], step->distance, errmsg);
+			break;
+		case QUERY_OR:
+			if (_isdisjunction(plan, s)) {
+				// merge the whole chain at once rather than two sets at a time
+				struct operands ops;
+				_initoperands(&ops, plan, s);
+				_oroperands(idx, plan, s, &ops, INT_MAX, errmsg);
+				result = postings_union(ops.sets, ops.num, index_numdocs(idx));
+				_freeoperands(&ops);
+				break;
+			}
+			// fall through
+		case QUERY_AND:
+		case QUERY_ANDNOT:
 		{
-			*q += 3; // skip keyword
-			set_t *right = _andterm(map, q, errmsg, level);
-			if (right == NULL || left == NULL) {
-				result = NULL;
-			} else {
-				result = set_intersection(left, right);
-				set_destroy(left);
-				set_destroy(right);
+			// pull the documents through the operands without building their sets
+			dociter_t *iter = _iteratepart(idx, plan, s, errmsg);
+			if (iter != NULL) {
+				result = dociter_drain(iter);
+				dociter_destroy(iter);
 			}
 			break;
 		}
-		case EOQ:
-		case PARENTHESIS_RIGHT:
-		case ANDNOT:
-			result = left;
-			break;
-		default:
-			*errmsg = strdup("Expecting orterm or orterm \"AND\" andterm");
-			result = NULL;
 	}
 
 	return result;
 }
 
 
-set_t *_query(map_t *map, char **q, char **errmsg, int level) {
-	// _query ::= _andterm
-	//        | _andterm "ANDNOT" query
+set_u32_t *_evaluate(index_t *idx, query_plan_t *plan, char **errmsg) {
+	return _evaluatepart(idx, plan, plan->numsteps - 1, errmsg);
+}
 
-	set_t *result, *left = _andterm(map, q, errmsg, level);
 
-	switch (get_token(q)) {
-		case ANDNOT:
-		{
-			*q += 6; // skip keyword
-			set_t *right = _query(map, q, errmsg, level);
-			if (right == NULL || left == NULL) {
-				result = NULL;
+/*
+ * Counts the documents in all of the operands of a chain of ANDs, up to
+ * limit, intersecting them in the order of the query.
+ */
+static int _countand(index_t *idx, query_plan_t *plan, int s, int limit, char **errmsg) {
+	int *operands = _newoperands(plan, s), numargs = plan->steps[s].numargs;
+	int i, count = -1, owned, ownright;
+	set_u32_t *docs = _operand(idx, plan, operands[0], &owned, errmsg), *right, *set;
+
+	for (i = 1; docs != NULL; i++) {
+		if (docs->size == 0) {
+			count = 0;
+			break;
+		}
+		right = _operand(idx, plan, operands[i], &ownright, errmsg);
+		if (right == NULL) {
+			break;
+		}
+		if (i == numargs - 1) {
+			count = set_u32_intersectionsize(docs, right, limit);
+			_release(right, ownright);
+			break;
+		}
+		set = set_u32_intersection(docs, right);
+		_release(right, ownright);
+		_release(docs, owned);
+		docs = set;
+		owned = 1;
+	}
+	if (docs != NULL) {
+		_release(docs, owned);
+	}
+	free(operands);
+	return count;
+}
+
+
+int _count(index_t *idx, query_plan_t *plan, int limit, char **errmsg) {
+	int s = plan->numsteps - 1;
+	struct query_step *step = &plan->steps[s];
+	set_u32_t *left, *right, **sets;
+	int count = -1, ownleft, ownright, numsets;
+
+	switch (step->op) {
+		case QUERY_WORD:
+			left = _operand(idx, plan, s, &ownleft, errmsg);
+			count = left->size < limit ? left->size : limit;
+			break;
+		case QUERY_WILDCARD:
+		case QUERY_FUZZY:
+			if (step->op == QUERY_WILDCARD) {
+				numsets = index_expandwildcard(idx, plan->words[step->words], &sets, errmsg);
 			} else {
-				result = set_difference(left, right);
-				set_destroy(left);
-				set_destroy(right);
+				numsets = index_expandfuzzy(idx, plan->words[step->words], step->distance, &sets, errmsg);
+			}
+			if (numsets >= 0) {
+				count = postings_unionsize(sets, numsets, index_numdocs(idx), limit);
 			}
+			free(sets);
+			break;
+		case QUERY_PHRASE:
+		case QUERY_NEAR:
+			left = _evaluatepart(idx, plan, s, errmsg);
+			if (left != NULL) {
+				count = left->size < limit ? left->size : limit;
+				set_u32_destroy(left);
+			}
+			break;
+		case QUERY_OR:
+		{
+			struct operands ops;
+			_initoperands(&ops, plan, s);
+			switch (_oroperands(idx, plan, s, &ops, limit, errmsg)) {
+				case 0:
+					count = postings_unionsize(ops.sets, ops.num, index_numdocs(idx), limit);
+					break;
+				case 1:
+					// one operand alone reaches the limit
+					count = limit;
+					break;
+			}
+			_freeoperands(&ops);
 			break;
 		}
-			if (level > 0) {
-				result = left;
-			} else {
+		case QUERY_AND:
+			count = _countand(idx, plan, s, limit, errmsg);
+			break;
+		case QUERY_ANDNOT:
+		{
+			int operands[2];
+			_operands(plan, s, operands);
+			left = _operand(idx, plan, operands[0], &ownleft, errmsg);
+			if (left == NULL) {
+				break;
 			}
-		case PARENTHESIS_RIGHT:
-			if (level == 0) {
-				*errmsg = strdup("Missing left parenthesis");
-				result = NULL;
-			} else {
-				result = left;
+			if (left->size == 0) {
+				_release(left, ownleft);
+				count = 0;
+				break;
 			}
+			right = _operand(idx, plan, operands[1], &ownright, errmsg);
+			if (right != NULL) {
+				count = set_u32_differencesize(left, right, limit);
+				_release(right, ownright);
+			}
+			_release(left, ownleft);
 			break;
-		case EOQ:
-			result = left;
+		}
+	}
+
+	return count;
+}
+
+
+/*
+ * A distinct part of the queries of a batch.  Parts that match the same
+ * documents for the same reasons (see _format()) are merged, so the
+ * queries form a DAG and each part is computed once however many
+ * queries contain it.
+ */
+struct dagnode {
+	query_plan_t *plan;		// and the step of the first occurrence
+	int step;
+	int id;
+	struct dagnode **operands;	// of the chain, or left and right of ANDNOT
+	int numoperands;
+	int numdone;			// operands computed so far
+	int uses;			// by parents and queries, until the documents can go
+	int done;
+	set_u32_t *docs;		// NULL on error
+	int owned;
+	char *errmsg;
+};
+
+
+struct buffer {
+	char *text;
+	int len;
+	int capacity;
+};
+
+
+static void _append(struct buffer *buf, char *s) {
+	int len = strlen(s);
+	if (buf->len + len + 1 > buf->capacity) {
+		while (buf->len + len + 1 > buf->capacity) {
+			buf->capacity = (buf->capacity == 0 ? 64 : 2 * buf->capacity);
+		}
+		buf->text = realloc(buf->text, buf->capacity);
+		if (buf->text == NULL) {
+			fatal_error("out of memory");
+		}
+	}
+	memcpy(buf->text + buf->len, s, len + 1);
+	buf->len += len;
+}
+
+
+/*
+ * Appends the canonical text of the given leaf.
+ */
+static void _formatleaf(query_plan_t *plan, struct query_step *step, struct buffer *buf) {
+	char **words = &plan->words[step->words], distance[32];
+	int i;
+
+	switch (step->op) {
+		case QUERY_PHRASE:
+			_append(buf, "\"");
+			for (i = 0; i < step->numargs; i++) {
+				_append(buf, i > 0 ? " " : "");
+				_append(buf, words[i]);
+			}
+			_append(buf, "\"");
+			break;
+		case QUERY_FUZZY:
+			snprintf(distance, sizeof(distance), "~%d", step->distance);
+			_append(buf, words[0]);
+			_append(buf, distance);
+			break;
+		case QUERY_NEAR:
+			snprintf(distance, sizeof(distance), " NEAR/%d ", step->distance);
+			_append(buf, words[0]);
+			_append(buf, distance);
+			_append(buf, words[1]);
 			break;
 		default:
-			*errmsg = strdup("Expecting andterm or andterm \"ANDNOT\" query");
-			result = NULL;
+			_append(buf, words[0]);
+			break;
 	}
+}
 
-	return result;
+
+/*
+ * Returns the part of the DAG for the given step, adding it under the
+ * given key if it is not there yet.  Assigns whether it was added to
+ * added.
+ */
+static struct dagnode *_dagget(map_str_t *dag, query_plan_t *plan, int s, char *key, int *added) {
+	struct dagnode *d = map_str_get(dag, key);
+	*added = (d == NULL);
+	if (d != NULL) {
+		d->uses++;
+		free(key);
+		return d;
+	}
+
+	d = calloc(1, sizeof(*d));
+	if (d == NULL) {
+		fatal_error("out of memory");
+	}
+	d->plan = plan;
+	d->step = s;
+	d->id = map_str_size(dag);
+	d->uses = 1;
+	map_str_put(dag, key, d); // the map keeps the key
+	return d;
+}
+
+
+static int compare_ids(const void *a, const void *b) {
+	return (*(struct dagnode **)a)->id - (*(struct dagnode **)b)->id;
+}
+
+
+/*
+ * Returns the part of the DAG for the given plan, adding it and the
+ * parts of it that are not there yet.  Goes from the leaves up with a
+ * stack of the parts so far, and keys an operator by its parts, so that
+ * the keys stay short however deep the query.
+ */
+static struct dagnode *_dagadd(map_str_t *dag, query_plan_t *plan) {
+	struct dagnode **stack = malloc(plan->numsteps * sizeof(*stack));
+	if (stack == NULL) {
+		fatal_error("out of memory");
+	}
+	int i, j, num = 0, added;
+
+	for (i = 0; i < plan->numsteps; i++) {
+		struct query_step *step = &plan->steps[i];
+		struct buffer key = { NULL, 0, 0 };
+		_append(&key, "");
+		if (_isleaf(step->op)) {
+			_formatleaf(plan, step, &key);
+			stack[num++] = _dagget(dag, plan, i, key.text, &added);
+			continue;
+		}
+
+		// the operands of a chain may come in any order
+		struct dagnode **operands = &stack[num - step->numargs];
+		char id[32];
+		if (step->op != QUERY_ANDNOT) {
+			qsort(operands, step->numargs, sizeof(*operands), compare_ids);
+		}
+		_append(&key, step->op == QUERY_OR ? "(OR" : step->op == QUERY_AND ? "(AND" : "(ANDNOT");
+		for (j = 0; j < step->numargs; j++) {
+			snprintf(id, sizeof(id), " %d", operands[j]->id);
+			_append(&key, id);
+		}
+		struct dagnode *d = _dagget(dag, plan, i, key.text, &added);
+		if (added) {
+			d->operands = malloc(step->numargs * sizeof(*d->operands));
+			if (d->operands == NULL) {
+				fatal_error("out of memory");
+			}
+			memcpy(d->operands, operands, step->numargs * sizeof(*operands));
+			d->numoperands = step->numargs;
+		} else {
+			// already there, along with the uses of its operands
+			for (j = 0; j < step->numargs; j++) {
+				operands[j]->uses--;
+			}
+		}
+		num -= step->numargs;
+		stack[num++] = d;
+	}
+
+	struct dagnode *root = stack[0];
+	free(stack);
+	return root;
+}
+
+
+/*
+ * Drops one use of a part, and frees its documents after the last.
+ */
+static void _dagrelease(struct dagnode *d) {
+	if (--d->uses == 0 && d->owned) {
+		set_u32_destroy(d->docs);
+		d->docs = NULL;
+		d->owned = 0;
+	}
+}
+
+
+/*
+ * Computes the documents of a part of the DAG from those of its
+ * operands, which are done.
+ */
+static void _dagcompute(index_t *idx, struct dagnode *d) {
+	set_u32_t **sets = malloc((d->numoperands + 1) * sizeof(*sets));
+	if (sets == NULL) {
+		fatal_error("out of memory");
+	}
+	int i, num = d->numdone;
+	for (i = 0; i < num; i++) {
+		sets[i] = d->operands[i]->docs;
+	}
+
+	struct query_step *step = &d->plan->steps[d->step];
+	d->done = 1;
+	if (d->errmsg == NULL) {
+		set_u32_t *set;
+		d->owned = 1;
+		switch (step->op) {
+			case QUERY_WORD:
+				set = index_lookup(idx, d->plan->words[step->words]);
+				d->docs = (set != NULL ? set : &empty_set);
+				d->owned = 0;
+				break;
+			case QUERY_WILDCARD:
+			case QUERY_FUZZY:
+			case QUERY_PHRASE:
+			case QUERY_NEAR:
+				d->docs = _evaluatepart(idx, d->plan, d->step, &d->errmsg);
+				d->owned = (d->docs != NULL);
+				break;
+			default:
+				d->docs = _combine(idx, step->op, sets, num);
+				break;
+		}
+	}
+
+	for (i = 0; i < num; i++) {
+		_dagrelease(d->operands[i]);
+	}
+	free(sets);
+}
+
+
+/*
+ * Computes the documents of a part of the DAG, and of its operands
+ * first, unless that has been done already.  The given stack has room
+ * for every part of the DAG.
+ */
+static set_u32_t *_dageval(index_t *idx, struct dagnode *root, struct dagnode **stack) {
+	int num = 0;
+	if (!root->done) {
+		stack[num++] = root;
+	}
+
+	while (num > 0) {
+		struct dagnode *d = stack[num - 1];
+		if (d->numdone < d->numoperands && d->errmsg == NULL) {
+			struct dagnode *operand = d->operands[d->numdone];
+			if (!operand->done) {
+				stack[num++] = operand;
+				continue;
+			}
+			d->numdone++;
+			if (operand->docs == NULL) {
+				d->errmsg = strdup(operand->errmsg);
+			}
+			continue;
+		}
+		_dagcompute(idx, d);
+		num--;
+	}
+	return root->docs;
+}
+
+
+void _evaluatebatch(index_t *idx, query_plan_t **plans, int numplans, set_u32_t **results, char **errmsgs) {
+	map_str_t *dag = map_str_create();
+	struct dagnode **roots = malloc((numplans + 1) * sizeof(*roots));
+	if (roots == NULL) {
+		fatal_error("out of memory");
+	}
+
+	int i, numsteps = 1;
+	for (i = 0; i < numplans; i++) {
+		roots[i] = NULL;
+		if (plans[i] != NULL) {
+			roots[i] = _dagadd(dag, plans[i]);
+			numsteps += plans[i]->numsteps;
+		}
+	}
+
+	struct dagnode **stack = malloc(numsteps * sizeof(*stack));
+	if (stack == NULL) {
+		fatal_error("out of memory");
+	}
+	for (i = 0; i < numplans; i++) {
+		results[i] = NULL;
+		if (roots[i] == NULL) {
+			continue;
+		}
+		set_u32_t *docs = _dageval(idx, roots[i], stack);
+		if (docs == NULL) {
+			errmsgs[i] = strdup(roots[i]->errmsg);
+		} else if (roots[i]->uses == 1 && roots[i]->owned) {
+			// the last use, so take the documents
+			results[i] = docs;
+			roots[i]->docs = NULL;
+			roots[i]->owned = 0;
+		} else {
+			results[i] = set_u32_copy(docs);
+		}
+		_dagrelease(roots[i]);
+	}
+	free(stack);
+
+	map_str_iter_t *it = map_str_createiter(dag);
+	while (map_str_hasnext(it)) {
+		map_str_entry_t *e = map_str_next(it);
+		struct dagnode *d = e->value;
+		if (d->owned) {
+			set_u32_destroy(d->docs);
+		}
+		free(d->errmsg);
+		free(d->operands);
+		free(d);
+		free(e->key);
+	}
+	map_str_destroyiter(it);
+	map_str_destroy(dag);
+	free(roots);
+}
+
+
+/*
+ * A step, along with the hash of its canonical text.
+ */
+struct hashed {
+	unsigned long hash;
+	int step;
+};
+
+
+static int compare_hashes(const void *a, const void *b) {
+	unsigned long x = ((struct hashed *)a)->hash, y = ((struct hashed *)b)->hash;
+	return (x > y) - (x < y);
+}
+
+
+/*
+ * Assigns the operands of every operator of the part of a query that
+ * ends at the given step, in canonical order, to the given array from
+ * the given offsets on.  Goes from the first step on with a stack of the
+ * parts so far and the hashes of their canonical texts.  A chain is in
+ * the order of the hashes of its operands, which depend only on what
+ * the operands match, so the order of the query does not matter.
+ */
+static void _canonical(query_plan_t *plan, int s, int *operands, int *offsets) {
+	int first = plan->steps[s].start, num = 0, i, j;
+	struct hashed *stack = malloc((s - first + 1) * sizeof(*stack));
+	unsigned long *parts = malloc((s - first + 2) * sizeof(*parts));
+	if (stack == NULL || parts == NULL) {
+		fatal_error("out of memory");
+	}
+
+	for (i = first; i <= s; i++) {
+		struct query_step *step = &plan->steps[i];
+		if (_isleaf(step->op)) {
+			struct buffer buf = { NULL, 0, 0 };
+			_append(&buf, "");
+			_formatleaf(plan, step, &buf);
+			stack[num].hash = hash_string(buf.text);
+			stack[num++].step = i;
+			free(buf.text);
+			continue;
+		}
+
+		struct hashed *args = &stack[num - step->numargs];
+		if (step->op != QUERY_ANDNOT) {
+			qsort(args, step->numargs, sizeof(*args), compare_hashes);
+		}
+		parts[0] = step->op;
+		for (j = 0; j < step->numargs; j++) {
+			operands[offsets[i - first] + j] = args[j].step;
+			parts[j + 1] = args[j].hash;
+		}
+		num -= step->numargs;
+		stack[num].hash = hash_bytes(parts, (step->numargs + 1) * sizeof(*parts));
+		stack[num++].step = i;
+	}
+	free(stack);
+	free(parts);
+}
+
+
+/*
+ * Formats the part of a query that ends at the given step as canonical
+ * text (see _compile()), from the top down with a stack of the operators
+ * whose operands are being formatted, so that every word is copied once.
+ */
+static char *_format(query_plan_t *plan, int s) {
+	int first = plan->steps[s].start, n = s - first + 1, i, num = 0, total = 0;
+	int *operands = malloc(n * sizeof(*operands)), *offsets = malloc(n * sizeof(*offsets));
+	int *stack = malloc(n * sizeof(*stack)), *next = malloc(n * sizeof(*next));
+	if (operands == NULL || offsets == NULL || stack == NULL || next == NULL) {
+		fatal_error("out of memory");
+	}
+	for (i = first; i <= s; i++) {
+		offsets[i - first] = total;
+		total += (_isleaf(plan->steps[i].op) ? 0 : plan->steps[i].numargs);
+	}
+	_canonical(plan, s, operands, offsets);
+
+	struct buffer buf = { NULL, 0, 0 };
+	_append(&buf, "");
+	while (s >= 0) {
+		struct query_step *step = &plan->steps[s];
+		if (_isleaf(step->op)) {
+			_formatleaf(plan, step, &buf);
+		} else {
+			_append(&buf, "(");
+			stack[num] = s;
+			next[num++] = 0;
+		}
+
+		// on to the next operand, closing the operators that are done
+		s = -1;
+		while (num > 0 && s < 0) {
+			step = &plan->steps[stack[num - 1]];
+			if (next[num - 1] == step->numargs) {
+				_append(&buf, ")");
+				num--;
+				continue;
+			}
+			if (next[num - 1] > 0) {
+				_append(&buf, step->op == QUERY_OR ? " OR " : step->op == QUERY_AND ? " AND " : " ANDNOT ");
+			}
+			s = operands[offsets[stack[num - 1] - first] + next[num - 1]++];
+		}
+	}
+
+	free(operands);
+	free(offsets);
+	free(stack);
+	free(next);
+	return buf.text;
+}
+
+
+query_plan_t *_compile(char *q, tokenizer_t *tokenizer, char **errmsg) {
+	struct builder b = { NULL, NULL, 0, NULL, 0, 0 };
+	if (!_parse(q, tokenizer, &b, errmsg)) {
+		_freebuilder(&b);
+		return NULL;
+	}
+
+	query_plan_t *plan = _lower(&b);
+	plan->key = _format(plan, plan->numsteps - 1);
+	plan->scoredwords = _scoredwords(plan);
+	plan->disjunction = _isdisjunction(plan, plan->numsteps - 1);
+	return plan;
+}
+
+
+void _freeplan(query_plan_t *plan) {
+	if (plan != NULL) {
+		list_destroy(plan->scoredwords);
+		free(plan->key);
+		free(plan->words);
+		free(plan->steps);
+		free(plan);
+	}
 }
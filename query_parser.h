@@ -1,10 +1,43 @@
 #ifndef QUERY_PARSER_H
 #define QUERY_PARSER_H
 
-#include "map.h"
-#include "set.h"
+#include "dociter.h"
+#include "index.h"
+#include "list.h"
+#include "set_u32.h"
+#include "tokenizer.h"
 
-/* parse a query using this BNF grammar
+/*
+ * The operations of compiled queries.  The leaves look up words and the
+ * operators combine the results of their operands.
+ */
+enum query_op { QUERY_WORD, QUERY_WILDCARD, QUERY_FUZZY, QUERY_PHRASE, QUERY_NEAR, QUERY_OR, QUERY_AND, QUERY_ANDNOT };
+
+/* one step of a compiled query; a chain of ORs or of ANDs is one step
+ * with all of the operands of the chain */
+struct query_step {
+	enum query_op op;
+	int numargs;	/* the words of a leaf, or the operands of an operator */
+	int words;	/* the first word of a leaf in the plan's words */
+	int distance;	/* NEAR, or the number of edits of FUZZY */
+	int start;	/* the first step of the part of the query that ends here */
+};
+
+/* a compiled query: its steps in postfix order, so that the operands of
+ * an operator are the parts of the query just before it and the last
+ * step is the whole query, along with what every execution of it needs
+ * that does not depend on the index; nothing in it changes once
+ * compiled, so threads may share it */
+struct query_plan {
+	struct query_step *steps;
+	int numsteps;
+	char **words;		/* the words of the leaves, in one block with their text */
+	char *key;		/* the canonical text of the query */
+	list_t *scoredwords;	/* every word that a matching document may contain */
+	int disjunction;	/* 1 if the query is plain words separated by OR */
+};
+
+/* compile a query using this BNF grammar
  *
  * query   ::= andterm
  *         | andterm "ANDNOT" query
@@ -13,9 +46,51 @@
  * orterm  ::= term
  *         | term "OR" orterm
  * term    ::= "(" query ")"
+ *         | '"' <word> ... '"'
+ *         | <word> "NEAR/" <distance> <word>
+ *         | <word> "~" <edits>
  *         | <word>
+ *         | <word>"*"
+ *         | "*"<word>
+ *
+ * splitting phrases into words with the given tokenizer; the canonical
+ * text of the query has every chain of ORs or ANDs in parentheses and
+ * its operands in an order of their own, so that queries which only
+ * differ in spacing, redundant parentheses or the order of the operands
+ * of OR and AND give the same text; the scored words are not wildcards
+ * or fuzzy words, nor words after ANDNOT, and belong to the plan; every
+ * walk over the plan uses a stack of its own rather than recursion, so
+ * queries may nest as deep as they are long
+ *
+ * returns: NULL on error along with errmsg and the plan otherwise */
+query_plan_t *_compile(char *q, tokenizer_t *tokenizer, char **errmsg);
+
+/* free a compiled query */
+void _freeplan(query_plan_t *plan);
+
+/* evaluate a compiled query
+ *
+ * returns: NULL on error along with errmsg and set of document ids otherwise */
+set_u32_t *_evaluate(index_t *idx, query_plan_t *plan, char **errmsg);
+
+/* build a tree of document iterators (see dociter.h) for a compiled
+ * query; wildcards, phrases and NEAR are matched up front, the rest
+ * lazily
+ *
+ * returns: NULL on error along with errmsg and the iterator otherwise */
+dociter_t *_iterate(index_t *idx, query_plan_t *plan, char **errmsg);
+
+/* evaluate several compiled queries at once, computing each distinct
+ * part of them only once; plans may be NULL, and give NULL
+ *
+ * returns: the sets of document ids (or NULL on error along with the
+ * errmsg) in results, which belong to the caller */
+void _evaluatebatch(index_t *idx, query_plan_t **plans, int numplans, set_u32_t **results, char **errmsgs);
+
+/* count the documents that match a compiled query, without building the
+ * set of matches at the root, and stopping once there are limit of them
  *
- * returns: NULL on error along with errmsg and set with files otherwise */
-set_t *_query(map_t *map, char **q, char **errmsg, int level);
+ * returns: -1 on error along with errmsg and the count (at most limit) otherwise */
+int _count(index_t *idx, query_plan_t *plan, int limit, char **errmsg);
 
 #endif /* QUERY_PARSER_H */
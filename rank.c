@@ -0,0 +1,500 @@
+#include "common.h"
+#include "dociter.h"
+#include "rank.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * How often rank_topk_or() checks that the bounds pay off, in documents
+ * it considers, and the postings that the cursors must skip per
+ * document considered for them to.
+ */
+enum { WAND_WINDOW = 256, WAND_MINSKIP = 8 };
+
+/*
+ * A word's position in its posting list, for rank_topk_or() and
+ * rank_topk_iter().
+ */
+typedef struct {
+    set_u32_t *docs;
+    int pos;
+    uint32_t doc;           /* Current document, or UINT32_MAX at the end */
+    int block;              /* Block found by the last blockbound() */
+    double idf;
+    postings_t *postings;
+} cursor_t;
+
+/*
+ * Returns 1 if hit a ranks below hit b.
+ */
+static inline int worse(rank_hit_t *a, rank_hit_t *b)
+{
+    return a->score < b->score || (a->score == b->score && a->doc > b->doc);
+}
+
+/*
+ * The hits are kept in a heap with the worst hit at the top, so a new
+ * hit only has to beat the top to get in.
+ */
+static void siftup(rank_hit_t *heap, int i)
+{
+    rank_hit_t tmp = heap[i];
+
+    while (i > 0 && worse(&tmp, &heap[(i - 1) / 2])) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = tmp;
+}
+
+static void siftdown(rank_hit_t *heap, int n, int i)
+{
+    rank_hit_t tmp = heap[i];
+
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= n)
+            break;
+        if (child + 1 < n && worse(&heap[child + 1], &heap[child]))
+            child++;
+        if (!worse(&heap[child], &tmp))
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = tmp;
+}
+
+/*
+ * Sorts the heap of the given number of hits in decreasing order of
+ * score, and returns the number.
+ */
+static int sorthits(rank_hit_t *hits, int n)
+{
+    int i;
+
+    /* Pop the worst hit to the back until the hits are in order */
+    for (i = n - 1; i > 0; i--) {
+        rank_hit_t tmp = hits[0];
+        hits[0] = hits[i];
+        hits[i] = tmp;
+        siftdown(hits, i, 0);
+    }
+    return n;
+}
+
+/*
+ * Returns 1 if the given document is in the deleted bitmap of the given
+ * statistics.
+ */
+static inline int is_deleted(rank_stats_t *stats, uint32_t doc)
+{
+    return stats->deleted != NULL &&
+           ((__atomic_load_n(&stats->deleted[doc / 64], __ATOMIC_RELAXED) >> (doc % 64)) & 1);
+}
+
+double rank_idf(rank_stats_t *stats, uint32_t df)
+{
+    return log(1.0 + (stats->numdocs - df + 0.5) / (df + 0.5));
+}
+
+double rank_bm25(rank_stats_t *stats, double idf, uint32_t freq, uint32_t doclen)
+{
+    double norm = BM25_K1 * (1.0 - BM25_B + BM25_B * doclen / stats->avgdoclen);
+    return idf * freq * (BM25_K1 + 1.0) / (freq + norm);
+}
+
+int rank_topk(postings_t **words, int numwords, set_u32_t *docs,
+              rank_stats_t *stats, rank_hit_t *hits, int k)
+{
+    double *idf = malloc((numwords + 1) * sizeof(double));
+    int *pos = calloc(numwords + 1, sizeof(int));
+    int i, w, n = 0;
+
+    if (idf == NULL || pos == NULL)
+        fatal_error("out of memory");
+    for (w = 0; w < numwords; w++)
+        idf[w] = rank_idf(stats, stats->dfs != NULL ? stats->dfs[w] : words[w]->docs->size);
+
+    for (i = 0; i < docs->size && k > 0; i++) {
+        rank_hit_t hit = { docs->elems[i], 0.0 };
+
+        for (w = 0; w < numwords; w++) {
+            set_u32_t *wdocs = words[w]->docs;
+            pos[w] = set_u32_seek(wdocs, pos[w], hit.doc);
+            if (pos[w] < wdocs->size && wdocs->elems[pos[w]] == hit.doc)
+                hit.score += rank_bm25(stats, idf[w], words[w]->freqs[pos[w]],
+                                       stats->doclens[hit.doc]);
+        }
+
+        if (n < k) {
+            hits[n] = hit;
+            siftup(hits, n++);
+        }
+        else if (worse(&hits[0], &hit)) {
+            hits[0] = hit;
+            siftdown(hits, n, 0);
+        }
+    }
+
+    free(idf);
+    free(pos);
+    return sorthits(hits, n);
+}
+
+void rank_setbounds(postings_t *postings, rank_stats_t *stats)
+{
+    set_u32_t *docs = postings->docs;
+    int numblocks = (docs->size + POSTINGS_BLOCK - 1) / POSTINGS_BLOCK;
+    int i;
+
+    free(postings->blockmax);
+    postings->blockmax = malloc((numblocks + 1) * sizeof(float));
+    if (postings->blockmax == NULL)
+        fatal_error("out of memory");
+    postings->maxscore = 0;
+    for (i = 0; i < numblocks; i++)
+        postings->blockmax[i] = 0;
+
+    for (i = 0; i < docs->size; i++) {
+        double score = rank_bm25(stats, 1.0, postings->freqs[i], stats->doclens[docs->elems[i]]);
+        /* Round up, so the bound holds after conversion to float */
+        float bound = nextafterf((float)score, INFINITY);
+        if (bound > postings->blockmax[i / POSTINGS_BLOCK])
+            postings->blockmax[i / POSTINGS_BLOCK] = bound;
+        if (bound > postings->maxscore)
+            postings->maxscore = bound;
+    }
+}
+
+/*
+ * Moves the cursor to the first document not smaller than doc.
+ */
+static void seekcursor(cursor_t *c, uint32_t doc)
+{
+    c->pos = set_u32_seek(c->docs, c->pos, doc);
+    c->doc = c->pos < c->docs->size ? c->docs->elems[c->pos] : UINT32_MAX;
+}
+
+/*
+ * Returns the last document of the given block of the cursor's list.
+ */
+static inline uint32_t lastdoc(cursor_t *c, int block)
+{
+    int end = (block + 1) * POSTINGS_BLOCK;
+    return c->docs->elems[(end < c->docs->size ? end : c->docs->size) - 1];
+}
+
+/*
+ * Returns the score bound of the block that would hold the given
+ * document, and assigns the last document of that block to the given
+ * pointer.  Only looks at the last document of each block, without
+ * moving the cursor itself.
+ */
+static double blockbound(cursor_t *c, uint32_t doc, uint32_t *last)
+{
+    int numblocks = (c->docs->size + POSTINGS_BLOCK - 1) / POSTINGS_BLOCK;
+    int block = c->pos / POSTINGS_BLOCK;
+
+    /* Resume from the previous search unless it went past doc */
+    if (c->block > block && lastdoc(c, c->block - 1) < doc)
+        block = c->block;
+    while (block < numblocks - 1 && lastdoc(c, block) < doc)
+        block++;
+    c->block = block;
+    *last = lastdoc(c, block);
+    return c->idf * c->postings->blockmax[block];
+}
+
+/*
+ * Moves the cursor at order[i] to its place in the order of documents.
+ */
+static void reorder(cursor_t *cursors, int *order, int numcursors, int i)
+{
+    int tmp = order[i];
+
+    while (i + 1 < numcursors && cursors[order[i + 1]].doc < cursors[tmp].doc) {
+        order[i] = order[i + 1];
+        i++;
+    }
+    order[i] = tmp;
+}
+
+/*
+ * Returns the number of postings that the given cursors have passed.
+ */
+static long passed(cursor_t *cursors, int numcursors)
+{
+    long n = 0;
+    int i;
+
+    for (i = 0; i < numcursors; i++)
+        n += cursors[i].pos;
+    return n;
+}
+
+/*
+ * Puts the cursors that have not reached the end in the given order of
+ * their current document, and returns their number.
+ */
+static int sortcursors(cursor_t *cursors, int numwords, int *order)
+{
+    int i, n = 0;
+
+    for (i = 0; i < numwords; i++) {
+        if (cursors[i].doc != UINT32_MAX)
+            order[n++] = i;
+    }
+    for (i = n - 2; i >= 0; i--)
+        reorder(cursors, order, n, i);
+    return n;
+}
+
+/*
+ * Scores every document that the cursors are on, in order and without
+ * the bounds, until they have passed at least the given number of
+ * postings more, or reached the end.  Adds the hits to the heap of the
+ * given number of hits, and returns the new number.
+ */
+static int scoreall(cursor_t *cursors, int numwords, rank_stats_t *stats,
+                    rank_hit_t *hits, int n, int k, long postings)
+{
+    int i;
+
+    while (postings > 0) {
+        uint32_t doc = UINT32_MAX;
+        for (i = 0; i < numwords; i++) {
+            if (cursors[i].doc < doc)
+                doc = cursors[i].doc;
+        }
+        if (doc == UINT32_MAX)
+            break;
+
+        /* Score in word order, to add up exactly like rank_topk() */
+        rank_hit_t hit = { doc, 0.0 };
+        for (i = 0; i < numwords; i++) {
+            cursor_t *c = &cursors[i];
+            if (c->doc == doc) {
+                hit.score += rank_bm25(stats, c->idf, c->postings->freqs[c->pos],
+                                       stats->doclens[doc]);
+                c->pos++;
+                c->doc = c->pos < c->docs->size ? c->docs->elems[c->pos] : UINT32_MAX;
+                postings--;
+            }
+        }
+        if (is_deleted(stats, doc))
+            continue;
+        if (n < k) {
+            hits[n] = hit;
+            siftup(hits, n++);
+        }
+        else if (worse(&hits[0], &hit)) {
+            hits[0] = hit;
+            siftdown(hits, n, 0);
+        }
+    }
+    return n;
+}
+
+int rank_topk_or(postings_t **words, int numwords, rank_stats_t *stats,
+                 rank_hit_t *hits, int k)
+{
+    cursor_t *cursors = malloc((numwords + 1) * sizeof(cursor_t));
+    int *order = malloc((numwords + 1) * sizeof(int));
+    int i, j, n = 0, numcursors, iterations = 0;
+    long start = 0, burst = WAND_MINSKIP * WAND_WINDOW;
+
+    if (cursors == NULL || order == NULL)
+        fatal_error("out of memory");
+    for (i = 0; i < numwords; i++) {
+        cursor_t *c = &cursors[i];
+        c->postings = words[i];
+        c->docs = words[i]->docs;
+        c->pos = 0;
+        c->block = 0;
+        c->doc = c->docs->size > 0 ? c->docs->elems[0] : UINT32_MAX;
+        c->idf = rank_idf(stats, stats->dfs != NULL ? stats->dfs[i] : c->docs->size);
+    }
+    numcursors = sortcursors(cursors, numwords, order);
+
+    while (numcursors > 0 && k > 0) {
+        /*
+         * Every window of iterations with a full heap, check that the
+         * bounds let the cursors skip enough postings to pay for the
+         * work of finding what to skip.  If not, score the next postings
+         * without the bounds, twice as many each time, so that queries
+         * where the bounds cannot prune cost little more than scoring
+         * everything, while the bounds get another chance once the
+         * threshold is higher.
+         */
+        if (n == k && iterations++ == 0) {
+            start = passed(cursors, numwords);
+        }
+        else if (n == k && iterations > WAND_WINDOW) {
+            iterations = 0;
+            if (passed(cursors, numwords) - start < WAND_MINSKIP * WAND_WINDOW) {
+                n = scoreall(cursors, numwords, stats, hits, n, k, burst);
+                burst *= 2;
+                numcursors = sortcursors(cursors, numwords, order);
+                continue;
+            }
+        }
+
+        /* Documents must score above this to get into the top k */
+        double threshold = n < k ? -1.0 : hits[0].score;
+        double bound = 0;
+        int pivot;
+
+        /* The pivot is the first cursor where the bounds add up */
+        for (pivot = 0; pivot < numcursors; pivot++) {
+            bound += cursors[order[pivot]].idf * cursors[order[pivot]].postings->maxscore;
+            if (bound > threshold)
+                break;
+        }
+        if (pivot == numcursors)
+            break;
+        uint32_t doc = cursors[order[pivot]].doc;
+
+        /* Include the cursors after the pivot that are on the same document */
+        while (pivot + 1 < numcursors && cursors[order[pivot + 1]].doc == doc)
+            pivot++;
+
+        /*
+         * Tighten the bound with the blocks that would hold doc.  Once
+         * it is above the threshold, doc is a candidate and the rest of
+         * the blocks do not matter.
+         */
+        uint32_t skipto = pivot + 1 < numcursors ? cursors[order[pivot + 1]].doc : UINT32_MAX;
+        bound = 0;
+        for (i = 0; i <= pivot && bound <= threshold; i++) {
+            uint32_t last;
+            bound += blockbound(&cursors[order[i]], doc, &last);
+            if (last < skipto - 1)
+                skipto = last + 1;
+        }
+
+        if (bound <= threshold) {
+            /* Nothing before skipto can get in */
+            for (i = pivot; i >= 0; i--) {
+                seekcursor(&cursors[order[i]], skipto);
+                reorder(cursors, order, numcursors, i);
+            }
+        }
+        else if (cursors[order[0]].doc == doc) {
+            /* Score in word order, to add up exactly like rank_topk() */
+            rank_hit_t hit = { doc, 0.0 };
+            /* Removed documents stay in the postings until they are compacted */
+            int live = !is_deleted(stats, doc);
+            for (i = 0; i < numwords; i++) {
+                cursor_t *c = &cursors[i];
+                if (c->doc == doc)
+                    hit.score += rank_bm25(stats, c->idf, c->postings->freqs[c->pos],
+                                           stats->doclens[doc]);
+            }
+            if (live && n < k) {
+                hits[n] = hit;
+                siftup(hits, n++);
+            }
+            else if (live && worse(&hits[0], &hit)) {
+                hits[0] = hit;
+                siftdown(hits, n, 0);
+            }
+            for (i = pivot; i >= 0; i--) {
+                seekcursor(&cursors[order[i]], doc + 1);
+                reorder(cursors, order, numcursors, i);
+            }
+        }
+        else {
+            /* Documents before the pivot's cannot get in */
+            for (i = pivot - 1; i >= 0; i--) {
+                if (cursors[order[i]].doc < doc) {
+                    seekcursor(&cursors[order[i]], doc);
+                    reorder(cursors, order, numcursors, i);
+                }
+            }
+        }
+
+        /* Drop the cursors that reached the end */
+        for (i = j = 0; i < numcursors; i++) {
+            if (cursors[order[i]].doc != UINT32_MAX)
+                order[j++] = order[i];
+        }
+        numcursors = j;
+    }
+
+    free(cursors);
+    free(order);
+    return sorthits(hits, n);
+}
+
+int rank_topk_iter(postings_t **words, int numwords, dociter_t *iter,
+                   rank_stats_t *stats, rank_hit_t *hits, int k)
+{
+    cursor_t *cursors = malloc((numwords + 1) * sizeof(cursor_t));
+    uint32_t doc;
+    int i, n = 0;
+
+    if (cursors == NULL)
+        fatal_error("out of memory");
+    for (i = 0; i < numwords; i++) {
+        cursor_t *c = &cursors[i];
+        c->postings = words[i];
+        c->docs = words[i]->docs;
+        c->pos = 0;
+        c->block = 0;
+        c->doc = 0;
+        c->idf = rank_idf(stats, stats->dfs != NULL ? stats->dfs[i] : c->docs->size);
+    }
+
+    doc = k > 0 ? dociter_next(iter) : DOCITER_END;
+    while (doc != DOCITER_END) {
+        rank_hit_t hit = { doc, 0.0 };
+
+        if (n == k) {
+            /* The blocks that would hold doc bound the documents up to skipto */
+            uint32_t skipto = DOCITER_END, last;
+            double bound = 0;
+            for (i = 0; i < numwords && bound <= hits[0].score; i++) {
+                cursor_t *c = &cursors[i];
+                if (c->docs->size == 0)
+                    continue;
+                double b = blockbound(c, doc, &last);
+                if (last < doc)
+                    continue;       /* Past the end of the list, so it adds nothing */
+                bound += b;
+                if (last < skipto - 1)
+                    skipto = last + 1;
+            }
+            if (bound <= hits[0].score) {
+                /* Nothing before skipto can get in */
+                doc = skipto == DOCITER_END ? DOCITER_END : dociter_advance(iter, skipto);
+                continue;
+            }
+        }
+
+        /* Score in word order, to add up exactly like rank_topk() */
+        for (i = 0; i < numwords; i++) {
+            cursor_t *c = &cursors[i];
+            seekcursor(c, doc);
+            if (c->doc == doc)
+                hit.score += rank_bm25(stats, c->idf, c->postings->freqs[c->pos],
+                                       stats->doclens[doc]);
+        }
+        if (!is_deleted(stats, doc)) {
+            if (n < k) {
+                hits[n] = hit;
+                siftup(hits, n++);
+            }
+            else if (worse(&hits[0], &hit)) {
+                hits[0] = hit;
+                siftdown(hits, n, 0);
+            }
+        }
+        doc = dociter_next(iter);
+    }
+
+    free(cursors);
+    return sorthits(hits, n);
+}
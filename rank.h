@@ -0,0 +1,109 @@
+#ifndef RANK_H
+#define RANK_H
+
+#include "dociter.h"
+#include "postings.h"
+#include "set_u32.h"
+
+#include <stdint.h>
+
+/*
+ * BM25 parameters.  K1 controls how quickly repeated occurrences of a
+ * word in a document stop adding to its score, and B how much the
+ * score of long documents is reduced.
+ */
+#define BM25_K1 1.2
+#define BM25_B 0.75
+
+/*
+ * Collection statistics used for scoring.  The number of documents
+ * that contain a word is the size of its posting list, unless dfs
+ * gives it, in the order of the words passed to the functions below,
+ * e.g. to score the documents of several indexes alike.
+ */
+typedef struct {
+    uint32_t numdocs;
+    uint32_t *doclens;      /* Document id -> number of words */
+    double avgdoclen;
+    uint64_t *deleted;      /* Bitmap of documents to leave out, or NULL */
+    uint32_t *dfs;          /* Documents that contain each of the words, or NULL */
+} rank_stats_t;
+
+/*
+ * A scored document.
+ */
+typedef struct {
+    uint32_t doc;
+    double score;
+} rank_hit_t;
+
+/*
+ * Returns the inverse document frequency of a word that occurs in
+ * the given number of documents.
+ */
+double rank_idf(rank_stats_t *stats, uint32_t df);
+
+/*
+ * Returns the BM25 score contribution of a word with the given inverse
+ * document frequency that occurs freq times in a document of the
+ * given length.
+ */
+double rank_bm25(rank_stats_t *stats, double idf, uint32_t freq, uint32_t doclen);
+
+/*
+ * Scores each of the given documents by the sum of the BM25 scores of
+ * the given words, and assigns the k best to hits in decreasing order
+ * of score (ties in increasing order of id).  Returns the number of
+ * hits, which is less than k if there are fewer documents.
+ *
+ * The documents are visited in order, and each word's posting list is
+ * advanced by galloping, so only the words' cursors and a heap of k
+ * hits are kept, no matter how many documents there are.
+ */
+int rank_topk(postings_t **words, int numwords, set_u32_t *docs,
+              rank_stats_t *stats, rank_hit_t *hits, int k);
+
+/*
+ * Computes the score bounds of the given posting list: for each block
+ * of POSTINGS_BLOCK documents, an upper bound on the score the word
+ * contributes to any of them, not counting the inverse document
+ * frequency.  The bounds depend on the document lengths, so they must
+ * be recomputed after documents are added.
+ */
+void rank_setbounds(postings_t *postings, rank_stats_t *stats);
+
+/*
+ * Like rank_topk(), but scores every document that contains any of the
+ * given words, whose score bounds must be up to date.
+ *
+ * Uses Block-Max WAND: the word cursors are kept in order of document
+ * id, and a document is only scored if the bounds of the words that
+ * may occur in it add up to more than the score of the k'th best hit
+ * so far.  Runs of documents whose block bounds are too low are
+ * skipped without looking at them.  When the bounds do not let it skip
+ * enough, as for words in most documents, it scores the next documents
+ * without them, so it is never much slower than scoring everything.
+ * The result is the same as that of rank_topk() over the union of the
+ * words' documents, less those in the deleted bitmap of the statistics.
+ */
+int rank_topk_or(postings_t **words, int numwords, rank_stats_t *stats,
+                 rank_hit_t *hits, int k);
+
+/*
+ * Like rank_topk(), but scores the documents that the given iterator
+ * produces (see dociter.h), e.g. the matches of a query with AND or
+ * ANDNOT, without building the set of them.  The words' score bounds
+ * must be up to date.
+ *
+ * Once there are k hits, a document is only scored if the bounds of
+ * the blocks that would hold it add up to more than the score of the
+ * k'th best hit, and otherwise the iterator is advanced past the first
+ * of those blocks to end, since no document before that can score
+ * more.  The result is the same as that of rank_topk() over the
+ * documents of the iterator, less those in the deleted bitmap of the
+ * statistics.
+ */
+int rank_topk_iter(postings_t **words, int numwords, dociter_t *iter,
+                   rank_stats_t *stats, rank_hit_t *hits, int k);
+
+#endif
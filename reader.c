@@ -0,0 +1,636 @@
+#include "common.h"
+#include "list.h"
+#include "reader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#endif
+
+/*
+ * A file that has been read, or left out, and waits to be handed out.
+ */
+typedef struct {
+    char *path;
+    char *text;
+    size_t len;
+    enum skip_reason reason;
+    int error;                  /* errno if the file could not be read, or 0 */
+} result_t;
+
+#ifdef HAVE_IO_URING
+/*
+ * The queues of an io_uring, shared with the kernel, and used without
+ * liburing.
+ */
+typedef struct {
+    int fd;
+    unsigned *sqtail, *sqmask, *sqarray;
+    unsigned *cqhead, *cqtail, *cqmask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqring, *cqring;
+    size_t sqringsize, cqringsize, sqessize;
+    unsigned entries;
+    unsigned queued;            /* Operations not yet submitted */
+    unsigned inflight;          /* Operations submitted and not yet completed */
+} ring_t;
+
+/*
+ * A file in flight.  It is being opened while fd is -1, and read after.
+ */
+typedef struct {
+    result_t *result;           /* NULL if the slot is free */
+    int fd;
+    size_t size;                /* The size of the file when it was opened */
+    int sniffed;                /* 1 once its first block has been looked at */
+} slot_t;
+
+/* The user data of operations that belong to no slot */
+#define CLOSE_TAG UINT64_MAX
+#endif
+
+struct reader {
+    crawler_t *crawler;
+    int depth;
+    list_t *ready;              /* result_t's to hand out */
+#ifdef HAVE_IO_URING
+    int uring;                  /* 1 if files are read with the ring */
+    ring_t ring;
+    slot_t *slots;              /* depth of them */
+    int active;                 /* Slots in use */
+    int crawled;                /* 1 once the crawler is done */
+#endif
+    /* The pool of threads, if the ring is not used */
+    pthread_mutex_t lock;
+    pthread_cond_t readable;    /* Signaled when results are ready, or a thread ends */
+    pthread_cond_t writable;    /* Signaled when results are taken, or the reader stops */
+    pthread_t *threads;
+    int numthreads;
+    int running;
+    int stop;
+};
+
+static result_t *result_create(char *path)
+{
+    result_t *result = calloc(1, sizeof(result_t));
+
+    if (result == NULL)
+        fatal_error("out of memory");
+    result->path = path;
+    return result;
+}
+
+static void result_destroy(result_t *result)
+{
+    free(result->path);
+    free(result->text);
+    free(result);
+}
+
+/*
+ * Returns the number of bytes at the start of a file of the given size
+ * that are read and sniffed before the rest.
+ */
+static size_t head_len(size_t size)
+{
+    return size < SNIFF_LEN ? size : SNIFF_LEN;
+}
+
+/*
+ * Looks at the first block of the given result, once it has been read,
+ * and drops the text if the file, of the given size, is not worth
+ * indexing, so the rest of it is never read.  Returns 1 if the text is
+ * dropped, or 0 otherwise.
+ */
+static int sniff_result(result_t *result, size_t size)
+{
+    result->reason = sniff_file(result->text, head_len(result->len));
+    if (result->reason == SKIP_NONE)
+        return 0;
+    free(result->text);
+    result->text = NULL;
+    result->len = size;
+    return 1;
+}
+
+/*
+ * Checks the size of the given opened file, and allocates the text of
+ * the given result to hold it.  Returns the size, or -1 if the file is
+ * left out or cannot be read.
+ */
+static ssize_t open_result(result_t *result, int fd)
+{
+    struct stat s;
+
+    if (fstat(fd, &s) != 0) {
+        result->error = errno;
+        return -1;
+    }
+    if (s.st_size > MAX_FILE_SIZE) {
+        result->reason = SKIP_SIZE;
+        result->len = s.st_size;
+        return -1;
+    }
+    result->text = malloc(s.st_size + 1);
+    if (result->text == NULL)
+        fatal_error("out of memory");
+    return s.st_size;
+}
+
+#ifdef HAVE_IO_URING
+static int ring_supports(int fd)
+{
+    int ops[] = { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE };
+    size_t i, size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    int supported = 1;
+
+    if (probe == NULL)
+        fatal_error("out of memory");
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+        free(probe);
+        return 0;
+    }
+    for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+            supported = 0;
+    }
+    free(probe);
+    return supported;
+}
+
+/*
+ * Sets up the given ring with room for the given number of operations.
+ * Returns 0, or -1 if io_uring is unavailable or lacks the operations
+ * that the reader needs.
+ */
+static int ring_init(ring_t *ring, unsigned entries)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd < 0)
+        return -1;
+    if (!(p.features & IORING_FEAT_NODROP) || !ring_supports(ring->fd)) {
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sqringsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cqringsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqringsize > ring->sqringsize)
+            ring->sqringsize = ring->cqringsize;
+        ring->cqringsize = ring->sqringsize;
+    }
+    ring->sqring = mmap(NULL, ring->sqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    ring->cqring = ring->sqring;
+    if (ring->sqring != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP))
+        ring->cqring = mmap(NULL, ring->cqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+    ring->sqessize = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqring == MAP_FAILED || ring->cqring == MAP_FAILED || ring->sqes == MAP_FAILED)
+        fatal_error("mmap() of io_uring failed");
+
+    ring->sqtail = (unsigned *)((char *)ring->sqring + p.sq_off.tail);
+    ring->sqmask = (unsigned *)((char *)ring->sqring + p.sq_off.ring_mask);
+    ring->sqarray = (unsigned *)((char *)ring->sqring + p.sq_off.array);
+    ring->cqhead = (unsigned *)((char *)ring->cqring + p.cq_off.head);
+    ring->cqtail = (unsigned *)((char *)ring->cqring + p.cq_off.tail);
+    ring->cqmask = (unsigned *)((char *)ring->cqring + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cqring + p.cq_off.cqes);
+    ring->entries = p.sq_entries;
+    return 0;
+}
+
+static void ring_destroy(ring_t *ring)
+{
+    munmap(ring->sqes, ring->sqessize);
+    if (ring->cqring != ring->sqring)
+        munmap(ring->cqring, ring->cqringsize);
+    munmap(ring->sqring, ring->sqringsize);
+    close(ring->fd);
+}
+
+/*
+ * Queues the given operation, to be submitted by the next ring_wait().
+ */
+static void ring_push(ring_t *ring, struct io_uring_sqe *sqe)
+{
+    unsigned tail = *ring->sqtail, i = tail & *ring->sqmask;
+
+    ring->sqes[i] = *sqe;
+    ring->sqarray[i] = i;
+    /* The kernel must see the operation before the new tail */
+    __atomic_store_n(ring->sqtail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+}
+
+/*
+ * Submits the queued operations, and waits for at least one operation
+ * to complete.
+ */
+static void ring_wait(ring_t *ring)
+{
+    long n = syscall(__NR_io_uring_enter, ring->fd, ring->queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+
+    if (n < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+            return;
+        fatal_error("io_uring_enter() failed");
+    }
+    ring->queued -= n;
+    ring->inflight += n;
+}
+
+static void queue_open(reader_t *reader, int i)
+{
+    struct io_uring_sqe sqe;
+
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_OPENAT;
+    sqe.fd = AT_FDCWD;
+    sqe.addr = (uintptr_t)reader->slots[i].result->path;
+    sqe.open_flags = O_RDONLY | O_CLOEXEC;
+    sqe.user_data = i;
+    ring_push(&reader->ring, &sqe);
+}
+
+static void queue_read(reader_t *reader, int i)
+{
+    slot_t *slot = &reader->slots[i];
+    struct io_uring_sqe sqe;
+
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_READ;
+    sqe.fd = slot->fd;
+    sqe.addr = (uintptr_t)(slot->result->text + slot->result->len);
+    /* Only the first block until it has been sniffed */
+    sqe.len = (slot->sniffed ? slot->size : head_len(slot->size)) - slot->result->len;
+    sqe.off = slot->result->len;
+    sqe.user_data = i;
+    ring_push(&reader->ring, &sqe);
+}
+
+/*
+ * Closes the file of the given slot, through the ring if it has room
+ * to spare, and hands out its result.
+ */
+static void release_slot(reader_t *reader, slot_t *slot)
+{
+    ring_t *ring = &reader->ring;
+
+    if (slot->fd >= 0) {
+        if (ring->queued + ring->inflight < ring->entries) {
+            struct io_uring_sqe sqe;
+
+            memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = IORING_OP_CLOSE;
+            sqe.fd = slot->fd;
+            sqe.user_data = CLOSE_TAG;
+            ring_push(ring, &sqe);
+        }
+        else {
+            close(slot->fd);
+        }
+    }
+    if (slot->result->error != 0 && slot->result->text != NULL) {
+        free(slot->result->text);
+        slot->result->text = NULL;
+    }
+    list_addlast(reader->ready, slot->result);
+    slot->result = NULL;
+    reader->active--;
+}
+
+/*
+ * Handles the completion of the open or read of the given slot, which
+ * returned the given result (or -errno).
+ */
+static void complete(reader_t *reader, int i, int res)
+{
+    slot_t *slot = &reader->slots[i];
+    result_t *result = slot->result;
+    ssize_t size;
+    int shrunk = 0;
+
+    if (res < 0) {
+        result->error = -res;
+        release_slot(reader, slot);
+        return;
+    }
+    if (slot->fd < 0) {
+        /* Opened */
+        slot->fd = res;
+        size = open_result(result, slot->fd);
+        if (size < 0) {
+            release_slot(reader, slot);
+            return;
+        }
+        slot->size = size;
+    }
+    else {
+        result->len += res;
+        shrunk = res == 0;
+    }
+
+    if (!slot->sniffed && (result->len >= head_len(slot->size) || shrunk)) {
+        slot->sniffed = 1;
+        if (sniff_result(result, slot->size)) {
+            release_slot(reader, slot);
+            return;
+        }
+    }
+    if (result->len == slot->size || shrunk) {
+        result->text[result->len] = '\0';
+        release_slot(reader, slot);
+    }
+    else {
+        queue_read(reader, i);
+    }
+}
+
+static void reap(reader_t *reader)
+{
+    ring_t *ring = &reader->ring;
+    unsigned head = *ring->cqhead;
+    unsigned tail = __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqmask];
+
+        ring->inflight--;
+        if (cqe->user_data != CLOSE_TAG)
+            complete(reader, cqe->user_data, cqe->res);
+    }
+    __atomic_store_n(ring->cqhead, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * Starts opening the next files found by the crawler in the free slots,
+ * and waits for the crawler only if nothing else is left to wait for.
+ */
+static void start_reads(reader_t *reader)
+{
+    int i;
+    char *path;
+
+    for (i = 0; i < reader->depth && !reader->crawled; i++) {
+        if (reader->slots[i].result != NULL)
+            continue;
+        if (reader->active == 0 && list_size(reader->ready) == 0) {
+            path = crawler_next(reader->crawler);
+            reader->crawled = path == NULL;
+        }
+        else {
+            path = crawler_trynext(reader->crawler);
+        }
+        if (path == NULL)
+            break;
+        reader->slots[i].result = result_create(path);
+        reader->slots[i].fd = -1;
+        reader->slots[i].sniffed = 0;
+        reader->active++;
+        queue_open(reader, i);
+    }
+}
+
+static result_t *uring_next(reader_t *reader)
+{
+    for (;;) {
+        start_reads(reader);
+        if (list_size(reader->ready) > 0)
+            return list_popfirst(reader->ready);
+        if (reader->active == 0)
+            return NULL;
+        ring_wait(&reader->ring);
+        reap(reader);
+    }
+}
+#endif
+
+/*
+ * Reads the given opened file of the given result with pread(), up to
+ * the given offset or the end of the file.  Returns 0, or -1 if the
+ * file cannot be read.
+ */
+static int pread_upto(result_t *result, int fd, size_t end)
+{
+    ssize_t r;
+
+    while (result->len < end) {
+        r = pread(fd, result->text + result->len, end - result->len, result->len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0) {
+            result->error = errno;
+            free(result->text);
+            result->text = NULL;
+            return -1;
+        }
+        if (r == 0)
+            break;
+        result->len += r;
+    }
+    return 0;
+}
+
+/*
+ * Reads the file of the given result with pread(), its first block
+ * first, so that files which are not worth indexing are not read in
+ * full.
+ */
+static void pread_result(result_t *result)
+{
+    int fd = open(result->path, O_RDONLY | O_CLOEXEC);
+    ssize_t size;
+
+    if (fd < 0) {
+        result->error = errno;
+        return;
+    }
+    size = open_result(result, fd);
+    if (size >= 0 && pread_upto(result, fd, head_len(size)) == 0 && !sniff_result(result, size) &&
+        pread_upto(result, fd, size) == 0)
+        result->text[result->len] = '\0';
+    close(fd);
+}
+
+static void *read_files(void *arg)
+{
+    reader_t *reader = arg;
+    char *path;
+
+    while ((path = crawler_next(reader->crawler)) != NULL) {
+        result_t *result = result_create(path);
+
+        pread_result(result);
+        pthread_mutex_lock(&reader->lock);
+        while (list_size(reader->ready) >= reader->depth && !reader->stop)
+            pthread_cond_wait(&reader->writable, &reader->lock);
+        if (reader->stop) {
+            pthread_mutex_unlock(&reader->lock);
+            result_destroy(result);
+            break;
+        }
+        list_addlast(reader->ready, result);
+        pthread_cond_signal(&reader->readable);
+        pthread_mutex_unlock(&reader->lock);
+    }
+
+    pthread_mutex_lock(&reader->lock);
+    reader->running--;
+    pthread_cond_broadcast(&reader->readable);
+    pthread_mutex_unlock(&reader->lock);
+    return NULL;
+}
+
+static result_t *pool_next(reader_t *reader)
+{
+    result_t *result = NULL;
+
+    pthread_mutex_lock(&reader->lock);
+    while (list_size(reader->ready) == 0 && reader->running > 0)
+        pthread_cond_wait(&reader->readable, &reader->lock);
+    if (list_size(reader->ready) > 0) {
+        result = list_popfirst(reader->ready);
+        pthread_cond_signal(&reader->writable);
+    }
+    pthread_mutex_unlock(&reader->lock);
+    return result;
+}
+
+reader_t *reader_create(crawler_t *crawler, int depth, int flags)
+{
+    reader_t *reader = calloc(1, sizeof(reader_t));
+    int i;
+
+    if (reader == NULL)
+        fatal_error("out of memory");
+    reader->crawler = crawler;
+    reader->depth = depth > 0 ? depth : 1;
+    reader->ready = list_create(compare_pointers);
+
+#ifdef HAVE_IO_URING
+    /* Room for a read or an open in every slot, and as many closes */
+    if (!(flags & READER_PREAD) && ring_init(&reader->ring, 2 * reader->depth) == 0) {
+        reader->uring = 1;
+        reader->slots = calloc(reader->depth, sizeof(slot_t));
+        if (reader->slots == NULL)
+            fatal_error("out of memory");
+        return reader;
+    }
+#endif
+
+    pthread_mutex_init(&reader->lock, NULL);
+    pthread_cond_init(&reader->readable, NULL);
+    pthread_cond_init(&reader->writable, NULL);
+    reader->numthreads = reader->depth < MAX_READER_THREADS ? reader->depth : MAX_READER_THREADS;
+    reader->running = reader->numthreads;
+    reader->threads = malloc(reader->numthreads * sizeof(pthread_t));
+    if (reader->threads == NULL)
+        fatal_error("out of memory");
+    for (i = 0; i < reader->numthreads; i++) {
+        if (pthread_create(&reader->threads[i], NULL, read_files, reader) != 0)
+            fatal_error("pthread_create() failed");
+    }
+    return reader;
+}
+
+void reader_destroy(reader_t *reader)
+{
+    int i;
+
+#ifdef HAVE_IO_URING
+    if (reader->uring) {
+        /* The kernel may still write to the buffers of the files in flight */
+        while (reader->ring.queued + reader->ring.inflight > 0) {
+            ring_wait(&reader->ring);
+            reap(reader);
+        }
+        ring_destroy(&reader->ring);
+        free(reader->slots);
+    }
+#endif
+    if (reader->threads != NULL) {
+        pthread_mutex_lock(&reader->lock);
+        reader->stop = 1;
+        pthread_cond_broadcast(&reader->writable);
+        pthread_mutex_unlock(&reader->lock);
+        for (i = 0; i < reader->numthreads; i++)
+            pthread_join(reader->threads[i], NULL);
+        pthread_cond_destroy(&reader->readable);
+        pthread_cond_destroy(&reader->writable);
+        pthread_mutex_destroy(&reader->lock);
+        free(reader->threads);
+    }
+
+    while (list_size(reader->ready) > 0)
+        result_destroy(list_popfirst(reader->ready));
+    list_destroy(reader->ready);
+    free(reader);
+}
+
+const char *reader_method(reader_t *reader)
+{
+#ifdef HAVE_IO_URING
+    if (reader->uring)
+        return "io_uring";
+#endif
+    return "pread";
+}
+
+char *reader_next(reader_t *reader, char **text, size_t *len, enum skip_reason *reason)
+{
+    result_t *result;
+    char *path;
+
+#ifdef HAVE_IO_URING
+    if (reader->uring)
+        result = uring_next(reader);
+    else
+#endif
+        result = pool_next(reader);
+    if (result == NULL)
+        return NULL;
+
+    path = result->path;
+    *text = result->text;
+    *len = result->len;
+    *reason = result->reason;
+    if (result->error != 0)
+        errno = result->error;
+    free(result);
+    return path;
+}
+
+char *reader_readfile(char *path, size_t *len, enum skip_reason *reason)
+{
+    result_t result;
+
+    memset(&result, 0, sizeof(result));
+    result.path = path;
+    pread_result(&result);
+    *len = result.len;
+    *reason = result.reason;
+    if (result.error != 0)
+        errno = result.error;
+    return result.text;
+}
@@ -0,0 +1,79 @@
+#ifndef READER_H
+#define READER_H
+
+#include "common.h"
+#include "crawler.h"
+
+#include <stddef.h>
+
+/*
+ * The type of readers.  A reader reads the files found by a crawler
+ * (see crawler.h) with many of them in flight at once, so that files
+ * are read ahead of the tokenizer, and waiting for the disk overlaps
+ * with indexing.  Files are handed out in the order they are read.
+ *
+ * On Linux, the reader submits the openat(), read() and close() of
+ * every file in batches through an io_uring, from the thread that
+ * calls reader_next(), with no threads of its own.  Where io_uring is
+ * unavailable (older kernels, or sandboxes that forbid it), or when
+ * asked to, a pool of threads reads the files with pread() instead.
+ *
+ * Like read_file(), every text is terminated by a '\0' past its length.
+ * Files are read up to the size they had when opened, and files that
+ * are not worth indexing (see sniff_file()) are not handed out as text.
+ */
+struct reader;
+typedef struct reader reader_t;
+
+/*
+ * Flags for reader_create().
+ */
+enum {
+    READER_PREAD = 1,       /* Use the pool of threads, even if io_uring works */
+};
+
+/*
+ * The default number of files in flight.
+ */
+enum { DEFAULT_READER_DEPTH = 64 };
+
+/*
+ * The most threads in the pool, whatever the depth.
+ */
+enum { MAX_READER_THREADS = 16 };
+
+/*
+ * Creates a reader of the files found by the given crawler, which must
+ * outlive it, with up to the given number of files in flight.
+ */
+reader_t *reader_create(crawler_t *crawler, int depth, int flags);
+
+/*
+ * Stops the given reader, and destroys it, but not its crawler.
+ */
+void reader_destroy(reader_t *reader);
+
+/*
+ * Returns "io_uring" or "pread", as the given reader reads files.
+ */
+const char *reader_method(reader_t *reader);
+
+/*
+ * Waits for the next file to be read, and returns its path, which
+ * belongs to the caller, or NULL once every file found by the crawler
+ * has been returned.  Assigns the text of the file, which belongs to
+ * the caller, and its length to the given pointers, or NULL and the
+ * size of the file if it is not worth indexing, with the reason.  If
+ * the file cannot be read, the text is NULL, the reason SKIP_NONE and
+ * errno tells why.
+ */
+char *reader_next(reader_t *reader, char **text, size_t *len, enum skip_reason *reason);
+
+/*
+ * Reads the file at the given path in the calling thread, and returns
+ * its text like reader_next(), for files that are not found by a
+ * crawler.
+ */
+char *reader_readfile(char *path, size_t *len, enum skip_reason *reason);
+
+#endif
@@ -0,0 +1,827 @@
+#include "common.h"
+#include "index.h"
+#include "list.h"
+#include "map_str.h"
+#include "segindex.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A frozen index in the list of segments, with the number of snapshots
+ * that hold it.
+ */
+typedef struct {
+    index_t *index;
+    int refs;
+} segment_t;
+
+/*
+ * The segments at some point, from the oldest to the newest, with the
+ * number of queries that use them, plus one while they are current.
+ */
+typedef struct {
+    segment_t **segments;
+    int numsegments;
+    int refs;
+} snapshot_t;
+
+struct segindex {
+    pthread_mutex_t lock;       /* Held while the segments change */
+    pthread_cond_t merged;      /* Signaled when a merge ends, or there is nothing to merge */
+    pthread_mutex_t snaplock;   /* Held while snapshots are taken and released */
+    pthread_cond_t work;        /* Signaled with snaplock when wake is set, or segments retire */
+    int wake;                   /* Set when a segment is flushed, or merging stops */
+    list_t *retired;            /* Segments that no snapshot holds, to destroy */
+    snapshot_t *current;
+    index_t *mem;               /* New and changed documents, not flushed yet */
+    int memwords;
+    int flushwords;
+    list_t *pending;            /* Paths to remove from the segments when flushing */
+    list_t *log;                /* Paths removed while merging, or NULL */
+    int stop;
+    pthread_t thread;           /* Merges segments */
+};
+
+/*
+ * Returns the current snapshot, which the caller must release.
+ */
+static snapshot_t *acquire(segindex_t *segindex)
+{
+    snapshot_t *snapshot;
+
+    pthread_mutex_lock(&segindex->snaplock);
+    snapshot = segindex->current;
+    snapshot->refs++;
+    pthread_mutex_unlock(&segindex->snaplock);
+    return snapshot;
+}
+
+/*
+ * Drops a reference to the given snapshot, and frees it if it was the
+ * last one.  The segments that no other snapshot holds are handed to
+ * the merging thread, which destroys them, since that takes a while
+ * for a large index and queries should not wait for it.
+ */
+static void release(segindex_t *segindex, snapshot_t *snapshot)
+{
+    int i, retired = 0;
+
+    pthread_mutex_lock(&segindex->snaplock);
+    if (--snapshot->refs > 0) {
+        pthread_mutex_unlock(&segindex->snaplock);
+        return;
+    }
+    for (i = 0; i < snapshot->numsegments; i++) {
+        if (--snapshot->segments[i]->refs == 0) {
+            list_addlast(segindex->retired, snapshot->segments[i]);
+            retired = 1;
+        }
+    }
+    if (retired)
+        pthread_cond_signal(&segindex->work);
+    pthread_mutex_unlock(&segindex->snaplock);
+    free(snapshot->segments);
+    free(snapshot);
+}
+
+/*
+ * Destroys the segments that no snapshot holds anymore.  The caller
+ * holds neither lock.
+ */
+static void destroy_retired(segindex_t *segindex)
+{
+    list_t *retired = list_create(compare_pointers), *old;
+
+    pthread_mutex_lock(&segindex->snaplock);
+    old = segindex->retired;
+    segindex->retired = retired;
+    pthread_mutex_unlock(&segindex->snaplock);
+
+    while (list_size(old) > 0) {
+        segment_t *segment = list_popfirst(old);
+        index_destroy(segment->index);
+        free(segment);
+    }
+    list_destroy(old);
+}
+
+/*
+ * Wakes the merging thread, which has work to do.
+ */
+static void wake_merger(segindex_t *segindex)
+{
+    pthread_mutex_lock(&segindex->snaplock);
+    segindex->wake = 1;
+    pthread_cond_signal(&segindex->work);
+    pthread_mutex_unlock(&segindex->snaplock);
+}
+
+/*
+ * Makes the given array of segments the current snapshot.  The caller
+ * holds the lock.
+ */
+static void publish(segindex_t *segindex, segment_t **segments, int numsegments)
+{
+    snapshot_t *snapshot = malloc(sizeof(snapshot_t)), *old;
+    int i;
+
+    if (snapshot == NULL)
+        fatal_error("out of memory");
+    snapshot->segments = segments;
+    snapshot->numsegments = numsegments;
+    snapshot->refs = 1;
+
+    pthread_mutex_lock(&segindex->snaplock);
+    for (i = 0; i < numsegments; i++)
+        segments[i]->refs++;
+    old = segindex->current;
+    segindex->current = snapshot;
+    pthread_mutex_unlock(&segindex->snaplock);
+    if (old != NULL)
+        release(segindex, old);
+}
+
+static segment_t *segment_create(index_t *index)
+{
+    segment_t *segment = malloc(sizeof(segment_t));
+
+    if (segment == NULL)
+        fatal_error("out of memory");
+    segment->index = index;
+    segment->refs = 0;
+    return segment;
+}
+
+static segment_t **copy_segments(snapshot_t *snapshot, int extra)
+{
+    segment_t **segments = malloc((snapshot->numsegments + extra + 1) * sizeof(segment_t *));
+
+    if (segments == NULL)
+        fatal_error("out of memory");
+    memcpy(segments, snapshot->segments, snapshot->numsegments * sizeof(segment_t *));
+    return segments;
+}
+
+/*
+ * Finds the segments to merge next, and assigns the position of the
+ * first and their number to the given pointers.  A segment where at
+ * least half the documents were removed is rewritten on its own.
+ * Otherwise, MERGE_FACTOR adjacent segments are merged if none of them
+ * is larger than the others together, so that a large segment is not
+ * merged again for every few small ones, and the cheapest of those is
+ * picked.  If there are MAX_SEGMENTS segments, the cheapest window is
+ * merged whatever the sizes.  Returns 0 if there is nothing to merge.
+ * The caller holds the lock.
+ */
+static int pick_merge(snapshot_t *snapshot, int *start, int *count)
+{
+    segment_t **segments = snapshot->segments;
+    int n = snapshot->numsegments, force = n >= MAX_SEGMENTS;
+    long cost, best = -1, bestforced = -1;
+    int i, j, largest, forcedstart = 0;
+
+    for (i = 0; i < n; i++) {
+        int numdocs = index_numdocs(segments[i]->index);
+        if (numdocs > 0 && 2 * index_size(segments[i]->index) <= numdocs) {
+            *start = i;
+            *count = 1;
+            return 1;
+        }
+    }
+    for (i = 0; i + MERGE_FACTOR <= n; i++) {
+        cost = largest = 0;
+        for (j = i; j < i + MERGE_FACTOR; j++) {
+            int numdocs = index_numdocs(segments[j]->index);
+            cost += numdocs;
+            if (numdocs > largest)
+                largest = numdocs;
+        }
+        if (largest <= cost - largest && (best < 0 || cost < best)) {
+            best = cost;
+            *start = i;
+        }
+        if (bestforced < 0 || cost < bestforced) {
+            bestforced = cost;
+            forcedstart = i;
+        }
+    }
+    if (best < 0 && force) {
+        best = bestforced;
+        *start = forcedstart;
+    }
+    *count = MERGE_FACTOR;
+    return best >= 0;
+}
+
+/*
+ * Merges the given segments of the current snapshot, without the lock
+ * while the new segment is built, and puts it in their place.  The
+ * caller holds the lock.
+ */
+static void merge(segindex_t *segindex, int start, int count)
+{
+    snapshot_t *snapshot = segindex->current;
+    index_t **indexes = malloc(count * sizeof(index_t *)), *merged;
+    segment_t **segments;
+    char **paths;
+    int i, n;
+
+    if (indexes == NULL)
+        fatal_error("out of memory");
+    for (i = 0; i < count; i++)
+        indexes[i] = snapshot->segments[start + i]->index;
+    /* Hold the segments while they are read */
+    pthread_mutex_lock(&segindex->snaplock);
+    snapshot->refs++;
+    pthread_mutex_unlock(&segindex->snaplock);
+    segindex->log = list_create(compare_strings);
+    pthread_mutex_unlock(&segindex->lock);
+
+    merged = index_merge(indexes, count);
+
+    pthread_mutex_lock(&segindex->lock);
+    /* Documents removed meanwhile may have been merged before they were */
+    n = list_size(segindex->log);
+    paths = malloc((n + 1) * sizeof(char *));
+    if (paths == NULL)
+        fatal_error("out of memory");
+    for (i = 0; i < n; i++)
+        paths[i] = list_popfirst(segindex->log);
+    index_removepaths(merged, paths, n);
+    while (n > 0)
+        free(paths[--n]);
+    free(paths);
+    list_destroy(segindex->log);
+    segindex->log = NULL;
+
+    /* Only merges take segments out, so the others kept their places */
+    n = 0;
+    segments = copy_segments(segindex->current, 0);
+    for (i = 0; i < segindex->current->numsegments; i++) {
+        if (i == start && (index_size(merged) > 0 || count == segindex->current->numsegments))
+            segments[n++] = segment_create(merged);
+        else if (i == start)
+            index_destroy(merged);
+        if (i < start || i >= start + count)
+            segments[n++] = segindex->current->segments[i];
+    }
+    publish(segindex, segments, n);
+    free(indexes);
+
+    pthread_mutex_unlock(&segindex->lock);
+    release(segindex, snapshot);
+    pthread_mutex_lock(&segindex->lock);
+}
+
+/*
+ * Merges segments while there is something worth merging, and destroys
+ * the segments that queries are done with.  Waits with snaplock rather
+ * than the lock, so that queries may wake it.
+ */
+static void *merge_thread(void *arg)
+{
+    segindex_t *segindex = arg;
+    int start, count, merging;
+
+    for (;;) {
+        destroy_retired(segindex);
+
+        pthread_mutex_lock(&segindex->lock);
+        if (segindex->stop) {
+            pthread_mutex_unlock(&segindex->lock);
+            break;
+        }
+        merging = pick_merge(segindex->current, &start, &count);
+        if (merging)
+            merge(segindex, start, count);
+        pthread_cond_broadcast(&segindex->merged);
+        pthread_mutex_unlock(&segindex->lock);
+
+        if (!merging) {
+            pthread_mutex_lock(&segindex->snaplock);
+            while (!segindex->wake && list_size(segindex->retired) == 0)
+                pthread_cond_wait(&segindex->work, &segindex->snaplock);
+            segindex->wake = 0;
+            pthread_mutex_unlock(&segindex->snaplock);
+        }
+    }
+    return NULL;
+}
+
+segindex_t *segindex_create(index_t *base)
+{
+    segindex_t *segindex = calloc(1, sizeof(segindex_t));
+    segment_t **segments = malloc(sizeof(segment_t *));
+
+    if (segindex == NULL || segments == NULL)
+        fatal_error("out of memory");
+    pthread_mutex_init(&segindex->lock, NULL);
+    pthread_cond_init(&segindex->work, NULL);
+    pthread_cond_init(&segindex->merged, NULL);
+    pthread_mutex_init(&segindex->snaplock, NULL);
+    segindex->mem = index_createlike(base);
+    segindex->flushwords = DEFAULT_FLUSH_WORDS;
+    segindex->pending = list_create(compare_strings);
+    segindex->retired = list_create(compare_pointers);
+    if (segindex->mem == NULL)
+        fatal_error("out of memory");
+    segments[0] = segment_create(base);
+    publish(segindex, segments, 1);
+
+    if (pthread_create(&segindex->thread, NULL, merge_thread, segindex) != 0)
+        fatal_error("pthread_create() failed");
+    return segindex;
+}
+
+void segindex_destroy(segindex_t *segindex)
+{
+    pthread_mutex_lock(&segindex->lock);
+    segindex->stop = 1;
+    pthread_mutex_unlock(&segindex->lock);
+    wake_merger(segindex);
+    pthread_join(segindex->thread, NULL);
+
+    release(segindex, segindex->current);
+    destroy_retired(segindex);
+    list_destroy(segindex->retired);
+    index_destroy(segindex->mem);
+    while (list_size(segindex->pending) > 0)
+        free(list_popfirst(segindex->pending));
+    list_destroy(segindex->pending);
+    pthread_cond_destroy(&segindex->work);
+    pthread_cond_destroy(&segindex->merged);
+    pthread_mutex_destroy(&segindex->lock);
+    pthread_mutex_destroy(&segindex->snaplock);
+    free(segindex);
+}
+
+void segindex_setflushwords(segindex_t *segindex, int words)
+{
+    segindex->flushwords = words;
+}
+
+/*
+ * Removes the documents with the given paths from every segment, and
+ * returns their number.  The caller holds the lock.
+ */
+static int remove_paths(segindex_t *segindex, char **paths, int numpaths)
+{
+    snapshot_t *snapshot = segindex->current;
+    int i, numremoved = 0;
+
+    for (i = 0; i < snapshot->numsegments; i++)
+        numremoved += index_removepaths(snapshot->segments[i]->index, paths, numpaths);
+    if (segindex->log != NULL) {
+        for (i = 0; i < numpaths; i++) {
+            char *path = strdup(paths[i]);
+            if (path == NULL)
+                fatal_error("out of memory");
+            list_addlast(segindex->log, path);
+        }
+    }
+    return numremoved;
+}
+
+int segindex_updatepath(segindex_t *segindex, char *path, list_t *words)
+{
+    snapshot_t *snapshot;
+    int i, found;
+
+    /* Before the document, whose trigrams may still come */
+    if (segindex->memwords >= segindex->flushwords)
+        segindex_flush(segindex);
+
+    found = index_haspath(segindex->mem, path);
+    /* The old version stays in its segment until the new one is flushed */
+    pthread_mutex_lock(&segindex->lock);
+    snapshot = segindex->current;
+    for (i = 0; i < snapshot->numsegments; i++) {
+        if (index_haspath(snapshot->segments[i]->index, path)) {
+            char *copy = strdup(path);
+            if (copy == NULL)
+                fatal_error("out of memory");
+            list_addlast(segindex->pending, copy);
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&segindex->lock);
+
+    segindex->memwords += list_size(words);
+    index_updatepath(segindex->mem, path, words);
+    return found;
+}
+
+void segindex_addtrigrams(segindex_t *segindex, char *text, size_t len)
+{
+    index_addtrigrams(segindex->mem, text, len);
+}
+
+int segindex_removepaths(segindex_t *segindex, char **paths, int numpaths)
+{
+    int numremoved = index_removepaths(segindex->mem, paths, numpaths);
+
+    pthread_mutex_lock(&segindex->lock);
+    numremoved += remove_paths(segindex, paths, numpaths);
+    pthread_mutex_unlock(&segindex->lock);
+    return numremoved;
+}
+
+void segindex_flush(segindex_t *segindex)
+{
+    segment_t **segments;
+    char **paths;
+    int i, n;
+
+    if (index_size(segindex->mem) == 0 && list_size(segindex->pending) == 0)
+        return;
+    index_freeze(segindex->mem);
+
+    pthread_mutex_lock(&segindex->lock);
+    while (segindex->current->numsegments >= MAX_SEGMENTS)
+        pthread_cond_wait(&segindex->merged, &segindex->lock);
+
+    /* The old versions go right before the new ones come */
+    n = list_size(segindex->pending);
+    paths = malloc((n + 1) * sizeof(char *));
+    if (paths == NULL)
+        fatal_error("out of memory");
+    for (i = 0; i < n; i++)
+        paths[i] = list_popfirst(segindex->pending);
+    remove_paths(segindex, paths, n);
+    while (n > 0)
+        free(paths[--n]);
+    free(paths);
+
+    n = segindex->current->numsegments;
+    if (index_size(segindex->mem) > 0) {
+        segments = copy_segments(segindex->current, 1);
+        segments[n++] = segment_create(segindex->mem);
+        publish(segindex, segments, n);
+        segindex->mem = index_createlike(segindex->mem);
+        if (segindex->mem == NULL)
+            fatal_error("out of memory");
+        wake_merger(segindex);
+    }
+    pthread_mutex_unlock(&segindex->lock);
+
+    if (index_numdocs(segindex->mem) > 0) {
+        /* Every document in it was removed */
+        index_t *mem = index_createlike(segindex->mem);
+        if (mem == NULL)
+            fatal_error("out of memory");
+        index_destroy(segindex->mem);
+        segindex->mem = mem;
+    }
+    segindex->memwords = 0;
+}
+
+void segindex_waitmerges(segindex_t *segindex)
+{
+    int start, count;
+
+    pthread_mutex_lock(&segindex->lock);
+    while (segindex->log != NULL || pick_merge(segindex->current, &start, &count))
+        pthread_cond_wait(&segindex->merged, &segindex->lock);
+    pthread_mutex_unlock(&segindex->lock);
+}
+
+int segindex_numsegments(segindex_t *segindex)
+{
+    snapshot_t *snapshot = acquire(segindex);
+    int n = snapshot->numsegments;
+
+    release(segindex, snapshot);
+    return n;
+}
+
+int segindex_numdocs(segindex_t *segindex)
+{
+    snapshot_t *snapshot = acquire(segindex);
+    int i, n = 0;
+
+    for (i = 0; i < snapshot->numsegments; i++)
+        n += index_size(snapshot->segments[i]->index);
+    release(segindex, snapshot);
+    return n;
+}
+
+/*
+ * Appends copies of the paths of the given list to the other list, and
+ * destroys the given list.
+ */
+static void copy_paths(list_t *to, list_t *from)
+{
+    while (list_size(from) > 0) {
+        char *path = strdup(list_popfirst(from));
+        if (path == NULL)
+            fatal_error("out of memory");
+        list_addlast(to, path);
+    }
+    list_destroy(from);
+}
+
+static void free_paths(list_t *paths)
+{
+    while (list_size(paths) > 0)
+        free(list_popfirst(paths));
+    list_destroy(paths);
+}
+
+/*
+ * Compiles the given query for the segments of the given snapshot, which
+ * all split phrases like the index the segmented index was created with.
+ */
+static query_plan_t *compile(snapshot_t *snapshot, char *query, char **errmsg)
+{
+    return index_compile(snapshot->segments[0]->index, query, errmsg);
+}
+
+list_t *segindex_query(segindex_t *segindex, char *query, char **errmsg)
+{
+    snapshot_t *snapshot = acquire(segindex);
+    query_plan_t *plan = compile(snapshot, query, errmsg);
+    list_t *results;
+    int i;
+
+    if (plan == NULL) {
+        release(segindex, snapshot);
+        return NULL;
+    }
+    results = list_create(compare_strings);
+    for (i = 0; i < snapshot->numsegments && results != NULL; i++) {
+        list_t *paths = index_runquery(snapshot->segments[i]->index, plan, errmsg);
+        if (paths == NULL) {
+            free_paths(results);
+            results = NULL;
+        }
+        else {
+            copy_paths(results, paths);
+        }
+    }
+    release(segindex, snapshot);
+    index_freeplan(plan);
+    return results;
+}
+
+int segindex_count(segindex_t *segindex, char *query, int limit, char **errmsg)
+{
+    snapshot_t *snapshot = acquire(segindex);
+    query_plan_t *plan = compile(snapshot, query, errmsg);
+    int i, count = 0;
+
+    if (plan == NULL) {
+        release(segindex, snapshot);
+        return -1;
+    }
+    for (i = 0; i < snapshot->numsegments && count < limit; i++) {
+        int n = index_runcount(snapshot->segments[i]->index, plan, limit - count, errmsg);
+        if (n < 0) {
+            count = -1;
+            break;
+        }
+        count += n;
+    }
+    release(segindex, snapshot);
+    index_freeplan(plan);
+    return count;
+}
+
+int segindex_exists(segindex_t *segindex, char *query, char **errmsg)
+{
+    return segindex_count(segindex, query, 1, errmsg);
+}
+
+list_t *segindex_query_ranked(segindex_t *segindex, char *query, int k, int *nummatches, char **errmsg)
+{
+    snapshot_t *snapshot = acquire(segindex);
+    query_plan_t *plan = compile(snapshot, query, errmsg);
+    index_t **indexes;
+    list_t *results;
+    int i;
+
+    if (plan == NULL) {
+        release(segindex, snapshot);
+        return NULL;
+    }
+    indexes = malloc((snapshot->numsegments + 1) * sizeof(index_t *));
+    if (indexes == NULL)
+        fatal_error("out of memory");
+    for (i = 0; i < snapshot->numsegments; i++)
+        indexes[i] = snapshot->segments[i]->index;
+    results = index_runranked_many(indexes, snapshot->numsegments, plan, k, nummatches, errmsg);
+    if (results != NULL) {
+        /* The segments may be gone once the snapshot is released */
+        list_iter_t *it = list_createiter(results);
+        while (list_hasnext(it)) {
+            index_hit_t *hit = list_next(it);
+            hit->path = strdup(hit->path);
+            if (hit->path == NULL)
+                fatal_error("out of memory");
+        }
+        list_destroyiter(it);
+    }
+    release(segindex, snapshot);
+    free(indexes);
+    index_freeplan(plan);
+    return results;
+}
+
+void segindex_query_batch(segindex_t *segindex, char **queries, int numqueries, list_t **results, char **errmsgs)
+{
+    snapshot_t *snapshot = acquire(segindex);
+    list_t **lists = malloc((numqueries + 1) * sizeof(list_t *));
+    char **errors = malloc((numqueries + 1) * sizeof(char *));
+    int i, q;
+
+    if (lists == NULL || errors == NULL)
+        fatal_error("out of memory");
+    for (q = 0; q < numqueries; q++)
+        results[q] = list_create(compare_strings);
+    for (i = 0; i < snapshot->numsegments; i++) {
+        index_query_batch(snapshot->segments[i]->index, queries, numqueries, lists, errors);
+        for (q = 0; q < numqueries; q++) {
+            if (results[q] == NULL) {
+                /* Failed in an earlier segment */
+                if (lists[q] != NULL)
+                    list_destroy(lists[q]);
+                else
+                    free(errors[q]);
+            }
+            else if (lists[q] == NULL) {
+                free_paths(results[q]);
+                results[q] = NULL;
+                errmsgs[q] = errors[q];
+            }
+            else {
+                copy_paths(results[q], lists[q]);
+            }
+        }
+    }
+    release(segindex, snapshot);
+    free(lists);
+    free(errors);
+}
+
+void segindex_count_batch(segindex_t *segindex, char **queries, int numqueries, int *counts, char **errmsgs)
+{
+    snapshot_t *snapshot = acquire(segindex);
+    int *segcounts = malloc((numqueries + 1) * sizeof(int));
+    char **errors = malloc((numqueries + 1) * sizeof(char *));
+    int i, q;
+
+    if (segcounts == NULL || errors == NULL)
+        fatal_error("out of memory");
+    memset(counts, 0, numqueries * sizeof(int));
+    for (i = 0; i < snapshot->numsegments; i++) {
+        index_count_batch(snapshot->segments[i]->index, queries, numqueries, segcounts, errors);
+        for (q = 0; q < numqueries; q++) {
+            if (counts[q] < 0) {
+                if (segcounts[q] < 0)
+                    free(errors[q]);
+            }
+            else if (segcounts[q] < 0) {
+                counts[q] = -1;
+                errmsgs[q] = errors[q];
+            }
+            else {
+                counts[q] += segcounts[q];
+            }
+        }
+    }
+    release(segindex, snapshot);
+    free(segcounts);
+    free(errors);
+}
+
+list_t *segindex_grep(segindex_t *segindex, char *pattern, int regex, char **errmsg)
+{
+    snapshot_t *snapshot = acquire(segindex);
+    list_t *results = list_create(compare_strings);
+    int i;
+
+    for (i = 0; i < snapshot->numsegments && results != NULL; i++) {
+        list_t *paths = index_grep(snapshot->segments[i]->index, pattern, regex, errmsg);
+        if (paths == NULL) {
+            free_paths(results);
+            results = NULL;
+        }
+        else {
+            copy_paths(results, paths);
+        }
+    }
+    release(segindex, snapshot);
+    return results;
+}
+
+/*
+ * A word suggested by a segment, with the number of documents of all
+ * segments that contain it.
+ */
+typedef struct {
+    char *word;
+    int numdocs;
+} suggestion_t;
+
+static int compare_suggestions(const void *a, const void *b)
+{
+    const suggestion_t *x = a, *y = b;
+
+    if (x->numdocs != y->numdocs)
+        return y->numdocs - x->numdocs;
+    return strcmp(x->word, y->word);
+}
+
+list_t *segindex_suggest(segindex_t *segindex, char *prefix, int n)
+{
+    snapshot_t *snapshot = acquire(segindex);
+    map_str_t *words = map_str_create();
+    list_t *results = list_create(compare_strings);
+    suggestion_t *suggestions;
+    map_str_iter_t *it;
+    int i, j, numsuggestions = 0;
+
+    /* A word in the most documents overall is among the best of some segment */
+    for (i = 0; i < snapshot->numsegments; i++) {
+        list_t *segwords = index_suggest(snapshot->segments[i]->index, prefix, n);
+        while (list_size(segwords) > 0) {
+            char *word = list_popfirst(segwords);
+            if (map_str_haskey(words, word))
+                free(word);
+            else
+                map_str_put(words, word, NULL);
+        }
+        list_destroy(segwords);
+    }
+
+    suggestions = malloc((map_str_size(words) + 1) * sizeof(suggestion_t));
+    if (suggestions == NULL)
+        fatal_error("out of memory");
+    it = map_str_createiter(words);
+    while (map_str_hasnext(it)) {
+        suggestion_t *s = &suggestions[numsuggestions++];
+        s->word = map_str_next(it)->key;
+        s->numdocs = 0;
+        for (j = 0; j < snapshot->numsegments; j++) {
+            set_u32_t *docs = index_lookup(snapshot->segments[j]->index, s->word);
+            if (docs != NULL)
+                s->numdocs += docs->size;
+        }
+    }
+    map_str_destroyiter(it);
+    map_str_destroy(words);
+    release(segindex, snapshot);
+
+    qsort(suggestions, numsuggestions, sizeof(suggestion_t), compare_suggestions);
+    if (n > MAX_SUGGESTIONS)
+        n = MAX_SUGGESTIONS;
+    for (i = 0; i < numsuggestions; i++) {
+        if (i < n)
+            list_addlast(results, suggestions[i].word);
+        else
+            free(suggestions[i].word);
+    }
+    free(suggestions);
+    return results;
+}
+
+/*
+ * Adds up the counters of the caches of every segment, which the given
+ * function assigns.
+ */
+static int sum_stats(segindex_t *segindex, qcache_stats_t *stats,
+                     int (*getstats)(index_t *index, qcache_stats_t *stats))
+{
+    snapshot_t *snapshot = acquire(segindex);
+    qcache_stats_t s;
+    int i, on = 0;
+
+    memset(stats, 0, sizeof(qcache_stats_t));
+    for (i = 0; i < snapshot->numsegments; i++) {
+        if (!getstats(snapshot->segments[i]->index, &s))
+            continue;
+        on = 1;
+        stats->hits += s.hits;
+        stats->misses += s.misses;
+        stats->evictions += s.evictions;
+        stats->invalidations += s.invalidations;
+        stats->rejections += s.rejections;
+        stats->entries += s.entries;
+        stats->bytes += s.bytes;
+        stats->budget += s.budget;
+    }
+    release(segindex, snapshot);
+    return on;
+}
+
+int segindex_cachestats(segindex_t *segindex, qcache_stats_t *stats)
+{
+    return sum_stats(segindex, stats, index_cachestats);
+}
+
+int segindex_subcachestats(segindex_t *segindex, qcache_stats_t *stats)
+{
+    return sum_stats(segindex, stats, index_subcachestats);
+}
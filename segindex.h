@@ -0,0 +1,171 @@
+#ifndef SEGINDEX_H
+#define SEGINDEX_H
+
+#include "index.h"
+#include "list.h"
+#include "qcache.h"
+
+/*
+ * The type of segmented indexes.  A segmented index is a list of frozen
+ * indexes (see index.h), its segments, from the oldest to the newest,
+ * along with a small index in memory that new and changed documents go
+ * into.  Once the index in memory holds enough words, or when asked to,
+ * it is frozen and becomes the newest segment, so adding documents
+ * never costs more than adding them to a small index.
+ *
+ * A thread of the segmented index merges adjacent segments in the
+ * background (see index_merge()), a few of about the same size at a
+ * time, so that segments grow in tiers, and the cost of merging a
+ * document is paid a few times rather than once per segment flushed.
+ * Segments where most documents were removed are rewritten on their
+ * own.  If the segments still reach MAX_SEGMENTS, flushing waits for
+ * the merges to catch up, which bounds the number of segments that a
+ * query visits.
+ *
+ * Queries run against a snapshot of the segments, which they take with
+ * a brief lock, and fan out to every segment of it, so flushing and
+ * merging never wait for queries, nor queries for them.  A snapshot,
+ * and the segments in it, stay alive until the last query using it
+ * ends, and the merging thread then destroys the segments that left
+ * it, so that queries never pay for that.  Many threads may query a
+ * segmented index at once, while one thread changes it.
+ *
+ * Removed documents are left out of queries at once.  Added and changed
+ * documents are found once the index in memory is flushed, and until
+ * then, queries find the old version of a changed document.
+ */
+struct segindex;
+typedef struct segindex segindex_t;
+
+/*
+ * The default number of words that the index in memory holds before it
+ * is flushed, the number of segments of about the same size that are
+ * merged at once, and the most segments there may be.
+ */
+enum { DEFAULT_FLUSH_WORDS = 1 << 20, MERGE_FACTOR = 4, MAX_SEGMENTS = 16 };
+
+/*
+ * Creates a segmented index whose first segment is the given index,
+ * which must be frozen, and which the segmented index takes ownership
+ * of.  New segments get the settings of the given index (see
+ * index_createlike()).
+ */
+segindex_t *segindex_create(index_t *base);
+
+/*
+ * Stops merging, and destroys the given segmented index with its
+ * segments.
+ */
+void segindex_destroy(segindex_t *segindex);
+
+/*
+ * Sets the number of words that the index in memory holds before it is
+ * flushed.
+ */
+void segindex_setflushwords(segindex_t *segindex, int words);
+
+/*
+ * Replaces the document with the given path, if any, with the given
+ * list of words, like index_updatepath().  The old version is removed
+ * once the new one is flushed.  The segmented index takes ownership of
+ * the path and the tokens.  Returns 1 if a document was replaced, or 0
+ * if the path is new.
+ */
+int segindex_updatepath(segindex_t *segindex, char *path, list_t *words);
+
+/*
+ * Adds the trigrams of the given text to the document last added with
+ * segindex_updatepath(), like index_addtrigrams().
+ */
+void segindex_addtrigrams(segindex_t *segindex, char *text, size_t len);
+
+/*
+ * Removes the documents with the given paths, or under them, from
+ * every segment and from the index in memory, like index_removepaths(),
+ * and returns the number of documents removed.
+ */
+int segindex_removepaths(segindex_t *segindex, char **paths, int numpaths);
+
+/*
+ * Freezes the index in memory, if it holds any document, into the
+ * newest segment, and starts a new one.  Waits first if there are
+ * MAX_SEGMENTS segments, until merging brings them below.
+ */
+void segindex_flush(segindex_t *segindex);
+
+/*
+ * Waits until there is nothing left worth merging.
+ */
+void segindex_waitmerges(segindex_t *segindex);
+
+/*
+ * Returns the number of segments that queries visit.
+ */
+int segindex_numsegments(segindex_t *segindex);
+
+/*
+ * Returns the number of documents that queries may find.
+ */
+int segindex_numdocs(segindex_t *segindex);
+
+/*
+ * Performs the given query like index_query(), on every segment.  The
+ * paths are in the order of the segments, and belong to the caller
+ * along with the list.
+ */
+list_t *segindex_query(segindex_t *segindex, char *query, char **errmsg);
+
+/*
+ * Counts the matches of the given query in every segment, up to the
+ * given limit, like index_count().
+ */
+int segindex_count(segindex_t *segindex, char *query, int limit, char **errmsg);
+
+/*
+ * Returns 1 if any document of any segment matches the given query,
+ * like index_exists(), or 0 otherwise, or -1 on error.
+ */
+int segindex_exists(segindex_t *segindex, char *query, char **errmsg);
+
+/*
+ * Performs the given query like index_query_ranked(), and returns the k
+ * best documents of all segments together (see index_runranked_many()).
+ * The hits and their paths belong to the caller along with the list.
+ */
+list_t *segindex_query_ranked(segindex_t *segindex, char *query, int k, int *nummatches, char **errmsg);
+
+/*
+ * Performs the given number of queries like index_query_batch(), on
+ * every segment.  The paths belong to the caller along with the lists.
+ */
+void segindex_query_batch(segindex_t *segindex, char **queries, int numqueries, list_t **results, char **errmsgs);
+
+/*
+ * Counts the matches of the given number of queries like
+ * index_count_batch(), on every segment.
+ */
+void segindex_count_batch(segindex_t *segindex, char **queries, int numqueries, int *counts, char **errmsgs);
+
+/*
+ * Returns the paths of the documents of every segment whose text
+ * matches the given pattern, like index_grep().  The paths belong to
+ * the caller along with the list.
+ */
+list_t *segindex_grep(segindex_t *segindex, char *pattern, int regex, char **errmsg);
+
+/*
+ * Returns the at most n words that start with the given prefix like
+ * index_suggest(), taken from the suggestions of every segment and
+ * ordered by the number of documents of all segments that contain them.
+ */
+list_t *segindex_suggest(segindex_t *segindex, char *prefix, int n);
+
+/*
+ * Assigns the counters of the query caches of all segments together to
+ * the given stats, like index_cachestats() and index_subcachestats().
+ * Returns 0 if no segment has a cache, or 1 otherwise.
+ */
+int segindex_cachestats(segindex_t *segindex, qcache_stats_t *stats);
+int segindex_subcachestats(segindex_t *segindex, qcache_stats_t *stats);
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef SET_U32_H
+#define SET_U32_H
+
+#include <stdint.h>
+
+/*
+ * Sets of unsigned 32-bit integers, such as document identifiers.
+ * See tset.h for the generated functions.
+ */
+#define TSET_NAME set_u32
+#define TSET_ELEM uint32_t
+#define TSET_CMP(a, b) (((a) > (b)) - ((a) < (b)))
+#include "tset.h"
+
+#endif
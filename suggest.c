@@ -0,0 +1,259 @@
+#include "common.h"
+#include "suggest.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A node of the trie, for a prefix that starts more than k terms.  The
+ * prefix is the labels of the nodes on the path from the root.
+ */
+typedef struct {
+    uint32_t label;         /* Offset in labels of the characters leading here */
+    uint32_t labellen;
+    uint32_t firstchild;    /* Children, sorted by the first character of their label */
+    uint32_t numchildren;
+} node_t;
+
+struct suggest {
+    termdict_t *dict;
+    uint32_t *weights;      /* term id -> weight */
+    int k;
+    node_t *nodes;          /* The root first, if there are more than k terms */
+    int numnodes;
+    int maxnodes;
+    uint32_t *top;          /* The k heaviest terms of each node */
+    char *labels;
+    size_t labelslen;
+    size_t labelscap;
+};
+
+/*
+ * Returns 1 if term a comes before term b among the suggestions, or 0
+ * otherwise.
+ */
+static inline int heavier(suggest_t *suggest, uint32_t a, uint32_t b)
+{
+    if (suggest->weights[a] != suggest->weights[b])
+        return suggest->weights[a] > suggest->weights[b];
+    return a < b;
+}
+
+/*
+ * Adds the given term to the given array of the count heaviest terms so
+ * far, keeping at most limit of them.  Returns the new count.
+ */
+static int offer(suggest_t *suggest, uint32_t *best, int count, int limit, uint32_t id)
+{
+    int pos = count;
+
+    while (pos > 0 && heavier(suggest, id, best[pos - 1]))
+        pos--;
+    if (pos >= limit)
+        return count;
+    if (count == limit)
+        count--;
+    memmove(best + pos + 1, best + pos, (count - pos) * sizeof(uint32_t));
+    best[pos] = id;
+    return count + 1;
+}
+
+static int add_nodes(suggest_t *suggest, int n)
+{
+    int first = suggest->numnodes;
+
+    while (suggest->numnodes + n > suggest->maxnodes) {
+        suggest->maxnodes = suggest->maxnodes > 0 ? suggest->maxnodes * 2 : 64;
+        suggest->nodes = realloc(suggest->nodes, suggest->maxnodes * sizeof(node_t));
+        suggest->top = realloc(suggest->top, (size_t)suggest->maxnodes * suggest->k * sizeof(uint32_t));
+        if (suggest->nodes == NULL || suggest->top == NULL)
+            fatal_error("out of memory");
+    }
+    suggest->numnodes += n;
+    return first;
+}
+
+static uint32_t add_label(suggest_t *suggest, const char *label, int len)
+{
+    uint32_t offset = suggest->labelslen;
+
+    while (suggest->labelslen + len >= suggest->labelscap) {
+        suggest->labelscap = suggest->labelscap > 0 ? suggest->labelscap * 2 : 1024;
+        suggest->labels = realloc(suggest->labels, suggest->labelscap);
+        if (suggest->labels == NULL)
+            fatal_error("out of memory");
+    }
+    memcpy(suggest->labels + offset, label, len);
+    suggest->labelslen += len;
+    return offset;
+}
+
+/*
+ * Fills in the given node for the more than k terms from lo to hi,
+ * which share at least their first depth characters.  The terms that
+ * share one more character make up a child, which gets a node of its
+ * own if there are more than k of them.
+ */
+static void build(suggest_t *suggest, char **terms, int node, int lo, int hi, int depth)
+{
+    uint32_t best[suggest->k];
+    int end = depth, count = 0, numchildren = 0, first, child, i, j, t;
+
+    /* The terms are sorted, so the first and last share the least */
+    while (terms[lo][end] != '\0' && terms[lo][end] == terms[hi - 1][end])
+        end++;
+    suggest->nodes[node].label = add_label(suggest, terms[lo] + depth, end - depth);
+    suggest->nodes[node].labellen = end - depth;
+
+    /* The prefix itself may be a term, which sorts before the rest */
+    if (terms[lo][end] == '\0')
+        count = offer(suggest, best, count, suggest->k, lo++);
+    for (i = lo; i < hi; i = j) {
+        for (j = i + 1; j < hi && terms[j][end] == terms[i][end]; j++)
+            ;
+        numchildren += j - i > suggest->k;
+    }
+    first = add_nodes(suggest, numchildren);
+    suggest->nodes[node].firstchild = first;
+    suggest->nodes[node].numchildren = numchildren;
+
+    for (i = lo, child = first; i < hi; i = j) {
+        for (j = i + 1; j < hi && terms[j][end] == terms[i][end]; j++)
+            ;
+        if (j - i > suggest->k) {
+            build(suggest, terms, child, i, j, end);
+            for (t = 0; t < suggest->k; t++)
+                count = offer(suggest, best, count, suggest->k, suggest->top[(size_t)child * suggest->k + t]);
+            child++;
+        }
+        else {
+            for (t = i; t < j; t++)
+                count = offer(suggest, best, count, suggest->k, t);
+        }
+    }
+    memcpy(suggest->top + (size_t)node * suggest->k, best, suggest->k * sizeof(uint32_t));
+}
+
+suggest_t *suggest_create(termdict_t *dict, uint32_t *weights, int k)
+{
+    suggest_t *suggest = calloc(1, sizeof(suggest_t));
+    int i, n = termdict_size(dict);
+
+    if (suggest == NULL)
+        fatal_error("out of memory");
+    suggest->dict = dict;
+    suggest->k = k;
+    suggest->weights = malloc((n + 1) * sizeof(uint32_t));
+    if (suggest->weights == NULL)
+        fatal_error("out of memory");
+    memcpy(suggest->weights, weights, n * sizeof(uint32_t));
+
+    if (n > k) {
+        char **terms = malloc(n * sizeof(char *));
+        termdict_iter_t *it = termdict_rangeiter(dict, NULL, NULL);
+
+        if (terms == NULL)
+            fatal_error("out of memory");
+        for (i = 0; termdict_hasnext(it); i++) {
+            terms[i] = strdup(termdict_next(it, NULL));
+            if (terms[i] == NULL)
+                fatal_error("out of memory");
+        }
+        termdict_destroyiter(it);
+
+        build(suggest, terms, add_nodes(suggest, 1), 0, n, 0);
+
+        for (i = 0; i < n; i++)
+            free(terms[i]);
+        free(terms);
+        /* Trim the arrays to their final size */
+        suggest->maxnodes = suggest->numnodes;
+        suggest->nodes = realloc(suggest->nodes, suggest->numnodes * sizeof(node_t));
+        suggest->top = realloc(suggest->top, (size_t)suggest->numnodes * k * sizeof(uint32_t));
+        suggest->labelscap = suggest->labelslen > 0 ? suggest->labelslen : 1;
+        suggest->labels = realloc(suggest->labels, suggest->labelscap);
+        if (suggest->nodes == NULL || suggest->top == NULL || suggest->labels == NULL)
+            fatal_error("out of memory");
+    }
+    return suggest;
+}
+
+void suggest_destroy(suggest_t *suggest)
+{
+    free(suggest->weights);
+    free(suggest->nodes);
+    free(suggest->top);
+    free(suggest->labels);
+    free(suggest);
+}
+
+size_t suggest_memsize(suggest_t *suggest)
+{
+    return sizeof(suggest_t) + termdict_size(suggest->dict) * sizeof(uint32_t) +
+           suggest->numnodes * (sizeof(node_t) + suggest->k * sizeof(uint32_t)) + suggest->labelslen;
+}
+
+/*
+ * Returns the child of the given node whose label starts with the
+ * given character, or -1 if it has none.
+ */
+static int findchild(suggest_t *suggest, node_t *node, unsigned char c)
+{
+    int lo = node->firstchild, hi = node->firstchild + node->numchildren - 1;
+
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        unsigned char first = suggest->labels[suggest->nodes[mid].label];
+
+        if (first == c)
+            return mid;
+        if (first < c)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return -1;
+}
+
+int suggest_lookup(suggest_t *suggest, char *prefix, int n, int *ids)
+{
+    uint32_t best[suggest->k];
+    termdict_iter_t *it;
+    char *p = prefix;
+    int node = 0, count = 0, id, i;
+
+    if (n > suggest->k)
+        n = suggest->k;
+    if (n <= 0)
+        return 0;
+
+    while (suggest->numnodes > 0) {
+        node_t *cur = &suggest->nodes[node];
+        char *label = suggest->labels + cur->label;
+
+        for (i = 0; i < (int)cur->labellen && *p != '\0'; i++, p++) {
+            /* Every term under the node has the label */
+            if (label[i] != *p)
+                return 0;
+        }
+        if (*p == '\0') {
+            for (i = 0; i < n; i++)
+                ids[i] = suggest->top[(size_t)node * suggest->k + i];
+            return n;
+        }
+        node = findchild(suggest, cur, *p);
+        if (node < 0)
+            break;
+    }
+
+    /* At most k terms start with the prefix */
+    it = termdict_prefixiter(suggest->dict, prefix);
+    while (termdict_hasnext(it)) {
+        termdict_next(it, &id);
+        count = offer(suggest, best, count, n, id);
+    }
+    termdict_destroyiter(it);
+    for (i = 0; i < count; i++)
+        ids[i] = best[i];
+    return count;
+}
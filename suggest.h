@@ -0,0 +1,55 @@
+#ifndef SUGGEST_H
+#define SUGGEST_H
+
+#include "termdict.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The type of suggesters.  A suggester completes a prefix to the terms
+ * of a term dictionary that start with it, heaviest first, where the
+ * weight of a term is e.g. the number of documents that contain it.
+ *
+ * The terms that start with a prefix are a range of the sorted
+ * dictionary, and the ranges form a trie.  The suggester keeps a radix
+ * trie (where a node stands for the longest prefix its terms share)
+ * of the prefixes that start more than k terms, with the k heaviest of
+ * those terms at each node.  Any other prefix starts at most k terms,
+ * which are read from the dictionary.  So completing a prefix takes a
+ * walk down the trie plus at most k terms, however many terms start
+ * with it, and the trie only has nodes for a small part of the terms.
+ *
+ * A suggester does not change once created, so threads may share it.
+ */
+struct suggest;
+typedef struct suggest suggest_t;
+
+/*
+ * Creates a suggester for the terms of the given dictionary, with the
+ * given weight for each term id, that completes a prefix to at most k
+ * terms.  The suggester keeps a reference to the dictionary, which
+ * must outlive it, and a copy of the weights.
+ */
+suggest_t *suggest_create(termdict_t *dict, uint32_t *weights, int k);
+
+/*
+ * Destroys the given suggester.
+ */
+void suggest_destroy(suggest_t *suggest);
+
+/*
+ * Returns the number of bytes of memory used by the given suggester,
+ * not counting its dictionary.
+ */
+size_t suggest_memsize(suggest_t *suggest);
+
+/*
+ * Assigns the ids of the at most n heaviest terms that start with the
+ * given prefix to the given array, heaviest first, and terms of equal
+ * weight in sorted order.  n is capped at the k of the suggester.
+ * Returns the number of ids.
+ */
+int suggest_lookup(suggest_t *suggest, char *prefix, int n, int *ids);
+
+#endif
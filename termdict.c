@@ -0,0 +1,476 @@
+#include "termdict.h"
+#include "common.h"
+#include "levenshtein.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The number of terms per block.  Only the first term of a block is
+ * stored in full, and the block index has one entry per block.
+ */
+#define BLOCK_SIZE 16
+
+struct termdict {
+    unsigned char *data;    /* Front coded entries */
+    size_t datalen;
+    uint32_t *blocks;       /* Offset in data of each block */
+    int numblocks;
+    int size;
+    int maxlen;             /* Length of the longest term */
+};
+
+struct termdict_iter {
+    termdict_t *dict;
+    size_t offset;          /* Offset of the entry after the current term */
+    int id;                 /* Id of the current term */
+    char *term;             /* The current term, decoded in place */
+    int termlen;
+    char *result;           /* The term last returned by termdict_next() */
+    char *prefix;           /* End at the first term without this prefix */
+    int prefixlen;
+    char *to;               /* End at the first term not smaller than this */
+    levenshtein_t *fuzzy;   /* Skip the terms it does not accept, or NULL */
+    char *walked;           /* The last string run through fuzzy */
+    int walkedlen;          /* Length of its prefix whose states are known */
+    int done;
+};
+
+/*
+ * Each entry is encoded as three parts: the length of the prefix it
+ * shares with the previous term, the length of the rest, and the
+ * rest.  The lengths are variable length integers with 7 bits per byte.
+ * The first entry of a block shares nothing with the previous term, so
+ * decoding can start at any block.
+ */
+static size_t putvarint(unsigned char *p, uint32_t v)
+{
+    size_t n = 0;
+
+    while (v >= 0x80) {
+        p[n++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+static uint32_t getvarint(const unsigned char *data, size_t *offset)
+{
+    uint32_t v = 0;
+    int shift = 0;
+    unsigned char b;
+
+    do {
+        b = data[(*offset)++];
+        v |= (uint32_t)(b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    return v;
+}
+
+/*
+ * Compares a term of the given length with a string of the given
+ * length, in the same order as strcmp().
+ */
+static int compare_term(const char *term, int termlen, const char *s, int slen)
+{
+    int cmp = memcmp(term, s, termlen < slen ? termlen : slen);
+    if (cmp != 0)
+        return cmp;
+    return termlen - slen;
+}
+
+termdict_t *termdict_create(char **terms, int numterms)
+{
+    termdict_t *dict = malloc(sizeof(termdict_t));
+    size_t capacity = 1024;
+    int i, prevlen = 0;
+
+    if (dict == NULL)
+        fatal_error("out of memory");
+    dict->size = numterms;
+    dict->maxlen = 0;
+    dict->numblocks = (numterms + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    dict->blocks = malloc((dict->numblocks + 1) * sizeof(uint32_t));
+    dict->data = malloc(capacity);
+    dict->datalen = 0;
+    if (dict->blocks == NULL || dict->data == NULL)
+        fatal_error("out of memory");
+
+    for (i = 0; i < numterms; i++) {
+        int len = strlen(terms[i]);
+        int shared = 0;
+
+        if (i % BLOCK_SIZE == 0) {
+            dict->blocks[i / BLOCK_SIZE] = dict->datalen;
+        }
+        else {
+            while (shared < len && shared < prevlen && terms[i][shared] == terms[i - 1][shared])
+                shared++;
+        }
+
+        /* Two varints of at most 5 bytes each, plus the suffix */
+        while (dict->datalen + 10 + (len - shared) > capacity) {
+            capacity *= 2;
+            dict->data = realloc(dict->data, capacity);
+            if (dict->data == NULL)
+                fatal_error("out of memory");
+        }
+        dict->datalen += putvarint(dict->data + dict->datalen, shared);
+        dict->datalen += putvarint(dict->data + dict->datalen, len - shared);
+        memcpy(dict->data + dict->datalen, terms[i] + shared, len - shared);
+        dict->datalen += len - shared;
+
+        if (len > dict->maxlen)
+            dict->maxlen = len;
+        prevlen = len;
+    }
+
+    /* Trim the data to its final size */
+    dict->data = realloc(dict->data, dict->datalen > 0 ? dict->datalen : 1);
+    if (dict->data == NULL)
+        fatal_error("out of memory");
+    return dict;
+}
+
+void termdict_destroy(termdict_t *dict)
+{
+    free(dict->data);
+    free(dict->blocks);
+    free(dict);
+}
+
+int termdict_size(termdict_t *dict)
+{
+    return dict->size;
+}
+
+size_t termdict_memsize(termdict_t *dict)
+{
+    return sizeof(termdict_t) + dict->datalen + dict->numblocks * sizeof(uint32_t);
+}
+
+/*
+ * Compares the first term of the given block with a string of the
+ * given length, like compare_term().
+ */
+static int compare_block(termdict_t *dict, int block, const char *s, int slen)
+{
+    size_t offset = dict->blocks[block];
+    int len;
+
+    getvarint(dict->data, &offset);     /* Shared prefix, always 0 */
+    len = getvarint(dict->data, &offset);
+    return compare_term((char *)dict->data + offset, len, s, slen);
+}
+
+/*
+ * Returns the block that the given string would be in, which is the
+ * last block whose first term is not greater than the string, out of
+ * the blocks from lo to hi.
+ */
+static int findblock(termdict_t *dict, const char *s, int slen, int lo, int hi)
+{
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (compare_block(dict, mid, s, slen) <= 0)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+/*
+ * Decodes the next term into the iterator.  Returns 0 if there are
+ * no more terms, or 1 otherwise.
+ */
+static int decode(termdict_iter_t *iter)
+{
+    termdict_t *dict = iter->dict;
+    int shared, len;
+
+    if (iter->id + 1 >= dict->size)
+        return 0;
+    shared = getvarint(dict->data, &iter->offset);
+    len = getvarint(dict->data, &iter->offset);
+    memcpy(iter->term + shared, dict->data + iter->offset, len);
+    iter->offset += len;
+    iter->termlen = shared + len;
+    iter->term[iter->termlen] = '\0';
+    iter->id++;
+    return 1;
+}
+
+static void fuzzy_match(termdict_iter_t *iter);
+
+/*
+ * Moves the iterator to the next term, and checks whether it has
+ * reached the end of its range.
+ */
+static void advance(termdict_iter_t *iter)
+{
+    if (!decode(iter)) {
+        iter->done = 1;
+    }
+    else if (iter->prefix != NULL &&
+             (iter->termlen < iter->prefixlen ||
+              memcmp(iter->term, iter->prefix, iter->prefixlen) != 0)) {
+        iter->done = 1;
+    }
+    else if (iter->to != NULL && strcmp(iter->term, iter->to) >= 0) {
+        iter->done = 1;
+    }
+    else if (iter->fuzzy != NULL) {
+        fuzzy_match(iter);
+    }
+}
+
+/*
+ * Moves the iterator to the first term that is not smaller than the
+ * given string (or to the first term if the string is NULL).
+ */
+static void position(termdict_iter_t *iter, const char *from, int fromlen)
+{
+    termdict_t *dict = iter->dict;
+    int block = 0;
+
+    if (dict->size == 0) {
+        iter->done = 1;
+        return;
+    }
+    if (from != NULL)
+        block = findblock(dict, from, fromlen, 0, dict->numblocks - 1);
+    iter->offset = dict->blocks[block];
+    iter->id = block * BLOCK_SIZE - 1;
+    iter->termlen = 0;
+
+    /* Skip the terms before from */
+    do {
+        if (!decode(iter)) {
+            iter->done = 1;
+            break;
+        }
+    } while (from != NULL && compare_term(iter->term, iter->termlen, from, fromlen) < 0);
+}
+
+/*
+ * Moves the iterator forward to the first term that is not smaller
+ * than the given string, which must be greater than the current term.
+ * The block of the string is found by galloping ahead from the current
+ * block, so nearby strings are found without a search of every block.
+ */
+static void skipto(termdict_iter_t *iter, const char *to, int tolen)
+{
+    termdict_t *dict = iter->dict;
+    int block = iter->id / BLOCK_SIZE, lo = block, step = 1;
+
+    while (lo + step < dict->numblocks && compare_block(dict, lo + step, to, tolen) <= 0) {
+        lo += step;
+        step *= 2;
+    }
+    if (lo + 1 < dict->numblocks)
+        lo = findblock(dict, to, tolen, lo, (lo + step < dict->numblocks ? lo + step : dict->numblocks) - 1);
+    if (lo > block) {
+        iter->offset = dict->blocks[lo];
+        iter->id = lo * BLOCK_SIZE - 1;
+        iter->termlen = 0;
+    }
+
+    /* Skip the terms before to */
+    do {
+        if (!decode(iter)) {
+            iter->done = 1;
+            break;
+        }
+    } while (compare_term(iter->term, iter->termlen, to, tolen) < 0);
+}
+
+/*
+ * Creates an iterator positioned at the first term that is not smaller
+ * than the given string (or at the first term if the string is NULL).
+ */
+static termdict_iter_t *seek(termdict_t *dict, char *from)
+{
+    termdict_iter_t *iter = calloc(1, sizeof(termdict_iter_t));
+
+    if (iter == NULL)
+        fatal_error("out of memory");
+    iter->dict = dict;
+    iter->term = malloc(dict->maxlen + 1);
+    iter->result = malloc(dict->maxlen + 1);
+    if (iter->term == NULL || iter->result == NULL)
+        fatal_error("out of memory");
+    position(iter, from, from != NULL ? strlen(from) : 0);
+    return iter;
+}
+
+/*
+ * Moves a fuzzy iterator from its current term to the first term from
+ * there on that its automaton accepts.  Whenever a term has a dead
+ * prefix, the iterator seeks past every term with that prefix, to the
+ * smallest string whose prefixes are all alive.
+ */
+static void fuzzy_match(termdict_iter_t *iter)
+{
+    char target[iter->dict->maxlen + 2];
+    int d, k, c;
+
+    while (!iter->done) {
+        /* The states of the prefix shared with the last string are known */
+        for (d = 0; d < iter->walkedlen && d < iter->termlen && iter->walked[d] == iter->term[d]; d++)
+            ;
+        for (; d < iter->termlen; d++) {
+            iter->walked[d] = iter->term[d];
+            if (!levenshtein_step(iter->fuzzy, d, (unsigned char)iter->term[d]))
+                break;
+        }
+        iter->walkedlen = d;
+        if (d == iter->termlen) {
+            if (levenshtein_accepts(iter->fuzzy, d))
+                return;
+            if (!decode(iter))
+                iter->done = 1;
+            continue;
+        }
+
+        /* The prefix of length d + 1 is dead, so replace its last character */
+        for (k = d; k >= 0; k--) {
+            c = levenshtein_nextchar(iter->fuzzy, k, (unsigned char)iter->term[k]);
+            if (c >= 0)
+                break;
+        }
+        if (k < 0) {
+            iter->done = 1;
+            return;
+        }
+        memcpy(target, iter->term, k);
+        target[k] = c;
+        memcpy(iter->walked, target, k + 1);
+        iter->walkedlen = k + 1;
+        skipto(iter, target, k + 1);
+    }
+}
+
+int termdict_lookup(termdict_t *dict, char *term)
+{
+    int termlen = strlen(term);
+    int block, id, end;
+    size_t offset;
+
+    if (dict->size == 0 || termlen > dict->maxlen)
+        return -1;
+
+    char cur[dict->maxlen + 1];
+
+    /* If the term is anywhere, it is in this block */
+    block = findblock(dict, term, termlen, 0, dict->numblocks - 1);
+    offset = dict->blocks[block];
+    end = (block + 1) * BLOCK_SIZE < dict->size ? (block + 1) * BLOCK_SIZE : dict->size;
+    for (id = block * BLOCK_SIZE; id < end; id++) {
+        int shared = getvarint(dict->data, &offset);
+        int len = getvarint(dict->data, &offset);
+        int cmp;
+
+        memcpy(cur + shared, dict->data + offset, len);
+        offset += len;
+        cmp = compare_term(cur, shared + len, term, termlen);
+        if (cmp == 0)
+            return id;
+        if (cmp > 0)
+            break;
+    }
+    return -1;
+}
+
+char *termdict_term(termdict_t *dict, int id)
+{
+    char *term = malloc(dict->maxlen + 1);
+    size_t offset = dict->blocks[id / BLOCK_SIZE];
+    int i, len = 0;
+
+    if (term == NULL)
+        fatal_error("out of memory");
+    for (i = id / BLOCK_SIZE * BLOCK_SIZE; i <= id; i++) {
+        int shared = getvarint(dict->data, &offset);
+        int rest = getvarint(dict->data, &offset);
+
+        memcpy(term + shared, dict->data + offset, rest);
+        offset += rest;
+        len = shared + rest;
+    }
+    term[len] = '\0';
+    return term;
+}
+
+termdict_iter_t *termdict_prefixiter(termdict_t *dict, char *prefix)
+{
+    termdict_iter_t *iter = seek(dict, prefix);
+
+    iter->prefixlen = strlen(prefix);
+    iter->prefix = malloc(iter->prefixlen + 1);
+    if (iter->prefix == NULL)
+        fatal_error("out of memory");
+    strcpy(iter->prefix, prefix);
+    if (!iter->done && strncmp(iter->term, prefix, iter->prefixlen) != 0)
+        iter->done = 1;
+    return iter;
+}
+
+termdict_iter_t *termdict_rangeiter(termdict_t *dict, char *from, char *to)
+{
+    termdict_iter_t *iter = seek(dict, from);
+
+    if (to != NULL) {
+        iter->to = strdup(to);
+        if (iter->to == NULL)
+            fatal_error("out of memory");
+        if (!iter->done && strcmp(iter->term, to) >= 0)
+            iter->done = 1;
+    }
+    return iter;
+}
+
+termdict_iter_t *termdict_fuzzyiter(termdict_t *dict, char *term, int maxedits)
+{
+    termdict_iter_t *iter = seek(dict, NULL);
+
+    iter->fuzzy = levenshtein_create(term, maxedits);
+    iter->walked = malloc(dict->maxlen + 1);
+    if (iter->walked == NULL)
+        fatal_error("out of memory");
+    iter->walkedlen = 0;
+    fuzzy_match(iter);
+    return iter;
+}
+
+void termdict_destroyiter(termdict_iter_t *iter)
+{
+    if (iter->fuzzy != NULL)
+        levenshtein_destroy(iter->fuzzy);
+    free(iter->walked);
+    free(iter->term);
+    free(iter->result);
+    free(iter->prefix);
+    free(iter->to);
+    free(iter);
+}
+
+int termdict_hasnext(termdict_iter_t *iter)
+{
+    return !iter->done;
+}
+
+char *termdict_next(termdict_iter_t *iter, int *id)
+{
+    if (iter->done)
+        fatal_error("term dictionary iterator exhausted");
+
+    memcpy(iter->result, iter->term, iter->termlen + 1);
+    if (id != NULL)
+        *id = iter->id;
+    advance(iter);
+    return iter->result;
+}
@@ -0,0 +1,104 @@
+#ifndef TERMDICT_H
+#define TERMDICT_H
+
+#include <stddef.h>
+
+/*
+ * The type of term dictionaries.
+ *
+ * A term dictionary is a frozen, sorted set of terms.  The terms are
+ * front coded: they are stored in blocks of consecutive terms, where
+ * each term only stores the suffix that differs from the previous
+ * term.  A sparse index with the position of each block is kept in
+ * memory, so a lookup is a binary search over the first terms of the
+ * blocks followed by a short scan within one block.
+ *
+ * Each term is identified by its rank in the sorted order, so the
+ * first term has id 0, the next id 1, and so on.
+ */
+struct termdict;
+typedef struct termdict termdict_t;
+
+/*
+ * Creates a term dictionary containing the given terms, which must be
+ * sorted in strcmp() order and contain no duplicates.  The dictionary
+ * does not keep references to the given strings.
+ */
+termdict_t *termdict_create(char **terms, int numterms);
+
+/*
+ * Destroys the given term dictionary.
+ */
+void termdict_destroy(termdict_t *dict);
+
+/*
+ * Returns the number of terms in the given dictionary.
+ */
+int termdict_size(termdict_t *dict);
+
+/*
+ * Returns the number of bytes of memory used by the given dictionary.
+ */
+size_t termdict_memsize(termdict_t *dict);
+
+/*
+ * Returns the id of the given term, or -1 if the dictionary does not
+ * contain the term.
+ */
+int termdict_lookup(termdict_t *dict, char *term);
+
+/*
+ * Returns the term with the given id, which must be between 0 and the
+ * size of the dictionary.  Only the block of the term is decoded.  The
+ * returned string belongs to the caller.
+ */
+char *termdict_term(termdict_t *dict, int id);
+
+/*
+ * The type of term dictionary iterators.  Iterators visit terms in
+ * sorted order.
+ */
+struct termdict_iter;
+typedef struct termdict_iter termdict_iter_t;
+
+/*
+ * Creates an iterator over all terms that start with the given prefix.
+ */
+termdict_iter_t *termdict_prefixiter(termdict_t *dict, char *prefix);
+
+/*
+ * Creates an iterator over all terms t where from <= t < to.  If from
+ * is NULL the range starts at the first term, and if to is NULL the
+ * range ends after the last term.
+ */
+termdict_iter_t *termdict_rangeiter(termdict_t *dict, char *from, char *to);
+
+/*
+ * Creates an iterator over all terms within the given number of edits
+ * of the given term (see levenshtein.h).  The iterator runs a
+ * Levenshtein automaton over the terms in sorted order, and skips over
+ * every range of terms that starts with a prefix the automaton rules
+ * out, so it only visits the terms near the matches rather than every
+ * term in the dictionary.
+ */
+termdict_iter_t *termdict_fuzzyiter(termdict_t *dict, char *term, int maxedits);
+
+/*
+ * Destroys the given iterator.
+ */
+void termdict_destroyiter(termdict_iter_t *iter);
+
+/*
+ * Returns 0 if the given iterator has reached the end of its range,
+ * or 1 otherwise.
+ */
+int termdict_hasnext(termdict_iter_t *iter);
+
+/*
+ * Returns the next term, and assigns its id to the given pointer
+ * unless it is NULL.  The returned string belongs to the iterator and
+ * is overwritten by the next call.
+ */
+char *termdict_next(termdict_iter_t *iter, int *id);
+
+#endif
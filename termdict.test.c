@@ -0,0 +1,317 @@
+#include "common.h"
+#include "suggest.h"
+#include "termdict.h"
+#include "unittest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+enum { NTERMS = 1000 };
+
+
+static int compare_terms(const void *a, const void *b)
+{
+	return strcmp(*(char **)a, *(char **)b);
+}
+
+
+/*
+ * Counts the terms visited by the given iterator, checking that they
+ * are visited in sorted order with consecutive ids.
+ */
+static int count_terms(termdict_iter_t *it, char **terms)
+{
+	int n = 0, id, previd = -1;
+
+	while (termdict_hasnext(it)) {
+		char *term = termdict_next(it, &id);
+		UNITTEST(strcmp(term, terms[id]) == 0);
+		UNITTEST(previd < 0 || id == previd + 1);
+		previd = id;
+		n++;
+	}
+	termdict_destroyiter(it);
+	return n;
+}
+
+
+void termdict_test(void)
+{
+	char *terms[NTERMS];
+	char buf[32];
+	int i;
+
+	/* Terms with long shared prefixes, as in source code */
+	for (i = 0; i < NTERMS; i++) {
+		snprintf(buf, sizeof(buf), "%s_%d", (i % 3 == 0 ? "handle" : (i % 3 == 1 ? "handler" : "config")), i);
+		terms[i] = strdup(buf);
+	}
+	qsort(terms, NTERMS, sizeof(char *), compare_terms);
+
+	termdict_t *dict = termdict_create(terms, NTERMS);
+	UNITTEST(termdict_size(dict) == NTERMS);
+
+	/* Exact lookups */
+	for (i = 0; i < NTERMS; i++) {
+		UNITTEST(termdict_lookup(dict, terms[i]) == i);
+	}
+	UNITTEST(termdict_lookup(dict, "") == -1);
+	UNITTEST(termdict_lookup(dict, "a") == -1);
+	UNITTEST(termdict_lookup(dict, "zzz") == -1);
+	UNITTEST(termdict_lookup(dict, "handle") == -1);
+	UNITTEST(termdict_lookup(dict, "handle_1000") == -1);
+
+	/* Prefix enumeration */
+	UNITTEST(count_terms(termdict_prefixiter(dict, "handle"), terms) == 667);
+	UNITTEST(count_terms(termdict_prefixiter(dict, "handler_"), terms) == NTERMS / 3);
+	UNITTEST(count_terms(termdict_prefixiter(dict, "config_1"), terms) == 36);
+	UNITTEST(count_terms(termdict_prefixiter(dict, "nothing"), terms) == 0);
+	UNITTEST(count_terms(termdict_prefixiter(dict, ""), terms) == NTERMS);
+
+	/* Range enumeration */
+	UNITTEST(count_terms(termdict_rangeiter(dict, NULL, NULL), terms) == NTERMS);
+	UNITTEST(count_terms(termdict_rangeiter(dict, "config", "handle"), terms) == 333);
+	UNITTEST(count_terms(termdict_rangeiter(dict, "handler", NULL), terms) == NTERMS / 3);
+	UNITTEST(count_terms(termdict_rangeiter(dict, NULL, "config_2"), terms) == 36);
+	UNITTEST(count_terms(termdict_rangeiter(dict, "x", "y"), terms) == 0);
+
+	/* Terms by id */
+	for (i = 0; i < NTERMS; i++) {
+		char *term = termdict_term(dict, i);
+		UNITTEST(strcmp(term, terms[i]) == 0);
+		free(term);
+	}
+
+	/* Front coding should take a fraction of the space of the strings */
+	size_t stringsize = 0;
+	for (i = 0; i < NTERMS; i++) {
+		stringsize += strlen(terms[i]) + 1;
+	}
+	UNITTEST(termdict_memsize(dict) < stringsize / 2);
+
+	termdict_destroy(dict);
+
+	/* The empty dictionary */
+	dict = termdict_create(terms, 0);
+	UNITTEST(termdict_lookup(dict, "a") == -1);
+	UNITTEST(count_terms(termdict_prefixiter(dict, "a"), terms) == 0);
+	termdict_destroy(dict);
+
+	for (i = 0; i < NTERMS; i++) {
+		free(terms[i]);
+	}
+}
+
+/*
+ * Returns the number of edits between the given strings, counting a
+ * swap of two adjacent characters as one edit.
+ */
+static int distance(char *a, char *b)
+{
+	int m = strlen(a), n = strlen(b), i, j;
+	int d[m + 1][n + 1];
+
+	for (i = 0; i <= m; i++) {
+		for (j = 0; j <= n; j++) {
+			if (i == 0 || j == 0) {
+				d[i][j] = i + j;
+				continue;
+			}
+			d[i][j] = d[i - 1][j - 1] + (a[i - 1] != b[j - 1]);
+			if (d[i - 1][j] + 1 < d[i][j])
+				d[i][j] = d[i - 1][j] + 1;
+			if (d[i][j - 1] + 1 < d[i][j])
+				d[i][j] = d[i][j - 1] + 1;
+			if (i > 1 && j > 1 && a[i - 1] == b[j - 2] && a[i - 2] == b[j - 1] && d[i - 2][j - 2] + 1 < d[i][j])
+				d[i][j] = d[i - 2][j - 2] + 1;
+		}
+	}
+	return d[m][n];
+}
+
+
+void fuzzy_test(void)
+{
+	char *words[] = { "receive", "recipe", "recieve", "relieve", "deceive", "receiver", "rec", NULL };
+	char *terms[NTERMS];
+	termdict_t *dict;
+	termdict_iter_t *it;
+	int i, j, n, id;
+
+	for (i = 0; words[i] != NULL; i++) {
+		terms[i] = strdup(words[i]);
+	}
+	n = i;
+	qsort(terms, n, sizeof(char *), compare_terms);
+	dict = termdict_create(terms, n);
+
+	/* A swap is one edit */
+	it = termdict_fuzzyiter(dict, "recieve", 1);
+	UNITTEST(strcmp(termdict_next(it, NULL), "receive") == 0);
+	UNITTEST(strcmp(termdict_next(it, NULL), "recieve") == 0);
+	UNITTEST(strcmp(termdict_next(it, NULL), "relieve") == 0);
+	UNITTEST(!termdict_hasnext(it));
+	termdict_destroyiter(it);
+	it = termdict_fuzzyiter(dict, "recieve", 2);
+	for (i = 0; termdict_hasnext(it); i++) {
+		termdict_next(it, NULL);
+	}
+	termdict_destroyiter(it);
+	UNITTEST(i == 6);
+	termdict_destroy(dict);
+	for (i = 0; i < n; i++) {
+		free(terms[i]);
+	}
+
+	/* Short random terms over a few letters, so that many are close */
+	for (i = 0; i < NTERMS; i++) {
+		char buf[16];
+		int len = 1 + random_int() % 8;
+		for (j = 0; j < len; j++) {
+			buf[j] = "abcde"[random_int() % 5];
+		}
+		buf[len] = '\0';
+		terms[i] = strdup(buf);
+	}
+	qsort(terms, NTERMS, sizeof(char *), compare_terms);
+	for (i = n = 0; i < NTERMS; i++) {
+		if (n == 0 || strcmp(terms[i], terms[n - 1]) != 0) {
+			terms[n++] = terms[i];
+		} else {
+			free(terms[i]);
+		}
+	}
+	dict = termdict_create(terms, n);
+
+	for (i = 0; i < 200; i++) {
+		char *query = terms[random_int() % n], *term;
+		int edits = 1 + i % 2, expected = 0, found = 0;
+
+		for (j = 0; j < n; j++) {
+			expected += distance(query, terms[j]) <= edits;
+		}
+		it = termdict_fuzzyiter(dict, query, edits);
+		while (termdict_hasnext(it)) {
+			term = termdict_next(it, &id);
+			UNITTEST(strcmp(term, terms[id]) == 0);
+			UNITTEST(distance(query, term) <= edits);
+			found++;
+		}
+		termdict_destroyiter(it);
+		UNITTEST(found == expected);
+	}
+
+	/* Nothing is within reach of a term from elsewhere */
+	it = termdict_fuzzyiter(dict, "xyzxyz", 2);
+	UNITTEST(!termdict_hasnext(it));
+	termdict_destroyiter(it);
+
+	termdict_destroy(dict);
+	for (i = 0; i < n; i++) {
+		free(terms[i]);
+	}
+}
+
+
+/*
+ * Checks the suggestions for the given prefix against every term.
+ */
+static void check_suggest(suggest_t *suggest, char **terms, int numterms, uint32_t *weights, char *prefix, int n)
+{
+	int ids[NTERMS], expected[NTERMS];
+	int i, j, count, numexpected = 0, prefixlen = strlen(prefix);
+
+	/* The n heaviest terms with the prefix, in order */
+	for (i = 0; i < numterms; i++) {
+		if (strncmp(terms[i], prefix, prefixlen) != 0) {
+			continue;
+		}
+		for (j = numexpected; j > 0 && weights[i] > weights[expected[j - 1]]; j--) {
+			expected[j] = expected[j - 1];
+		}
+		expected[j] = i;
+		numexpected++;
+	}
+	if (numexpected > n) {
+		numexpected = n;
+	}
+
+	count = suggest_lookup(suggest, prefix, n, ids);
+	UNITTEST(count == numexpected);
+	for (i = 0; i < count && i < numexpected; i++) {
+		UNITTEST(ids[i] == expected[i]);
+	}
+}
+
+
+void suggest_test(void)
+{
+	char *terms[NTERMS], buf[16];
+	uint32_t weights[NTERMS];
+	suggest_t *suggest;
+	termdict_t *dict;
+	int i, j, n, k;
+
+	/* Short random terms over a few letters, so that prefixes are shared */
+	for (i = 0; i < NTERMS; i++) {
+		int len = 1 + random_int() % 6;
+		for (j = 0; j < len; j++) {
+			buf[j] = "abcd"[random_int() % 4];
+		}
+		buf[len] = '\0';
+		terms[i] = strdup(buf);
+	}
+	qsort(terms, NTERMS, sizeof(char *), compare_terms);
+	for (i = n = 0; i < NTERMS; i++) {
+		if (n == 0 || strcmp(terms[i], terms[n - 1]) != 0) {
+			terms[n++] = terms[i];
+		} else {
+			free(terms[i]);
+		}
+	}
+	/* Few distinct weights, so that there are ties */
+	for (i = 0; i < n; i++) {
+		weights[i] = random_int() % 20;
+	}
+	dict = termdict_create(terms, n);
+
+	for (k = 1; k <= 8; k *= 2) {
+		suggest = suggest_create(dict, weights, k);
+		check_suggest(suggest, terms, n, weights, "", k);
+		check_suggest(suggest, terms, n, weights, "e", k);
+		check_suggest(suggest, terms, n, weights, "abcdabcd", k);
+		for (i = 0; i < n; i++) {
+			/* Every prefix of every term */
+			strcpy(buf, terms[i]);
+			for (j = strlen(buf); j >= 0; j--) {
+				buf[j] = '\0';
+				check_suggest(suggest, terms, n, weights, buf, 1 + i % k);
+			}
+		}
+		UNITTEST(suggest_lookup(suggest, "a", 0, NULL) == 0);
+		suggest_destroy(suggest);
+	}
+
+	/* Fewer terms than suggestions */
+	suggest = suggest_create(dict, weights, n + 1);
+	check_suggest(suggest, terms, n, weights, "", n + 1);
+	check_suggest(suggest, terms, n, weights, "ab", n + 1);
+	suggest_destroy(suggest);
+
+	termdict_destroy(dict);
+	for (i = 0; i < n; i++) {
+		free(terms[i]);
+	}
+}
+
+
+int main(int argc, char **argv)
+{
+	termdict_test();
+	fuzzy_test();
+	suggest_test();
+
+	return 0;
+}
@@ -0,0 +1,344 @@
+/*
+ * Template for hash maps with a concrete key type.
+ *
+ * Unlike map_t, which hashes and compares keys through function
+ * pointers, the maps generated from this file use hash and equality
+ * macros that the compiler can inline into the bucket chain walks.
+ * Values are untyped pointers, as in map_t.
+ *
+ * To generate a map type, define the following macros and include
+ * this file:
+ *
+ *   TMAP_NAME      prefix of the generated names, e.g. map_str
+ *   TMAP_KEY       key type, e.g. char *
+ *   TMAP_HASH(k)   returns an unsigned long hash of the key k
+ *   TMAP_EQ(a, b)  returns non-zero if the keys a and b are equal
+ *
+ * This defines the types <prefix>_t, <prefix>_entry_t and
+ * <prefix>_iter_t and the functions <prefix>_create(),
+ * <prefix>_destroy(), <prefix>_size(), <prefix>_put(),
+ * <prefix>_haskey() and <prefix>_get(), which behave like their map.h
+ * counterparts, <prefix>_puthashed() and <prefix>_gethashed(), which
+ * take a precomputed TMAP_HASH() of the key, <prefix>_remove(), and
+ * <prefix>_createiter(), <prefix>_destroyiter(), <prefix>_hasnext() and
+ * <prefix>_next() for visiting every entry in an unspecified order.
+ *
+ * Each entry caches the hash of its key, so keys are never rehashed
+ * when the map grows, and chain walks only compare keys whose hashes
+ * match.  <prefix>_setincremental() selects incremental resizing, as
+ * map_setincremental() does for map_t.
+ *
+ * The macros are undefined at the end of this file, so it may be
+ * included several times with different parameters.
+ */
+
+#include "common.h"
+
+#include <stdlib.h>
+
+#if !defined(TMAP_NAME) || !defined(TMAP_KEY) || !defined(TMAP_HASH) || !defined(TMAP_EQ)
+#error "TMAP_NAME, TMAP_KEY, TMAP_HASH and TMAP_EQ must be defined before including tmap.h"
+#endif
+
+#ifndef TMAP_CAT
+#define TMAP_CAT_(a, b) a ## b
+#define TMAP_CAT(a, b) TMAP_CAT_(a, b)
+#endif
+
+#ifndef TMAP_MIGRATE_STEP
+#define TMAP_MIGRATE_STEP 4
+#endif
+
+#define TMAP_FN(fn) TMAP_CAT(TMAP_NAME, _ ## fn)
+#define TMAP_T TMAP_FN(t)
+#define TMAP_ENTRY_T TMAP_FN(entry_t)
+#define TMAP_ITER_T TMAP_FN(iter_t)
+
+typedef struct TMAP_FN(entry) {
+    TMAP_KEY key;
+    void *value;
+    unsigned long hash;
+    struct TMAP_FN(entry) *next;
+} TMAP_ENTRY_T;
+
+typedef struct {
+    int size;
+    TMAP_ENTRY_T **buckets;
+    int numbuckets;     /* Always a power of two */
+    int incremental;    /* Resize a few buckets at a time? */
+    TMAP_ENTRY_T **oldbuckets;  /* Table being migrated, or NULL */
+    int oldnumbuckets;
+    int migrated;       /* Old buckets below this one are empty */
+} TMAP_T;
+
+typedef struct {
+    TMAP_T *map;
+    int bucket;         /* Buckets past numbuckets are old buckets */
+    TMAP_ENTRY_T *entry;
+} TMAP_ITER_T;
+
+static inline TMAP_T *TMAP_FN(create)(void)
+{
+    TMAP_T *map = malloc(sizeof(TMAP_T));
+    if (map == NULL)
+        fatal_error("out of memory");
+    map->size = 0;
+    map->numbuckets = 8;
+    map->buckets = calloc(map->numbuckets, sizeof(TMAP_ENTRY_T *));
+    if (map->buckets == NULL)
+        fatal_error("out of memory");
+    map->incremental = 0;
+    map->oldbuckets = NULL;
+    map->oldnumbuckets = 0;
+    map->migrated = 0;
+    return map;
+}
+
+static inline void TMAP_FN(freebuckets)(int numbuckets, TMAP_ENTRY_T **buckets)
+{
+    int b;
+    TMAP_ENTRY_T *e, *tmp;
+
+    for (b = 0; b < numbuckets; b++) {
+        e = buckets[b];
+        while (e != NULL) {
+            tmp = e;
+            e = e->next;
+            free(tmp);
+        }
+    }
+    free(buckets);
+}
+
+static inline void TMAP_FN(destroy)(TMAP_T *map)
+{
+    if (map->oldbuckets != NULL)
+        TMAP_FN(freebuckets)(map->oldnumbuckets, map->oldbuckets);
+    TMAP_FN(freebuckets)(map->numbuckets, map->buckets);
+    free(map);
+}
+
+static inline int TMAP_FN(size)(TMAP_T *map)
+{
+    return map->size;
+}
+
+/*
+ * Migrates up to the given number of old buckets to the new table,
+ * relinking the existing entries instead of allocating new ones, and
+ * frees the old table once it is empty.
+ */
+static inline void TMAP_FN(migrate)(TMAP_T *map, int nbuckets)
+{
+    while (nbuckets-- > 0 && map->migrated < map->oldnumbuckets) {
+        TMAP_ENTRY_T *e = map->oldbuckets[map->migrated];
+        while (e != NULL) {
+            TMAP_ENTRY_T *next = e->next;
+            int nb = e->hash & (map->numbuckets - 1);
+            e->next = map->buckets[nb];
+            map->buckets[nb] = e;
+            e = next;
+        }
+        map->oldbuckets[map->migrated++] = NULL;
+    }
+    if (map->migrated == map->oldnumbuckets) {
+        free(map->oldbuckets);
+        map->oldbuckets = NULL;
+        map->oldnumbuckets = 0;
+        map->migrated = 0;
+    }
+}
+
+/*
+ * Doubles the number of buckets.  Unless the map is incremental, all
+ * entries are migrated right away.
+ */
+static inline void TMAP_FN(grow)(TMAP_T *map)
+{
+    if (map->oldbuckets != NULL)
+        TMAP_FN(migrate)(map, map->oldnumbuckets);
+
+    map->oldnumbuckets = map->numbuckets;
+    map->oldbuckets = map->buckets;
+    map->migrated = 0;
+
+    map->numbuckets = map->oldnumbuckets * 2;
+    map->buckets = calloc(map->numbuckets, sizeof(TMAP_ENTRY_T *));
+    if (map->buckets == NULL)
+        fatal_error("out of memory");
+
+    if (!map->incremental)
+        TMAP_FN(migrate)(map, map->oldnumbuckets);
+}
+
+static inline void TMAP_FN(setincremental)(TMAP_T *map, int incremental)
+{
+    map->incremental = incremental;
+    if (!incremental && map->oldbuckets != NULL)
+        TMAP_FN(migrate)(map, map->oldnumbuckets);
+}
+
+static inline TMAP_ENTRY_T *TMAP_FN(lookup)(TMAP_T *map, TMAP_KEY key, unsigned long hash)
+{
+    TMAP_ENTRY_T *e = map->buckets[hash & (map->numbuckets - 1)];
+
+    while (e != NULL && (e->hash != hash || !TMAP_EQ(key, e->key))) {
+        e = e->next;
+    }
+    if (e == NULL && map->oldbuckets != NULL) {
+        /* The key may still be in an unmigrated old bucket */
+        int b = hash & (map->oldnumbuckets - 1);
+        if (b >= map->migrated) {
+            e = map->oldbuckets[b];
+            while (e != NULL && (e->hash != hash || !TMAP_EQ(key, e->key))) {
+                e = e->next;
+            }
+        }
+    }
+    return e;
+}
+
+static inline void TMAP_FN(puthashed)(TMAP_T *map, TMAP_KEY key, unsigned long hash, void *value)
+{
+    TMAP_ENTRY_T *e;
+
+    if (map->oldbuckets != NULL)
+        TMAP_FN(migrate)(map, TMAP_MIGRATE_STEP);
+
+    e = TMAP_FN(lookup)(map, key, hash);
+    if (e == NULL) {
+        int b = hash & (map->numbuckets - 1);
+        e = malloc(sizeof(TMAP_ENTRY_T));
+        if (e == NULL)
+            fatal_error("out of memory");
+        e->key = key;
+        e->value = value;
+        e->hash = hash;
+        e->next = map->buckets[b];
+        map->buckets[b] = e;
+        map->size++;
+        if (map->size >= map->numbuckets)
+            TMAP_FN(grow)(map);
+    }
+    else {
+        e->value = value;
+    }
+}
+
+static inline void TMAP_FN(put)(TMAP_T *map, TMAP_KEY key, void *value)
+{
+    TMAP_FN(puthashed)(map, key, TMAP_HASH(key), value);
+}
+
+static inline int TMAP_FN(haskey)(TMAP_T *map, TMAP_KEY key)
+{
+    return TMAP_FN(lookup)(map, key, TMAP_HASH(key)) != NULL;
+}
+
+static inline void *TMAP_FN(gethashed)(TMAP_T *map, TMAP_KEY key, unsigned long hash)
+{
+    TMAP_ENTRY_T *e = TMAP_FN(lookup)(map, key, hash);
+    return e == NULL ? NULL : e->value;
+}
+
+static inline void *TMAP_FN(get)(TMAP_T *map, TMAP_KEY key)
+{
+    return TMAP_FN(gethashed)(map, key, TMAP_HASH(key));
+}
+
+/*
+ * Removes the entry with the given key, and returns its value, or NULL
+ * if there is no such entry.  The key itself is not freed.
+ */
+static inline void *TMAP_FN(remove)(TMAP_T *map, TMAP_KEY key)
+{
+    unsigned long hash = TMAP_HASH(key);
+    TMAP_ENTRY_T **link = &map->buckets[hash & (map->numbuckets - 1)];
+    TMAP_ENTRY_T *e;
+    void *value;
+
+    while (*link != NULL && ((*link)->hash != hash || !TMAP_EQ(key, (*link)->key)))
+        link = &(*link)->next;
+    if (*link == NULL && map->oldbuckets != NULL) {
+        /* The key may still be in an unmigrated old bucket */
+        int b = hash & (map->oldnumbuckets - 1);
+        if (b >= map->migrated) {
+            link = &map->oldbuckets[b];
+            while (*link != NULL && ((*link)->hash != hash || !TMAP_EQ(key, (*link)->key)))
+                link = &(*link)->next;
+        }
+    }
+    e = *link;
+    if (e == NULL)
+        return NULL;
+    *link = e->next;
+    value = e->value;
+    free(e);
+    map->size--;
+    return value;
+}
+
+/*
+ * Returns the head of the given iterator bucket, where the buckets of
+ * the old table (while it is being migrated) follow those of the new.
+ */
+static inline TMAP_ENTRY_T *TMAP_FN(iterbucket)(TMAP_T *map, int bucket)
+{
+    if (bucket < map->numbuckets)
+        return map->buckets[bucket];
+    return map->oldbuckets[bucket - map->numbuckets];
+}
+
+static inline int TMAP_FN(iterbuckets)(TMAP_T *map)
+{
+    return map->numbuckets + (map->oldbuckets != NULL ? map->oldnumbuckets : 0);
+}
+
+static inline TMAP_ITER_T *TMAP_FN(createiter)(TMAP_T *map)
+{
+    TMAP_ITER_T *iter = malloc(sizeof(TMAP_ITER_T));
+    if (iter == NULL)
+        fatal_error("out of memory");
+    iter->map = map;
+    iter->bucket = 0;
+    iter->entry = map->buckets[0];
+    while (iter->entry == NULL && ++iter->bucket < TMAP_FN(iterbuckets)(map))
+        iter->entry = TMAP_FN(iterbucket)(map, iter->bucket);
+    return iter;
+}
+
+static inline void TMAP_FN(destroyiter)(TMAP_ITER_T *iter)
+{
+    free(iter);
+}
+
+static inline int TMAP_FN(hasnext)(TMAP_ITER_T *iter)
+{
+    return iter->entry != NULL;
+}
+
+/*
+ * Returns the next entry; its key and value may be read, and the
+ * value may be modified.  The map must not be modified while it is
+ * being iterated over.
+ */
+static inline TMAP_ENTRY_T *TMAP_FN(next)(TMAP_ITER_T *iter)
+{
+    TMAP_ENTRY_T *e = iter->entry;
+
+    if (e == NULL)
+        fatal_error("map iterator exhausted");
+    iter->entry = e->next;
+    while (iter->entry == NULL && ++iter->bucket < TMAP_FN(iterbuckets)(iter->map))
+        iter->entry = TMAP_FN(iterbucket)(iter->map, iter->bucket);
+    return e;
+}
+
+#undef TMAP_ITER_T
+#undef TMAP_ENTRY_T
+#undef TMAP_T
+#undef TMAP_FN
+#undef TMAP_NAME
+#undef TMAP_KEY
+#undef TMAP_HASH
+#undef TMAP_EQ
@@ -0,0 +1,160 @@
+#include "common.h"
+#include "list.h"
+#include "tokenizer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Measures the throughput of the tokenizer in bytes per second, on
+ * text that is all ASCII, as most source code is, and on text where
+ * some of the words are in other scripts, with and without folding
+ * case.  The byte at a time ASCII tokenizer that came before it is the
+ * baseline.
+ */
+
+enum {
+	TEXTLEN = 16 << 20,
+	ROUNDS = 10,
+};
+
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+ * Fills the given buffer with lines of code-like text.  Every mixed'th
+ * word is taken from a list of non-ASCII words, unless mixed is 0.
+ */
+static void make_text(char *text, size_t len, int mixed)
+{
+	char *ascii[] = { "int", "return", "index_t", "*idx", "=", "NULL;", "if", "(n", ">", "0)", "{",
+					  "}", "/*", "Returns", "the", "number", "of", "words", "*/", "list_addlast(list,", "word);" };
+	char *other[] = { "größe", "naïve", "Привет", "мир", "日本語", "テスト", "Ελληνικά", "café", "«quoted»" };
+	unsigned int seed = 1;
+	size_t n = 0;
+	int i = 0;
+
+	while (n < len - 32) {
+		char *word;
+		seed = seed * 1103515245 + 12345;
+		if (mixed > 0 && ++i % mixed == 0) {
+			word = other[(seed >> 16) % (sizeof(other) / sizeof(other[0]))];
+		} else {
+			word = ascii[(seed >> 16) % (sizeof(ascii) / sizeof(ascii[0]))];
+		}
+		n += sprintf(text + n, "%s%c", word, (seed >> 8) % 8 == 0 ? '\n' : ' ');
+	}
+	text[n] = '\0';
+}
+
+
+/*
+ * The tokenizer before UTF-8 support, one byte at a time.
+ */
+static int old_is_word_char(int c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+		   (c >= '0' && c <= '9') || c == '\'' || c == '_';
+}
+
+static void old_add_token(list_t *list, char *buf, size_t len)
+{
+	char *word = malloc(len + 1);
+	if (word == NULL)
+		fatal_error("out of memory");
+	memcpy(word, buf, len);
+	word[len] = '\0';
+	list_addlast(list, token_create(word, len));
+}
+
+static void old_tokenize(const char *text, size_t n, list_t *list)
+{
+	char word[MAX_WORD_LEN];
+	size_t len = 0, i;
+
+	for (i = 0; i < n; i++) {
+		if (old_is_word_char((unsigned char)text[i])) {
+			word[len++] = text[i];
+			if (len == MAX_WORD_LEN) {
+				old_add_token(list, word, len);
+				len = 0;
+			}
+		}
+		else if (len > 0) {
+			old_add_token(list, word, len);
+			len = 0;
+		}
+	}
+	if (len > 0) {
+		old_add_token(list, word, len);
+	}
+}
+
+
+static void empty(list_t *tokens)
+{
+	while (list_size(tokens) > 0) {
+		token_destroy(list_popfirst(tokens));
+	}
+}
+
+
+/*
+ * Tokenizes the given text ROUNDS times with the given tokenizer, or
+ * the old one if it is NULL, and prints the best throughput.
+ */
+static void bench(char *name, tokenizer_t *tokenizer, const char *text, size_t len)
+{
+	list_t *tokens = list_create(compare_pointers);
+	double t, best = 0;
+	int round, numtokens = 0;
+
+	for (round = 0; round < ROUNDS; round++) {
+		t = now();
+		if (tokenizer == NULL) {
+			old_tokenize(text, len, tokens);
+		} else {
+			tokenizer_text(tokenizer, text, len, tokens);
+		}
+		t = now() - t;
+		if (best == 0 || t < best) {
+			best = t;
+		}
+		numtokens = list_size(tokens);
+		empty(tokens);
+	}
+	list_destroy(tokens);
+	printf("%-28s %8.1f MB/s  (%d words)\n", name, len / best / (1 << 20), numtokens);
+}
+
+
+int main(int argc, char **argv)
+{
+	char *ascii = malloc(TEXTLEN), *mixed = malloc(TEXTLEN);
+	tokenizer_t *fold = tokenizer_create(TOKENIZER_CASEFOLD, NULL);
+
+	if (ascii == NULL || mixed == NULL) {
+		fatal_error("out of memory");
+	}
+	make_text(ascii, TEXTLEN, 0);
+	make_text(mixed, TEXTLEN, 4);
+
+	bench("ascii, old tokenizer", NULL, ascii, strlen(ascii));
+	bench("ascii", tokenizer_default(), ascii, strlen(ascii));
+	bench("ascii, case folded", fold, ascii, strlen(ascii));
+	bench("mixed", tokenizer_default(), mixed, strlen(mixed));
+	bench("mixed, case folded", fold, mixed, strlen(mixed));
+
+	tokenizer_destroy(fold);
+	free(ascii);
+	free(mixed);
+	return 0;
+}
@@ -0,0 +1,308 @@
+#include "common.h"
+#include "tokenizer.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct tokenizer {
+    int flags;
+    unsigned char ascii[128];   /* Each ASCII character as put in words, or 0 */
+};
+
+static tokenizer_t default_tokenizer;
+static pthread_once_t default_once = PTHREAD_ONCE_INIT;
+
+static void init(tokenizer_t *tokenizer, int flags, char *wordchars)
+{
+    int c;
+
+    tokenizer->flags = flags;
+    memset(tokenizer->ascii, 0, sizeof(tokenizer->ascii));
+    for (c = '0'; c <= '9'; c++)
+        tokenizer->ascii[c] = c;
+    for (c = 'a'; c <= 'z'; c++) {
+        tokenizer->ascii[c] = c;
+        tokenizer->ascii[c - 'a' + 'A'] = flags & TOKENIZER_CASEFOLD ? c : c - 'a' + 'A';
+    }
+    for (; *wordchars != '\0'; wordchars++) {
+        if ((unsigned char)*wordchars < 0x80)
+            tokenizer->ascii[(unsigned char)*wordchars] = *wordchars;
+    }
+}
+
+tokenizer_t *tokenizer_create(int flags, char *wordchars)
+{
+    tokenizer_t *tokenizer = malloc(sizeof(tokenizer_t));
+
+    if (tokenizer == NULL)
+        fatal_error("out of memory");
+    init(tokenizer, flags, wordchars != NULL ? wordchars : DEFAULT_WORD_CHARS);
+    return tokenizer;
+}
+
+tokenizer_t *tokenizer_copy(tokenizer_t *tokenizer)
+{
+    tokenizer_t *copy = malloc(sizeof(tokenizer_t));
+
+    if (copy == NULL)
+        fatal_error("out of memory");
+    *copy = *tokenizer;
+    return copy;
+}
+
+void tokenizer_destroy(tokenizer_t *tokenizer)
+{
+    free(tokenizer);
+}
+
+static void init_default(void)
+{
+    init(&default_tokenizer, 0, DEFAULT_WORD_CHARS);
+}
+
+tokenizer_t *tokenizer_default(void)
+{
+    pthread_once(&default_once, init_default);
+    return &default_tokenizer;
+}
+
+/*
+ * Decodes the UTF-8 sequence at the given position, which starts with a
+ * byte of 0x80 or more and has at most avail bytes.  Assigns the code
+ * point to the given pointer, and returns the length of the sequence,
+ * or 0 if it is malformed (e.g. truncated, overlong or a surrogate).
+ */
+static int decode(const unsigned char *p, size_t avail, uint32_t *cp)
+{
+    int len, i;
+    uint32_t min;
+
+    if (p[0] >= 0xc2 && p[0] <= 0xdf) {
+        len = 2;
+        *cp = p[0] & 0x1f;
+        min = 0x80;
+    }
+    else if (p[0] >= 0xe0 && p[0] <= 0xef) {
+        len = 3;
+        *cp = p[0] & 0x0f;
+        min = 0x800;
+    }
+    else if (p[0] >= 0xf0 && p[0] <= 0xf4) {
+        len = 4;
+        *cp = p[0] & 0x07;
+        min = 0x10000;
+    }
+    else {
+        return 0;
+    }
+    if ((size_t)len > avail)
+        return 0;
+    for (i = 1; i < len; i++) {
+        if ((p[i] & 0xc0) != 0x80)
+            return 0;
+        *cp = *cp << 6 | (p[i] & 0x3f);
+    }
+    if (*cp < min || *cp > 0x10ffff || (*cp >= 0xd800 && *cp <= 0xdfff))
+        return 0;
+    return len;
+}
+
+/*
+ * Returns 1 if the given code point, which is not ASCII, is a letter, a
+ * digit or a mark, or 0 if it is punctuation, a symbol or a space.
+ */
+static int is_word_codepoint(uint32_t cp)
+{
+    if (cp < 0xc0)
+        /* Latin-1 punctuation and symbols, except ª, µ and º */
+        return cp == 0xaa || cp == 0xb5 || cp == 0xba;
+    if (cp < 0x2000)
+        return cp != 0xd7 && cp != 0xf7 && cp != 0x37e && cp != 0x387 &&
+               !(cp >= 0x55a && cp <= 0x55f) && cp != 0x589 && cp != 0x5be &&
+               !(cp >= 0x60c && cp <= 0x60d) && cp != 0x61b && cp != 0x61f &&
+               cp != 0x964 && cp != 0x965 && cp != 0x1680;
+    if (cp < 0x2c00)
+        /* Punctuation, currency, arrows, math, box drawing, dingbats */
+        return 0;
+    if (cp >= 0x2e00 && cp <= 0x2e7f)
+        /* Supplemental punctuation */
+        return 0;
+    if (cp >= 0x3000 && cp <= 0x303f)
+        /* CJK punctuation, e.g. "、" and "。" */
+        return 0;
+    if (cp >= 0xe000 && cp <= 0xf8ff)
+        /* Private use */
+        return 0;
+    if ((cp >= 0xfe10 && cp <= 0xfe1f) || (cp >= 0xfe30 && cp <= 0xfe6f) || cp == 0xfeff)
+        return 0;
+    if ((cp >= 0xff00 && cp <= 0xff0f) || (cp >= 0xff1a && cp <= 0xff20) ||
+        (cp >= 0xff3b && cp <= 0xff40) || (cp >= 0xff5b && cp <= 0xff65) || (cp >= 0xfff0 && cp <= 0xffff))
+        /* Full width punctuation, and specials */
+        return 0;
+    if (cp >= 0x1f000 && cp <= 0x1faff)
+        /* Emoji and other pictographs */
+        return 0;
+    return 1;
+}
+
+/*
+ * Returns the lower case of the given code point, which takes as many
+ * bytes in UTF-8, or the code point itself.
+ */
+static uint32_t fold_codepoint(uint32_t cp)
+{
+    if (cp >= 0xc0 && cp <= 0xde && cp != 0xd7)
+        return cp + 0x20;
+    if (cp >= 0x100 && cp <= 0x17f) {
+        /* Latin Extended-A pairs each upper case letter with the next */
+        if ((cp <= 0x137 && cp != 0x130 && cp != 0x131) || (cp >= 0x14a && cp <= 0x177))
+            return cp | 1;
+        if ((cp >= 0x139 && cp <= 0x148) || (cp >= 0x179 && cp <= 0x17e))
+            return cp & 1 ? cp + 1 : cp;
+        if (cp == 0x178)
+            return 0xff;
+        return cp;
+    }
+    if (cp >= 0x386 && cp <= 0x3ab) {
+        if (cp == 0x386)
+            return 0x3ac;
+        if (cp >= 0x388 && cp <= 0x38a)
+            return cp + 0x25;
+        if (cp == 0x38c)
+            return 0x3cc;
+        if (cp == 0x38e || cp == 0x38f)
+            return cp + 0x3f;
+        if (cp >= 0x391 && cp != 0x3a2)
+            return cp + 0x20;
+        return cp;
+    }
+    if (cp >= 0x400 && cp <= 0x40f)
+        return cp + 0x50;
+    if (cp >= 0x410 && cp <= 0x42f)
+        return cp + 0x20;
+    if ((cp >= 0x460 && cp <= 0x481) || (cp >= 0x48a && cp <= 0x4bf))
+        return cp | 1;
+    if (cp >= 0x531 && cp <= 0x556)
+        return cp + 0x30;
+    return cp;
+}
+
+/*
+ * Folds the character of the given length at the given position in
+ * place, if it is a two byte character, the only ones that fold.
+ */
+static inline void fold_char(unsigned char *p, int len, uint32_t cp)
+{
+    if (len == 2) {
+        cp = fold_codepoint(cp);
+        p[0] = 0xc0 | cp >> 6;
+        p[1] = 0x80 | (cp & 0x3f);
+    }
+}
+
+void fold_case(char *s, size_t len)
+{
+    unsigned char *p = (unsigned char *)s;
+    size_t i = 0;
+
+    while (i < len) {
+        uint32_t cp;
+        int n;
+
+        if (p[i] < 0x80) {
+            if (p[i] >= 'A' && p[i] <= 'Z')
+                p[i] += 'a' - 'A';
+            i++;
+            continue;
+        }
+        n = decode(p + i, len - i, &cp);
+        if (n == 0) {
+            i++;
+            continue;
+        }
+        fold_char(p + i, n, cp);
+        i += n;
+    }
+}
+
+static void add_token(list_t *list, char *buf, size_t len)
+{
+    char *word = malloc(len + 1);
+    if (word == NULL)
+        fatal_error("out of memory");
+    memcpy(word, buf, len);
+    word[len] = '\0';
+    list_addlast(list, token_create(word, len));
+}
+
+/*
+ * Adds the given ASCII character to the current word, or ends the word
+ * if the character is not a word character.
+ */
+static inline void add_ascii(tokenizer_t *tokenizer, list_t *list, char *word, size_t *len, unsigned char c)
+{
+    c = tokenizer->ascii[c];
+    if (c != 0) {
+        word[(*len)++] = c;
+        if (*len == MAX_WORD_LEN) {
+            /* Split overlong words, like the old fscanf() based tokenizer */
+            add_token(list, word, *len);
+            *len = 0;
+        }
+    }
+    else if (*len > 0) {
+        add_token(list, word, *len);
+        *len = 0;
+    }
+}
+
+void tokenizer_text(tokenizer_t *tokenizer, const char *text, size_t len, list_t *list)
+{
+    const unsigned char *p = (const unsigned char *)text;
+    char word[MAX_WORD_LEN];
+    size_t wordlen = 0, i = 0;
+
+    while (i < len) {
+        uint32_t cp;
+        int n;
+
+        if (p[i] < 0x80) {
+            add_ascii(tokenizer, list, word, &wordlen, p[i]);
+            i++;
+            continue;
+        }
+
+        n = decode(p + i, len - i, &cp);
+        if (n > 0 && !(tokenizer->flags & TOKENIZER_ASCII) && is_word_codepoint(cp)) {
+            if (wordlen + n > MAX_WORD_LEN) {
+                add_token(list, word, wordlen);
+                wordlen = 0;
+            }
+            memcpy(word + wordlen, p + i, n);
+            if (tokenizer->flags & TOKENIZER_CASEFOLD)
+                fold_char((unsigned char *)word + wordlen, n, cp);
+            wordlen += n;
+        }
+        else if (wordlen > 0) {
+            add_token(list, word, wordlen);
+            wordlen = 0;
+        }
+        i += n > 0 ? n : 1;
+    }
+    if (wordlen > 0) {
+        add_token(list, word, wordlen);
+    }
+}
+
+void tokenize_file(FILE *file, list_t *list)
+{
+    size_t len;
+    char *text = read_file(file, &len);
+
+    if (text != NULL) {
+        tokenizer_text(tokenizer_default(), text, len, list);
+        free(text);
+    }
+}
@@ -0,0 +1,92 @@
+#ifndef TOKENIZER_H
+#define TOKENIZER_H
+
+#include "list.h"
+
+#include <stddef.h>
+#include <stdio.h>
+
+/*
+ * The type of tokenizers.  A tokenizer splits UTF-8 text into words,
+ * which are the longest runs of word characters.  Letters and digits
+ * are always word characters, in any script unless the tokenizer is
+ * limited to ASCII, and so are the ASCII punctuation characters it is
+ * configured with ("_'" by default, e.g. "_'-" to keep "built-in" in
+ * one piece).  Everything else separates words, and so do bytes that
+ * are not valid UTF-8.
+ *
+ * Outside ASCII, a character is taken to be a letter or a digit unless
+ * it is in one of the blocks of punctuation, symbols, spaces or emoji.
+ * Combining marks are letters, so "naïve" is one word whether or not
+ * the "ï" is precomposed.
+ *
+ * ASCII characters, which make up most source code, are split with a
+ * lookup table rather than by decoding them.
+ */
+struct tokenizer;
+typedef struct tokenizer tokenizer_t;
+
+/*
+ * Flags for tokenizer_create().
+ */
+enum {
+    TOKENIZER_CASEFOLD = 1,     /* Fold words to lower case (see fold_case()) */
+    TOKENIZER_ASCII = 2,        /* Only ASCII letters and digits are word characters */
+};
+
+/*
+ * The ASCII punctuation characters that are word characters by default.
+ */
+#define DEFAULT_WORD_CHARS "_'"
+
+/*
+ * Creates a tokenizer with the given flags, where the given ASCII
+ * punctuation characters are word characters, or those of
+ * DEFAULT_WORD_CHARS if they are NULL.
+ */
+tokenizer_t *tokenizer_create(int flags, char *wordchars);
+
+/*
+ * Creates a tokenizer that splits text like the given one.
+ */
+tokenizer_t *tokenizer_copy(tokenizer_t *tokenizer);
+
+/*
+ * Destroys the given tokenizer.
+ */
+void tokenizer_destroy(tokenizer_t *tokenizer);
+
+/*
+ * Returns the tokenizer with no flags and the default word characters,
+ * which belongs to this module.
+ */
+tokenizer_t *tokenizer_default(void);
+
+/*
+ * Splits the given text into words, and adds them to the given list as
+ * token_t's (see common.h), in the same order that they occur in the
+ * text.  Words longer than MAX_WORD_LEN bytes are split, but never
+ * within a character.
+ */
+void tokenizer_text(tokenizer_t *tokenizer, const char *text, size_t len, list_t *list);
+
+/*
+ * Folds the given UTF-8 string of the given length to lower case, in
+ * place.  Folding covers the ASCII, Latin-1, Latin Extended-A, Greek,
+ * Cyrillic and Armenian letters, whose lower and upper case take as
+ * many bytes, so the length of the string does not change.
+ */
+void fold_case(char *s, size_t len);
+
+/*
+ * Reads the given file, and parses it into words (tokens) with the
+ * default tokenizer.  Adds the words to the given list as token_t's,
+ * in the same order that they occur in the file.
+ *
+ * This tokenizer ignores punctuation and whitespace, so if the file
+ * contains the text "Hello! This is an example...." the recognized
+ * words will be "Hello", "This", "is", "an", and "example".
+ */
+void tokenize_file(FILE *file, list_t *list);
+
+#endif
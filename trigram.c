@@ -0,0 +1,401 @@
+#include "common.h"
+#include "trigram.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Maps from trigrams, packed into the low 24 bits of an integer, to
+ * their sets of documents.
+ */
+#define TMAP_NAME map_u32
+#define TMAP_KEY uint32_t
+#define TMAP_HASH(k) ((unsigned long)(k) * 0x9e3779b97f4a7c15UL >> 32)
+#define TMAP_EQ(a, b) ((a) == (b))
+#include "tmap.h"
+
+struct trigram {
+    map_u32_t *map;         /* trigram -> set_u32_t */
+};
+
+/*
+ * While a filter is being built, NULL stands for the set of every
+ * document, which is what parts that cannot be filtered on match.
+ */
+typedef struct {
+    trigram_t *trigrams;
+    const char *p;          /* Next character of the expression */
+    uint32_t run;           /* Last characters of the current literal run */
+    int runlen;
+} parser_t;
+
+trigram_t *trigram_create(void)
+{
+    trigram_t *trigrams = malloc(sizeof(trigram_t));
+
+    if (trigrams == NULL)
+        fatal_error("out of memory");
+    trigrams->map = map_u32_create();
+    return trigrams;
+}
+
+void trigram_destroy(trigram_t *trigrams)
+{
+    map_u32_iter_t *it = map_u32_createiter(trigrams->map);
+
+    while (map_u32_hasnext(it))
+        set_u32_destroy(map_u32_next(it)->value);
+    map_u32_destroyiter(it);
+    map_u32_destroy(trigrams->map);
+    free(trigrams);
+}
+
+void trigram_add(trigram_t *trigrams, uint32_t doc, const char *text, size_t len)
+{
+    uint32_t t = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        set_u32_t *docs;
+
+        t = (t << 8 | (unsigned char)text[i]) & 0xffffff;
+        if (i < 2)
+            continue;
+        docs = map_u32_get(trigrams->map, t);
+        if (docs == NULL) {
+            docs = set_u32_create();
+            map_u32_put(trigrams->map, t, docs);
+        }
+        /* Most trigrams occur several times in a document */
+        if (docs->size == 0 || docs->elems[docs->size - 1] != doc)
+            set_u32_add(docs, doc);
+    }
+}
+
+void trigram_merge(trigram_t *trigrams, trigram_t *src, uint32_t *docmap)
+{
+    map_u32_iter_t *it = map_u32_createiter(src->map);
+    int i;
+
+    while (map_u32_hasnext(it)) {
+        map_u32_entry_t *e = map_u32_next(it);
+        set_u32_t *from = e->value, *docs = NULL;
+
+        for (i = 0; i < from->size; i++) {
+            uint32_t doc = docmap[from->elems[i]];
+            if (doc == UINT32_MAX)
+                continue;
+            if (docs == NULL) {
+                docs = map_u32_get(trigrams->map, e->key);
+                if (docs == NULL) {
+                    docs = set_u32_create();
+                    map_u32_put(trigrams->map, e->key, docs);
+                }
+            }
+            set_u32_add(docs, doc);
+        }
+    }
+    map_u32_destroyiter(it);
+}
+
+void trigram_compact(trigram_t *trigrams)
+{
+    map_u32_iter_t *it = map_u32_createiter(trigrams->map);
+
+    while (map_u32_hasnext(it)) {
+        set_u32_t *docs = map_u32_next(it)->value;
+        if (docs->capacity > docs->size) {
+            docs->elems = realloc(docs->elems, docs->size * sizeof(uint32_t));
+            if (docs->elems == NULL)
+                fatal_error("out of memory");
+            docs->capacity = docs->size;
+        }
+    }
+    map_u32_destroyiter(it);
+}
+
+int trigram_size(trigram_t *trigrams)
+{
+    return map_u32_size(trigrams->map);
+}
+
+static set_u32_t *every_document(uint32_t numdocs)
+{
+    set_u32_t *docs = set_u32_create();
+    uint32_t doc;
+
+    set_u32_reserve(docs, numdocs);
+    for (doc = 0; doc < numdocs; doc++)
+        docs->elems[doc] = doc;
+    docs->size = numdocs;
+    return docs;
+}
+
+/*
+ * Returns the intersection of the given sets, where NULL is every
+ * document.  Both sets are destroyed.
+ */
+static set_u32_t *and_sets(set_u32_t *a, set_u32_t *b)
+{
+    set_u32_t *result;
+
+    if (a == NULL)
+        return b;
+    if (b == NULL)
+        return a;
+    result = set_u32_intersection(a, b);
+    set_u32_destroy(a);
+    set_u32_destroy(b);
+    return result;
+}
+
+/*
+ * Returns the union of the given sets, where NULL is every document.
+ * Both sets are destroyed.
+ */
+static set_u32_t *or_sets(set_u32_t *a, set_u32_t *b)
+{
+    set_u32_t *result;
+
+    if (a == NULL || b == NULL) {
+        if (a != NULL)
+            set_u32_destroy(a);
+        if (b != NULL)
+            set_u32_destroy(b);
+        return NULL;
+    }
+    result = set_u32_union(a, b);
+    set_u32_destroy(a);
+    set_u32_destroy(b);
+    return result;
+}
+
+/*
+ * Returns the given set restricted to the documents of the given
+ * trigram.  The set is destroyed.
+ */
+static set_u32_t *and_trigram(trigram_t *trigrams, set_u32_t *docs, uint32_t t)
+{
+    set_u32_t *tdocs = map_u32_get(trigrams->map, t);
+    set_u32_t *result;
+
+    if (tdocs == NULL) {
+        /* No document contains it */
+        if (docs != NULL)
+            set_u32_destroy(docs);
+        return set_u32_create();
+    }
+    if (docs == NULL)
+        return set_u32_copy(tdocs);
+    result = set_u32_intersection(docs, tdocs);
+    set_u32_destroy(docs);
+    return result;
+}
+
+static int compare_sizes(const void *a, const void *b)
+{
+    return (*(set_u32_t **)a)->size - (*(set_u32_t **)b)->size;
+}
+
+set_u32_t *trigram_substring(trigram_t *trigrams, const char *s, size_t len, uint32_t numdocs)
+{
+    set_u32_t **sets, *result;
+    uint32_t t = 0;
+    size_t i, n = 0;
+
+    if (len < 3)
+        return every_document(numdocs);
+    sets = malloc((len - 2) * sizeof(set_u32_t *));
+    if (sets == NULL)
+        fatal_error("out of memory");
+    for (i = 0; i < len; i++) {
+        t = (t << 8 | (unsigned char)s[i]) & 0xffffff;
+        if (i < 2)
+            continue;
+        sets[n] = map_u32_get(trigrams->map, t);
+        if (sets[n++] == NULL) {
+            free(sets);
+            return set_u32_create();
+        }
+    }
+    /* Smallest first, so every intersection is as small as it gets */
+    qsort(sets, n, sizeof(set_u32_t *), compare_sizes);
+    result = set_u32_copy(sets[0]);
+    for (i = 1; i < n && result->size > 0; i++) {
+        set_u32_t *tmp = set_u32_intersection(result, sets[i]);
+        set_u32_destroy(result);
+        result = tmp;
+    }
+    free(sets);
+    return result;
+}
+
+/*
+ * Adds the given character to the current literal run, and returns the
+ * given set restricted to the trigram it completes, if any.
+ */
+static set_u32_t *literal(parser_t *parser, set_u32_t *docs, unsigned char c)
+{
+    parser->run = (parser->run << 8 | c) & 0xffffff;
+    if (++parser->runlen < 3)
+        return docs;
+    return and_trigram(parser->trigrams, docs, parser->run);
+}
+
+/*
+ * Skips the quantifiers after an atom, if any.  Returns 1 if the atom
+ * may occur zero times, 0 if it must occur at least once, or -1 if it
+ * must occur exactly once.
+ */
+static int quantifier(parser_t *parser)
+{
+    int result = -1;
+
+    for (;;) {
+        if (*parser->p == '*' || *parser->p == '?') {
+            result = 1;
+            parser->p++;
+        }
+        else if (*parser->p == '+') {
+            result = result < 0 ? 0 : result;
+            parser->p++;
+        }
+        else if (*parser->p == '{') {
+            result = result < 0 ? 0 : result;
+            if (atoi(parser->p + 1) == 0)
+                result = 1;
+            while (*parser->p != '\0' && *parser->p != '}')
+                parser->p++;
+            if (*parser->p == '}')
+                parser->p++;
+        }
+        else {
+            return result;
+        }
+    }
+}
+
+/*
+ * Skips a bracket expression such as "[^a-z_]" or "[[:alpha:]]".
+ */
+static void bracket(parser_t *parser)
+{
+    const char *p = parser->p + 1;
+
+    if (*p == '^')
+        p++;
+    if (*p == ']')
+        p++;
+    while (*p != '\0' && *p != ']') {
+        if (p[0] == '[' && (p[1] == ':' || p[1] == '.' || p[1] == '=')) {
+            char close = p[1];
+            p += 2;
+            while (*p != '\0' && !(p[0] == close && p[1] == ']'))
+                p++;
+            if (*p != '\0')
+                p += 2;
+        }
+        else {
+            p++;
+        }
+    }
+    parser->p = *p == ']' ? p + 1 : p;
+}
+
+static set_u32_t *alternation(parser_t *parser);
+
+/*
+ * Returns the documents that may match the branch at the current
+ * position, which ends at '|', ')' or the end of the expression.
+ */
+static set_u32_t *branch(parser_t *parser)
+{
+    set_u32_t *docs = NULL;
+
+    parser->runlen = 0;
+    for (;;) {
+        char c = *parser->p;
+        int repeat;
+
+        if (c == '\0' || c == '|' || c == ')')
+            return docs;
+        if (c == '(') {
+            set_u32_t *group;
+
+            parser->p++;
+            group = alternation(parser);
+            if (*parser->p == ')')
+                parser->p++;
+            if (quantifier(parser) == 1) {
+                if (group != NULL)
+                    set_u32_destroy(group);
+            }
+            else {
+                docs = and_sets(docs, group);
+            }
+            parser->runlen = 0;
+            continue;
+        }
+        if (c == '[' || c == '.' || c == '^' || c == '$' || c == '*' || c == '+' ||
+            c == '?' || c == '{' || (c == '\\' && isalnum((unsigned char)parser->p[1]))) {
+            /* Not a plain character (e.g. \w or \1), so the run ends */
+            if (c == '[')
+                bracket(parser);
+            else
+                parser->p += c == '\\' ? 2 : 1;
+            quantifier(parser);
+            parser->runlen = 0;
+            continue;
+        }
+        if (c == '\\') {
+            if (parser->p[1] == '\0') {
+                parser->p++;
+                continue;
+            }
+            c = *++parser->p;
+        }
+        parser->p++;
+        repeat = quantifier(parser);
+        if (repeat == 1) {
+            /* Optional, so the characters around it need not be adjacent */
+            parser->runlen = 0;
+            continue;
+        }
+        docs = literal(parser, docs, c);
+        if (repeat == 0) {
+            /* Repeated, so only the last copy is next to what follows */
+            parser->run = (unsigned char)c;
+            parser->runlen = 1;
+        }
+    }
+}
+
+/*
+ * Returns the documents that may match the alternatives at the current
+ * position, which end at ')' or the end of the expression.
+ */
+static set_u32_t *alternation(parser_t *parser)
+{
+    set_u32_t *docs = branch(parser);
+
+    while (*parser->p == '|') {
+        parser->p++;
+        docs = or_sets(docs, branch(parser));
+    }
+    return docs;
+}
+
+set_u32_t *trigram_regex(trigram_t *trigrams, const char *regex, uint32_t numdocs)
+{
+    parser_t parser;
+    set_u32_t *docs;
+
+    parser.trigrams = trigrams;
+    parser.p = regex;
+    parser.run = 0;
+    parser.runlen = 0;
+    /* A stray ')' ends the expression early, which only filters less */
+    docs = alternation(&parser);
+    return docs != NULL ? docs : every_document(numdocs);
+}
@@ -0,0 +1,76 @@
+#ifndef TRIGRAM_H
+#define TRIGRAM_H
+
+#include "set_u32.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The type of trigram indexes.  A trigram index holds, for every
+ * sequence of 3 bytes, the set of documents whose text contains it.
+ * Every occurrence of a string of 3 or more bytes contains each of the
+ * string's trigrams, so the documents that contain all of them are the
+ * only ones that can contain the string.  Those candidates still have
+ * to be checked, since the trigrams may occur apart.
+ *
+ * A regular expression is turned into a filter over trigrams the same
+ * way: the runs of plain characters that every match must contain
+ * give sets of trigrams that must all occur, and alternatives give
+ * sets of which one must.  Parts that are not plain characters (e.g.
+ * ".", "[a-z]" or anything optional) are not filtered on, so the
+ * candidates are a superset of the matches.
+ */
+struct trigram;
+typedef struct trigram trigram_t;
+
+/*
+ * Creates a new, empty trigram index.
+ */
+trigram_t *trigram_create(void);
+
+/*
+ * Destroys the given trigram index.
+ */
+void trigram_destroy(trigram_t *trigrams);
+
+/*
+ * Adds every trigram of the given text to the given document.
+ * Documents must be added in increasing order of id.
+ */
+void trigram_add(trigram_t *trigrams, uint32_t doc, const char *text, size_t len);
+
+/*
+ * Adds the trigrams of the documents of the given src index to the
+ * given index under new ids.  docmap maps the ids of src to the new
+ * ids, or to UINT32_MAX for documents to leave out.  The new ids must
+ * increase, and be larger than those already in the index.
+ */
+void trigram_merge(trigram_t *trigrams, trigram_t *src, uint32_t *docmap);
+
+/*
+ * Releases the room kept for adding more documents.
+ */
+void trigram_compact(trigram_t *trigrams);
+
+/*
+ * Returns the number of distinct trigrams in the given index.
+ */
+int trigram_size(trigram_t *trigrams);
+
+/*
+ * Returns the set of documents that may contain the given string, out
+ * of the documents with ids below numdocs.  Strings shorter than a
+ * trigram give every document.  The returned set belongs to the caller.
+ */
+set_u32_t *trigram_substring(trigram_t *trigrams, const char *s, size_t len, uint32_t numdocs);
+
+/*
+ * Returns the set of documents that may contain a match of the given
+ * POSIX extended regular expression, out of the documents with ids
+ * below numdocs.  The expression must be valid (see regcomp()).  The
+ * returned set belongs to the caller.
+ */
+set_u32_t *trigram_regex(trigram_t *trigrams, const char *regex, uint32_t numdocs);
+
+#endif
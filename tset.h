@@ -0,0 +1,344 @@
+/*
+ * Template for sets of a concrete element type.
+ *
+ * Unlike set_t, which compares elements through a cmpfunc_t pointer,
+ * the sets generated from this file use a comparison macro that the
+ * compiler can inline into the merge loops of union, intersection and
+ * difference.  Elements are kept in a sorted array, so adding elements
+ * in increasing order (e.g. document identifiers) is a plain append.
+ *
+ * To generate a set type, define the following macros and include
+ * this file:
+ *
+ *   TSET_NAME       prefix of the generated names, e.g. set_u32
+ *   TSET_ELEM       element type, e.g. uint32_t
+ *   TSET_CMP(a, b)  returns <0, 0 or >0, like a cmpfunc_t
+ *
+ * This defines the types <prefix>_t and <prefix>_iter_t and the
+ * functions <prefix>_create(), <prefix>_destroy(), <prefix>_size(),
+ * <prefix>_add(), <prefix>_contains(), <prefix>_seek(), <prefix>_union(),
+ * <prefix>_intersection(), <prefix>_difference(), <prefix>_copy(),
+ * <prefix>_intersectionsize(), <prefix>_differencesize(),
+ * <prefix>_createiter(), <prefix>_destroyiter(), <prefix>_hasnext()
+ * and <prefix>_next(), which behave like their set.h counterparts.
+ *
+ * The macros are undefined at the end of this file, so it may be
+ * included several times with different parameters.
+ */
+
+#include "common.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(TSET_NAME) || !defined(TSET_ELEM) || !defined(TSET_CMP)
+#error "TSET_NAME, TSET_ELEM and TSET_CMP must be defined before including tset.h"
+#endif
+
+#ifndef TSET_CAT
+#define TSET_CAT_(a, b) a ## b
+#define TSET_CAT(a, b) TSET_CAT_(a, b)
+#endif
+
+#define TSET_FN(fn) TSET_CAT(TSET_NAME, _ ## fn)
+#define TSET_T TSET_FN(t)
+#define TSET_ITER_T TSET_FN(iter_t)
+
+typedef struct {
+    TSET_ELEM *elems;   /* Sorted, without duplicates */
+    int size;
+    int capacity;
+} TSET_T;
+
+typedef struct {
+    TSET_T *set;
+    int pos;
+} TSET_ITER_T;
+
+/*
+ * Makes room for at least n elements.
+ */
+static inline void TSET_FN(reserve)(TSET_T *set, int n)
+{
+    if (n > set->capacity) {
+        int capacity = set->capacity > 0 ? set->capacity : 4;
+        while (capacity < n)
+            capacity *= 2;
+        set->elems = realloc(set->elems, capacity * sizeof(TSET_ELEM));
+        if (set->elems == NULL)
+            fatal_error("out of memory");
+        set->capacity = capacity;
+    }
+}
+
+static inline TSET_T *TSET_FN(create)(void)
+{
+    TSET_T *set = malloc(sizeof(TSET_T));
+    if (set == NULL)
+        fatal_error("out of memory");
+    set->elems = NULL;
+    set->size = 0;
+    set->capacity = 0;
+    return set;
+}
+
+static inline void TSET_FN(destroy)(TSET_T *set)
+{
+    free(set->elems);
+    free(set);
+}
+
+static inline int TSET_FN(size)(TSET_T *set)
+{
+    return set->size;
+}
+
+/*
+ * Returns the position of the first element that is not smaller
+ * than the given element.
+ */
+static inline int TSET_FN(lowerbound)(TSET_T *set, TSET_ELEM elem)
+{
+    int lo = 0, hi = set->size;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (TSET_CMP(set->elems[mid], elem) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Returns the position of the first element at or after the given
+ * position that is not smaller than the given element, or the size of
+ * the set if there is none.  Gallops ahead from the given position, so
+ * a sequence of seeks to increasing elements costs little more than
+ * the number of elements skipped over.
+ */
+static inline int TSET_FN(seek)(TSET_T *set, int pos, TSET_ELEM elem)
+{
+    int step = 1, hi;
+
+    while (pos + step < set->size && TSET_CMP(set->elems[pos + step], elem) < 0) {
+        pos += step;
+        step *= 2;
+    }
+    hi = pos + step < set->size ? pos + step : set->size;
+    while (pos < hi) {
+        int mid = pos + (hi - pos) / 2;
+        if (TSET_CMP(set->elems[mid], elem) < 0)
+            pos = mid + 1;
+        else
+            hi = mid;
+    }
+    return pos;
+}
+
+static inline void TSET_FN(add)(TSET_T *set, TSET_ELEM elem)
+{
+    int pos;
+
+    /* Fast path: elements usually arrive in increasing order */
+    if (set->size == 0 || TSET_CMP(set->elems[set->size - 1], elem) < 0) {
+        pos = set->size;
+    }
+    else {
+        pos = TSET_FN(lowerbound)(set, elem);
+        if (TSET_CMP(set->elems[pos], elem) == 0) {
+            /* Already contained */
+            return;
+        }
+    }
+    TSET_FN(reserve)(set, set->size + 1);
+    memmove(&set->elems[pos + 1], &set->elems[pos],
+            (set->size - pos) * sizeof(TSET_ELEM));
+    set->elems[pos] = elem;
+    set->size++;
+}
+
+static inline int TSET_FN(contains)(TSET_T *set, TSET_ELEM elem)
+{
+    int pos = TSET_FN(lowerbound)(set, elem);
+    return pos < set->size && TSET_CMP(set->elems[pos], elem) == 0;
+}
+
+static inline TSET_T *TSET_FN(union)(TSET_T *a, TSET_T *b)
+{
+    TSET_T *result = TSET_FN(create)();
+    int i = 0, j = 0, n = 0;
+
+    TSET_FN(reserve)(result, a->size + b->size);
+    while (i < a->size && j < b->size) {
+        int cmp = TSET_CMP(a->elems[i], b->elems[j]);
+        if (cmp < 0) {
+            /* Occurs in a only */
+            result->elems[n++] = a->elems[i++];
+        }
+        else if (cmp > 0) {
+            /* Occurs in b only */
+            result->elems[n++] = b->elems[j++];
+        }
+        else {
+            /* Occurs in both a and b */
+            result->elems[n++] = a->elems[i++];
+            j++;
+        }
+    }
+    /* Plus what's left of the remaining set (either a or b) */
+    while (i < a->size)
+        result->elems[n++] = a->elems[i++];
+    while (j < b->size)
+        result->elems[n++] = b->elems[j++];
+    result->size = n;
+    return result;
+}
+
+static inline TSET_T *TSET_FN(intersection)(TSET_T *a, TSET_T *b)
+{
+    TSET_T *result = TSET_FN(create)();
+    int i = 0, j = 0, n = 0;
+
+    TSET_FN(reserve)(result, a->size < b->size ? a->size : b->size);
+    while (i < a->size && j < b->size) {
+        int cmp = TSET_CMP(a->elems[i], b->elems[j]);
+        if (cmp < 0) {
+            i++;
+        }
+        else if (cmp > 0) {
+            j++;
+        }
+        else {
+            /* Occurs in both a and b, keep this one */
+            result->elems[n++] = a->elems[i++];
+            j++;
+        }
+    }
+    result->size = n;
+    return result;
+}
+
+static inline TSET_T *TSET_FN(difference)(TSET_T *a, TSET_T *b)
+{
+    TSET_T *result = TSET_FN(create)();
+    int i = 0, j = 0, n = 0;
+
+    TSET_FN(reserve)(result, a->size);
+    while (i < a->size && j < b->size) {
+        int cmp = TSET_CMP(a->elems[i], b->elems[j]);
+        if (cmp < 0) {
+            /* Occurs in a only, keep this one */
+            result->elems[n++] = a->elems[i++];
+        }
+        else if (cmp > 0) {
+            j++;
+        }
+        else {
+            i++;
+            j++;
+        }
+    }
+    /* Plus what's left of a */
+    while (i < a->size)
+        result->elems[n++] = a->elems[i++];
+    result->size = n;
+    return result;
+}
+
+/*
+ * Returns the size of the intersection of a and b without building it,
+ * or limit if the intersection has at least limit elements.  When one
+ * set is much smaller, each of its elements is looked up in the other
+ * by galloping.
+ */
+static inline int TSET_FN(intersectionsize)(TSET_T *a, TSET_T *b, int limit)
+{
+    int i = 0, j = 0, n = 0;
+
+    if (a->size > b->size) {
+        TSET_T *tmp = a;
+        a = b;
+        b = tmp;
+    }
+    if (a->size * 16 < b->size) {
+        for (i = 0; i < a->size && j < b->size && n < limit; i++) {
+            j = TSET_FN(seek)(b, j, a->elems[i]);
+            if (j < b->size && TSET_CMP(b->elems[j], a->elems[i]) == 0)
+                n++;
+        }
+        return n;
+    }
+    while (i < a->size && j < b->size && n < limit) {
+        int cmp = TSET_CMP(a->elems[i], b->elems[j]);
+        n += cmp == 0;
+        i += cmp <= 0;
+        j += cmp >= 0;
+    }
+    return n;
+}
+
+/*
+ * Returns the size of a minus b without building it, or limit if it
+ * has at least limit elements.
+ */
+static inline int TSET_FN(differencesize)(TSET_T *a, TSET_T *b, int limit)
+{
+    int i = 0, j = 0, n = 0;
+
+    while (i < a->size && j < b->size && n < limit) {
+        int cmp = TSET_CMP(a->elems[i], b->elems[j]);
+        n += cmp < 0;
+        i += cmp <= 0;
+        j += cmp >= 0;
+    }
+    /* Plus what's left of a */
+    n += a->size - i;
+    return n < limit ? n : limit;
+}
+
+static inline TSET_T *TSET_FN(copy)(TSET_T *set)
+{
+    TSET_T *result = TSET_FN(create)();
+
+    TSET_FN(reserve)(result, set->size);
+    if (set->size > 0)
+        memcpy(result->elems, set->elems, set->size * sizeof(TSET_ELEM));
+    result->size = set->size;
+    return result;
+}
+
+static inline TSET_ITER_T *TSET_FN(createiter)(TSET_T *set)
+{
+    TSET_ITER_T *iter = malloc(sizeof(TSET_ITER_T));
+    if (iter == NULL)
+        fatal_error("out of memory");
+    iter->set = set;
+    iter->pos = 0;
+    return iter;
+}
+
+static inline void TSET_FN(destroyiter)(TSET_ITER_T *iter)
+{
+    free(iter);
+}
+
+static inline int TSET_FN(hasnext)(TSET_ITER_T *iter)
+{
+    return iter->pos < iter->set->size;
+}
+
+static inline TSET_ELEM TSET_FN(next)(TSET_ITER_T *iter)
+{
+    if (iter->pos >= iter->set->size)
+        fatal_error("set iterator exhausted");
+    return iter->set->elems[iter->pos++];
+}
+
+#undef TSET_ITER_T
+#undef TSET_T
+#undef TSET_FN
+#undef TSET_NAME
+#undef TSET_ELEM
+#undef TSET_CMP
@@ -0,0 +1,312 @@
+#include "common.h"
+#include "list.h"
+#include "map_str.h"
+#include "watcher.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+
+/*
+ * What happened to a path in the current batch.
+ */
+enum { CHANGED = 1, REMOVED = 2 };
+
+#define WATCH_EVENTS (IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+struct watcher {
+    int fd;
+    char *root;
+    int delay;
+    char **dirs;                /* Watch descriptor -> path of the directory, or NULL */
+    int maxdirs;
+    map_str_t *batch;           /* Path -> CHANGED or REMOVED */
+    int warned;                 /* Ran out of watches */
+};
+
+static long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Records what happened to the given path, which belongs to the batch
+ * from then on, and replaces what happened to it before.
+ */
+static void mark(watcher_t *watcher, char *path, int what)
+{
+    if (map_str_haskey(watcher->batch, path)) {
+        map_str_put(watcher->batch, path, (void *)(intptr_t)what);
+        free(path);
+    }
+    else {
+        map_str_put(watcher->batch, path, (void *)(intptr_t)what);
+    }
+}
+
+static void set_dir(watcher_t *watcher, int wd, char *path)
+{
+    if (wd >= watcher->maxdirs) {
+        int n = watcher->maxdirs;
+        watcher->maxdirs = wd >= 2 * n ? wd + 1 : 2 * n;
+        watcher->dirs = realloc(watcher->dirs, watcher->maxdirs * sizeof(char *));
+        if (watcher->dirs == NULL)
+            fatal_error("out of memory");
+        memset(watcher->dirs + n, 0, (watcher->maxdirs - n) * sizeof(char *));
+    }
+    free(watcher->dirs[wd]);
+    watcher->dirs[wd] = path;
+}
+
+/*
+ * Watches the given directory and every directory under it, and marks
+ * the files in them as changed if report is set.
+ */
+static void add_tree(watcher_t *watcher, char *dir, int report)
+{
+    int wd = inotify_add_watch(watcher->fd, dir, WATCH_EVENTS | IN_ONLYDIR | IN_DONT_FOLLOW);
+    struct dirent *entry;
+    DIR *dp;
+
+    if (wd < 0) {
+        if (errno == ENOSPC && !watcher->warned) {
+            fprintf(stderr, "cannot watch '%s': too many directories (see fs.inotify.max_user_watches)\n", dir);
+            watcher->warned = 1;
+        }
+        return;
+    }
+    set_dir(watcher, wd, strdup(dir));
+    if (watcher->dirs[wd] == NULL)
+        fatal_error("out of memory");
+
+    /* Read after the watch is added, so no file created meanwhile is missed */
+    dp = opendir(dir);
+    if (dp == NULL)
+        return;
+    while ((entry = readdir(dp)) != NULL) {
+        int type = entry->d_type;
+        char *path;
+        struct stat s;
+
+        if (entry->d_name[0] == '.')
+            continue;
+        path = join_path(dir, entry->d_name);
+        if ((type == DT_UNKNOWN || type == DT_LNK) && stat(path, &s) == 0) {
+            /* Like the crawler, follow links to files, but not to directories */
+            if (S_ISREG(s.st_mode))
+                type = DT_REG;
+            else if (S_ISDIR(s.st_mode) && type == DT_UNKNOWN)
+                type = DT_DIR;
+        }
+        if (type == DT_DIR)
+            add_tree(watcher, path, report);
+        if (type == DT_REG && report && sniff_name(entry->d_name) == SKIP_NONE)
+            mark(watcher, path, CHANGED);
+        else
+            free(path);
+    }
+    closedir(dp);
+}
+
+/*
+ * Stops watching the given directory and the directories under it.
+ */
+static void remove_tree(watcher_t *watcher, char *dir)
+{
+    size_t len = strlen(dir);
+    int wd;
+
+    for (wd = 0; wd < watcher->maxdirs; wd++) {
+        char *path = watcher->dirs[wd];
+        if (path != NULL && strncmp(path, dir, len) == 0 && (path[len] == '\0' || path[len] == '/')) {
+            inotify_rm_watch(watcher->fd, wd);
+            free(path);
+            watcher->dirs[wd] = NULL;
+        }
+    }
+}
+
+static void handle_event(watcher_t *watcher, struct inotify_event *event)
+{
+    struct stat s;
+    char *path;
+
+    if (event->mask & IN_Q_OVERFLOW) {
+        /* Events were lost, so start over */
+        mark(watcher, strdup(watcher->root), REMOVED);
+        add_tree(watcher, watcher->root, 1);
+        return;
+    }
+    if (event->wd < 0 || event->wd >= watcher->maxdirs || watcher->dirs[event->wd] == NULL)
+        return;
+    if (event->mask & IN_IGNORED) {
+        /* The directory is gone */
+        free(watcher->dirs[event->wd]);
+        watcher->dirs[event->wd] = NULL;
+        return;
+    }
+    if (event->len == 0 || event->name[0] == '.')
+        return;
+
+    path = join_path(watcher->dirs[event->wd], event->name);
+    if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        if (event->mask & IN_ISDIR)
+            remove_tree(watcher, path);
+        mark(watcher, path, REMOVED);
+    }
+    else if (event->mask & IN_ISDIR) {
+        add_tree(watcher, path, 1);
+        free(path);
+    }
+    else if (sniff_name(event->name) == SKIP_NONE && stat(path, &s) == 0 && S_ISREG(s.st_mode)) {
+        mark(watcher, path, CHANGED);
+    }
+    else {
+        free(path);
+    }
+}
+
+watcher_t *watcher_create(char *root, int delay)
+{
+    int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    watcher_t *watcher;
+
+    if (fd < 0)
+        return NULL;
+    if (inotify_add_watch(fd, root, WATCH_EVENTS | IN_ONLYDIR) < 0) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return NULL;
+    }
+    watcher = calloc(1, sizeof(watcher_t));
+    if (watcher == NULL)
+        fatal_error("out of memory");
+    watcher->fd = fd;
+    watcher->root = strdup(root);
+    watcher->delay = delay;
+    watcher->batch = map_str_create();
+    if (watcher->root == NULL)
+        fatal_error("out of memory");
+    add_tree(watcher, root, 0);
+    return watcher;
+}
+
+/*
+ * Hands out the paths of the batch, and starts a new one.  Returns the
+ * number of paths.
+ */
+static int end_batch(watcher_t *watcher, list_t *changed, list_t *removed)
+{
+    map_str_iter_t *it = map_str_createiter(watcher->batch);
+    int n = 0;
+
+    while (map_str_hasnext(it)) {
+        map_str_entry_t *e = map_str_next(it);
+        if (e->value == (void *)(intptr_t)CHANGED)
+            list_addlast(changed, e->key);
+        else
+            list_addlast(removed, e->key);
+        n++;
+    }
+    map_str_destroyiter(it);
+    map_str_destroy(watcher->batch);
+    watcher->batch = map_str_create();
+    return n;
+}
+
+void watcher_destroy(watcher_t *watcher)
+{
+    list_t *paths = list_create(compare_strings);
+    int wd;
+
+    end_batch(watcher, paths, paths);
+    while (list_size(paths) > 0)
+        free(list_popfirst(paths));
+    list_destroy(paths);
+    map_str_destroy(watcher->batch);
+    for (wd = 0; wd < watcher->maxdirs; wd++)
+        free(watcher->dirs[wd]);
+    free(watcher->dirs);
+    free(watcher->root);
+    close(watcher->fd);
+    free(watcher);
+}
+
+int watcher_wait(watcher_t *watcher, int timeout, list_t *changed, list_t *removed)
+{
+    char buf[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd = { watcher->fd, POLLIN, 0 };
+    long deadline = timeout < 0 ? -1 : now_ms() + timeout, started = -1, now, wait;
+    ssize_t len, offset;
+
+    for (;;) {
+        now = now_ms();
+        if (map_str_size(watcher->batch) == 0) {
+            if (deadline >= 0 && now >= deadline)
+                return 0;
+            wait = deadline < 0 ? -1 : deadline - now;
+        }
+        else {
+            /* Wait for the tree to be quiet, but not for too long */
+            if (started < 0)
+                started = now;
+            wait = started + (long)watcher->delay * MAX_WATCH_BATCH - now;
+            if (wait <= 0)
+                break;
+            if (wait > watcher->delay)
+                wait = watcher->delay;
+        }
+
+        int n = poll(&pfd, 1, wait);
+        if (n < 0 && errno != EINTR)
+            return -1;
+        if (n == 0 && map_str_size(watcher->batch) > 0)
+            break;
+        if (n <= 0)
+            continue;
+
+        len = read(watcher->fd, buf, sizeof(buf));
+        if (len < 0 && errno != EINTR && errno != EAGAIN)
+            return -1;
+        for (offset = 0; offset < len; ) {
+            struct inotify_event *event = (struct inotify_event *)(buf + offset);
+            handle_event(watcher, event);
+            offset += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return end_batch(watcher, changed, removed);
+}
+
+#else
+
+watcher_t *watcher_create(char *root, int delay)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+void watcher_destroy(watcher_t *watcher)
+{
+}
+
+int watcher_wait(watcher_t *watcher, int timeout, list_t *changed, list_t *removed)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef WATCHER_H
+#define WATCHER_H
+
+#include "list.h"
+
+/*
+ * The type of watchers.  A watcher follows the changes to the files
+ * under a directory with inotify, which watches every directory of the
+ * tree, including those created later, and hands them out in batches:
+ * the events of a batch are collected until the tree has been quiet
+ * for a while, and events on the same path are merged, so that a file
+ * saved several times in a row is read once.
+ *
+ * The files are those that a crawler would find (see crawler.h), so
+ * hidden files and directories, files with the extension of a binary
+ * format, and symbolic links to directories are left out.  If events
+ * are lost (the kernel's queue overflowed), the batch removes the root
+ * and changes every file under it.
+ */
+struct watcher;
+typedef struct watcher watcher_t;
+
+/*
+ * The default time in milliseconds that the tree must be quiet for a
+ * batch to end.  A batch ends after at most MAX_WATCH_BATCH times this
+ * even if the tree never is.
+ */
+enum { DEFAULT_WATCH_DELAY = 200, MAX_WATCH_BATCH = 10 };
+
+/*
+ * Starts watching the given root directory, with batches that end once
+ * it has been quiet for the given number of milliseconds.  Returns
+ * NULL, with errno set, if the root cannot be watched.
+ */
+watcher_t *watcher_create(char *root, int delay);
+
+/*
+ * Stops watching, and destroys the given watcher.
+ */
+void watcher_destroy(watcher_t *watcher);
+
+/*
+ * Waits up to the given number of milliseconds (or forever if it is
+ * negative) for a change, and collects the batch that starts with it.
+ * Adds the paths of the files created or changed to the given list of
+ * changed paths, and those of the files and directories deleted or
+ * moved away to the list of removed paths.  The paths belong to the
+ * caller.  Returns the number of paths added, which is 0 if nothing
+ * changed in time, or -1 on error.
+ */
+int watcher_wait(watcher_t *watcher, int timeout, list_t *changed, list_t *removed);
+
+#endif